@@ -71,29 +71,80 @@ uint8_t PKT_CONTENT[]={
 /* Prototypes */
 static ssize_t do_encode_packet( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c );
 static void run_transop_benchmark(const char *op_name, n2n_trans_op_t *op_fn, n2n_edge_conf_t *conf, uint8_t *pktbuf);
+#ifndef WIN32
+static void run_latency_benchmark(int busy_poll);
+#endif
+static void run_peer_table_benchmark(void);
+static void run_peer_table_check(void);
+#ifdef __linux__
+static void run_peer_table_stress(void);
+#endif
+static void run_fec_benchmark(unsigned int loss_permille);
+static void run_hc_benchmark(unsigned int loss_permille);
+static void run_multipath_benchmark(unsigned int loss_permille, int track_src);
+#ifndef WIN32
+static void run_conn_sock_benchmark(int connected);
+#endif
 static int perform_decryption = 0;
+static int perform_latency = 0;
+static int perform_peer_table = 0;
+static int perform_stress = 0;
+static int perform_fec = 0;
+static int perform_hc = 0;
+static int perform_multipath = 0;
+static int perform_conn_sock = 0;
+static const char *conn_sock_peer = NULL;
+static char *transop_plugin = NULL;
 
 static void usage() {
-  fprintf(stderr, "Usage: benchmark [-d]\n"
-    " -d\t\tEnable decryption. Default: only encryption is performed\n");
+  fprintf(stderr, "Usage: benchmark [-d] [-l] [-p] [-s] [-f] [-c] [-m] [-y [<addr>:<port>]] [-j <plugin>]\n"
+    " -d\t\tEnable decryption. Default: only encryption is performed\n"
+    " -l\t\tMeasure UDP round trip latency, blocking vs busy-poll wakeups\n"
+    " -p\t\tMeasure peer lookup and purge scan rates, hash list vs compact table,\n"
+    "\t\tand check removals from the compact table\n"
+    " -s\t\tStress the compact table with lock-free readers against a churning writer\n"
+    " -f\t\tForward error correction over links with simulated loss\n"
+    " -c\t\tHeader compression of small TCP and UDP packets with simulated loss\n"
+    " -m\t\tReordering of the packets spread over two paths with simulated loss\n"
+    " -y\t\tDatagrams/s to a busy peer, sendto() vs a connected socket. The peer is\n"
+    "\t\ton the loopback unless given, a listening UDP socket across a real route\n"
+    " -j <plugin>\tAlso run the transform of the plugin shared object\n");
   exit(1);
 }
 
 static void parseArgs(int argc, char * argv[]) {
-  if((argc != 1) && (argc != 2))
-    usage();
+  int i;
 
-  if(argc == 2) {
-    if(strcmp(argv[1], "-d") != 0)
+  for(i=1; i<argc; i++) {
+    if(strcmp(argv[i], "-d") == 0)
+      perform_decryption = 1;
+    else if(strcmp(argv[i], "-l") == 0)
+      perform_latency = 1;
+    else if(strcmp(argv[i], "-p") == 0)
+      perform_peer_table = 1;
+    else if(strcmp(argv[i], "-s") == 0)
+      perform_stress = 1;
+    else if(strcmp(argv[i], "-f") == 0)
+      perform_fec = 1;
+    else if(strcmp(argv[i], "-c") == 0)
+      perform_hc = 1;
+    else if(strcmp(argv[i], "-m") == 0)
+      perform_multipath = 1;
+    else if(strcmp(argv[i], "-y") == 0) {
+      perform_conn_sock = 1;
+      if((i+1 < argc) && (argv[i+1][0] != '-'))
+        conn_sock_peer = argv[++i];
+    }
+    else if((strcmp(argv[i], "-j") == 0) && (i+1 < argc))
+      transop_plugin = argv[++i];
+    else
       usage();
-
-    perform_decryption = 1;
   }
 }
 
 int main(int argc, char * argv[]) {
   uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-  n2n_trans_op_t transop_null, transop_twofish;
+  n2n_trans_op_t transop_null, transop_twofish, transop_plug;
 #ifdef N2N_HAVE_AES
   n2n_trans_op_t transop_aes_cbc;
 #endif
@@ -101,6 +152,65 @@ int main(int argc, char * argv[]) {
 
   parseArgs(argc, argv);
 
+  if(perform_latency) {
+#ifndef WIN32
+    run_latency_benchmark(0);
+    run_latency_benchmark(1);
+#endif
+    return 0;
+  }
+
+  if(perform_peer_table) {
+    run_peer_table_benchmark();
+    return 0;
+  }
+
+  if(perform_stress) {
+#ifdef __linux__
+    run_peer_table_stress();
+#else
+    fprintf(stderr, "The stress test needs pthreads, only built on Linux\n");
+#endif
+    return 0;
+  }
+
+  if(perform_fec) {
+    static const unsigned int loss[] = { 0, 5, 10, 20, 50, 100, 200 };
+    size_t i;
+
+    for(i=0; i<sizeof(loss)/sizeof(loss[0]); i++)
+      run_fec_benchmark(loss[i]);
+    return 0;
+  }
+
+  if(perform_hc) {
+    static const unsigned int loss[] = { 0, 10, 50, 200 };
+    size_t i;
+
+    for(i=0; i<sizeof(loss)/sizeof(loss[0]); i++)
+      run_hc_benchmark(loss[i]);
+    return 0;
+  }
+
+  if(perform_multipath) {
+    static const unsigned int loss[] = { 0, 1, 10, 50 };
+    size_t i;
+
+    for(i=0; i<sizeof(loss)/sizeof(loss[0]); i++) {
+      run_multipath_benchmark(loss[i], 0);
+      run_multipath_benchmark(loss[i], 1);
+    }
+    return 0;
+  }
+
+  if(perform_conn_sock) {
+#ifndef WIN32
+    run_conn_sock_benchmark(0);
+    run_conn_sock_benchmark(1);
+#endif
+    return 0;
+  }
+
   /* Init configuration */
   edge_init_conf_defaults(&conf);
   strncpy((char*)conf.community_name, "abc123def456", sizeof(conf.community_name));
@@ -112,6 +222,9 @@ int main(int argc, char * argv[]) {
 #ifdef N2N_HAVE_AES
   n2n_transop_aes_cbc_init(&conf, &transop_aes_cbc);
 #endif
+  conf.transop_plugin = transop_plugin;
+  if((transop_plugin != NULL) && (n2n_transop_plugin_init(&conf, &transop_plug) != 0))
+    return 1;
 
   /* Run the tests */
   run_transop_benchmark("transop_null", &transop_null, &conf, pktbuf);
@@ -119,6 +232,8 @@ int main(int argc, char * argv[]) {
 #ifdef N2N_HAVE_AES
   run_transop_benchmark("transop_aes", &transop_aes_cbc, &conf, pktbuf);
 #endif
+  if(transop_plugin != NULL)
+    run_transop_benchmark("transop_plugin", &transop_plug, &conf, pktbuf);
 
   /* Cleanup */
   transop_null.deinit(&transop_null);
@@ -126,6 +241,8 @@ int main(int argc, char * argv[]) {
 #ifdef N2N_HAVE_AES
   transop_aes_cbc.deinit(&transop_aes_cbc);
 #endif
+  if(transop_plugin != NULL)
+    transop_plug.deinit(&transop_plug);
 
   return 0;
 }
@@ -184,6 +301,877 @@ static void run_transop_benchmark(const char *op_name, n2n_trans_op_t *op_fn, n2
 	   (unsigned int)num_packets, mpps * 1e3, mpps * sizeof(PKT_CONTENT));
 }
 
+#ifndef WIN32
+#define LATENCY_ROUND_TRIPS     20000
+#define LATENCY_PKT_SIZE        64
+
+/* Wait for the socket to become readable, either sleeping in select() or
+ * spinning on zero timeout polls as the busy-poll mode of the daemons does. */
+static void wait_readable(int sock, int busy_poll) {
+  fd_set mask;
+  struct timeval wait_time;
+
+  do {
+    FD_ZERO(&mask);
+    FD_SET(sock, &mask);
+    wait_time.tv_sec = busy_poll ? 0 : 1; wait_time.tv_usec = 0;
+  } while(select(sock+1, &mask, NULL, NULL, &wait_time) <= 0);
+}
+
+static int cmp_usec(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+  return((x > y) - (x < y));
+}
+
+/* Ping-pong LATENCY_PKT_SIZE datagrams with a child process over loopback and
+ * report the round trip distribution. */
+static void run_latency_benchmark(int busy_poll) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  uint8_t buf[LATENCY_PKT_SIZE];
+  uint64_t *rtt, t0;
+  int echo_sock, ping_sock, i;
+  pid_t pid;
+
+  if(busy_poll && (sysconf(_SC_NPROCESSORS_ONLN) < 2)) {
+    /* Both ends spinning on a single CPU only measure the scheduler. */
+    printf("Run latency[busy-poll]: skipped, needs at least 2 CPUs\n");
+    return;
+  }
+
+  echo_sock = socket(PF_INET, SOCK_DGRAM, 0);
+  ping_sock = socket(PF_INET, SOCK_DGRAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if((echo_sock < 0) || (ping_sock < 0)
+     || (bind(echo_sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+     || (getsockname(echo_sock, (struct sockaddr*)&addr, &addr_len) != 0)
+     || (connect(ping_sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)) {
+    fprintf(stderr, "Unable to set up the latency sockets: %s\n", strerror(errno));
+    return;
+  }
+
+  if(busy_poll) {
+    set_busy_poll(echo_sock, 50);
+    set_busy_poll(ping_sock, 50);
+  }
+
+  if((pid = fork()) == 0) {
+    struct sockaddr_in from;
+    socklen_t from_len;
+    ssize_t len;
+
+    if(busy_poll)
+      pin_to_cpu(1);
+
+    for(;;) {
+      wait_readable(echo_sock, busy_poll);
+      from_len = sizeof(from);
+      len = recvfrom(echo_sock, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+
+      if(len <= 1) /* quit */
+        _exit(0);
+
+      sendto(echo_sock, buf, len, 0, (struct sockaddr*)&from, from_len);
+    }
+  }
+
+  if(busy_poll)
+    pin_to_cpu(0);
+
+  rtt = (uint64_t*)calloc(LATENCY_ROUND_TRIPS, sizeof(uint64_t));
+  memset(buf, 0xaa, sizeof(buf));
+
+  printf("Run latency[%s] for %u round trips (%u bytes):   ",
+         busy_poll ? "busy-poll" : "blocking", LATENCY_ROUND_TRIPS, LATENCY_PKT_SIZE);
+  fflush(stdout);
+
+  for(i=0; i<LATENCY_ROUND_TRIPS; i++) {
+    t0 = time_usec();
+    send(ping_sock, buf, sizeof(buf), 0);
+    wait_readable(ping_sock, busy_poll);
+    recv(ping_sock, buf, sizeof(buf), 0);
+    rtt[i] = time_usec() - t0;
+  }
+
+  send(ping_sock, buf, 1, 0);
+  waitpid(pid, NULL, 0);
+
+  qsort(rtt, LATENCY_ROUND_TRIPS, sizeof(uint64_t), cmp_usec);
+  printf("\tp50 %6u us\tp99 %6u us\tmax %6u us\n",
+         (unsigned int)rtt[LATENCY_ROUND_TRIPS / 2],
+         (unsigned int)rtt[LATENCY_ROUND_TRIPS * 99 / 100],
+         (unsigned int)rtt[LATENCY_ROUND_TRIPS - 1]);
+
+  free(rtt);
+  close(echo_sock);
+  close(ping_sock);
+}
+#endif
+
+#define PEER_TABLE_EDGES        100000
+#define PEER_TABLE_LOOKUPS      (10 * PEER_TABLE_EDGES)
+#define PEER_TABLE_SCANS        100
+#define PEER_TABLE_CHECK_PEERS  1500    /* 3/4 of a 2048 slot table: long clusters */
+#define PEER_TABLE_CHECK_ROUNDS 50
+
+/* Edges of a supernode: one vendor prefix, random host parts. */
+static void peer_table_macs(n2n_mac_t *macs, uint32_t *order) {
+  uint32_t i, j, tmp, seed = 0x6e326e;
+
+  for(i=0; i<PEER_TABLE_EDGES; i++) {
+    macs[i][0] = 0x02, macs[i][1] = 0x42, macs[i][2] = 0xac;
+    seed = seed * 1103515245 + 12345;
+    macs[i][3] = seed >> 24, macs[i][4] = seed >> 16;
+    macs[i][5] = i & 0xff; /* keep them unique */
+    macs[i][4] ^= (i >> 8) & 0xff, macs[i][3] ^= (i >> 16) & 0xff;
+  }
+
+  /* Look them up in random order so that every lookup misses the cache. */
+  for(i=0; i<PEER_TABLE_LOOKUPS; i++)
+    order[i] = i % PEER_TABLE_EDGES;
+
+  for(i=PEER_TABLE_LOOKUPS-1; i>0; i--) {
+    seed = seed * 1103515245 + 12345;
+    j = seed % (i + 1);
+    tmp = order[i], order[i] = order[j], order[j] = tmp;
+  }
+}
+
+static void print_peer_table_rates(const char *name, uint64_t lookup_nsec, uint64_t scan_nsec, size_t bytes) {
+  printf("Run peer_table[%s] with %u edges:   \t%8.1f Mlookups/s\t%8.1f Mentries/s scanned\t%6.1f MB\n",
+         name, PEER_TABLE_EDGES,
+         PEER_TABLE_LOOKUPS / (lookup_nsec / 1e9) / 1e6,
+         (double)PEER_TABLE_EDGES * PEER_TABLE_SCANS / (scan_nsec / 1e9) / 1e6,
+         bytes / 1e6);
+}
+
+/* Lookup and purge scan rates of the supernode edge table, the original
+ * uthash list of malloc'd peer_info against the compact peer table. The purge
+ * scans remove nothing, they measure the cost of visiting every entry. */
+static void run_peer_table_benchmark(void) {
+  n2n_mac_t *macs = calloc(PEER_TABLE_EDGES, sizeof(n2n_mac_t));
+  uint32_t *order = calloc(PEER_TABLE_LOOKUPS, sizeof(uint32_t));
+  struct peer_info *list = NULL, *scan;
+  n2n_peer_table_t table;
+  n2n_sock_t sock;
+  uint64_t t0, lookup_nsec, scan_nsec;
+  size_t found = 0;
+  uint32_t i;
+
+  if(!macs || !order) {
+    fprintf(stderr, "Unable to allocate the peer table benchmark\n");
+    exit(1);
+  }
+
+  peer_table_macs(macs, order);
+
+  memset(&sock, 0, sizeof(sock));
+  sock.family = AF_INET;
+  sock.addr.v4[0] = 10;
+
+  /* peer_info hash list */
+  for(i=0; i<PEER_TABLE_EDGES; i++) {
+    scan = calloc(1, sizeof(struct peer_info));
+    memcpy(scan->mac_addr, macs[i], N2N_MAC_SIZE);
+    scan->sock = sock;
+    scan->sock.port = 1 + (i & 0x7fff);
+    scan->last_seen = 1000;
+    HASH_ADD_PEER(list, scan);
+  }
+
+  t0 = time_nsec();
+  for(i=0; i<PEER_TABLE_LOOKUPS; i++) {
+    HASH_FIND_PEER(list, macs[order[i]], scan);
+    found += (scan != NULL);
+  }
+  lookup_nsec = time_nsec() - t0;
+
+  t0 = time_nsec();
+  for(i=0; i<PEER_TABLE_SCANS; i++)
+    found += purge_peer_list(&list, 1000);
+  scan_nsec = time_nsec() - t0;
+
+  print_peer_table_rates("peer_info", lookup_nsec, scan_nsec,
+                         HASH_COUNT(list) * sizeof(struct peer_info)
+                         + list->hh.tbl->num_buckets * sizeof(UT_hash_bucket));
+  clear_peer_list(&list);
+
+  /* Compact table */
+  memset(&table, 0, sizeof(table));
+
+  for(i=0; i<PEER_TABLE_EDGES; i++) {
+    sock.port = 1 + (i & 0x7fff);
+    peer_table_add(&table, macs[i], &sock)->last_seen = 1000;
+  }
+
+  t0 = time_nsec();
+  for(i=0; i<PEER_TABLE_LOOKUPS; i++)
+    found += (peer_table_find(&table, macs[order[i]]) != NULL);
+  lookup_nsec = time_nsec() - t0;
+
+  t0 = time_nsec();
+  for(i=0; i<PEER_TABLE_SCANS; i++)
+    found += peer_table_purge(&table, 1000);
+  scan_nsec = time_nsec() - t0;
+
+  print_peer_table_rates("compact", lookup_nsec, scan_nsec,
+                         (table.mask + 1) * (sizeof(n2n_peer_slot_t) + sizeof(n2n_sock_t)));
+
+  if((found != 2 * (size_t)PEER_TABLE_LOOKUPS) || (table.count != PEER_TABLE_EDGES))
+    fprintf(stderr, "Peer table lookups failed!\n");
+
+  peer_table_free(&table);
+  free(order);
+  free(macs);
+
+  run_peer_table_check();
+}
+
+/* Removal from the compact table shifts the rest of the cluster back. Fill
+ * a table to its load limit, so that clusters are long and one wraps around
+ * the end of the array, then purge a random half of the peers and delete a
+ * few more: every remaining peer must still be found with its socket and no
+ * removed one. */
+static void run_peer_table_check(void) {
+  n2n_mac_t macs[PEER_TABLE_CHECK_PEERS];
+  uint8_t gone[PEER_TABLE_CHECK_PEERS];
+  n2n_peer_table_t table;
+  n2n_peer_slot_t *slot;
+  n2n_sock_t sock;
+  uint32_t i, round, seed = 0x70757267, wrapped = 0, errors = 0;
+
+  memset(&sock, 0, sizeof(sock));
+  sock.family = AF_INET;
+
+  for(round=0; round<PEER_TABLE_CHECK_ROUNDS; round++) {
+    size_t purged, expected = 0;
+
+    memset(&table, 0, sizeof(table));
+
+    for(i=0; i<PEER_TABLE_CHECK_PEERS; i++) {
+      seed = seed * 1103515245 + 12345;
+      macs[i][0] = 0x02, macs[i][1] = 0x42;
+      macs[i][2] = seed >> 24, macs[i][3] = seed >> 16;
+      macs[i][4] = i >> 8, macs[i][5] = i & 0xff;
+
+      sock.port = 1 + i;
+      gone[i] = (seed >> 8) & 1;
+      expected += gone[i];
+      peer_table_add(&table, macs[i], &sock)->last_seen = gone[i] ? 1 : 3;
+    }
+
+    wrapped += (table.slots[0].port != 0) && (table.slots[table.mask].port != 0);
+
+    purged = peer_table_purge(&table, 2);
+    errors += (purged != expected);
+
+    /* Deletions in the middle of whatever clusters are left */
+    for(i=0; i<PEER_TABLE_CHECK_PEERS; i+=7) {
+      if(!gone[i] && ((slot = peer_table_find(&table, macs[i])) != NULL)) {
+        peer_table_del(&table, slot);
+        gone[i] = 1;
+      }
+    }
+
+    for(i=0; i<PEER_TABLE_CHECK_PEERS; i++) {
+      slot = peer_table_find(&table, macs[i]);
+
+      if(gone[i])
+        errors += (slot != NULL);
+      else
+        errors += (slot == NULL) || (peer_table_sock(&table, slot)->port != 1 + i);
+    }
+
+    peer_table_free(&table);
+  }
+
+  printf("Check peer_table removals: %u rounds, %u with a wrapped cluster: %s\n",
+         PEER_TABLE_CHECK_ROUNDS, wrapped, errors ? "FAILED" : "OK");
+}
+
+#ifdef __linux__
+#include <pthread.h>
+
+#define STRESS_READERS          4
+#define STRESS_SECONDS          10
+#define STRESS_STABLE           1000    /* Always in the table. */
+#define STRESS_CHURN            50000   /* Added and purged every round. */
+
+struct stress_reader {
+  pthread_t        thread;
+  n2n_peer_table_t *table;
+  n2n_epoch_t      *epoch;
+  n2n_mac_t        *macs;
+  int              *running;
+  uint64_t         lookups;
+  uint64_t         found;
+  uint64_t         errors;
+};
+
+/* The writer derives the socket of a peer from its MAC and the port it
+ * currently has, so a reader can tell a torn or foreign copy. */
+static void stress_sock(n2n_sock_t *sock, const n2n_mac_t mac, uint16_t port) {
+  memset(sock, 0, sizeof(*sock));
+  sock->family = AF_INET;
+  sock->port = port;
+  sock->addr.v4[0] = mac[4];
+  sock->addr.v4[1] = port >> 8;
+  sock->addr.v4[2] = port & 0xff;
+  sock->addr.v4[3] = mac[5];
+}
+
+static int stress_sock_valid(const n2n_sock_t *sock, const n2n_mac_t mac) {
+  n2n_sock_t expected;
+
+  stress_sock(&expected, mac, sock->port);
+  return((sock->port != 0) && (memcmp(sock, &expected, sizeof(expected)) == 0));
+}
+
+static void* stress_reader_main(void *arg) {
+  struct stress_reader *r = (struct stress_reader*)arg;
+  int id = epoch_register(r->epoch);
+  uint32_t seed = (uint32_t)(uintptr_t)r;
+
+  if(id < 0)
+    return(NULL);
+
+  while(__atomic_load_n(r->running, __ATOMIC_RELAXED)) {
+    int i;
+
+    epoch_enter(r->epoch, id);
+
+    for(i=0; i<64; i++) {
+      uint32_t k;
+      n2n_sock_t sock;
+
+      seed = seed * 1103515245 + 12345;
+      k = (seed >> 8) % (STRESS_STABLE + STRESS_CHURN);
+
+      if(peer_table_lookup(r->table, r->macs[k], &sock)) {
+        r->found++;
+        r->errors += !stress_sock_valid(&sock, r->macs[k]);
+      } else
+        r->errors += (k < STRESS_STABLE); /* Stable peers never leave. */
+
+      r->lookups++;
+    }
+
+    epoch_exit(r->epoch, id);
+  }
+
+  return(NULL);
+}
+
+/* Readers look up random peers without locks while the owner keeps adding
+ * peers, moving them to new ports and purging them, which grows and shrinks
+ * the table every round. Any stable peer missing or any socket not matching
+ * its MAC is an error. Run it under valgrind or ASAN to catch the readers
+ * touching retired arrays. */
+static void run_peer_table_stress(void) {
+  n2n_mac_t *macs = calloc(PEER_TABLE_EDGES, sizeof(n2n_mac_t));
+  uint32_t *order = calloc(PEER_TABLE_LOOKUPS, sizeof(uint32_t));
+  struct stress_reader readers[STRESS_READERS];
+  n2n_peer_table_t table;
+  n2n_epoch_t epoch;
+  n2n_sock_t sock;
+  uint64_t t0, elapsed, lookups = 0, found = 0, errors = 0, writes = 0;
+  uint32_t i, rounds = 0, seed = 1;
+  int running = 1;
+
+  if(!macs || !order) {
+    fprintf(stderr, "Unable to allocate the peer table stress test\n");
+    exit(1);
+  }
+
+  peer_table_macs(macs, order);
+  free(order);
+
+  epoch_init(&epoch);
+  memset(&table, 0, sizeof(table));
+  peer_table_share(&table, &epoch);
+
+  for(i=0; i<STRESS_STABLE; i++) {
+    stress_sock(&sock, macs[i], 1);
+    peer_table_add(&table, macs[i], &sock)->last_seen = 2;
+  }
+
+  memset(readers, 0, sizeof(readers));
+  for(i=0; i<STRESS_READERS; i++) {
+    readers[i].table = &table;
+    readers[i].epoch = &epoch;
+    readers[i].macs = macs;
+    readers[i].running = &running;
+
+    if(pthread_create(&readers[i].thread, NULL, stress_reader_main, &readers[i]) != 0) {
+      fprintf(stderr, "Unable to start the stress readers\n");
+      exit(1);
+    }
+  }
+
+  t0 = time_nsec();
+  do {
+    for(i=STRESS_STABLE; i<STRESS_STABLE+STRESS_CHURN; i++) {
+      stress_sock(&sock, macs[i], 1 + (rounds & 0x7fff));
+      peer_table_add(&table, macs[i], &sock)->last_seen = 0;
+      writes++;
+    }
+
+    /* Move random peers, stable and churned, to new ports */
+    for(i=0; i<STRESS_CHURN; i++) {
+      uint32_t k;
+      n2n_peer_slot_t *slot;
+
+      seed = seed * 1103515245 + 12345;
+      k = (seed >> 8) % (STRESS_STABLE + STRESS_CHURN);
+
+      if((slot = peer_table_find(&table, macs[k])) != NULL) {
+        stress_sock(&sock, macs[k], 1 + ((seed >> 4) & 0xfffe));
+        peer_table_set_sock(&table, slot, &sock);
+        writes++;
+      }
+    }
+
+    writes += peer_table_purge(&table, 1);
+    rounds++;
+  } while((elapsed = time_nsec() - t0) < STRESS_SECONDS * 1000000000ULL);
+
+  __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+  for(i=0; i<STRESS_READERS; i++) {
+    pthread_join(readers[i].thread, NULL);
+    lookups += readers[i].lookups;
+    found += readers[i].found;
+    errors += readers[i].errors;
+  }
+
+  printf("Run peer_table[stress] with %u readers for %u rounds:\t%8.1f Mlookups/s\t%8.1f Mwrites/s\t%5.1f%% found\t%llu errors\n",
+         STRESS_READERS, rounds, lookups / (elapsed / 1e9) / 1e6, writes / (elapsed / 1e9) / 1e6,
+         lookups ? 100.0 * found / lookups : 0.0, (unsigned long long)errors);
+
+  if(errors || (table.count != STRESS_STABLE))
+    fprintf(stderr, "Peer table stress test failed!\n");
+
+  peer_table_free(&table);
+  epoch_free(&epoch);
+  free(macs);
+}
+#endif
+
+#define FEC_PACKETS             200000
+#define FEC_MAX_GROUP           16
+
+static size_t fec_unit_len(uint32_t n) {
+  return(64 + (n * 7919) % 1337); /* 64 to 1400 bytes */
+}
+
+/* One direction of a link dropping loss_permille of the datagrams, data and
+ * parity alike. The sender encodes, the receiver decodes and checks what it
+ * rebuilds, and the loss the receiver measures goes back to the sender as
+ * the reverse traffic would carry it. */
+static void run_fec_benchmark(unsigned int loss_permille) {
+  n2n_fec_tx_t *tx = calloc(1, sizeof(n2n_fec_tx_t));
+  n2n_fec_rx_t rx;
+  n2n_FEC_t fec;
+  uint8_t body[N2N_PKT_BUF_SIZE], parity[N2N_PKT_BUF_SIZE], out[N2N_PKT_BUF_SIZE];
+  uint32_t seed = 0x6e326e, n, k, lost = 0, delivered = 0, recovered = 0, corrupt = 0;
+  size_t unit_len, parity_len, out_len, rem, idx, data_bytes = 0, sent_bytes = 0;
+  uint16_t seq;
+  uint64_t t0, nsec;
+
+  if(tx == NULL) {
+    fprintf(stderr, "Unable to allocate the FEC benchmark\n");
+    exit(1);
+  }
+
+  memset(&rx, 0, sizeof(rx));
+  t0 = time_nsec();
+
+  for(n=0; n<FEC_PACKETS; n++) {
+    unit_len = fec_unit_len(n);
+    memset(body + N2N_FEC_HDR_SIZE, n & 0xff, unit_len);
+    memcpy(body + N2N_FEC_HDR_SIZE, &n, sizeof(n));
+
+    parity_len = fec_encode(tx, FEC_MAX_GROUP, 0, 0, body, N2N_FEC_HDR_SIZE + unit_len,
+                            parity, sizeof(parity));
+    data_bytes += unit_len;
+    sent_bytes += N2N_FEC_HDR_SIZE + unit_len + parity_len;
+
+    seed = seed * 1103515245 + 12345;
+    if(((seed >> 8) % 1000) >= loss_permille) {
+      rem = N2N_FEC_HDR_SIZE + unit_len, idx = 0;
+      decode_FEC(&fec, body, &rem, &idx);
+      fec_decode(&rx, &fec, body + idx, rem, out, sizeof(out), &seq);
+      delivered++;
+    } else
+      lost++;
+
+    seed = seed * 1103515245 + 12345;
+    if((parity_len > 0) && (((seed >> 8) % 1000) >= loss_permille)) {
+      rem = parity_len, idx = 0;
+      decode_FEC(&fec, parity, &rem, &idx);
+      out_len = fec_decode(&rx, &fec, parity + idx, rem, out, sizeof(out), &seq);
+
+      if(out_len > 0) {
+        memcpy(&k, out, sizeof(k));
+
+        if((k > n) || (seq != (k & 0xffff)) || (out_len != fec_unit_len(k)) || (out[out_len-1] != (k & 0xff)))
+          corrupt++;
+        else
+          recovered++;
+      }
+    }
+
+    tx->peer_loss = rx.loss;
+  }
+
+  nsec = time_nsec() - t0;
+
+  printf("Run fec with %4.1f%% loss:\t%5.2f%% lost without FEC\t%5.2f%% with FEC"
+         "\t%5.1f%% overhead (group %u)\t%6.0f MB/s\t%u corrupt\n",
+         loss_permille / 10.0,
+         100.0 * lost / FEC_PACKETS,
+         100.0 * (FEC_PACKETS - delivered - recovered) / FEC_PACKETS,
+         100.0 * (sent_bytes - data_bytes) / data_bytes,
+         fec_group_size(rx.loss, FEC_MAX_GROUP),
+         data_bytes / (nsec / 1e9) / 1e6,
+         corrupt);
+
+  fec_rx_free(&rx);
+  free(tx);
+}
+
+#define HC_PACKETS              200000
+#define HC_FLOWS                20
+
+/* Ethernet/IPv4 frame of packet n of flow f: TCP with the timestamp option
+ * (an interactive session) or UDP (a VoIP call) every other flow, small
+ * payloads, the fields that change in a flow changing. */
+static size_t hc_frame(uint8_t *frame, uint32_t f, uint32_t n) {
+  uint8_t *ip = frame + 14, *l4 = ip + 20;
+  int tcp = (f % 2 == 0);
+  size_t l4_len = tcp ? 32 : 8, payload = tcp ? (n * 37) % 200 : 160;
+  uint32_t sum = 0, v;
+  int i;
+
+  memset(frame, 0, 14 + 20 + l4_len);
+  memcpy(frame, "\x02\x00\x00\x00\x00\x02\x02\x00\x00\x00\x00\x01\x08\x00", 14);
+
+  ip[0] = 0x45;
+  ip[1] = (n % 50 == 0) ? 0xb8 : 0;
+  ip[2] = (20 + l4_len + payload) >> 8, ip[3] = (20 + l4_len + payload) & 0xff;
+  ip[4] = n >> 8, ip[5] = n & 0xff;
+  ip[6] = 0x40;                         /* DF */
+  ip[8] = 64, ip[9] = tcp ? 6 : 17;
+  memcpy(ip + 12, "\x0a\xc8\x00\x01\x0a\xc8\x00", 7);
+  ip[19] = 2 + f;
+
+  for(i = 0; i < 20; i += 2)
+    sum += (ip[i] << 8) | ip[i+1];
+  while(sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  ip[10] = (~sum >> 8) & 0xff, ip[11] = ~sum & 0xff;
+
+  l4[0] = 0xc0, l4[1] = f;              /* ports */
+  l4[2] = 0x13, l4[3] = 0xc4;
+
+  if(tcp) {
+    v = htonl(1000 + n * 100);
+    memcpy(l4 + 4, &v, 4);
+    v = htonl(5000 + n * 3);
+    memcpy(l4 + 8, &v, 4);
+    l4[12] = 0x80;
+    l4[13] = 0x18;                      /* PSH ACK */
+    l4[14] = 0x01, l4[15] = 0xf5;
+    l4[16] = n * 13, l4[17] = n * 7;    /* checksum */
+    memcpy(l4 + 20, "\x01\x01\x08\x0a", 4);
+    v = htonl(n * 4);
+    memcpy(l4 + 24, &v, 4);
+    v = htonl(n * 4 - 20);
+    memcpy(l4 + 28, &v, 4);
+  } else {
+    l4[4] = (8 + payload) >> 8, l4[5] = (8 + payload) & 0xff;
+    l4[6] = n * 11, l4[7] = n * 3;
+  }
+
+  memset(l4 + l4_len, n & 0xff, payload);
+
+  return(14 + 20 + l4_len + payload);
+}
+
+/* Frames of HC_FLOWS interleaved flows over a link dropping loss_permille
+ * of them; the rebuilt frames must be identical to the original ones. */
+static void run_hc_benchmark(unsigned int loss_permille) {
+  n2n_hc_t *tx = calloc(1, sizeof(n2n_hc_t)), *rx = calloc(1, sizeof(n2n_hc_t));
+  uint8_t frame[N2N_PKT_BUF_SIZE], comp[N2N_PKT_BUF_SIZE], out[N2N_PKT_BUF_SIZE];
+  uint32_t seed = 0x6e326e, n, lost = 0, delivered = 0, corrupt = 0;
+  size_t len, comp_len, out_len, frame_bytes = 0, comp_bytes = 0;
+  uint64_t t0, nsec;
+
+  if((tx == NULL) || (rx == NULL)) {
+    fprintf(stderr, "Unable to allocate the header compression benchmark\n");
+    exit(1);
+  }
+
+  t0 = time_nsec();
+
+  for(n=0; n<HC_PACKETS; n++) {
+    len = hc_frame(frame, n % HC_FLOWS, n / HC_FLOWS);
+
+    /* A second of traffic every 1000 frames, for the refreshes */
+    if((comp_len = hc_compress(tx, frame, len, comp, sizeof(comp), n / 1000)) == 0)
+      corrupt++;
+
+    frame_bytes += len;
+    comp_bytes += comp_len;
+
+    seed = seed * 1103515245 + 12345;
+    if(((seed >> 8) % 1000) < loss_permille) {
+      lost++;
+      continue;
+    }
+
+    if((out_len = hc_decompress(rx, comp, comp_len, out, sizeof(out))) == 0)
+      continue; /* Context lost, waiting for a refresh */
+
+    if((out_len != len) || memcmp(out, frame, len))
+      corrupt++;
+    else
+      delivered++;
+  }
+
+  nsec = time_nsec() - t0;
+
+  printf("Run hc with %4.1f%% loss:\t%5.2f%% lost\t%5.2f%% more without context"
+         "\t%5.1f%% of the bytes\t%6.0f MB/s\t%u corrupt\n",
+         loss_permille / 10.0,
+         100.0 * lost / HC_PACKETS,
+         100.0 * (HC_PACKETS - lost - delivered - corrupt) / HC_PACKETS,
+         100.0 * comp_bytes / frame_bytes,
+         frame_bytes / (nsec / 1e9) / 1e6,
+         corrupt);
+
+  free(tx);
+  free(rx);
+}
+
+#define MP_PACKETS              200000
+#define MP_INTERVAL_USEC        500     /* 2000 packets/s, about 22 Mbit/s of full units */
+#define MP_TICK_USEC            1000    /* The edge flushes held units on its wakeups */
+
+typedef struct mp_arrival {
+  uint64_t usec;
+  uint32_t n;
+} mp_arrival_t;
+
+static int mp_arrival_cmp(const void *a, const void *b) {
+  const mp_arrival_t *x = (const mp_arrival_t*)a, *y = (const mp_arrival_t*)b;
+
+  return((x->usec > y->usec) - (x->usec < y->usec));
+}
+
+/* Note the delivery at usec of the unit in front of the reordering. */
+static void mp_delivered(const uint8_t *unit, uint64_t usec, const uint64_t *arrived,
+                         uint32_t *last, uint32_t *delivered, uint32_t *late,
+                         uint64_t *held_usec, uint64_t *max_held) {
+  uint32_t n;
+
+  memcpy(&n, unit, sizeof(n));
+  if((*delivered > 0) && (n < *last))
+    (*late)++;
+  else
+    *last = n;
+
+  (*delivered)++;
+  *held_usec += usec - arrived[n];
+  if((usec - arrived[n]) > *max_held)
+    *max_held = usec - arrived[n];
+}
+
+/* A peer spreading its packets 2:1 over a path with 5ms and one with 15ms
+ * of one way delay (each with some jitter, in order), both dropping
+ * loss_permille of them. The receiver reorders them as handle_FEC() does,
+ * once with the sockets they came from and once without, which leaves only
+ * the timeout to give up on the lost ones. */
+static void run_multipath_benchmark(unsigned int loss_permille, int track_src) {
+  static const uint32_t delay[2] = { 5000, 15000 };
+  mp_arrival_t *arrivals = calloc(MP_PACKETS, sizeof(mp_arrival_t));
+  uint64_t *arrived = calloc(MP_PACKETS, sizeof(uint64_t));
+  uint64_t path_last[2] = { 0, 0 }, tick, held_usec = 0, max_held = 0;
+  n2n_reorder_t ro;
+  n2n_sock_t src[2];
+  const uint8_t *unit;
+  uint8_t buf[64];
+  uint32_t seed = 0x6e326e, n, num = 0, i, last = 0, delivered = 0, late = 0;
+  int path;
+
+  if((arrivals == NULL) || (arrived == NULL)) {
+    fprintf(stderr, "Unable to allocate the multipath benchmark\n");
+    exit(1);
+  }
+
+  memset(&ro, 0, sizeof(ro));
+  memset(src, 0, sizeof(src));
+  for(path = 0; path < 2; path++) {
+    src[path].family = AF_INET;
+    src[path].port = 7000 + path;
+    memcpy(src[path].addr.v4, "\x0a\x00\x00\x01", IPV4_SIZE);
+  }
+
+  for(n = 0; n < MP_PACKETS; n++) {
+    uint64_t usec;
+
+    path = (n % 3 == 2);
+    seed = seed * 1103515245 + 12345;
+    usec = (uint64_t)n * MP_INTERVAL_USEC + delay[path] + (seed >> 8) % 500;
+    if(usec < path_last[path])
+      usec = path_last[path];
+    path_last[path] = usec;
+
+    seed = seed * 1103515245 + 12345;
+    if(((seed >> 8) % 1000) < loss_permille)
+      continue;
+
+    arrivals[num].usec = arrived[n] = usec;
+    arrivals[num++].n = n;
+  }
+
+  qsort(arrivals, num, sizeof(mp_arrival_t), mp_arrival_cmp);
+  tick = MP_TICK_USEC;
+
+  for(i = 0; i < num; i++) {
+    uint64_t usec = arrivals[i].usec;
+    size_t len;
+
+    for(; tick < usec; tick += MP_TICK_USEC) {
+      while((len = reorder_pop(&ro, tick, &unit)) > 0)
+        mp_delivered(unit, tick, arrived, &last, &delivered, &late, &held_usec, &max_held);
+    }
+
+    n = arrivals[i].n;
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, &n, sizeof(n));
+    path = (n % 3 == 2);
+
+    if(reorder_push(&ro, n & 0xffff, buf, sizeof(buf), 1, track_src ? &src[path] : NULL, usec))
+      mp_delivered(buf, usec, arrived, &last, &delivered, &late, &held_usec, &max_held);
+
+    while((len = reorder_pop(&ro, usec, &unit)) > 0)
+      mp_delivered(unit, usec, arrived, &last, &delivered, &late, &held_usec, &max_held);
+  }
+
+  for(; ro.held; tick += MP_TICK_USEC) {
+    while(reorder_pop(&ro, tick, &unit) > 0)
+      mp_delivered(unit, tick, arrived, &last, &delivered, &late, &held_usec, &max_held);
+  }
+
+  printf("Run multipath with %4.1f%% loss, %s:\t%5.2f ms held on average\t%6.2f ms at most"
+         "\t%5.2f%% out of order\t%u of %u delivered\n",
+         loss_permille / 10.0, track_src ? "loss detection" : "timeout only  ",
+         delivered ? held_usec / 1000.0 / delivered : 0.0, max_held / 1000.0,
+         delivered ? 100.0 * late / delivered : 0.0, delivered, num);
+
+  reorder_free(&ro);
+  free(arrivals);
+  free(arrived);
+}
+
+#ifndef WIN32
+#define CONN_SOCK_PACKETS       1000000
+#define CONN_SOCK_PKT_SIZE      128
+
+/* Datagrams per second to a busy peer from the main socket: sendto() with
+ * its address, or send() on the socket conn_sock.c connected to it. The peer
+ * is a socket on the loopback that is never read, the kernel drops what
+ * overflows its buffer in both cases. On the loopback the delivery to the
+ * peer dominates, a peer given as <addr>:<port> behind a real route (eg. a
+ * veth) shows more of the route lookup saved. */
+static void run_conn_sock_benchmark(int connected) {
+  n2n_conn_socks_t cs;
+  struct sockaddr_in peer;
+  socklen_t peer_len = sizeof(peer);
+  uint8_t buf[CONN_SOCK_PKT_SIZE];
+  SOCKET main_sock, peer_sock = -1, sock = -1;
+  uint64_t t0, nsec;
+  uint32_t i, sent = 0;
+
+  memset(&peer, 0, sizeof(peer));
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  main_sock = open_socket_reuseport(0, htonl(INADDR_ANY));
+
+  if(conn_sock_peer != NULL) {
+    char addr[32], *port;
+
+    strncpy(addr, conn_sock_peer, sizeof(addr) - 1);
+    addr[sizeof(addr) - 1] = '\0';
+
+    if(((port = strchr(addr, ':')) == NULL) || (*port = '\0', inet_pton(AF_INET, addr, &peer.sin_addr) != 1)) {
+      fprintf(stderr, "Invalid peer '%s', expecting <addr>:<port>\n", conn_sock_peer);
+      return;
+    }
+
+    peer.sin_port = htons(atoi(port + 1));
+  } else if(((peer_sock = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+	    || (bind(peer_sock, (struct sockaddr*)&peer, sizeof(peer)) != 0)
+	    || (getsockname(peer_sock, (struct sockaddr*)&peer, &peer_len) != 0))
+    peer_sock = -2;
+
+  if((main_sock < 0) || (peer_sock == -2)
+     || (conn_socks_init(&cs, main_sock, 1) != 0)) {
+    fprintf(stderr, "Unable to set up the connected socket benchmark: %s\n", strerror(errno));
+    return;
+  }
+
+  if(connected) {
+    /* Busy enough for one update to promote it */
+    conn_sock_lookup(&cs, &peer);
+    conn_socks_update(&cs, 1);
+
+    if((sock = conn_sock_lookup(&cs, &peer)) < 0) {
+      fprintf(stderr, "The peer was not promoted\n");
+      return;
+    }
+  }
+
+  memset(buf, 0xaa, sizeof(buf));
+
+  printf("Run conn_sock[%s] for %u datagrams (%u bytes):   ",
+         connected ? "connected" : "sendto", CONN_SOCK_PACKETS, CONN_SOCK_PKT_SIZE);
+  fflush(stdout);
+
+  t0 = time_nsec();
+
+  for(i=0; i<CONN_SOCK_PACKETS; i++) {
+    ssize_t rc;
+
+    if(connected && ((sock = conn_sock_lookup(&cs, &peer)) >= 0))
+      rc = send(sock, buf, sizeof(buf), 0);
+    else
+      rc = sendto(main_sock, buf, sizeof(buf), 0, (struct sockaddr*)&peer, sizeof(peer));
+
+    if(rc > 0)
+      sent++;
+  }
+
+  nsec = time_nsec() - t0;
+
+  printf("\t%8.3f Mpps\t%6.0f ns/datagram\t%u sent\n",
+         CONN_SOCK_PACKETS / (nsec / 1e9) / 1e6,
+         (double)nsec / CONN_SOCK_PACKETS, sent);
+
+  conn_socks_free(&cs);
+  close(main_sock);
+
+  if(peer_sock >= 0)
+    close(peer_sock);
+}
+#endif
+
 static ssize_t do_encode_packet( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c )
 {
   n2n_mac_t destMac={0,1,2,3,4,5};
@@ -0,0 +1,321 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Connected sockets of the busy destinations.
+ *
+ * Every sendto() on the main socket looks the route of its destination up
+ * again. A UDP socket connect()ed to the destination keeps the route cached
+ * and skips the address handling. The destinations sent to more than the
+ * configured rate get such a socket, bound to the local port of the main
+ * socket with SO_REUSEPORT; the kernel then also delivers their datagrams
+ * on it, so the caller reads it like the main socket. A destination sent to
+ * at less than a quarter of that rate for N2N_CONN_COLD_SEC goes back to
+ * the main socket.
+ *
+ * The datagrams are counted per destination in a table of N2N_CONN_SOCKS
+ * slots, two per hash. A destination takes over a slot that is not
+ * connected once the count of its holder, which it decrements, reaches
+ * zero: the busy ones end up holding the slots.
+ *
+ * Linux only puts sockets of the same owner in the SO_REUSEPORT group of
+ * a port, and the owner is whoever created the socket. The edge drops its
+ * privileges after opening the main socket, so the connected sockets come
+ * from a pool of N2N_CONN_POOL sockets created before, bound when first
+ * used. A bound socket cannot be unbound: a demoted one stays connected to
+ * its former destination, parked, and is still read until another
+ * destination takes it over.
+ */
+
+#include "n2n.h"
+
+/* ************************************** */
+
+static n2n_conn_sock_t* conn_sock_slot(n2n_conn_socks_t *cs, uint32_t addr, uint16_t port) {
+  uint32_t hash = (addr ^ (port * 2654435761u)) * 2654435761u;
+
+  return(&cs->slot[((hash >> 16) % (N2N_CONN_SOCKS / 2)) * 2]);
+}
+
+/* ************************************** */
+
+/** Enable connected sockets for the destinations sent to at more than pps
+ *  datagrams/s from main_sock, which must have been opened with
+ *  open_socket_reuseport(). */
+int conn_socks_init(n2n_conn_socks_t *cs, SOCKET main_sock, uint32_t pps) {
+  struct sockaddr_in local;
+  socklen_t len = sizeof(local);
+  int i;
+
+  memset(cs, 0, sizeof(n2n_conn_socks_t));
+
+  for(i = 0; i < N2N_CONN_SOCKS; i++)
+    cs->slot[i].sock = -1;
+
+  for(i = 0; i < N2N_CONN_POOL; i++)
+    cs->pool[i] = -1;
+
+#ifndef SO_REUSEPORT
+  traceEvent(TRACE_WARNING, "Connected sockets need SO_REUSEPORT, not supported on this platform");
+  return(-1);
+#else
+  if(getsockname(main_sock, (struct sockaddr*)&local, &len) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to get the address of the main socket [%s]", strerror(errno));
+    return(-1);
+  }
+
+  cs->local_addr = local.sin_addr.s_addr;
+  cs->local_port = ntohs(local.sin_port);
+  cs->pps = pps;
+
+  for(i = 0; i < N2N_CONN_POOL; i++) {
+    if((cs->pool[i] = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+      traceEvent(TRACE_WARNING, "Unable to create the connected sockets [%s]", strerror(errno));
+      conn_socks_free(cs);
+      return(-1);
+    }
+  }
+
+  return(0);
+#endif
+}
+
+/* ************************************** */
+
+/** Account a datagram to dest. Returns the socket connected to it, -1 if
+ *  it is to be sent on the main socket. */
+SOCKET conn_sock_lookup(n2n_conn_socks_t *cs, const struct sockaddr_in *dest) {
+  uint32_t addr = dest->sin_addr.s_addr;
+  uint16_t port = dest->sin_port;
+  n2n_conn_sock_t *slot = conn_sock_slot(cs, addr, port);
+
+  if((slot->addr != addr) || (slot->port != port)) {
+    n2n_conn_sock_t *other = slot + 1;
+
+    if((other->addr == addr) && (other->port == port))
+      slot = other;
+    else {
+      /* Wear down the weaker holder that is not connected */
+      if((slot->sock >= 0) || ((other->sock < 0) && (other->pkts < slot->pkts)))
+	slot = other;
+
+      if(slot->sock >= 0)
+	return(-1);
+
+      if(slot->pkts > 0) {
+	slot->pkts--;
+	return(-1);
+      }
+
+      slot->addr = addr;
+      slot->port = port;
+      slot->cold = 0;
+    }
+  }
+
+  slot->pkts++;
+
+  return(slot->sock);
+}
+
+/* ************************************** */
+
+/** Back to the main socket. The socket stays connected, parked. */
+static void conn_sock_close(n2n_conn_socks_t *cs, n2n_conn_sock_t *slot) {
+  int i;
+
+  for(i = 0; i < N2N_CONN_POOL; i++) {
+    if(cs->pool[i] == slot->sock)
+      cs->pool_state[i] = N2N_CONN_PARKED;
+  }
+
+  slot->sock = -1;
+  slot->cold = 0;
+  cs->connected--;
+  cs->demoted++;
+}
+
+/* ************************************** */
+
+/** Bind a spare socket of the pool next to the main socket. When that
+ *  fails, none of the spares would do better: they are all closed. */
+static int conn_sock_bind(n2n_conn_socks_t *cs, SOCKET sock) {
+  struct sockaddr_in local;
+  int sockopt = 1, i;
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&sockopt, sizeof(sockopt));
+#ifdef SO_REUSEPORT
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&sockopt, sizeof(sockopt));
+#endif
+
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(cs->local_port);
+  local.sin_addr.s_addr = cs->local_addr;
+
+  if(bind(sock, (struct sockaddr*)&local, sizeof(local)) == 0)
+    return(0);
+
+  traceEvent(TRACE_WARNING, "Unable to bind a connected socket to port %u [%s], no more will be opened",
+	     (unsigned int)cs->local_port, strerror(errno));
+
+  for(i = 0; i < N2N_CONN_POOL; i++) {
+    if((cs->pool[i] >= 0) && (cs->pool_state[i] == N2N_CONN_SPARE)) {
+      closesocket(cs->pool[i]);
+      cs->pool[i] = -1;
+    }
+  }
+
+  return(-1);
+}
+
+/* ************************************** */
+
+static void conn_sock_promote(n2n_conn_socks_t *cs, n2n_conn_sock_t *slot) {
+  struct sockaddr_in dest;
+  n2n_sock_str_t sockbuf;
+  n2n_sock_t peer;
+  SOCKET sock;
+  int i, pick = -1;
+
+  peer.family = AF_INET;
+  peer.port = ntohs(slot->port);
+  memcpy(peer.addr.v4, &slot->addr, IPV4_SIZE);
+
+  /* The socket parked on that destination if any, else any free one */
+  for(i = 0; i < N2N_CONN_POOL; i++) {
+    if((cs->pool[i] < 0) || (cs->pool_state[i] == N2N_CONN_USED))
+      continue;
+
+    if((cs->pool_state[i] == N2N_CONN_PARKED)
+       && (cs->pool_addr[i] == slot->addr) && (cs->pool_port[i] == slot->port)) {
+      pick = i;
+      break;
+    }
+
+    if(pick < 0)
+      pick = i;
+  }
+
+  if(pick < 0) {
+    traceEvent(TRACE_DEBUG, "No socket left to connect to %s", sock_to_cstr(sockbuf, &peer));
+    return;
+  }
+
+  sock = cs->pool[pick];
+
+  if(cs->pool_state[pick] == N2N_CONN_SPARE) {
+    if(conn_sock_bind(cs, sock) != 0)
+      return;
+
+    if(cs->recv_tos)
+      tos_enable(sock);
+
+    cs->pool_state[pick] = N2N_CONN_PARKED;
+  }
+
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_addr.s_addr = slot->addr;
+  dest.sin_port = slot->port;
+
+  if(connect(sock, (struct sockaddr*)&dest, sizeof(dest)) != 0) {
+    /* Bound but not connected it would take a share of the main socket's
+     * datagrams */
+    traceEvent(TRACE_WARNING, "Unable to connect a socket to %s [%s]",
+	       sock_to_cstr(sockbuf, &peer), strerror(errno));
+    closesocket(sock);
+    cs->pool[pick] = -1;
+    return;
+  }
+
+  cs->pool_state[pick] = N2N_CONN_USED;
+  cs->pool_addr[pick] = slot->addr;
+  cs->pool_port[pick] = slot->port;
+
+  slot->sock = sock;
+  slot->cold = 0;
+  cs->connected++;
+  cs->promoted++;
+
+  traceEvent(TRACE_INFO, "Connected socket for %s", sock_to_cstr(sockbuf, &peer));
+}
+
+/* ************************************** */
+
+/** Promote the destinations above the rate and demote the cold ones. To be
+ *  called about once per second. */
+void conn_socks_update(n2n_conn_socks_t *cs, time_t now) {
+  time_t elapsed = now - cs->last_update;
+  int i;
+
+  if(elapsed <= 0)
+    return;
+
+  if(cs->last_update == 0)
+    elapsed = 1;
+
+  for(i = 0; i < N2N_CONN_SOCKS; i++) {
+    n2n_conn_sock_t *slot = &cs->slot[i];
+    uint32_t pps = slot->pkts / elapsed;
+
+    if(slot->sock >= 0) {
+      if(pps >= cs->pps / 4)
+	slot->cold = 0;
+      else if((slot->cold += elapsed) >= N2N_CONN_COLD_SEC)
+	conn_sock_close(cs, slot);
+    } else if((slot->port != 0) && (pps >= cs->pps))
+      conn_sock_promote(cs, slot);
+
+    slot->pkts = 0;
+  }
+
+  cs->last_update = now;
+}
+
+/* ************************************** */
+
+/** Send on the main socket again, eg. after the destination refused a
+ *  datagram. */
+void conn_sock_demote(n2n_conn_socks_t *cs, SOCKET sock) {
+  int i;
+
+  for(i = 0; i < N2N_CONN_SOCKS; i++) {
+    if(cs->slot[i].sock == sock) {
+      conn_sock_close(cs, &cs->slot[i]);
+      return;
+    }
+  }
+}
+
+/* ************************************** */
+
+void conn_socks_free(n2n_conn_socks_t *cs) {
+  int i;
+
+  for(i = 0; i < N2N_CONN_SOCKS; i++) {
+    if(cs->slot[i].sock >= 0)
+      conn_sock_close(cs, &cs->slot[i]);
+  }
+
+  for(i = 0; i < N2N_CONN_POOL; i++) {
+    if(cs->pool[i] >= 0) {
+      closesocket(cs->pool[i]);
+      cs->pool[i] = -1;
+    }
+  }
+}
@@ -0,0 +1,134 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* DSCP and ECN between the inner (tunnelled) and outer IP headers.
+ *
+ * The outer datagram gets the whole TOS of the inner packet: its DSCP for
+ * the QoS of the underlay, and its ECN field as in the normal mode of RFC
+ * 6040, so that routers of the underlay can mark congestion on packets of
+ * ECN capable flows. At the other end the marks of the outer header are
+ * merged back into the inner packet (RFC 6040 section 4.2), letting inner
+ * TCP slow down without having lost a packet.
+ */
+
+#include "n2n.h"
+
+#define ETH_FRAMESIZE           14
+#define ETH_TYPE_IPV4           0x0800
+#define ETH_TYPE_IPV6           0x86DD
+
+/* ************************************** */
+
+/** Locate the inner IP header, returns its version (4 or 6), 0 for other
+ *  frames. */
+static int inner_ip(const uint8_t *frame, size_t len) {
+  uint16_t type;
+
+  if(len < ETH_FRAMESIZE + 1)
+    return(0);
+
+  type = (frame[12] << 8) | frame[13];
+
+  if((type == ETH_TYPE_IPV4) && (len >= ETH_FRAMESIZE + 20)
+     && ((frame[ETH_FRAMESIZE] >> 4) == 4))
+    return(4);
+
+  if((type == ETH_TYPE_IPV6) && (len >= ETH_FRAMESIZE + 40)
+     && ((frame[ETH_FRAMESIZE] >> 4) == 6))
+    return(6);
+
+  return(0);
+}
+
+/* ************************************** */
+
+static uint8_t inner_tos(const uint8_t *ip, int version) {
+  if(version == 4)
+    return(ip[1]);
+
+  /* IPv6 traffic class, across the first two bytes */
+  return(((ip[0] & 0x0f) << 4) | (ip[1] >> 4));
+}
+
+/* ************************************** */
+
+static void inner_set_ecn(uint8_t *ip, int version, uint8_t ecn) {
+  if(version == 4) {
+    /* Incremental update of the header checksum, RFC 1624 eqn. 3 */
+    uint16_t old_word = (ip[0] << 8) | ip[1], new_word;
+    uint32_t sum;
+
+    ip[1] = (ip[1] & ~N2N_ECN_MASK) | ecn;
+    new_word = (ip[0] << 8) | ip[1];
+
+    sum = (uint16_t)~((ip[10] << 8) | ip[11]);
+    sum += (uint16_t)~old_word;
+    sum += new_word;
+
+    while(sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+
+    sum = (uint16_t)~sum;
+    ip[10] = sum >> 8;
+    ip[11] = sum & 0xff;
+  } else
+    ip[1] = (ip[1] & ~(N2N_ECN_MASK << 4)) | (ecn << 4);
+}
+
+/* ************************************** */
+
+/** TOS of the outer datagram carrying the frame: the one of the inner IP
+ *  packet, 0 for anything else. */
+uint8_t ecn_encap_tos(const uint8_t *frame, size_t len) {
+  int version = inner_ip(frame, len);
+
+  return(version ? inner_tos(frame + ETH_FRAMESIZE, version) : 0);
+}
+
+/* ************************************** */
+
+/** Merge the ECN field of the outer header into the inner packet of the
+ *  frame.
+ *
+ *  Returns 1 when a congestion mark was copied in, 0 when the frame is to
+ *  be delivered as it is (possibly with ECT(1) now) and -1 when it must be
+ *  dropped: marked, but its flow is not ECN capable.
+ */
+int ecn_decap(uint8_t *frame, size_t len, uint8_t outer_tos) {
+  uint8_t outer = outer_tos & N2N_ECN_MASK, inner;
+  int version = inner_ip(frame, len);
+  uint8_t *ip = frame + ETH_FRAMESIZE;
+
+  if((version == 0) || (outer == N2N_ECN_NOT_ECT))
+    return(0);
+
+  inner = inner_tos(ip, version) & N2N_ECN_MASK;
+
+  if(inner == N2N_ECN_NOT_ECT)
+    return((outer == N2N_ECN_CE) ? -1 : 0);
+
+  if((outer == N2N_ECN_CE) && (inner != N2N_ECN_CE)) {
+    inner_set_ecn(ip, version, N2N_ECN_CE);
+    return(1);
+  }
+
+  if((outer == N2N_ECN_ECT1) && (inner == N2N_ECN_ECT0))
+    inner_set_ecn(ip, version, N2N_ECN_ECT1);
+
+  return(0);
+}
@@ -137,7 +137,15 @@ static void help() {
 	 "-l <supernode host:port>\n"
 	 "    "
 	 "[-p <local port>] [-M <mtu>] "
-	 "[-r] [-E] [-v] [-i <reg_interval>] [-t <mgmt port>] [-b] [-A] [-h]\n\n");
+	 "[-r] [-E] [-v] [-i <reg_interval>] [-t <mgmt port>] [-b] [-A] [-h]\n"
+	 "    "
+	 "[-x <cpu list>] [-B <usec>] [-q <bytes>|auto] [-T] [-Z <dir>] [-C <file>] [-P <num>]\n"
+	 "    "
+	 "[-F <group>] [-I <addr>[:<weight>]] [-R <rate>] [-H] [-y <pps>] [-D] "
+#ifdef N2N_HAVE_DLOPEN
+	 "[-j <file>]"
+#endif
+	 "\n\n");
 
 #ifdef __linux__
   printf("-d <tun device>          | tun device name\n");
@@ -147,7 +155,7 @@ static void help() {
   printf("-c <community>           | n2n community name the edge belongs to.\n");
   printf("-k <encrypt key>         | Encryption key (ASCII) - also N2N_KEY=<encrypt key>.\n");
   printf("-s <netmask>             | Edge interface netmask in dotted decimal notation (255.255.255.0).\n");
-  printf("-l <supernode host:port> | Supernode IP:port\n");
+  printf("-l <supernode host:port> | Supernode IP:port, [IPv6]:port\n");
   printf("-i <reg_interval>        | Registration interval, for NAT hole punching (default 20 seconds)\n");
   printf("-b                       | Periodically resolve supernode IP\n");
   printf("                         | (when supernodes are running on dynamic IPs)\n");
@@ -165,10 +173,35 @@ static void help() {
   printf("-r                       | Enable packet forwarding through n2n community.\n");
 #ifdef N2N_HAVE_AES
   printf("-A                       | Use AES CBC for encryption (default=use twofish).\n");
+#endif
+#ifdef N2N_HAVE_DLOPEN
+  printf("-j <file>                | Use the transform of the plugin <file> (shared object), keyed by -k.\n");
 #endif
   printf("-E                       | Accept multicast MAC addresses (default=drop).\n");
   printf("-v                       | Make more verbose. Repeat as required.\n");
   printf("-t <port>                | Management UDP Port (for multiple edges on a machine).\n");
+  printf("-x <cpu list>            | Pin the edge to the first CPU of the list, eg. -x 2 or -x 0-3,8\n"
+         "                         | (memory follows that CPU, RX steering is up to RSS/RPS).\n");
+  printf("-q <bytes>|auto          | UDP socket buffer size (eg. 4m), or 'auto' to grow it on kernel drops.\n");
+  printf("-T                       | Measure kernel queueing latencies (SO_TIMESTAMPING), see management port.\n");
+  printf("-B <usec>                | Busy-poll for <usec> after traffic before blocking (low latency, burns CPU).\n");
+#ifdef __linux__
+  printf("-Z <dir>                 | Exchange frames with the edges of this host through shared memory,\n"
+         "                         | meeting them in <dir> (frames are not encrypted).\n");
+#endif
+  printf("-C <file>                | Keep the peers in <file> across restarts and probe them at startup.\n");
+  printf("-P <num>                 | Get the active edges from the supernode and pre-register with up to <num>.\n");
+  printf("-F <group>               | Forward error correction: one parity packet per up to <group> (2-16)\n"
+         "                         | packets to a peer, adapted to the loss it reports.\n");
+  printf("-I <addr>[:<weight>]     | Also send to the peers from local address <addr>, spreading the packets\n"
+         "                         | over the uplinks by <weight> (1-100, default 1). Repeat for each uplink.\n");
+  printf("-R <rate>                | Pace the packets to each peer at up to <rate> bit/s (eg. 20m), smoothing\n"
+         "                         | the bursts that overflow the buffers of routers and NATs on the path.\n");
+  printf("-H                       | Compress the ethernet/IPv4/TCP/UDP headers of the packets to the peers.\n");
+  printf("-y <pps>                 | Give the peers sent more than <pps> datagrams/s a socket connected to\n"
+         "                         | them (kernel route caching), back to the main socket once idle.\n");
+  printf("-D                       | Copy DSCP and ECN of the tunnelled packets to the UDP datagrams, and\n"
+         "                         | congestion marks of the underlay back to them (RFC 6040).\n");
 
   printf("\nEnvironment variables:\n");
   printf("  N2N_KEY                | Encryption key (ASCII). Not with -k.\n");
@@ -316,6 +349,138 @@ static int setOption(int optkey, char *optargument, n2n_priv_config_t *ec, n2n_e
       break;
     }
 
+  case 'x': /* CPU affinity */
+    {
+      if(parse_cpu_list(optargument, &conf->cpu_affinity) <= 0) {
+        traceEvent(TRACE_WARNING, "Invalid CPU list '%s': ignored", optargument);
+        memset(&conf->cpu_affinity, 0, sizeof(conf->cpu_affinity));
+      }
+      break;
+    }
+
+  case 'q': /* socket buffers */
+    {
+      conf->sock_buf_size = parse_sock_buf_size(optargument);
+      break;
+    }
+
+  case 'T': /* kernel timestamps */
+    {
+      conf->timestamping = 1;
+      break;
+    }
+
+  case 'Z': /* shared memory */
+    {
+      if(conf->shm_dir) free(conf->shm_dir);
+      conf->shm_dir = strdup(optargument);
+      break;
+    }
+
+  case 'C': /* peer cache */
+    {
+      if(conf->peer_cache) free(conf->peer_cache);
+      conf->peer_cache = strdup(optargument);
+      break;
+    }
+
+  case 'j': /* transform plugin */
+    {
+      if(conf->transop_plugin) free(conf->transop_plugin);
+      conf->transop_plugin = strdup(optargument);
+      break;
+    }
+
+  case 'P': /* supernode peer list */
+    {
+      conf->peer_list_max = atoi(optargument);
+      break;
+    }
+
+  case 'F': /* forward error correction */
+    {
+      int group = atoi(optargument);
+
+      if((group < 2) || (group > N2N_FEC_MAX_GROUP)) {
+	traceEvent(TRACE_WARNING, "FEC group must be between 2 and %u", N2N_FEC_MAX_GROUP);
+	return(-1);
+      }
+
+      conf->fec_group = group;
+      break;
+    }
+
+  case 'R': /* egress pacing */
+    {
+      if((conf->pace_rate = parse_rate(optargument)) == 0)
+	return(-1);
+      break;
+    }
+
+  case 'H': /* header compression */
+    {
+      conf->header_compression = 1;
+      break;
+    }
+
+  case 'y': /* connected sockets */
+    {
+      int pps = atoi(optargument);
+
+      if(pps <= 0) {
+	traceEvent(TRACE_WARNING, "Invalid rate '%s' for connected sockets", optargument);
+	return(-1);
+      }
+
+      conf->conn_sock_pps = pps;
+      break;
+    }
+
+  case 'D': /* DSCP and ECN propagation */
+    {
+      conf->tos_propagate = 1;
+      break;
+    }
+
+  case 'I': /* multipath uplink */
+    {
+      ipstr_t addr;
+      char *colon;
+      int weight = 1;
+
+      if(conf->num_paths >= N2N_EDGE_MAX_PATHS) {
+	traceEvent(TRACE_WARNING, "Too many paths: at most %u are supported", N2N_EDGE_MAX_PATHS);
+	return(-1);
+      }
+
+      strncpy(addr, optargument, sizeof(addr)-1);
+      addr[sizeof(addr)-1] = '\0';
+
+      if((colon = strchr(addr, ':')) != NULL) {
+	*colon = '\0';
+	weight = atoi(colon + 1);
+      }
+
+      if((weight < 1) || (weight > 100)) {
+	traceEvent(TRACE_WARNING, "Path weight must be between 1 and 100");
+	return(-1);
+      }
+
+      if((conf->path_addr[conf->num_paths] = inet_addr(addr)) == INADDR_NONE) {
+	traceEvent(TRACE_WARNING, "Invalid path address %s", addr);
+	return(-1);
+      }
+
+      conf->path_weight[conf->num_paths++] = weight;
+      break;
+    }
+
+  case 'B': /* busy poll */
+    {
+      conf->busy_poll_usec = atoi(optargument);
+      break;
+    }
+
   case 'h': /* help */
     {
       help();
@@ -344,6 +509,20 @@ static const struct option long_options[] = {
   { "tun-device",      required_argument, NULL, 'd' },
   { "euid",            required_argument, NULL, 'u' },
   { "egid",            required_argument, NULL, 'g' },
+  { "cpu-affinity",    required_argument, NULL, 'x' },
+  { "busy-poll",       required_argument, NULL, 'B' },
+  { "sock-buf",        required_argument, NULL, 'q' },
+  { "timestamps",      no_argument,       NULL, 'T' },
+  { "shm-dir",         required_argument, NULL, 'Z' },
+  { "peer-cache",      required_argument, NULL, 'C' },
+  { "peer-list",       required_argument, NULL, 'P' },
+  { "fec",             required_argument, NULL, 'F' },
+  { "path",            required_argument, NULL, 'I' },
+  { "tos",             no_argument,       NULL, 'D' },
+  { "pace",            required_argument, NULL, 'R' },
+  { "header-compression", no_argument,    NULL, 'H' },
+  { "connect-peers",   required_argument, NULL, 'y' },
+  { "transop-plugin",  required_argument, NULL, 'j' },
   { "help"   ,         no_argument,       NULL, 'h' },
   { "verbose",         no_argument,       NULL, 'v' },
   { NULL,              0,                 NULL,  0  }
@@ -356,7 +535,7 @@ static int loadFromCLI(int argc, char *argv[], n2n_edge_conf_t *conf, n2n_priv_c
   u_char c;
 
   while((c = getopt_long(argc, argv,
-			 "K:k:a:bc:Eu:g:m:M:s:d:l:p:fvhrt:i:"
+			 "K:k:a:bc:Eu:g:m:M:s:d:l:p:fvhrt:i:x:B:q:TZ:C:P:F:I:DR:Hy:j:"
 #ifdef N2N_HAVE_AES
 			 "A"
 #endif
@@ -696,6 +875,9 @@ int main(int argc, char* argv[]) {
   tuntap_close(&tuntap);
 
   if(conf.encrypt_key) free(conf.encrypt_key);
+  if(conf.shm_dir) free(conf.shm_dir);
+  if(conf.peer_cache) free(conf.peer_cache);
+  if(conf.transop_plugin) free(conf.transop_plugin);
 
   return(rc);
 }
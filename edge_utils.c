@@ -41,6 +41,16 @@
 #define ARP_PERIOD_INTERVAL             (10) /* sec */
 #endif
 
+#define SHM_RETRY_INTERVAL              (10) /* sec between attempts to reach a MAC over shared memory */
+#define PEER_CACHE_SAVE_INTERVAL        (60) /* sec between writes of the peer cache */
+#define PEER_CACHE_MAX_AGE              (3600) /* sec, older cached peers are not probed */
+#define PEER_LIST_INTERVAL_USEC         (100000) /* usec between batches of pre-registrations */
+#define PEER_LIST_BATCH                 4      /* pre-registrations per batch */
+#define PATH_PROBE_INTERVAL             (1) /* sec between probes of the paths */
+#define PATH_PROBE_PEERS                8      /* peers probed on every path */
+#define MGMT_HC_PEERS                   8      /* peers listed with their compression savings */
+#define DATA_PEERS_MAX                  256    /* peers with FEC, reordering, pacing or compression state */
+
 #define ETH_FRAMESIZE 14
 #define IP4_SRCOFFSET 12
 #define IP4_DSTOFFSET 16
@@ -55,6 +65,9 @@ static void check_peer_registration_needed(n2n_edge_t * eee,
 		const n2n_sock_t * peer);
 static int edge_init_sockets(n2n_edge_t *eee, int udp_local_port, int mgmt_port);
 static void supernode2addr(n2n_sock_t * sn, const n2n_sn_name_t addrIn);
+static void edge_load_peer_cache(n2n_edge_t *eee, time_t now);
+static struct data_peer* data_peer_get(n2n_edge_t * eee, const n2n_mac_t mac, time_t now);
+static n2n_hc_t* data_peer_hc(n2n_hc_t ** hc);
 static void check_known_peer_sock_change(n2n_edge_t * eee,
 			 uint8_t from_supernode,
 			 const n2n_mac_t mac,
@@ -89,6 +102,41 @@ struct n2n_edge_stats {
   uint32_t rx_sup;
   uint32_t tx_sup_broadcast;
   uint32_t rx_sup_broadcast;
+  uint32_t tx_shm;
+  uint32_t rx_shm;
+  uint32_t tx_fec_parity;
+  uint32_t rx_fec_recovered;
+  uint32_t rx_ecn_ce;
+  uint32_t rx_ecn_drop;
+  uint32_t tx_pace_drop;
+};
+
+/* ************************************** */
+
+/** Shared-memory state of a destination MAC: an open channel, or when to try
+ *  again to find it on this host. */
+struct shm_peer {
+  n2n_mac_t           mac_addr;
+  n2n_shm_chan_t *    chan;
+  time_t              next_attempt;
+
+  UT_hash_handle hh; /* makes this structure hashable */
+};
+
+/* Data path state of a peer: FEC (see fec.c), reordering of the packets
+ * spread over several paths (multipath.c), egress pacing (pacing.c) and
+ * header compression (hc.c). */
+struct data_peer {
+  n2n_mac_t           mac_addr;
+  time_t              last_seen;
+  n2n_fec_tx_t        tx;
+  n2n_fec_rx_t        rx;
+  n2n_reorder_t       reorder;
+  n2n_pacer_t         pacer;
+  n2n_hc_t *          hc_tx;        /* Allocated when first used */
+  n2n_hc_t *          hc_rx;
+
+  UT_hash_handle hh; /* makes this structure hashable */
 };
 
 /* ************************************** */
@@ -107,6 +155,7 @@ struct n2n_edge {
   /* Sockets */
   n2n_sock_t          supernode;
   int                 udp_sock;
+  int                 udp_sock6;              /**< IPv6 peers and supernode, -1 without IPv6. */
   int                 udp_mgmt_sock;          /**< socket for status info. */
 
 #ifndef SKIP_MULTICAST_PEERS_DISCOVERY
@@ -126,6 +175,39 @@ struct n2n_edge {
 
   /* Statistics */
   struct n2n_edge_stats stats;
+  n2n_sock_buf_t      udp_sock_buf;           /**< Buffer sizing and kernel drops of udp_sock. */
+  n2n_tstamp_t        udp_tstamp;             /**< Kernel timestamps of udp_sock. */
+
+  /* Shared memory with the edges of this host */
+  int                 shm_sock;               /**< Listening Unix socket, -1 when disabled. */
+  char                shm_path[N2N_PATHNAME_MAXLEN];
+  struct shm_peer *   shm_peers;
+
+  /* Active peers listed by the supernode */
+  uint8_t             peer_list_want;         /**< 1: ask for a PEER_LIST once registered, 2: ask with every REGISTER_SUPER. */
+  uint32_t            peer_list_cursor;       /**< Where that page starts. */
+  n2n_PEER_LIST_ENTRY_t *peer_list;           /**< Peers to pre-register with, up to conf.peer_list_max. */
+  int                 peer_list_len;
+  int                 peer_list_next;         /**< First peer not pre-registered yet. */
+  uint64_t            peer_list_usec;         /**< Time of the last batch of pre-registrations. */
+
+  /* Forward error correction, sequence of the packets */
+  struct data_peer *   data_peers;
+  uint8_t             reorder_held;           /**< Some peer has packets held for reordering. */
+
+  /* Multipath */
+  n2n_path_t          paths[N2N_EDGE_MAX_PATHS];
+  int                 num_paths;
+
+  /* Egress pacing */
+  uint64_t            pace_wait;              /**< Usec until a queued datagram may leave, 0 if none is queued. */
+
+  /* Connected sockets of the busy peers */
+  n2n_conn_socks_t    conn_socks;             /**< conn_socks.pps is 0 when not used. */
+
+  /* DSCP and ECN of the packet being sent and received */
+  uint8_t             tx_tos;
+  uint8_t             rx_tos;
 };
 
 /* ************************************** */
@@ -135,7 +217,7 @@ static const char* transop_str(enum n2n_transform tr) {
   case N2N_TRANSFORM_ID_NULL:    return("null");
   case N2N_TRANSFORM_ID_TWOFISH: return("twofish");
   case N2N_TRANSFORM_ID_AESCBC:  return("AES-CBC");
-  default:                       return("invalid");
+  default:                       return((tr >= N2N_TRANSFORM_ID_USER_START) ? "plugin" : "invalid");
   };
 }
 
@@ -147,7 +229,7 @@ static const char* transop_str(enum n2n_transform tr) {
  */
 n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *rv) {
   n2n_transform_t transop_id = conf->transop_id;
-  n2n_edge_t *eee = calloc(1, sizeof(n2n_edge_t));
+  n2n_edge_t *eee = NULL;
   int rc = -1, i;
 
   if((rc = edge_verify_conf(conf)) != 0) {
@@ -155,6 +237,13 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
     goto edge_init_error;
   }
 
+  /* Pin before allocating so that the edge state and buffers are first
+   * touched, hence placed, on the NUMA node of the CPU. */
+  if(conf->cpu_affinity.num > 0)
+    pin_to_cpu(conf->cpu_affinity.cpu[0]);
+
+  eee = calloc(1, sizeof(n2n_edge_t));
+
   if(!eee) {
     traceEvent(TRACE_ERROR, "Cannot allocate memory");
     goto edge_init_error;
@@ -175,6 +264,8 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
   eee->known_peers    = NULL;
   eee->pending_peers  = NULL;
   eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS;
+  eee->shm_sock = -1;
+  eee->udp_sock6 = -1;
 
 #ifdef NOT_USED
   if(lzo_init() != LZO_E_OK) {
@@ -190,6 +281,11 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
   supernode2addr(&(eee->supernode), conf->sn_ip_array[eee->sn_idx]);
 
   /* Set active transop */
+  if(conf->transop_plugin != NULL) {
+    rc = n2n_transop_plugin_init(&eee->conf, &eee->transop);
+    /* The plugin tells its ID, the received packets are checked against it */
+    transop_id = eee->conf.transop_id = eee->transop.transform_id;
+  } else
   switch(transop_id) {
   case N2N_TRANSFORM_ID_TWOFISH:
     rc = n2n_transop_twofish_init(&eee->conf, &eee->transop);
@@ -216,6 +312,51 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
     goto edge_init_error;
   }
 
+  if(conf->cpu_affinity.num > 0)
+    set_incoming_cpu(eee->udp_sock, conf->cpu_affinity.cpu[0]);
+
+  if(conf->busy_poll_usec > 0)
+    set_busy_poll(eee->udp_sock, conf->busy_poll_usec);
+
+  sock_buf_init(eee->udp_sock, conf->sock_buf_size, &eee->udp_sock_buf);
+
+  if(conf->timestamping)
+    tstamp_enable(eee->udp_sock, &eee->udp_tstamp);
+
+  if(conf->tos_propagate) {
+    tos_enable(eee->udp_sock);
+
+    if(eee->udp_sock6 >= 0)
+      tos_enable(eee->udp_sock6);
+    eee->conn_socks.recv_tos = 1;
+
+    for(i = 0; i < eee->num_paths; i++)
+      tos_enable(eee->paths[i].sock);
+  }
+
+  if(conf->shm_dir != NULL) {
+#ifdef N2N_HAVE_SHM
+    eee->shm_sock = shm_listen(conf->shm_dir, conf->community_name, dev->mac_addr,
+			       eee->shm_path, sizeof(eee->shm_path));
+    if(eee->shm_sock >= 0)
+      traceEvent(TRACE_NORMAL, "Shared-memory transport on %s", eee->shm_path);
+#else
+    traceEvent(TRACE_WARNING, "Shared-memory transport not supported on this platform");
+#endif
+  }
+
+  if(conf->peer_list_max > 0) {
+    if((eee->peer_list = calloc(conf->peer_list_max, sizeof(n2n_PEER_LIST_ENTRY_t))) == NULL) {
+      traceEvent(TRACE_ERROR, "Cannot allocate memory");
+      goto edge_init_error;
+    }
+
+    eee->peer_list_want = 1;
+  }
+
+  if(conf->peer_cache != NULL)
+    edge_load_peer_cache(eee, eee->start_time);
+
 //edge_init_success:
   *rv = 0;
   return(eee);
@@ -260,65 +401,72 @@ static int is_valid_peer_sock(const n2n_sock_t *sock) {
 
 /* ***************************************************** */
 
-/** Resolve the supernode IP address.
+/** Resolve the supernode IP address: <host>:<port>, with an IPv6 literal
+ *  in brackets, eg. [2001:db8::1]:7654. A host name resolving to both
+ *  families is reached over IPv4.
  *
  *  REVISIT: This is a really bad idea. The edge will block completely while the
  *           hostname resolution is performed. This could take 15 seconds.
  */
 static void supernode2addr(n2n_sock_t * sn, const n2n_sn_name_t addrIn) {
   n2n_sn_name_t addr;
-  const char *supernode_host;
+  char *supernode_host = addr, *supernode_port;
+  const struct addrinfo aihints = {0, AF_UNSPEC, SOCK_DGRAM, 0, 0, NULL, NULL, NULL};
+  struct addrinfo *ainfo = NULL, *ai, *found = NULL;
+  int nameerr;
 
   memcpy(addr, addrIn, N2N_EDGE_SN_HOST_SIZE);
+  addr[N2N_EDGE_SN_HOST_SIZE - 1] = '\0';
 
-  supernode_host = strtok(addr, ":");
+  if(addr[0] == '[') {
+    supernode_host++;
 
-  if(supernode_host)
-    {
-      in_addr_t sn_addr;
-      char *supernode_port = strtok(NULL, ":");
-      const struct addrinfo aihints = {0, PF_INET, 0, 0, 0, NULL, NULL, NULL};
-      struct addrinfo * ainfo = NULL;
-      int nameerr;
-
-      if(supernode_port)
-	sn->port = atoi(supernode_port);
-      else
-	traceEvent(TRACE_WARNING, "Bad supernode parameter (-l <host:port>) %s %s:%s",
-		   addr, supernode_host, supernode_port);
+    if((supernode_port = strchr(supernode_host, ']')) != NULL) {
+      *supernode_port++ = '\0';
+      supernode_port = (*supernode_port == ':') ? supernode_port + 1 : NULL;
+    }
+  } else if((supernode_port = strrchr(addr, ':')) != NULL)
+    *supernode_port++ = '\0';
+
+  if(supernode_host[0] == '\0') {
+    traceEvent(TRACE_WARNING, "Wrong supernode parameter (-l <host:port>)");
+    return;
+  }
 
-      nameerr = getaddrinfo(supernode_host, NULL, &aihints, &ainfo);
+  if(supernode_port)
+    sn->port = atoi(supernode_port);
+  else
+    traceEvent(TRACE_WARNING, "Bad supernode parameter (-l <host:port>) %s", addrIn);
 
-      if(0 == nameerr)
-        {
-	  struct sockaddr_in * saddr;
+  nameerr = getaddrinfo(supernode_host, NULL, &aihints, &ainfo);
 
-	  /* ainfo s the head of a linked list if non-NULL. */
-	  if(ainfo && (PF_INET == ainfo->ai_family))
-            {
-	      /* It is definitely and IPv4 address -> sockaddr_in */
-	      saddr = (struct sockaddr_in *)ainfo->ai_addr;
+  if(0 == nameerr) {
+    /* ainfo is the head of a linked list if non-NULL: IPv4 first */
+    for(ai = ainfo; ai && !found; ai = ai->ai_next)
+      if(ai->ai_family == AF_INET) found = ai;
 
-	      memcpy(sn->addr.v4, &(saddr->sin_addr.s_addr), IPV4_SIZE);
-	      sn->family=AF_INET;
-            }
-	  else
-            {
-	      /* Should only return IPv4 addresses due to aihints. */
-	      traceEvent(TRACE_WARNING, "Failed to resolve supernode IPv4 address for %s", supernode_host);
-            }
+    for(ai = ainfo; ai && !found; ai = ai->ai_next)
+      if(ai->ai_family == AF_INET6) found = ai;
 
-	  freeaddrinfo(ainfo); /* free everything allocated by getaddrinfo(). */
-	  ainfo = NULL;
-        } else {
-	traceEvent(TRACE_WARNING, "Failed to resolve supernode host %s, assuming numeric", supernode_host);
-	sn_addr = inet_addr(supernode_host); /* uint32_t */
-	memcpy(sn->addr.v4, &(sn_addr), IPV4_SIZE);
-	sn->family=AF_INET;
-      }
+    if(found) {
+      n2n_sock_t resolved;
 
+      sockaddr_to_sock(&resolved, (const n2n_sockaddr_t *)found->ai_addr);
+      sn->family = resolved.family;
+      memcpy(&sn->addr, &resolved.addr, sizeof(sn->addr));
     } else
-    traceEvent(TRACE_WARNING, "Wrong supernode parameter (-l <host:port>)");
+      traceEvent(TRACE_WARNING, "Failed to resolve supernode address for %s", supernode_host);
+
+    freeaddrinfo(ainfo); /* free everything allocated by getaddrinfo(). */
+    ainfo = NULL;
+  } else {
+    in_addr_t sn_addr;
+
+    traceEvent(TRACE_WARNING, "Failed to resolve supernode host %s, assuming numeric", supernode_host);
+    sn_addr = inet_addr(supernode_host); /* uint32_t */
+    memcpy(sn->addr.v4, &(sn_addr), IPV4_SIZE);
+    sn->family=AF_INET;
+  }
 }
 
 /* ************************************** */
@@ -467,6 +615,230 @@ static void peer_set_p2p_confirmed(n2n_edge_t * eee,
 
 /* ************************************** */
 
+/** Add a peer we are about to send a REGISTER to, without waiting for
+ *  traffic to it. */
+static struct peer_info* add_pending_peer(n2n_edge_t *eee, const n2n_mac_t mac,
+					  const n2n_sock_t *sock, time_t now) {
+  struct peer_info *scan = calloc(1, sizeof(struct peer_info));
+
+  if(scan == NULL)
+    return(NULL);
+
+  memcpy(scan->mac_addr, mac, N2N_MAC_SIZE);
+  scan->sock = *sock;
+  scan->timeout = REGISTER_SUPER_INTERVAL_DFL;
+  scan->last_seen = now; /* Purged as any pending peer if nobody answers. */
+  HASH_ADD_PEER(eee->pending_peers, scan);
+
+  return(scan);
+}
+
+/** REGISTER with a few more peers of the supernode list, directly and
+ *  through the supernode: the relayed copy makes the peer register back
+ *  towards us, which opens its NAT when ours is the one in the way. Paced
+ *  so that a long list does not come out as a burst. */
+static void edge_preregister_peers(n2n_edge_t *eee, time_t now) {
+  uint64_t usec = time_usec();
+  int num = 0;
+
+  if((usec - eee->peer_list_usec) < PEER_LIST_INTERVAL_USEC)
+    return;
+
+  eee->peer_list_usec = usec;
+
+  while((num < PEER_LIST_BATCH) && (eee->peer_list_next < eee->peer_list_len)) {
+    n2n_PEER_LIST_ENTRY_t *peer = &eee->peer_list[eee->peer_list_next++];
+    struct peer_info *scan;
+
+    HASH_FIND_PEER(eee->known_peers, peer->mac, scan);
+    if(scan == NULL)
+      HASH_FIND_PEER(eee->pending_peers, peer->mac, scan);
+    if(scan != NULL)
+      continue; /* Traffic got there first */
+
+    if(add_pending_peer(eee, peer->mac, &peer->sock, now) == NULL)
+      break;
+
+    send_register(eee, &peer->sock, peer->mac);
+    send_register(eee, &(eee->supernode), peer->mac);
+    num++;
+  }
+
+  if(eee->peer_list_next == eee->peer_list_len)
+    traceEvent(TRACE_INFO, "Pre-registered with the %d peers listed by the supernode", eee->peer_list_len);
+}
+
+/* ************************************** */
+
+/* The peer cache is a text file with a line per P2P peer, one that answered
+ * a REGISTER on that socket:
+ *
+ *   <MAC> <IPv4>:<port>|[<IPv6>]:<port> <last seen>
+ *
+ * Only the community named in the header may use it. */
+
+/** Parse a socket of the cache, as written by sock_to_cstr(). */
+static int peer_cache_sock(n2n_sock_t *sock, char *str) {
+  char *port, *end;
+  unsigned long num;
+
+  memset(sock, 0, sizeof(n2n_sock_t));
+
+  if(str[0] == '[') {
+    if((port = strstr(str, "]:")) == NULL)
+      return(-1);
+
+    *port = '\0', port += 2;
+    sock->family = AF_INET6;
+
+    if(inet_pton(AF_INET6, &str[1], sock->addr.v6) != 1)
+      return(-1);
+  } else {
+    if((port = strrchr(str, ':')) == NULL)
+      return(-1);
+
+    *port++ = '\0';
+    sock->family = AF_INET;
+
+    if(inet_pton(AF_INET, str, sock->addr.v4) != 1)
+      return(-1);
+  }
+
+  num = strtoul(port, &end, 10);
+  if((*end != '\0') || (num == 0) || (num > 65535))
+    return(-1);
+
+  sock->port = num;
+
+  return(0);
+}
+
+/** Send a REGISTER to every recent peer of the cache at once. The ones
+ *  still listening on the same socket answer with a REGISTER_ACK, which
+ *  confirms them as usual, so P2P is back one round trip after startup
+ *  instead of after the next PACKET, QUERY_PEER and REGISTER exchange. */
+static void edge_load_peer_cache(n2n_edge_t *eee, time_t now) {
+  FILE *fd = fopen(eee->conf.peer_cache, "r");
+  char line[256], community[N2N_COMMUNITY_SIZE+1];
+  unsigned int num_probed = 0;
+
+  if(fd == NULL) {
+    if(errno != ENOENT)
+      traceEvent(TRACE_WARNING, "Unable to read peer cache %s: %s",
+		 eee->conf.peer_cache, strerror(errno));
+    return;
+  }
+
+  memset(community, 0, sizeof(community));
+
+  while(fgets(line, sizeof(line), fd)) {
+    unsigned int mac[6], i;
+    char sock_str[N2N_SOCKBUF_SIZE];
+    long last_seen;
+    n2n_sock_t sock;
+    n2n_mac_t mac_addr;
+    struct peer_info *scan;
+    macstr_t mac_buf;
+    n2n_sock_str_t sockbuf;
+
+    if(line[0] == '#') {
+      /* The name runs to the end of the line, it may hold spaces */
+      if(strncmp(line, "# community ", 12) == 0) {
+	strncpy(community, &line[12], N2N_COMMUNITY_SIZE-1);
+	community[N2N_COMMUNITY_SIZE-1] = '\0';
+	community[strcspn(community, "\r\n")] = '\0';
+      }
+      continue;
+    }
+
+    if(strncmp(community, (char*)eee->conf.community_name, N2N_COMMUNITY_SIZE) != 0) {
+      traceEvent(TRACE_NORMAL, "Peer cache %s belongs to community '%s', ignored",
+		 eee->conf.peer_cache, community);
+      break;
+    }
+
+    if((sscanf(line, "%x:%x:%x:%x:%x:%x %63s %ld",
+	       &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5],
+	       sock_str, &last_seen) != 8)
+       || (peer_cache_sock(&sock, sock_str) != 0))
+      continue;
+
+    if((now - last_seen) > PEER_CACHE_MAX_AGE)
+      continue;
+
+    for(i=0; i<6; i++) mac_addr[i] = mac[i];
+
+    if(!memcmp(mac_addr, eee->device.mac_addr, N2N_MAC_SIZE) || !is_valid_peer_sock(&sock))
+      continue;
+
+    HASH_FIND_PEER(eee->pending_peers, mac_addr, scan);
+    if(scan)
+      continue;
+
+    if((scan = add_pending_peer(eee, mac_addr, &sock, now)) == NULL)
+      break;
+
+    traceEvent(TRACE_DEBUG, "=== cached peer %s -> %s",
+	       macaddr_str(mac_buf, scan->mac_addr),
+	       sock_to_cstr(sockbuf, &(scan->sock)));
+
+    send_register(eee, &(scan->sock), scan->mac_addr);
+    num_probed++;
+  }
+
+  fclose(fd);
+
+  if(num_probed)
+    traceEvent(TRACE_NORMAL, "Probing %u cached peers from %s", num_probed, eee->conf.peer_cache);
+}
+
+static void write_peer_cache(FILE *fd, struct peer_info *list) {
+  struct peer_info *scan, *tmp;
+  macstr_t mac_buf;
+  n2n_sock_str_t sockbuf;
+
+  HASH_ITER(hh, list, scan, tmp) {
+    fprintf(fd, "%s %s %ld\n",
+	    macaddr_str(mac_buf, scan->mac_addr),
+	    sock_to_cstr(sockbuf, &(scan->sock)),
+	    (long)scan->last_seen);
+  }
+}
+
+/** Write the peer cache, replacing the previous one only once complete. */
+static void edge_save_peer_cache(n2n_edge_t *eee) {
+  char tmp_path[N2N_PATHNAME_MAXLEN];
+  FILE *fd;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", eee->conf.peer_cache);
+
+  if((fd = fopen(tmp_path, "w")) == NULL) {
+    traceEvent(TRACE_WARNING, "Unable to write peer cache %s: %s", tmp_path, strerror(errno));
+    return;
+  }
+
+  fprintf(fd, "# n2n peer cache\n# community %s\n", eee->conf.community_name);
+  /* Pending peers never answered on their socket, the supernode tells
+   * their current one anyway */
+  write_peer_cache(fd, eee->known_peers);
+
+  if(fclose(fd) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to write peer cache %s: %s", tmp_path, strerror(errno));
+    unlink(tmp_path);
+    return;
+  }
+
+#ifdef WIN32
+  unlink(eee->conf.peer_cache); /* rename() does not replace on Windows */
+#endif
+  if(rename(tmp_path, eee->conf.peer_cache) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to replace peer cache %s: %s", eee->conf.peer_cache, strerror(errno));
+    unlink(tmp_path);
+  }
+}
+
+/* ************************************** */
+
 int is_empty_ip_address(const n2n_sock_t * sock) {
   const uint8_t * ptr=NULL;
   size_t len=0;
@@ -545,18 +917,51 @@ static void check_known_peer_sock_change(n2n_edge_t * eee,
 
 /* ************************************** */
 
-/** Send a datagram to a socket defined by a n2n_sock_t */
-static ssize_t sendto_sock(int fd, const void * buf,
+/** Send a datagram on the main UDP socket of its family to a socket defined
+ *  by a n2n_sock_t, or on the socket connected to it if it is a busy peer. */
+static ssize_t sendto_sock(n2n_edge_t * eee, const void * buf,
 			   size_t len, const n2n_sock_t * dest) {
-  struct sockaddr_in peer_addr;
+  n2n_sockaddr_t peer_addr;
+  socklen_t addr_len = sock_to_sockaddr(&peer_addr, dest);
+  uint64_t begin;
   ssize_t sent;
+  SOCKET sock;
+
+  if(dest->family == AF_INET6) {
+    if(eee->udp_sock6 < 0) {
+      errno = EAFNOSUPPORT;
+      return(-1);
+    }
 
-  fill_sockaddr((struct sockaddr *) &peer_addr,
-		sizeof(peer_addr),
-		dest);
+    sent = sendto_tos(eee->udp_sock6, buf, len, &peer_addr.sa, addr_len, eee->tx_tos);
+    N2N_PROBE2(edge_tx, len, sent);
+
+    if(sent < 0)
+      traceEvent(TRACE_ERROR, "sendto failed (%d) %s", errno, strerror(errno));
+
+    return(sent);
+  }
+
+  if(eee->conn_socks.pps
+     && ((sock = conn_sock_lookup(&eee->conn_socks, &peer_addr.in)) >= 0)) {
+    if((sent = sendto_tos(sock, buf, len, NULL, 0, eee->tx_tos)) >= 0) {
+      N2N_PROBE2(edge_tx, len, sent);
+      return(sent);
+    }
+
+    /* Refused, eg. by an ICMP port unreachable: back to the main socket */
+    traceEvent(TRACE_INFO, "Connected socket failed [%s]", strerror(errno));
+    conn_sock_demote(&eee->conn_socks, sock);
+  }
+
+  begin = tstamp_tx_begin(&eee->udp_tstamp);
+  sent = sendto_tos(eee->udp_sock, buf, len, &peer_addr.sa, addr_len, eee->tx_tos);
+
+  if(sent >= 0)
+    tstamp_tx_sent(&eee->udp_tstamp, begin);
+
+  N2N_PROBE2(edge_tx, len, sent);
 
-  sent = sendto(fd, buf, len, 0/*flags*/,
-		(struct sockaddr *)&peer_addr, sizeof(struct sockaddr_in));
   if(sent < 0)
     {
       char * c = strerror(errno);
@@ -572,9 +977,11 @@ static ssize_t sendto_sock(int fd, const void * buf,
 
 /* ************************************** */
 
-/** Send a REGISTER_SUPER packet to the current supernode. */
+/** Send a REGISTER_SUPER packet to the current supernode. When auth is set
+ *  the request answers a supernode challenge and keeps the last cookie. */
 static void send_register_super(n2n_edge_t * eee,
-				const n2n_sock_t * supernode) {
+				const n2n_sock_t * supernode,
+				const n2n_auth_t * auth) {
   uint8_t pktbuf[N2N_PKT_BUF_SIZE] = {0};
   size_t idx;
   /* ssize_t sent; */
@@ -589,22 +996,34 @@ static void send_register_super(n2n_edge_t * eee,
   cmn.flags = 0;
   memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
 
-  for(idx=0; idx < N2N_COOKIE_SIZE; ++idx)
-    eee->last_cookie[idx] = rand() % 0xff;
+  if(auth == NULL) {
+    for(idx=0; idx < N2N_COOKIE_SIZE; ++idx)
+      eee->last_cookie[idx] = rand() % 0xff;
+
+    reg.auth.scheme=0; /* No auth yet */
+  } else
+    memcpy(&(reg.auth), auth, sizeof(n2n_auth_t));
 
   memcpy(reg.cookie, eee->last_cookie, N2N_COOKIE_SIZE);
-  reg.auth.scheme=0; /* No auth yet */
 
   idx=0;
   encode_mac(reg.edgeMac, &idx, eee->device.mac_addr);
 
+  if(eee->peer_list_want == 2) {
+    cmn.flags |= N2N_FLAGS_PEER_LIST;
+    reg.list_cursor = eee->peer_list_cursor;
+    reg.list_max = MIN(eee->conf.peer_list_max - eee->peer_list_len, 0xffff);
+  }
+
   idx=0;
   encode_REGISTER_SUPER(pktbuf, &idx, &cmn, &reg);
 
   traceEvent(TRACE_INFO, "send REGISTER_SUPER to %s",
 	     sock_to_cstr(sockbuf, supernode));
 
-  /* sent = */ sendto_sock(eee->udp_sock, pktbuf, idx, supernode);
+  N2N_PROBE2(register_super, eee->sn_idx, auth != NULL);
+
+  /* sent = */ sendto_sock(eee, pktbuf, idx, supernode);
 }
 
 /* ************************************** */
@@ -632,7 +1051,7 @@ static void send_query_peer( n2n_edge_t * eee,
 
     traceEvent( TRACE_DEBUG, "send QUERY_PEER to supernode" );
 
-    sendto_sock( eee->udp_sock, pktbuf, idx, &(eee->supernode) );
+    sendto_sock( eee, pktbuf, idx, &(eee->supernode) );
 }
 
 /** Send a REGISTER packet to another edge. */
@@ -670,7 +1089,7 @@ static void send_register(n2n_edge_t * eee,
   traceEvent(TRACE_INFO, "send REGISTER %s",
 	     sock_to_cstr(sockbuf, remote_peer));
 
-  /* sent = */ sendto_sock(eee->udp_sock, pktbuf, idx, remote_peer);
+  /* sent = */ sendto_sock(eee, pktbuf, idx, remote_peer);
 }
 
 /* ************************************** */
@@ -705,7 +1124,7 @@ static void send_register_ack(n2n_edge_t * eee,
 	     sock_to_cstr(sockbuf, remote_peer));
 
 
-  /* sent = */ sendto_sock(eee->udp_sock, pktbuf, idx, remote_peer);
+  /* sent = */ sendto_sock(eee, pktbuf, idx, remote_peer);
 }
 
 /* ************************************** */
@@ -735,6 +1154,10 @@ static void update_supernode_reg(n2n_edge_t * eee, time_t nowTime) {
     traceEvent(TRACE_WARNING, "Supernode not responding - moving to %u of %u",
 	       (unsigned int)eee->sn_idx, (unsigned int)eee->conf.sn_num);
 
+    /* Ask the new one for its list from the start */
+    eee->peer_list_want = (eee->peer_list_len < eee->conf.peer_list_max);
+    eee->peer_list_cursor = 0;
+
     eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS;
   }
   else
@@ -747,7 +1170,7 @@ static void update_supernode_reg(n2n_edge_t * eee, time_t nowTime) {
 	       sn_idx+1, eee->conf.sn_num,
 	       supernode_ip(eee), (unsigned int)eee->sup_attempts);
 
-    send_register_super(eee, &(eee->supernode));
+    send_register_super(eee, &(eee->supernode), NULL);
   }
 
   register_with_local_peers(eee);
@@ -781,28 +1204,16 @@ static const char * supernode_ip(const n2n_edge_t * eee) {
 
 /* ************************************** */
 
-/** A PACKET has arrived containing an encapsulated ethernet datagram - usually
- *  encrypted. */
-static int handle_PACKET(n2n_edge_t * eee,
-			 const n2n_common_t * cmn,
-			 const n2n_PACKET_t * pkt,
-			 const n2n_sock_t * orig_sender,
-			 uint8_t * payload,
-			 size_t psize) {
-  ssize_t             data_sent_len;
+/** Account a PACKET to its path and sender, before its payload is handled. */
+static void note_PACKET(n2n_edge_t * eee,
+			const n2n_common_t * cmn,
+			const n2n_PACKET_t * pkt,
+			const n2n_sock_t * orig_sender) {
   uint8_t             from_supernode;
-  uint8_t *           eth_payload=NULL;
-  int                 retval = -1;
   time_t              now;
-  ether_hdr_t *       eh;
-  ipstr_t             ip_buf;
 
   now = time(NULL);
 
-  traceEvent(TRACE_DEBUG, "handle_PACKET size %u transform %u",
-	     (unsigned int)psize, (unsigned int)pkt->transform);
-  /* hexdump(payload, psize); */
-
   from_supernode= cmn->flags & N2N_FLAGS_FROM_SUPERNODE;
 
   if(from_supernode)
@@ -821,60 +1232,461 @@ static int handle_PACKET(n2n_edge_t * eee,
 
   /* Update the sender in peer table entry */
   check_peer_registration_needed(eee, from_supernode, pkt->srcMac, orig_sender);
+}
+
+/* ************************************** */
+
+/** Decode the payload of a PACKET from src_mac and write it to the TAP. */
+static int packet_to_tap(n2n_edge_t * eee,
+			 n2n_transform_t transform,
+			 const n2n_mac_t src_mac,
+			 const uint8_t * payload,
+			 size_t psize) {
+  ssize_t             data_sent_len;
+  uint8_t *           eth_payload=NULL;
+  int                 retval = -1;
+  ether_hdr_t *       eh;
+  ipstr_t             ip_buf;
 
   /* Handle transform. */
   {
     uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+    uint8_t hcbuf[N2N_PKT_BUF_SIZE];
     size_t eth_size;
     n2n_transform_t rx_transop_id;
 
-    rx_transop_id = (n2n_transform_t)pkt->transform;
+    rx_transop_id = transform;
+
+    if((rx_transop_id == eee->conf.transop_id) || (rx_transop_id == N2N_TRANSFORM_ID_HC)) {
+	uint64_t t0 = N2N_PROBE_CLOCK(transform_rev);
+
+	eth_payload = decodebuf;
+	eh = (ether_hdr_t*)eth_payload;
+	eth_size = eee->transop.rev(&eee->transop,
+						    eth_payload, N2N_PKT_BUF_SIZE,
+						    payload, psize, src_mac);
+	++(eee->transop.rx_cnt); /* stats */
+
+	N2N_PROBE4(transform_rev, rx_transop_id, psize, eth_size, N2N_PROBE_SINCE(t0));
+
+	if(rx_transop_id == N2N_TRANSFORM_ID_HC) {
+	  struct data_peer *peer = data_peer_get(eee, src_mac, time(NULL));
+	  n2n_hc_t *hc = peer ? data_peer_hc(&peer->hc_rx) : NULL;
+
+	  if((hc == NULL)
+	     || ((eth_size = hc_decompress(hc, decodebuf, eth_size, hcbuf, sizeof(hcbuf))) == 0)) {
+	    traceEvent(TRACE_DEBUG, "Dropping header compressed frame without context");
+	    return(-1);
+	  }
+
+	  eth_payload = hcbuf;
+	  eh = (ether_hdr_t*)eth_payload;
+	}
+
+	if(!(eee->conf.allow_routing)) {
+	  if(ntohs(eh->type) == 0x0800) {
+	    uint32_t *dst = (uint32_t*)&eth_payload[ETH_FRAMESIZE + IP4_DSTOFFSET];
+
+	    /* Note: all elements of the_ip are in network order */
+	    if(*dst != eee->device.ip_addr) {
+	      /* This is a packet that needs to be routed */
+	      traceEvent(TRACE_INFO, "Discarding routed packet [%s]",
+			 intoa(ntohl(*dst), ip_buf, sizeof(ip_buf)));
+	      return(-1);
+	    } else {
+	      /* This packet is directed to us */
+	      /* traceEvent(TRACE_INFO, "Sending non-routed packet"); */
+	    }
+	  }
+	}
+
+	if(eee->conf.tos_propagate) {
+	  switch(ecn_decap(eth_payload, eth_size, eee->rx_tos)) {
+	  case 1:
+	    ++(eee->stats.rx_ecn_ce);
+	    break;
+	  case -1:
+	    /* Congestion marked, but the inner flow cannot be told */
+	    ++(eee->stats.rx_ecn_drop);
+	    return(-1);
+	  }
+	}
+
+	/* Write ethernet packet to tap device. */
+	traceEvent(TRACE_INFO, "sending to TAP %u", (unsigned int)eth_size);
+	data_sent_len = tuntap_write(&(eee->device), eth_payload, eth_size);
+
+	if (data_sent_len == eth_size)
+	  {
+	    retval = 0;
+	  }
+      }
+    else
+      {
+	traceEvent(TRACE_ERROR, "invalid transop ID: expected %s(%u), got %s(%u)",
+		   transop_str(eee->conf.transop_id), eee->conf.transop_id,
+		   transop_str(rx_transop_id), rx_transop_id);
+      }
+  }
+
+  return retval;
+}
+
+/* ************************************** */
+
+/** A PACKET has arrived containing an encapsulated ethernet datagram - usually
+ *  encrypted. */
+static int handle_PACKET(n2n_edge_t * eee,
+			 const n2n_common_t * cmn,
+			 const n2n_PACKET_t * pkt,
+			 const n2n_sock_t * orig_sender,
+			 uint8_t * payload,
+			 size_t psize) {
+  traceEvent(TRACE_DEBUG, "handle_PACKET size %u transform %u",
+	     (unsigned int)psize, (unsigned int)pkt->transform);
+  /* hexdump(payload, psize); */
+
+  note_PACKET(eee, cmn, pkt, orig_sender);
+
+  return(packet_to_tap(eee, pkt->transform, pkt->srcMac, payload, psize));
+}
+
+/* ************************************** */
+
+/** Find the data path state of a peer, creating it if needed. Returns NULL
+ *  when DATA_PEERS_MAX peers already have some. */
+static struct data_peer* data_peer_get(n2n_edge_t * eee, const n2n_mac_t mac, time_t now) {
+  struct data_peer *peer;
+
+  HASH_FIND_PEER(eee->data_peers, mac, peer);
+
+  if(peer == NULL) {
+    if(HASH_COUNT(eee->data_peers) >= DATA_PEERS_MAX)
+      return(NULL);
+
+    if((peer = (struct data_peer*)calloc(1, sizeof(struct data_peer))) == NULL)
+      return(NULL);
+
+    memcpy(peer->mac_addr, mac, N2N_MAC_SIZE);
+    HASH_ADD_PEER(eee->data_peers, peer);
+  }
+
+  peer->last_seen = now;
+
+  return(peer);
+}
+
+/* ************************************** */
+
+/** Header compression state of a peer, allocating it if needed. */
+static n2n_hc_t* data_peer_hc(n2n_hc_t ** hc) {
+  if(*hc == NULL)
+    *hc = (n2n_hc_t*)calloc(1, sizeof(n2n_hc_t));
+
+  return(*hc);
+}
+
+/* ************************************** */
+
+/** Drop the data path state of the peers gone quiet. */
+static void data_peer_purge(n2n_edge_t * eee, time_t purge_before) {
+  struct data_peer *peer, *tmp;
+
+  HASH_ITER(hh, eee->data_peers, peer, tmp) {
+    if(peer->last_seen < purge_before) {
+      HASH_DEL(eee->data_peers, peer);
+      fec_rx_free(&peer->rx);
+      reorder_free(&peer->reorder);
+      pacer_free(&peer->pacer);
+      free(peer->hc_tx);
+      free(peer->hc_rx);
+      free(peer);
+    }
+  }
+}
+
+/* ************************************** */
+
+/** Write a FEC unit, the transform ID and the payload, to the TAP. */
+static int unit_to_tap(n2n_edge_t * eee, const n2n_mac_t src_mac,
+		       const uint8_t * unit, size_t len) {
+  size_t rem = len, idx = 0;
+  uint16_t transform;
+
+  if(decode_uint16(&transform, unit, &rem, &idx) != 2)
+    return(-1);
+
+  return(packet_to_tap(eee, transform, src_mac, unit + idx, rem));
+}
+
+/* ************************************** */
+
+/** A PACKET with transform N2N_TRANSFORM_ID_FEC: hand the data unit, and the
+ *  unit the parity rebuilds if any, to the TAP in order. */
+static int handle_FEC(n2n_edge_t * eee,
+		      const n2n_common_t * cmn,
+		      const n2n_PACKET_t * pkt,
+		      const n2n_sock_t * orig_sender,
+		      uint8_t * payload,
+		      size_t psize) {
+  n2n_FEC_t fec;
+  struct data_peer *peer;
+  struct peer_info *scan;
+  uint8_t recovered[N2N_FEC_UNIT_SIZE];
+  const uint8_t *unit;
+  const n2n_sock_t *path_sender = orig_sender;
+  size_t rem = psize, idx = 0, len;
+  uint64_t now_usec = time_usec();
+  uint16_t seq;
+  int hold, retval = -1;
+
+  if(decode_FEC(&fec, payload, &rem, &idx) < 0) {
+    traceEvent(TRACE_WARNING, "Dropping invalid FEC packet");
+    return(-1);
+  }
+
+  /* The decoding and reordering buffers are only worth it for the peers
+   * we know of: the MAC of a PACKET is not authenticated. */
+  HASH_FIND_PEER(eee->data_peers, pkt->srcMac, peer);
+
+  if(peer == NULL) {
+    HASH_FIND_PEER(eee->known_peers, pkt->srcMac, scan);
+    if(scan == NULL)
+      HASH_FIND_PEER(eee->pending_peers, pkt->srcMac, scan);
+
+    if(scan)
+      peer = data_peer_get(eee, pkt->srcMac, time(NULL));
+  } else
+    peer->last_seen = time(NULL);
+
+  if(peer == NULL) {
+    /* Deliver the data unit as is, without recovery nor reordering */
+    note_PACKET(eee, cmn, pkt, orig_sender);
+
+    if((fec.index < fec.group) || (fec.group == 0))
+      return(unit_to_tap(eee, pkt->srcMac, payload + idx, rem));
+
+    return(-1);
+  }
+
+  hold = (fec.flags & N2N_FEC_FLAG_MULTIPATH);
+
+  if(hold) {
+    /* Spread over the uplinks of the peer, still the socket we know it by */
+    HASH_FIND_PEER(eee->known_peers, pkt->srcMac, scan);
+    if(scan) orig_sender = &scan->sock;
+  }
+
+  note_PACKET(eee, cmn, pkt, orig_sender);
+
+  peer->tx.peer_loss = fec.loss;
+  len = fec_decode(&peer->rx, &fec, payload + idx, rem,
+		   recovered, sizeof(recovered), &seq);
+
+  if(((fec.index < fec.group) || (fec.group == 0))
+     && reorder_push(&peer->reorder, fec.seq, payload + idx, rem, hold, path_sender, now_usec))
+    retval = unit_to_tap(eee, pkt->srcMac, payload + idx, rem);
+
+  /* The units below did not come with this outer header */
+  eee->rx_tos = 0;
+
+  if(len > 0) {
+    traceEvent(TRACE_DEBUG, "FEC recovered %u bytes, sequence %u",
+	       (unsigned int)len, (unsigned int)seq);
+    ++(eee->stats.rx_fec_recovered);
+
+    if(reorder_push(&peer->reorder, seq, recovered, len, hold, NULL, now_usec))
+      retval = unit_to_tap(eee, pkt->srcMac, recovered, len);
+  }
+
+  while((len = reorder_pop(&peer->reorder, now_usec, &unit)) > 0)
+    unit_to_tap(eee, pkt->srcMac, unit, len);
+
+  if(peer->reorder.held)
+    eee->reorder_held = 1;
+
+  return(retval);
+}
+
+/* ************************************** */
+
+/** Deliver the units held for reordering that waited long enough. Returns
+ *  whether some are still held. */
+static int edge_reorder_flush(n2n_edge_t * eee) {
+  struct data_peer *peer, *tmp;
+  const uint8_t *unit;
+  uint64_t now_usec = time_usec();
+  size_t len;
+  int held = 0;
+
+  eee->rx_tos = 0;
+
+  HASH_ITER(hh, eee->data_peers, peer, tmp) {
+    while((len = reorder_pop(&peer->reorder, now_usec, &unit)) > 0)
+      unit_to_tap(eee, peer->mac_addr, unit, len);
+
+    if(peer->reorder.held)
+      held = 1;
+  }
+
+  return(held);
+}
+
+/* ************************************** */
+
+/** Number of open shared-memory channels. */
+static unsigned int edge_shm_channels(const n2n_edge_t * eee) {
+  struct shm_peer *peer, *tmp;
+  unsigned int num = 0;
+
+  HASH_ITER(hh, eee->shm_peers, peer, tmp) {
+    if(peer->chan != NULL)
+      num++;
+  }
+
+  return(num);
+}
+
+#ifdef N2N_HAVE_SHM
+
+static struct shm_peer* edge_shm_peer(n2n_edge_t * eee, const n2n_mac_t mac) {
+  struct shm_peer *peer;
+
+  HASH_FIND(hh, eee->shm_peers, mac, sizeof(n2n_mac_t), peer);
+
+  if((peer == NULL) && ((peer = calloc(1, sizeof(struct shm_peer))) != NULL)) {
+    memcpy(peer->mac_addr, mac, sizeof(n2n_mac_t));
+    HASH_ADD(hh, eee->shm_peers, mac_addr, sizeof(n2n_mac_t), peer);
+  }
+
+  return(peer);
+}
+
+/** Hand a frame for <mac> to a local edge through shared memory. Returns -1
+ *  if it must go over UDP instead. */
+static int edge_shm_send(n2n_edge_t * eee, const n2n_mac_t mac,
+			 const uint8_t * frame, size_t len, time_t now) {
+  struct shm_peer *peer = edge_shm_peer(eee, mac);
+  macstr_t mac_buf;
+
+  if(peer == NULL)
+    return(-1);
+
+  if(peer->chan == NULL) {
+    if(now < peer->next_attempt)
+      return(-1);
+
+    peer->next_attempt = now + SHM_RETRY_INTERVAL;
+    peer->chan = shm_connect(eee->conf.shm_dir, eee->conf.community_name,
+			     eee->device.mac_addr, mac);
+    if(peer->chan == NULL)
+      return(-1);
+
+    traceEvent(TRACE_NORMAL, "Shared-memory channel to %s", macaddr_str(mac_buf, mac));
+  }
+
+  if(shm_send(peer->chan, frame, len) < 0)
+    return(-1);
+
+  ++(eee->stats.tx_shm);
+
+  return(0);
+}
+
+/** A local edge opened a channel to us. When both edges connected to each
+ *  other at the same time, the channel opened by the lower MAC is kept on
+ *  both sides. */
+static void edge_shm_accept(n2n_edge_t * eee) {
+  n2n_shm_chan_t *chan = shm_accept(eee->shm_sock, eee->conf.community_name);
+  struct shm_peer *peer;
+  macstr_t mac_buf;
+
+  if(chan == NULL)
+    return;
+
+  if((peer = edge_shm_peer(eee, chan->peer_mac)) == NULL) {
+    shm_close(chan);
+    return;
+  }
+
+  if(peer->chan != NULL) {
+    if(memcmp(eee->device.mac_addr, chan->peer_mac, sizeof(n2n_mac_t)) < 0) {
+      shm_close(chan);
+      return;
+    }
+
+    shm_close(peer->chan);
+  }
+
+  peer->chan = chan;
+  traceEvent(TRACE_NORMAL, "Shared-memory channel from %s", macaddr_str(mac_buf, chan->peer_mac));
+}
 
-    if(rx_transop_id == eee->conf.transop_id) {
-	eth_payload = decodebuf;
-	eh = (ether_hdr_t*)eth_payload;
-	eth_size = eee->transop.rev(&eee->transop,
-						    eth_payload, N2N_PKT_BUF_SIZE,
-						    payload, psize, pkt->srcMac);
-	++(eee->transop.rx_cnt); /* stats */
+/** Add the shared-memory fds to the select() set. The rings themselves do not
+ *  make fds readable so the wait is cancelled if frames are already queued. */
+static int edge_shm_fdset(n2n_edge_t * eee, fd_set * socket_mask, int max_sock,
+			  struct timeval * wait_time) {
+  struct shm_peer *peer, *tmp;
 
-	if(!(eee->conf.allow_routing)) {
-	  if(ntohs(eh->type) == 0x0800) {
-	    uint32_t *dst = (uint32_t*)&eth_payload[ETH_FRAMESIZE + IP4_DSTOFFSET];
+  FD_SET(eee->shm_sock, socket_mask);
+  max_sock = max(max_sock, eee->shm_sock);
 
-	    /* Note: all elements of the_ip are in network order */
-	    if(*dst != eee->device.ip_addr) {
-	      /* This is a packet that needs to be routed */
-	      traceEvent(TRACE_INFO, "Discarding routed packet [%s]",
-			 intoa(ntohl(*dst), ip_buf, sizeof(ip_buf)));
-	      return(-1);
-	    } else {
-	      /* This packet is directed to us */
-	      /* traceEvent(TRACE_INFO, "Sending non-routed packet"); */
-	    }
-	  }
-	}
+  HASH_ITER(hh, eee->shm_peers, peer, tmp) {
+    if(peer->chan == NULL)
+      continue;
 
-	/* Write ethernet packet to tap device. */
-	traceEvent(TRACE_INFO, "sending to TAP %u", (unsigned int)eth_size);
-	data_sent_len = tuntap_write(&(eee->device), eth_payload, eth_size);
+    FD_SET(peer->chan->sock, socket_mask);
+    FD_SET(peer->chan->rx_event, socket_mask);
+    max_sock = max(max_sock, max(peer->chan->sock, peer->chan->rx_event));
 
-	if (data_sent_len == eth_size)
-	  {
-	    retval = 0;
-	  }
-      }
-    else
-      {
-	traceEvent(TRACE_ERROR, "invalid transop ID: expected %s(%u), got %s(%u)",
-		   transop_str(eee->conf.transop_id), eee->conf.transop_id,
-		   transop_str(rx_transop_id), rx_transop_id);
+    if((wait_time->tv_sec != 0) || (wait_time->tv_usec != 0)) {
+      if(shm_arm(peer->chan)) {
+	shm_disarm(peer->chan, 0);
+	wait_time->tv_sec = 0; wait_time->tv_usec = 0;
       }
+    }
   }
 
-  return retval;
+  return(max_sock);
+}
+
+/** Write the frames received through shared memory to the TAP device, straight
+ *  from the rings. <socket_mask> is NULL when select() reported nothing. */
+static void edge_shm_poll(n2n_edge_t * eee, fd_set * socket_mask, time_t now) {
+  struct shm_peer *peer, *tmp;
+  const uint8_t *frame;
+  macstr_t mac_buf;
+  size_t len;
+  int i;
+
+  if(socket_mask && FD_ISSET(eee->shm_sock, socket_mask))
+    edge_shm_accept(eee);
+
+  HASH_ITER(hh, eee->shm_peers, peer, tmp) {
+    if(peer->chan == NULL)
+      continue;
+
+    shm_disarm(peer->chan, socket_mask && FD_ISSET(peer->chan->rx_event, socket_mask));
+
+    for(i=0; (i<N2N_SHM_RING_SLOTS) && ((frame = shm_peek(peer->chan, &len)) != NULL); i++) {
+      tuntap_write(&eee->device, (unsigned char *)frame, len);
+      shm_consume(peer->chan);
+      ++(eee->stats.rx_shm);
+    }
+
+    if(socket_mask && FD_ISSET(peer->chan->sock, socket_mask)) {
+      /* Nothing is ever sent on the connection: the peer is gone. */
+      traceEvent(TRACE_NORMAL, "Shared-memory channel with %s closed",
+		 macaddr_str(mac_buf, peer->mac_addr));
+      shm_close(peer->chan);
+      peer->chan = NULL;
+      peer->next_attempt = now + SHM_RETRY_INTERVAL;
+    }
+  }
 }
 
+#endif /* N2N_HAVE_SHM */
+
 /* ************************************** */
 
 /** Read a datagram from the management UDP socket and take appropriate
@@ -887,6 +1699,7 @@ static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
   socklen_t           i;
   size_t              msg_len;
   time_t              now;
+  int                 p;
 
   now = time(NULL);
   i = sizeof(sender_sock);
@@ -988,6 +1801,71 @@ static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
 		      (unsigned int)eee->stats.tx_p2p,
 		      (unsigned int)eee->stats.rx_p2p);
 
+  if(eee->shm_sock >= 0)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"shm    tx:%u rx:%u channels:%u\n",
+			(unsigned int)eee->stats.tx_shm,
+			(unsigned int)eee->stats.rx_shm,
+			edge_shm_channels(eee));
+
+  if(eee->conf.fec_group || eee->num_paths)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"fec    parity:%u recovered:%u peers:%u\n",
+			(unsigned int)eee->stats.tx_fec_parity,
+			(unsigned int)eee->stats.rx_fec_recovered,
+			HASH_COUNT(eee->data_peers));
+
+  if(eee->conf.pace_rate) {
+    struct data_peer *peer, *tmp;
+    unsigned int queued = 0;
+
+    HASH_ITER(hh, eee->data_peers, peer, tmp)
+      queued += peer->pacer.count;
+
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"pacing rate:%.1fMbit/s queued:%u dropped:%u\n",
+			eee->conf.pace_rate * 8 / 1e6, queued,
+			(unsigned int)eee->stats.tx_pace_drop);
+  }
+
+  if(eee->conf.header_compression) {
+    struct data_peer *peer, *tmp;
+    macstr_t mac_buf;
+    int shown = 0;
+
+    HASH_ITER(hh, eee->data_peers, peer, tmp) {
+      if((peer->hc_tx == NULL) && (peer->hc_rx == NULL))
+	continue;
+
+      if(shown++ == MGMT_HC_PEERS)
+	break;
+
+      msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			  "hc     %s saved:%lld miss:%u\n",
+			  macaddr_str(mac_buf, peer->mac_addr),
+			  (long long)(peer->hc_tx ? peer->hc_tx->saved : 0),
+			  (unsigned int)(peer->hc_rx ? peer->hc_rx->miss : 0));
+    }
+  }
+
+  if(eee->conf.tos_propagate)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"ecn    ce:%u dropped:%u\n",
+			(unsigned int)eee->stats.rx_ecn_ce,
+			(unsigned int)eee->stats.rx_ecn_drop);
+
+  for(p = 0; p < eee->num_paths; p++) {
+    const n2n_path_t *path = &eee->paths[p];
+    ipstr_t ip_buf;
+
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"path   %s weight:%u rtt:%.1fms loss:%.1f%% tx:%u %s\n",
+			intoa(ntohl(path->addr), ip_buf, sizeof(ip_buf)),
+			(unsigned int)path->weight, path->rtt_usec / 1000.0,
+			path->loss * 100.0 / 256, (unsigned int)path->tx_packets,
+			path_is_up(path, now) ? "up" : "down");
+  }
+
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "transop |%6u|%6u|\n",
 		      (unsigned int)eee->transop.tx_cnt,
@@ -998,6 +1876,31 @@ static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
 		      HASH_COUNT(eee->pending_peers),
 		      HASH_COUNT(eee->known_peers));
 
+  msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+		      "socket rcvbuf:%u sndbuf:%u kernel_drops:%u\n",
+		      (unsigned int)eee->udp_sock_buf.rcvbuf,
+		      (unsigned int)eee->udp_sock_buf.sndbuf,
+		      (unsigned int)eee->udp_sock_buf.kernel_drops);
+
+  if(eee->conn_socks.pps)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"connected peers:%u promoted:%u demoted:%u\n",
+			(unsigned int)eee->conn_socks.connected,
+			(unsigned int)eee->conn_socks.promoted,
+			(unsigned int)eee->conn_socks.demoted);
+
+  if(eee->udp_tstamp.enabled) {
+    char hist[128];
+
+    latency_hist_str(&eee->udp_tstamp.rx, hist, sizeof(hist));
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"latency rx_queue %s\n", hist);
+
+    latency_hist_str(&eee->udp_tstamp.tx, hist, sizeof(hist));
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"latency tx_queue %s\n", hist);
+  }
+
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "last super:%lu(%ld sec ago) p2p:%lu(%ld sec ago)\n",
 		      eee->last_sup, (now-eee->last_sup), eee->last_p2p,
@@ -1093,7 +1996,7 @@ static int find_peer_destination(n2n_edge_t * eee,
 
   if(!memcmp(mac_address, broadcast_mac, 6)) {
     traceEvent(TRACE_DEBUG, "Broadcast destination peer, using supernode");
-    memcpy(destination, &(eee->supernode), sizeof(struct sockaddr_in));
+    memcpy(destination, &(eee->supernode), sizeof(n2n_sock_t));
     return(0);
   }
 
@@ -1119,7 +2022,7 @@ static int find_peer_destination(n2n_edge_t * eee,
   }
 
   if(retval == 0) {
-    memcpy(destination, &(eee->supernode), sizeof(struct sockaddr_in));
+    memcpy(destination, &(eee->supernode), sizeof(n2n_sock_t));
     traceEvent(TRACE_DEBUG, "P2P Peer [MAC=%02X:%02X:%02X:%02X:%02X:%02X] not found, using supernode",
         mac_address[0] & 0xFF, mac_address[1] & 0xFF, mac_address[2] & 0xFF,
         mac_address[3] & 0xFF, mac_address[4] & 0xFF, mac_address[5] & 0xFF);
@@ -1127,6 +2030,8 @@ static int find_peer_destination(n2n_edge_t * eee,
     check_query_peer_info(eee, now, mac_address);
   }
 
+  N2N_PROBE2(peer_lookup, mac_address, retval);
+
   traceEvent(TRACE_DEBUG, "find_peer_address (%s) -> [%s]",
 	     macaddr_str(mac_buf, mac_address),
 	     sock_to_cstr(sockbuf, destination));
@@ -1136,21 +2041,20 @@ static int find_peer_destination(n2n_edge_t * eee,
 
 /* ***************************************************** */
 
-/** Send an ecapsulated ethernet PACKET to a destination edge or broadcast MAC
- *  address. */
-static int send_packet(n2n_edge_t * eee,
-		       n2n_mac_t dstMac,
-		       const uint8_t * pktbuf,
-		       size_t pktlen) {
-  int is_p2p;
+/** Send a PACKET to the destination find_peer_destination() gave for dstMac,
+ *  on one of the paths or on the main socket when path is negative. */
+static int send_packet_to(n2n_edge_t * eee,
+			  n2n_mac_t dstMac,
+			  int is_p2p,
+			  const n2n_sock_t * destination,
+			  int path,
+			  const uint8_t * pktbuf,
+			  size_t pktlen) {
   /*ssize_t s; */
   n2n_sock_str_t sockbuf;
-  n2n_sock_t destination;
 
   /* hexdump(pktbuf, pktlen); */
 
-  is_p2p = find_peer_destination(eee, dstMac, &destination);
-
   if(is_p2p)
     ++(eee->stats.tx_p2p);
   else {
@@ -1160,15 +2064,99 @@ static int send_packet(n2n_edge_t * eee,
       ++(eee->stats.tx_sup_broadcast);
   }
 
-  traceEvent(TRACE_INFO, "send_packet to %s", sock_to_cstr(sockbuf, &destination));
+  traceEvent(TRACE_INFO, "send_packet to %s", sock_to_cstr(sockbuf, destination));
+
+  /* The paths are IPv4 uplinks */
+  if((path >= 0) && (destination->family == AF_INET)) {
+    struct sockaddr_in peer_addr;
 
-  /* s = */ sendto_sock(eee->udp_sock, pktbuf, pktlen, &destination);
+    fill_sockaddr((struct sockaddr *) &peer_addr, sizeof(peer_addr), destination);
+
+    if(sendto_tos(eee->paths[path].sock, pktbuf, pktlen,
+		  (struct sockaddr *)&peer_addr, sizeof(struct sockaddr_in), eee->tx_tos) < 0)
+      traceEvent(TRACE_ERROR, "sendto on path %d failed (%d) %s", path, errno, strerror(errno));
+    else
+      ++(eee->paths[path].tx_packets);
+  } else
+    /* s = */ sendto_sock(eee, pktbuf, pktlen, destination);
 
   return 0;
 }
 
 /* ************************************** */
 
+/** send_packet_to() the peer, at the pace of conf.pace_rate. Datagrams the
+ *  bucket has no tokens for are queued for edge_pace_flush(). */
+static void send_packet_paced(n2n_edge_t * eee,
+			      struct data_peer * peer,
+			      int is_p2p,
+			      const n2n_sock_t * destination,
+			      int path,
+			      const uint8_t * pktbuf,
+			      size_t pktlen) {
+  n2n_pace_slot_t *slot;
+
+  if(eee->conf.pace_rate == 0) {
+    send_packet_to(eee, peer->mac_addr, is_p2p, destination, path, pktbuf, pktlen);
+    return;
+  }
+
+  if((peer->pacer.count == 0) && pacer_ready(&peer->pacer, eee->conf.pace_rate, time_usec())) {
+    pacer_sent(&peer->pacer, pktlen);
+    send_packet_to(eee, peer->mac_addr, is_p2p, destination, path, pktbuf, pktlen);
+    return;
+  }
+
+  if((pktlen > sizeof(slot->pkt)) || ((slot = pacer_enqueue(&peer->pacer)) == NULL)) {
+    ++(eee->stats.tx_pace_drop);
+    return;
+  }
+
+  slot->dest = *destination;
+  slot->path = path;
+  slot->is_p2p = is_p2p;
+  slot->tos = eee->tx_tos;
+  slot->len = pktlen;
+  memcpy(slot->pkt, pktbuf, pktlen);
+
+  if(eee->pace_wait == 0)
+    eee->pace_wait = pacer_wait(&peer->pacer, eee->conf.pace_rate);
+}
+
+/* ************************************** */
+
+/** Send the queued datagrams the pacers have tokens for. Returns the usec
+ *  until the next one may leave, 0 when none is left. */
+static uint64_t edge_pace_flush(n2n_edge_t * eee) {
+  struct data_peer *peer, *tmp;
+  n2n_pace_slot_t *slot;
+  uint64_t now_usec = time_usec(), wait = 0, peer_wait;
+
+  HASH_ITER(hh, eee->data_peers, peer, tmp) {
+    while(((slot = pacer_head(&peer->pacer)) != NULL)
+	  && pacer_ready(&peer->pacer, eee->conf.pace_rate, now_usec)) {
+      pacer_sent(&peer->pacer, slot->len);
+      eee->tx_tos = slot->tos;
+      send_packet_to(eee, peer->mac_addr, slot->is_p2p, &slot->dest, slot->path,
+		     slot->pkt, slot->len);
+      pacer_dequeue(&peer->pacer);
+    }
+
+    if(peer->pacer.count) {
+      peer_wait = pacer_wait(&peer->pacer, eee->conf.pace_rate);
+
+      if((wait == 0) || (peer_wait < wait))
+	wait = peer_wait;
+    }
+  }
+
+  eee->tx_tos = 0;
+
+  return(wait);
+}
+
+/* ************************************** */
+
 /** A layer-2 packet was received at the tunnel and needs to be sent via UDP. */
 static void send_packet2net(n2n_edge_t * eee,
 		     uint8_t *tap_pkt, size_t len) {
@@ -1179,8 +2167,15 @@ static void send_packet2net(n2n_edge_t * eee,
   n2n_PACKET_t pkt;
 
   uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-  size_t idx=0;
+  size_t idx=0, tlen, fec_idx=0;
+  uint64_t t0;
   n2n_transform_t tx_transop_idx = eee->transop.transform_id;
+  struct data_peer *peer = NULL;
+  n2n_sock_t destination;
+  int is_p2p = 0, path = -1, fec = 0;
+  uint8_t hcbuf[N2N_PKT_BUF_SIZE];
+  const uint8_t *frame = tap_pkt;
+  size_t frame_len = len, hc_len;
 
   ether_hdr_t eh;
 
@@ -1212,6 +2207,13 @@ static void send_packet2net(n2n_edge_t * eee,
 
   memcpy(destMac, tap_pkt, N2N_MAC_SIZE); /* dest MAC is first in ethernet header */
 
+#ifdef N2N_HAVE_SHM
+  /* Local edges get the plain frame through shared memory. */
+  if((eee->shm_sock >= 0) && !is_multi_broadcast(destMac)
+     && (edge_shm_send(eee, destMac, tap_pkt, len, time(NULL)) == 0))
+    return;
+#endif
+
   memset(&cmn, 0, sizeof(cmn));
   cmn.ttl = N2N_DEFAULT_TTL;
   cmn.pc = n2n_packet;
@@ -1223,19 +2225,87 @@ static void send_packet2net(n2n_edge_t * eee,
   memcpy(pkt.dstMac, destMac, N2N_MAC_SIZE);
 
   pkt.sock.family=0; /* do not encode sock */
-  pkt.transform = tx_transop_idx;
+
+  if((eee->conf.fec_group || eee->num_paths || eee->conf.pace_rate || eee->conf.header_compression)
+     && !is_multi_broadcast(destMac)
+     && ((peer = data_peer_get(eee, destMac, time(NULL))) != NULL)) {
+    n2n_hc_t *hc;
+
+    if(eee->conf.header_compression && ((hc = data_peer_hc(&peer->hc_tx)) != NULL)
+       && ((hc_len = hc_compress(hc, tap_pkt, len, hcbuf, sizeof(hcbuf), time(NULL))) > 0)) {
+      /* The transform encodes the compressed frame instead */
+      tx_transop_idx = N2N_TRANSFORM_ID_HC;
+      frame = hcbuf;
+      frame_len = hc_len;
+    }
+
+    fec = (eee->conf.fec_group || eee->num_paths);
+
+    is_p2p = find_peer_destination(eee, destMac, &destination);
+
+    /* Spread the P2P packets over the paths */
+    if(eee->num_paths && is_p2p)
+      path = path_schedule(eee->paths, eee->num_paths, time(NULL));
+  } else
+    is_p2p = find_peer_destination(eee, destMac, &destination); /* to peer or supernode */
+
+  pkt.transform = fec ? N2N_TRANSFORM_ID_FEC : tx_transop_idx;
 
   idx=0;
   encode_PACKET(pktbuf, &idx, &cmn, &pkt);
   traceEvent(TRACE_DEBUG, "encoded PACKET header of size=%u transform %u",
 	     (unsigned int)idx, tx_transop_idx);
 
-  idx += eee->transop.fwd(&eee->transop,
-					  pktbuf+idx, N2N_PKT_BUF_SIZE-idx,
-					  tap_pkt, len, pkt.dstMac);
+  if(fec) {
+    /* Room for the FEC header, filled by fec_encode() */
+    fec_idx = idx;
+    idx += N2N_FEC_HDR_SIZE;
+    encode_uint16(pktbuf, &idx, tx_transop_idx);
+  }
+
+  t0 = N2N_PROBE_CLOCK(transform_fwd);
+  tlen = eee->transop.fwd(&eee->transop,
+			  pktbuf+idx, N2N_PKT_BUF_SIZE-idx,
+			  frame, frame_len, pkt.dstMac);
+  idx += tlen;
   eee->transop.tx_cnt++; /* stats */
 
-  send_packet(eee, destMac, pktbuf, idx); /* to peer or supernode */
+  N2N_PROBE4(transform_fwd, tx_transop_idx, frame_len, tlen, N2N_PROBE_SINCE(t0));
+
+  /* The datagrams of this frame carry its DSCP and ECN, not the QUERY_PEER
+   * the destination lookup may have sent */
+  if(eee->conf.tos_propagate)
+    eee->tx_tos = ecn_encap_tos(tap_pkt, len);
+
+  if(fec) {
+    uint8_t paritybuf[N2N_PKT_BUF_SIZE];
+    size_t parity_len;
+
+    parity_len = fec_encode(&peer->tx, eee->conf.fec_group, peer->rx.loss,
+			    (path >= 0) ? N2N_FEC_FLAG_MULTIPATH : 0,
+			    pktbuf+fec_idx, idx-fec_idx,
+			    paritybuf+fec_idx, sizeof(paritybuf)-fec_idx);
+
+    send_packet_paced(eee, peer, is_p2p, &destination, path, pktbuf, idx);
+
+    if(parity_len > 0) {
+      /* Same PACKET header, parity unit instead */
+      memcpy(paritybuf, pktbuf, fec_idx);
+
+      if(path >= 0)
+	path = path_schedule(eee->paths, eee->num_paths, time(NULL));
+
+      send_packet_paced(eee, peer, is_p2p, &destination, path,
+			paritybuf, fec_idx+parity_len);
+
+      ++(eee->stats.tx_fec_parity);
+    }
+  } else if(peer)
+    send_packet_paced(eee, peer, is_p2p, &destination, path, pktbuf, idx);
+  else
+    send_packet_to(eee, destMac, is_p2p, &destination, -1, pktbuf, idx);
+
+  eee->tx_tos = 0;
 }
 
 /* ************************************** */
@@ -1335,20 +2405,32 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
   size_t              idx;
   size_t              msg_type;
   uint8_t             from_supernode;
-  struct sockaddr_in  sender_sock;
+  n2n_sockaddr_t      sender_sock;
   n2n_sock_t          sender;
   n2n_sock_t *        orig_sender=NULL;
+  n2n_rx_meta_t       meta;
   time_t              now=0;
 
-  size_t              i;
+  socklen_t           i;
+
+  if(in_sock == eee->udp_sock)
+    tstamp_drain_tx(in_sock, &eee->udp_tstamp);
 
   i = sizeof(sender_sock);
-  recvlen = recvfrom(in_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
-		     (struct sockaddr *)&sender_sock, (socklen_t*)&i);
+  recvlen = recvfrom_meta(in_sock, udp_buf, N2N_PKT_BUF_SIZE,
+			  &sender_sock.sa, &i, &meta);
 
   if(recvlen < 0) {
+    if(eee->conn_socks.pps && (in_sock != eee->udp_sock) && (errno == ECONNREFUSED)) {
+      /* The peer of a connected socket went away */
+      conn_sock_demote(&eee->conn_socks, in_sock);
+      return;
+    }
+
 #ifdef WIN32
     if(WSAGetLastError() != WSAECONNRESET)
+#else
+    if((errno != EAGAIN) && (errno != EWOULDBLOCK)) /* only TX timestamps were queued */
 #endif
     {
       traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", recvlen, errno, strerror(errno));
@@ -1360,11 +2442,16 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
     return; /* failed to receive data from UDP */
   }
 
-  /* REVISIT: when UDP/IPv6 is supported we will need a flag to indicate which
-   * IP transport version the packet arrived on. May need to UDP sockets. */
-  sender.family = AF_INET; /* UDP socket was opened PF_INET v4 */
-  sender.port = ntohs(sender_sock.sin_port);
-  memcpy(&(sender.addr.v4), &(sender_sock.sin_addr.s_addr), IPV4_SIZE);
+  if(in_sock == eee->udp_sock) {
+    sock_buf_update(in_sock, &eee->udp_sock_buf, &meta, time(NULL));
+    tstamp_rx(&eee->udp_tstamp, &meta);
+  }
+
+  eee->rx_tos = meta.tos;
+
+  N2N_PROBE2(edge_rx, recvlen, in_sock == eee->udp_sock);
+
+  sockaddr_to_sock(&sender, &sender_sock);
 
   /* The packet may not have an orig_sender socket spec. So default to last
    * hop as sender. */
@@ -1388,6 +2475,8 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
   msg_type = cmn.pc; /* packet code */
   from_supernode= cmn.flags & N2N_FLAGS_FROM_SUPERNODE;
 
+  N2N_PROBE3(edge_decode, msg_type, cmn.flags, recvlen);
+
   if(0 == memcmp(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE)) {
       switch(msg_type) {
       case MSG_TYPE_PACKET:
@@ -1404,7 +2493,10 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 		     sock_to_cstr(sockbuf1, &sender),
 		     sock_to_cstr(sockbuf2, orig_sender));
 
-	  handle_PACKET(eee, &cmn, &pkt, orig_sender, udp_buf+idx, recvlen-idx);
+	  if(pkt.transform == N2N_TRANSFORM_ID_FEC)
+	    handle_FEC(eee, &cmn, &pkt, orig_sender, udp_buf+idx, recvlen-idx);
+	  else
+	    handle_PACKET(eee, &cmn, &pkt, orig_sender, udp_buf+idx, recvlen-idx);
 	  break;
       }
       case MSG_TYPE_REGISTER:
@@ -1489,6 +2581,9 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 			 sock_to_cstr(sockbuf2, orig_sender),
 			 (unsigned int)eee->sup_attempts);
 
+	      N2N_PROBE2(register_super_ack, ra.edgeMac,
+			 0 == memcmp(ra.cookie, eee->last_cookie, N2N_COOKIE_SIZE));
+
 	      if(0 == memcmp(ra.cookie, eee->last_cookie, N2N_COOKIE_SIZE))
                 {
 		  if(ra.num_sn > 0)
@@ -1501,6 +2596,15 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 		  eee->sn_wait=0;
 		  eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS; /* refresh because we got a response */
 
+		  if(eee->peer_list_want == 1) {
+		    /* The supernode only lists peers to an edge registered
+		     * from the asking socket: ask now that we are. */
+		    eee->peer_list_want = 2;
+		    send_register_super(eee, &(eee->supernode), NULL);
+		    eee->sn_wait = 1;
+		    eee->last_register_req = now;
+		  }
+
 		  /* NOTE: the register_interval should be chosen by the edge node
 		   * based on its NAT configuration. */
 		  //eee->conf.register_interval = ra.lifetime;
@@ -1515,6 +2619,29 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 	      traceEvent(TRACE_WARNING, "Rx REGISTER_SUPER_ACK with no outstanding REGISTER_SUPER.");
             }
 	  break;
+      }
+      case MSG_TYPE_REGISTER_SUPER_NAK:
+      {
+	  n2n_REGISTER_SUPER_NAK_t nak;
+
+	  if(!eee->sn_wait)
+	    break;
+
+	  if(decode_REGISTER_SUPER_NAK(&nak, &cmn, udp_buf, &rem, &idx) < 0)
+	    break;
+
+	  if((0 == memcmp(nak.cookie, eee->last_cookie, N2N_COOKIE_SIZE))
+	     && (nak.auth.scheme == N2N_AUTH_SCHEME_SN_COOKIE)) {
+	    /* The supernode wants proof that we own this socket: echo the
+	     * challenge right away instead of waiting for the next retry. */
+	    traceEvent(TRACE_INFO, "Rx REGISTER_SUPER_NAK challenge from %s",
+		       sock_to_cstr(sockbuf1, &sender));
+
+	    send_register_super(eee, &sender, &(nak.auth));
+	  } else
+	    traceEvent(TRACE_WARNING, "Rx REGISTER_SUPER_NAK with wrong or old cookie.");
+
+	  break;
       } case MSG_TYPE_PEER_INFO: {
         n2n_PEER_INFO_t pi;
         struct peer_info *  scan;
@@ -1542,6 +2669,70 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 
         break;
       }
+      case MSG_TYPE_PEER_LIST: {
+	n2n_PEER_LIST_t list;
+	int n;
+
+	if((eee->peer_list_want != 2) || !from_supernode || !sock_equal(&sender, &(eee->supernode))) {
+	  traceEvent(TRACE_DEBUG, "Ignoring unexpected PEER_LIST from %s", sock_to_cstr(sockbuf1, &sender));
+	  break;
+	}
+
+	if(decode_PEER_LIST(&list, &cmn, udp_buf, &rem, &idx) < 0)
+	  break;
+
+	for(n=0; (n < list.count) && (eee->peer_list_len < eee->conf.peer_list_max); n++) {
+	  if(!memcmp(list.peers[n].mac, eee->device.mac_addr, N2N_MAC_SIZE)
+	     || !is_valid_peer_sock(&list.peers[n].sock))
+	    continue;
+
+	  eee->peer_list[eee->peer_list_len++] = list.peers[n];
+	}
+
+	traceEvent(TRACE_INFO, "Rx PEER_LIST of %u peers (%u in the community)",
+		   (unsigned int)list.count, (unsigned int)list.total);
+
+	if(list.cursor && (eee->peer_list_len < eee->conf.peer_list_max)) {
+	  /* Next page with a registration refresh, counted as one */
+	  eee->peer_list_cursor = list.cursor;
+	  send_register_super(eee, &(eee->supernode), NULL);
+	  eee->sn_wait = 1;
+	  eee->last_register_req = now;
+	} else
+	  eee->peer_list_want = 0;
+
+	break;
+      }
+      case MSG_TYPE_PATH_PROBE: {
+	n2n_PATH_PROBE_t probe;
+
+	decode_PATH_PROBE(&probe, &cmn, udp_buf, &rem, &idx);
+
+	if(!probe.echo) {
+	  struct peer_info *scan;
+
+	  if(memcmp(probe.dstMac, eee->device.mac_addr, N2N_MAC_SIZE))
+	    break;
+
+	  /* Only the peers we talk to P2P probe us, do not reflect for others */
+	  HASH_FIND_PEER(eee->known_peers, probe.srcMac, scan);
+	  if(scan == NULL) {
+	    traceEvent(TRACE_DEBUG, "Ignoring PATH_PROBE from unknown %s [%s]",
+		       macaddr_str(mac_buf1, probe.srcMac), sock_to_cstr(sockbuf1, &sender));
+	    break;
+	  }
+
+	  /* Back to where it came from, so over the path it probes */
+	  probe.echo = 1;
+	  idx = 0;
+	  encode_PATH_PROBE(udp_buf, &idx, &cmn, &probe);
+	  sendto(in_sock, udp_buf, idx, 0/*flags*/, &sender_sock.sa, i);
+	} else if(!memcmp(probe.srcMac, eee->device.mac_addr, N2N_MAC_SIZE)
+		  && (probe.path < eee->num_paths))
+	  path_probe_acked(&eee->paths[probe.path], probe.seq, (uint32_t)time_usec(), now);
+
+	break;
+      }
       default:
         /* Not a known message type */
         traceEvent(TRACE_WARNING, "Unable to handle packet type %d: ignored", (signed int)msg_type);
@@ -1555,6 +2746,55 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 
 /* ************************************** */
 
+/** Probe every path towards the P2P peers we exchange data with. */
+static void edge_probe_paths(n2n_edge_t * eee) {
+  struct data_peer *peer, *tmp;
+  struct peer_info *scan;
+  struct sockaddr_in peer_addr;
+  n2n_common_t cmn;
+  n2n_PATH_PROBE_t probe;
+  uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+  uint32_t usec = (uint32_t)time_usec();
+  size_t idx;
+  int i, probed = 0;
+
+  memset(&cmn, 0, sizeof(cmn));
+  cmn.ttl = N2N_DEFAULT_TTL;
+  cmn.pc = n2n_path_probe;
+  memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+
+  memset(&probe, 0, sizeof(probe));
+  memcpy(probe.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
+
+  HASH_ITER(hh, eee->data_peers, peer, tmp) {
+    HASH_FIND_PEER(eee->known_peers, peer->mac_addr, scan);
+
+    if((scan == NULL) || (scan->sock.family != AF_INET))
+      continue;
+
+    if(probed++ == PATH_PROBE_PEERS)
+      break;
+
+    memcpy(probe.dstMac, peer->mac_addr, N2N_MAC_SIZE);
+    fill_sockaddr((struct sockaddr *) &peer_addr, sizeof(peer_addr), &scan->sock);
+
+    for(i = 0; i < eee->num_paths; i++) {
+      probe.path = i;
+      probe.seq = path_probe_sent(&eee->paths[i], usec);
+
+      idx = 0;
+      encode_PATH_PROBE(pktbuf, &idx, &cmn, &probe);
+      sendto(eee->paths[i].sock, pktbuf, idx, 0/*flags*/,
+	     (struct sockaddr *)&peer_addr, sizeof(struct sockaddr_in));
+    }
+  }
+
+  for(i = 0; i < eee->num_paths; i++)
+    path_probe_update(&eee->paths[i], usec);
+}
+
+/* ************************************** */
+
 void print_edge_stats(const n2n_edge_t *eee) {
   const struct n2n_edge_stats *s = &eee->stats;
 
@@ -1575,6 +2815,10 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
   time_t lastTransop=0;
   time_t last_purge_known = 0;
   time_t last_purge_pending = 0;
+  time_t last_cache_save = time(NULL);
+  time_t last_data_purge = time(NULL);
+  time_t last_path_probe = 0;
+  uint64_t last_rx_usec = 0;
 #ifdef __ANDROID_NDK__
   time_t lastArpPeriod=0;
 #endif
@@ -1594,7 +2838,7 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
    */
 
   while(*keep_running) {
-    int rc, max_sock = 0;
+    int rc, max_sock = 0, i;
     fd_set socket_mask;
     struct timeval wait_time;
     time_t nowTime;
@@ -1604,9 +2848,14 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
     FD_SET(eee->udp_mgmt_sock, &socket_mask);
     max_sock = max(eee->udp_sock, eee->udp_mgmt_sock);
 
+    if(eee->udp_sock6 >= 0) {
+      FD_SET(eee->udp_sock6, &socket_mask);
+      max_sock = max(max_sock, eee->udp_sock6);
+    }
+
 #ifndef SKIP_MULTICAST_PEERS_DISCOVERY
     FD_SET(eee->udp_multicast_sock, &socket_mask);
-    max_sock = max(eee->udp_sock, eee->udp_multicast_sock);
+    max_sock = max(max_sock, eee->udp_multicast_sock);
 #endif
 
 #ifndef WIN32
@@ -1614,11 +2863,56 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
     max_sock = max(max_sock, eee->device.fd);
 #endif
 
-    wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS; wait_time.tv_usec = 0;
+    for(i = 0; i < eee->num_paths; i++) {
+      FD_SET(eee->paths[i].sock, &socket_mask);
+      max_sock = max(max_sock, eee->paths[i].sock);
+    }
+
+    for(i = 0; eee->conn_socks.pps && (i < N2N_CONN_POOL); i++) {
+      if((eee->conn_socks.pool[i] >= 0) && (eee->conn_socks.pool_state[i] != N2N_CONN_SPARE)) {
+	FD_SET(eee->conn_socks.pool[i], &socket_mask);
+	max_sock = max(max_sock, eee->conn_socks.pool[i]);
+      }
+    }
+
+    /* In busy-poll mode keep polling without sleeping for as long as traffic
+     * was seen recently, then fall back to blocking until the next packet. */
+    if((eee->conf.busy_poll_usec > 0)
+       && ((time_usec() - last_rx_usec) < (uint64_t)eee->conf.busy_poll_usec)) {
+      wait_time.tv_sec = 0; wait_time.tv_usec = 0;
+    } else {
+      wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS; wait_time.tv_usec = 0;
+    }
+
+    /* Wake up for the next batch of pre-registrations */
+    if((eee->peer_list_next < eee->peer_list_len) && (wait_time.tv_sec > 0)) {
+      wait_time.tv_sec = 0; wait_time.tv_usec = PEER_LIST_INTERVAL_USEC;
+    }
+
+    /* Wake up to give up on the gaps of the packets held for reordering */
+    if(eee->reorder_held && ((wait_time.tv_sec > 0) || (wait_time.tv_usec > N2N_REORDER_MIN_USEC))) {
+      wait_time.tv_sec = 0; wait_time.tv_usec = N2N_REORDER_MIN_USEC;
+    }
+
+    /* ... and to send the datagrams waiting for the pacers */
+    if(eee->pace_wait
+       && (((uint64_t)wait_time.tv_sec * 1000000 + wait_time.tv_usec) > eee->pace_wait)) {
+      /* Seconds apart at low rates, tv_usec must stay below a second */
+      wait_time.tv_sec = eee->pace_wait / 1000000;
+      wait_time.tv_usec = eee->pace_wait % 1000000;
+    }
+
+#ifdef N2N_HAVE_SHM
+    if(eee->shm_sock >= 0)
+      max_sock = edge_shm_fdset(eee, &socket_mask, max_sock, &wait_time);
+#endif
 
     rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
     nowTime=time(NULL);
 
+    if((rc > 0) && (eee->conf.busy_poll_usec > 0))
+      last_rx_usec = time_usec();
+
     /* Make sure ciphers are updated before the packet is treated. */
     if((nowTime - lastTransop) > TRANSOP_TICK_INTERVAL) {
       lastTransop = nowTime;
@@ -1635,6 +2929,24 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
 	readFromIPSocket(eee, eee->udp_sock);
       }
 
+      if((eee->udp_sock6 >= 0) && FD_ISSET(eee->udp_sock6, &socket_mask))
+	readFromIPSocket(eee, eee->udp_sock6);
+
+      for(i = 0; i < eee->num_paths; i++) {
+	if(FD_ISSET(eee->paths[i].sock, &socket_mask))
+	  readFromIPSocket(eee, eee->paths[i].sock);
+      }
+
+      /* The kernel delivers the datagrams of the busy peers on their
+       * connected sockets, also the parked ones */
+      for(i = 0; eee->conn_socks.pps && (i < N2N_CONN_POOL); i++) {
+	SOCKET sock = eee->conn_socks.pool[i];
+
+	if((sock >= 0) && (eee->conn_socks.pool_state[i] != N2N_CONN_SPARE)
+	   && FD_ISSET(sock, &socket_mask))
+	  readFromIPSocket(eee, sock);
+      }
+
 
 #ifndef SKIP_MULTICAST_PEERS_DISCOVERY
       if(FD_ISSET(eee->udp_multicast_sock, &socket_mask)) {
@@ -1667,9 +2979,31 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
 #endif
     }
 
+#ifdef N2N_HAVE_SHM
+    if(eee->shm_sock >= 0)
+      edge_shm_poll(eee, (rc > 0) ? &socket_mask : NULL, nowTime);
+#endif
+
     /* Finished processing select data. */
     update_supernode_reg(eee, nowTime);
 
+    if(eee->peer_list_next < eee->peer_list_len)
+      edge_preregister_peers(eee, nowTime);
+
+    if(eee->reorder_held)
+      eee->reorder_held = edge_reorder_flush(eee);
+
+    if(eee->pace_wait)
+      eee->pace_wait = edge_pace_flush(eee);
+
+    if(eee->conn_socks.pps)
+      conn_socks_update(&eee->conn_socks, nowTime);
+
+    if(eee->num_paths && ((nowTime - last_path_probe) >= PATH_PROBE_INTERVAL)) {
+      edge_probe_paths(eee);
+      last_path_probe = nowTime;
+    }
+
     numPurged =  purge_expired_registrations(&eee->known_peers, &last_purge_known);
     numPurged += purge_expired_registrations(&eee->pending_peers, &last_purge_pending);
 
@@ -1680,6 +3014,16 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
 		 HASH_COUNT(eee->known_peers));
     }
 
+    if(eee->data_peers && ((nowTime - last_data_purge) >= PURGE_REGISTRATION_FREQUENCY)) {
+      data_peer_purge(eee, nowTime - REGISTRATION_TIMEOUT);
+      last_data_purge = nowTime;
+    }
+
+    if(eee->conf.peer_cache && ((nowTime - last_cache_save) >= PEER_CACHE_SAVE_INTERVAL)) {
+      edge_save_peer_cache(eee);
+      last_cache_save = nowTime;
+    }
+
     if(eee->conf.dyn_ip_mode &&
        ((nowTime - lastIfaceCheck) > IFACE_UPDATE_INTERVAL)) {
       traceEvent(TRACE_NORMAL, "Re-checking dynamic IP address.");
@@ -1695,6 +3039,9 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
 #endif /* #ifdef __ANDROID_NDK__ */
   } /* while */
 
+  if(eee->conf.peer_cache)
+    edge_save_peer_cache(eee);
+
   send_deregister(eee, &(eee->supernode));
 
   closesocket(eee->udp_sock);
@@ -1706,12 +3053,23 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
 
 /** Deinitialise the edge and deallocate any owned memory. */
 void edge_term(n2n_edge_t * eee) {
+  int i;
+
   if(eee->udp_sock >= 0)
     closesocket(eee->udp_sock);
 
+  if(eee->udp_sock6 >= 0)
+    closesocket(eee->udp_sock6);
+
   if(eee->udp_mgmt_sock >= 0)
     closesocket(eee->udp_mgmt_sock);
 
+  for(i = 0; i < eee->num_paths; i++)
+    closesocket(eee->paths[i].sock);
+
+  if(eee->conn_socks.pps)
+    conn_socks_free(&eee->conn_socks);
+
 #ifndef SKIP_MULTICAST_PEERS_DISCOVERY
   if(eee->udp_multicast_sock >= 0)
     closesocket(eee->udp_multicast_sock);
@@ -1720,6 +3078,36 @@ void edge_term(n2n_edge_t * eee) {
   clear_peer_list(&eee->pending_peers);
   clear_peer_list(&eee->known_peers);
 
+  {
+    struct data_peer *peer, *tmp;
+
+    HASH_ITER(hh, eee->data_peers, peer, tmp) {
+      HASH_DEL(eee->data_peers, peer);
+      fec_rx_free(&peer->rx);
+      reorder_free(&peer->reorder);
+      pacer_free(&peer->pacer);
+      free(peer->hc_tx);
+      free(peer->hc_rx);
+      free(peer);
+    }
+  }
+
+#ifdef N2N_HAVE_SHM
+  if(eee->shm_sock >= 0) {
+    struct shm_peer *peer, *tmp;
+
+    HASH_ITER(hh, eee->shm_peers, peer, tmp) {
+      if(peer->chan) shm_close(peer->chan);
+      HASH_DEL(eee->shm_peers, peer);
+      free(peer);
+    }
+
+    closesocket(eee->shm_sock);
+    unlink(eee->shm_path);
+  }
+#endif
+
+  free(eee->peer_list);
   eee->transop.deinit(&eee->transop);
   free(eee);
 }
@@ -1727,15 +3115,60 @@ void edge_term(n2n_edge_t * eee) {
 /* ************************************** */
 
 static int edge_init_sockets(n2n_edge_t *eee, int udp_local_port, int mgmt_port) {
+  int i;
+
   if(udp_local_port > 0)
     traceEvent(TRACE_NORMAL, "Binding to local port %d", udp_local_port);
 
-  eee->udp_sock = open_socket(udp_local_port, 1 /* bind ANY */);
+  /* The connected sockets of the busy peers share its port */
+  if(eee->conf.conn_sock_pps)
+    eee->udp_sock = open_socket_reuseport(udp_local_port, htonl(INADDR_ANY));
+  else
+    eee->udp_sock = open_socket(udp_local_port, 1 /* bind ANY */);
+
   if(eee->udp_sock < 0) {
     traceEvent(TRACE_ERROR, "Failed to bind main UDP port %u", udp_local_port);
     return(-1);
   }
 
+  /* IPv6 on the same port, when the host has it */
+  {
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+
+    if(getsockname(eee->udp_sock, (struct sockaddr *)&local, &len) == 0)
+      eee->udp_sock6 = open_socket6(ntohs(local.sin_port));
+
+    if(eee->udp_sock6 < 0)
+      traceEvent(TRACE_NORMAL, "No IPv6 socket, peers are only reached over IPv4");
+  }
+
+  if(eee->conf.conn_sock_pps) {
+    if(conn_socks_init(&eee->conn_socks, eee->udp_sock, eee->conf.conn_sock_pps) == 0)
+      traceEvent(TRACE_NORMAL, "Connecting a socket to the peers sent over %u datagrams/s",
+		 (unsigned int)eee->conf.conn_sock_pps);
+    else
+      eee->conn_socks.pps = 0;
+  }
+
+  for(i = 0; i < eee->conf.num_paths; i++) {
+    n2n_path_t *path = &eee->paths[eee->num_paths];
+    ipstr_t ip_buf;
+
+    path->addr = eee->conf.path_addr[i];
+    path->weight = eee->conf.path_weight[i];
+    path->sock = open_socket_addr(0, path->addr);
+
+    if(path->sock < 0) {
+      traceEvent(TRACE_ERROR, "Failed to bind path %s", intoa(ntohl(path->addr), ip_buf, sizeof(ip_buf)));
+      return(-5);
+    }
+
+    traceEvent(TRACE_NORMAL, "Path %d from %s, weight %u", eee->num_paths,
+	       intoa(ntohl(path->addr), ip_buf, sizeof(ip_buf)), (unsigned int)path->weight);
+    eee->num_paths++;
+  }
+
   eee->udp_mgmt_sock = open_socket(mgmt_port, 0 /* bind LOOPBACK */);
   if(eee->udp_mgmt_sock < 0) {
     traceEvent(TRACE_ERROR, "Failed to bind management UDP port %u", mgmt_port);
@@ -0,0 +1,113 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*
+  This plugin demonstrates the transform plugin interface: it copies the
+  payload and appends a FNV-1a checksum, checked and stripped on receive.
+  It does NOT encrypt. Build it with
+
+    make example_transop_plugin.so
+
+  and load it on every edge of the community with -j ./example_transop_plugin.so
+ */
+
+#include <string.h>
+#include <time.h>
+#include "n2n_transforms.h"
+
+#define EXAMPLE_TRANSFORM_ID    N2N_TRANSFORM_ID_USER_START
+#define EXAMPLE_SUM_SIZE        4
+
+static uint32_t example_sum(const uint8_t * buf, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for(i = 0; i < len; i++)
+    hash = (hash ^ buf[i]) * 16777619u;
+
+  return(hash);
+}
+
+static int example_deinit(n2n_trans_op_t * arg) {
+  return(0);
+}
+
+static void example_tick(n2n_trans_op_t * arg, time_t now) {}
+
+static int example_encode(n2n_trans_op_t * arg,
+                          uint8_t * outbuf, size_t out_len,
+                          const uint8_t * inbuf, size_t in_len,
+                          const n2n_mac_t peer_mac) {
+  uint32_t sum;
+
+  if(in_len + EXAMPLE_SUM_SIZE > out_len)
+    return(-1);
+
+  sum = example_sum(inbuf, in_len);
+  memcpy(outbuf, inbuf, in_len);
+  outbuf[in_len]     = sum >> 24;
+  outbuf[in_len + 1] = sum >> 16;
+  outbuf[in_len + 2] = sum >> 8;
+  outbuf[in_len + 3] = sum;
+  arg->tx_cnt++;
+
+  return(in_len + EXAMPLE_SUM_SIZE);
+}
+
+static int example_decode(n2n_trans_op_t * arg,
+                          uint8_t * outbuf, size_t out_len,
+                          const uint8_t * inbuf, size_t in_len,
+                          const n2n_mac_t peer_mac) {
+  size_t len = in_len - EXAMPLE_SUM_SIZE;
+  uint32_t sum;
+
+  if((in_len < EXAMPLE_SUM_SIZE) || (len > out_len))
+    return(-1);
+
+  sum = ((uint32_t)inbuf[len] << 24) | (inbuf[len + 1] << 16) | (inbuf[len + 2] << 8) | inbuf[len + 3];
+
+  if(sum != example_sum(inbuf, len))
+    return(-1);
+
+  memcpy(outbuf, inbuf, len);
+  arg->rx_cnt++;
+
+  return(len);
+}
+
+static int example_init(const char * key, n2n_trans_op_t * ttt) {
+  memset(ttt, 0, sizeof(n2n_trans_op_t));
+
+  ttt->transform_id  = EXAMPLE_TRANSFORM_ID;
+  ttt->no_encryption = 1;
+  ttt->deinit        = example_deinit;
+  ttt->tick          = example_tick;
+  ttt->fwd           = example_encode;
+  ttt->rev           = example_decode;
+
+  return(0);
+}
+
+/* The only symbol the edge looks up */
+const n2n_transop_plugin_t n2n_transop_plugin = {
+  N2N_TRANSOP_PLUGIN_ABI,
+  sizeof(n2n_trans_op_t),
+  "example-checksum",
+  EXAMPLE_TRANSFORM_ID,
+  example_init
+};
@@ -0,0 +1,259 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Forward error correction of PACKETs.
+ *
+ * The sender numbers its data packets to each peer. While the peer reports
+ * loss, every group of data packets is followed by a parity packet holding
+ * the XOR of their units, from which the receiver rebuilds one lost unit of
+ * the group. The loss is measured by the receiver from the sequence gaps
+ * and reported back in the header of the packets going the other way. The
+ * group shrinks as the loss grows, and without loss no parity is sent and
+ * nothing is buffered, leaving only the header on the data path.
+ */
+
+#include "n2n.h"
+
+/* Aim at one lost packet every ten groups: group * loss / 256 = 1/10 */
+#define FEC_GROUP_TARGET        26
+
+/* ************************************** */
+
+/** Data packets per parity packet for a loss in 1/256, 0 for none. */
+uint8_t fec_group_size(uint8_t loss, uint8_t max_group) {
+  unsigned int group;
+
+  if((loss == 0) || (max_group < 2))
+    return(0);
+
+  group = FEC_GROUP_TARGET / loss;
+
+  if(group < 2) group = 2;
+  if(group > max_group) group = max_group;
+
+  return(group);
+}
+
+/* ************************************** */
+
+/* A word at a time, the compiler vectorises the loop where it can. */
+static void fec_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i;
+
+  for(i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+
+  for(; i < len; i++)
+    dst[i] ^= src[i];
+}
+
+/* ************************************** */
+
+/** Fill the header of a data packet and account its unit.
+ *
+ *  body holds N2N_FEC_HDR_SIZE free bytes followed by the unit. loss is the
+ *  loss measured from the peer, reported to it in the header with flags.
+ *
+ *  Returns the length of the parity packet written to parity when this
+ *  packet completes a group, 0 otherwise.
+ */
+size_t fec_encode(n2n_fec_tx_t *tx, uint8_t max_group, uint8_t loss, uint8_t flags,
+                  uint8_t *body, size_t body_len, uint8_t *parity, size_t parity_size) {
+  n2n_FEC_t fec;
+  const uint8_t *unit = body + N2N_FEC_HDR_SIZE;
+  size_t unit_len = body_len - N2N_FEC_HDR_SIZE;
+  size_t idx = 0;
+
+  if(tx->index == 0) {
+    /* The group size only changes between groups. */
+    tx->group = fec_group_size(tx->peer_loss, max_group);
+    tx->len_xor = 0;
+    tx->parity_len = 0;
+  }
+
+  fec.seq = tx->seq++;
+  fec.group = tx->group;
+  fec.index = tx->index;
+  fec.loss = loss;
+  fec.flags = flags;
+  encode_FEC(body, &idx, &fec);
+
+  if((tx->group == 0) || (unit_len > N2N_FEC_UNIT_SIZE))
+    return(0);
+
+  if(unit_len > tx->parity_len) {
+    memset((uint8_t*)tx->parity + tx->parity_len, 0, unit_len - tx->parity_len);
+    tx->parity_len = unit_len;
+  }
+
+  fec_xor((uint8_t*)tx->parity, unit, unit_len);
+  tx->len_xor ^= unit_len;
+
+  if(++tx->index < tx->group)
+    return(0);
+
+  tx->index = 0;
+
+  if(parity_size < (N2N_FEC_HDR_SIZE + 2 + tx->parity_len))
+    return(0);
+
+  fec.seq = tx->seq - tx->group;
+  fec.index = tx->group;
+  idx = 0;
+  encode_FEC(parity, &idx, &fec);
+  encode_uint16(parity, &idx, tx->len_xor);
+  memcpy(parity + idx, tx->parity, tx->parity_len);
+  tx->parity_sent++;
+
+  return(idx + tx->parity_len);
+}
+
+/* ************************************** */
+
+/* Rebuild the single missing unit of the group from its parity. */
+static size_t fec_recover(n2n_fec_rx_t *rx, const n2n_FEC_t *fec,
+                          const uint8_t *parity, size_t parity_len,
+                          uint8_t *out, size_t out_size, uint16_t *out_seq) {
+  uint32_t full = (1u << fec->group) - 1;
+  size_t rem = parity_len, idx = 0, block_len, len;
+  uint16_t len_xor;
+  int i, missing = -1;
+
+  if((rx->units == NULL) || (rx->group != fec->group) || (rx->base != fec->seq)
+     || (rx->have == full))
+    return(0);
+
+  for(i = 0; i < fec->group; i++) {
+    if(!(rx->have & (1u << i))) {
+      if(missing >= 0)
+        return(0); /* XOR parity only repairs one loss */
+      missing = i;
+    }
+  }
+
+  if(rem < 2)
+    return(0);
+
+  decode_uint16(&len_xor, parity, &rem, &idx);
+  block_len = parity_len - idx;
+
+  if((block_len > out_size) || (block_len > N2N_FEC_UNIT_SIZE))
+    return(0);
+
+  memcpy(out, parity + idx, block_len);
+  len = len_xor;
+
+  for(i = 0; i < fec->group; i++) {
+    if(i == missing) continue;
+
+    fec_xor(out, rx->units + i * N2N_FEC_UNIT_SIZE, rx->len[i]);
+    len ^= rx->len[i];
+  }
+
+  if(len > block_len)
+    return(0);
+
+  rx->have = full;
+  rx->recovered++;
+  *out_seq = rx->base + missing;
+
+  return(len);
+}
+
+/* ************************************** */
+
+/** Account a received unit, data or parity, of the peer.
+ *
+ *  Returns the length of a lost unit rebuilt into out, with its sequence in
+ *  out_seq, 0 if none.
+ */
+size_t fec_decode(n2n_fec_rx_t *rx, const n2n_FEC_t *fec,
+                  const uint8_t *unit, size_t unit_len,
+                  uint8_t *out, size_t out_size, uint16_t *out_seq) {
+  uint16_t base;
+  int16_t gap;
+
+  if(fec->group && (fec->index == fec->group))
+    return(fec_recover(rx, fec, unit, unit_len, out, out_size, out_seq));
+
+  /* Measure the loss from the gaps in the data sequence. */
+  gap = (int16_t)(fec->seq - rx->next_seq);
+
+  if(!rx->synced || (gap > N2N_FEC_WINDOW) || (gap < -N2N_FEC_WINDOW)) {
+    /* First packet, or the peer restarted */
+    rx->synced = 1;
+    rx->next_seq = fec->seq + 1;
+    rx->win_recv = rx->win_lost = 0;
+    rx->group = 0;
+  } else if(gap >= 0) {
+    rx->win_lost += gap;
+    rx->next_seq = fec->seq + 1;
+  } else if(rx->win_lost > 0)
+    rx->win_lost--; /* Reordered, counted as lost before */
+
+  rx->win_recv++;
+
+  if((rx->win_recv + rx->win_lost) >= N2N_FEC_WINDOW) {
+    uint32_t loss = (rx->win_lost * 256) / (rx->win_recv + rx->win_lost);
+
+    if(loss > 255) loss = 255;
+    if((loss == 0) && (rx->win_lost > 0)) loss = 1;
+
+    rx->loss = loss;
+    rx->win_recv = rx->win_lost = 0;
+  }
+
+  if((fec->group == 0) || (unit_len > N2N_FEC_UNIT_SIZE))
+    return(0);
+
+  /* Keep the unit until the parity of its group arrives. */
+  base = fec->seq - fec->index;
+
+  if((rx->group != fec->group) || (rx->base != base)) {
+    if(rx->group && ((int16_t)(base - rx->base) < 0))
+      return(0); /* Late unit of an older group */
+
+    if((rx->units == NULL)
+       && ((rx->units = (uint8_t*)malloc(N2N_FEC_MAX_GROUP * N2N_FEC_UNIT_SIZE)) == NULL))
+      return(0);
+
+    rx->group = fec->group;
+    rx->base = base;
+    rx->have = 0;
+  }
+
+  memcpy(rx->units + fec->index * N2N_FEC_UNIT_SIZE, unit, unit_len);
+  rx->len[fec->index] = unit_len;
+  rx->have |= (1u << fec->index);
+
+  return(0);
+}
+
+/* ************************************** */
+
+void fec_rx_free(n2n_fec_rx_t *rx) {
+  free(rx->units);
+  rx->units = NULL;
+  rx->group = 0;
+}
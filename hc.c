@@ -0,0 +1,291 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Header compression of the tunnelled ethernet/IPv4/TCP and UDP frames.
+ *
+ * Each flow to a peer gets a context: the headers of one of its frames, sent
+ * once in full (HC_FULL). The following frames of the flow only carry the
+ * fields that change from packet to packet (HC_TCP, HC_UDP): 16 bytes plus
+ * the TCP options instead of 54 for TCP, 6 instead of 42 for UDP. The
+ * lengths and the IP checksum are rebuilt by the receiver.
+ *
+ * There is no feedback from the receiver. Frames are compressed against the
+ * context, never against the previous frame, so a lost frame costs nothing
+ * but itself, and the full headers are sent again every N2N_HC_REFRESH frames
+ * or N2N_HC_REFRESH_SEC seconds, after a lost HC_FULL or a restart of the
+ * peer. A generation number tells a context from the one that held another
+ * flow in the same slot before.
+ *
+ * Frames with IP options, fragments, urgent data or protocols other than TCP
+ * and UDP are sent as they are.
+ */
+
+#include "n2n.h"
+
+#define HC_FULL                 1
+#define HC_TCP                  2
+#define HC_UDP                  3
+
+#define HC_HDR_SIZE             3       /* type, context, generation */
+
+#define ETH_SIZE                14
+#define IP_SIZE                 20
+#define TCP_SIZE                20
+#define UDP_SIZE                8
+
+#define IP_PROTO_TCP            6
+#define IP_PROTO_UDP            17
+#define TCP_FLAG_URG            0x20
+
+/* ************************************** */
+
+/** Length of the headers of a compressible frame, 0 for any other. */
+static size_t hc_header_len(const uint8_t *frame, size_t len) {
+  const uint8_t *ip = frame + ETH_SIZE, *l4 = ip + IP_SIZE;
+  size_t tcp_len;
+
+  if((len < ETH_SIZE + IP_SIZE + UDP_SIZE)
+     || (frame[12] != 0x08) || (frame[13] != 0x00) /* IPv4 */
+     || (ip[0] != 0x45)                            /* without options */
+     || ((ip[6] & 0x3f) || ip[7])                  /* not a fragment */
+     || ((size_t)((ip[2] << 8) | ip[3]) != len - ETH_SIZE))
+    return(0);
+
+  switch(ip[9]) {
+  case IP_PROTO_UDP:
+    return(ETH_SIZE + IP_SIZE + UDP_SIZE);
+
+  case IP_PROTO_TCP:
+    if(len < ETH_SIZE + IP_SIZE + TCP_SIZE)
+      return(0);
+
+    tcp_len = (l4[12] >> 4) * 4;
+
+    if((tcp_len < TCP_SIZE) || (len < ETH_SIZE + IP_SIZE + tcp_len)
+       || (l4[13] & TCP_FLAG_URG))
+      return(0);
+
+    return(ETH_SIZE + IP_SIZE + tcp_len);
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Whether the frame belongs to the flow of the context: same ethernet
+ *  header, the same IP header but for TOS, length, ID and checksum, and the
+ *  same ports and TCP header length. */
+static int hc_same_flow(const n2n_hc_ctx_t *ctx, const uint8_t *frame) {
+  const uint8_t *hdr = ctx->hdr;
+
+  return(ctx->valid
+	 && !memcmp(hdr, frame, ETH_SIZE + 1)                      /* ..version, IHL */
+	 && !memcmp(hdr + ETH_SIZE + 6, frame + ETH_SIZE + 6, 4)   /* fragment, TTL, protocol */
+	 && !memcmp(hdr + ETH_SIZE + 12, frame + ETH_SIZE + 12, 8) /* addresses */
+	 && !memcmp(hdr + ETH_SIZE + IP_SIZE, frame + ETH_SIZE + IP_SIZE, 4) /* ports */
+	 && ((hdr[ETH_SIZE + 9] != IP_PROTO_TCP)
+	     || (hdr[ETH_SIZE + IP_SIZE + 12] == frame[ETH_SIZE + IP_SIZE + 12])));
+}
+
+/* ************************************** */
+
+/* The first of the two context slots a flow can use, from its addresses and
+ * ports. */
+static int hc_slot(const uint8_t *frame) {
+  const uint8_t *ip = frame + ETH_SIZE;
+  uint32_t hash = 2166136261u;
+  int i;
+
+  /* FNV-1a */
+  for(i = 12; i < IP_SIZE + 4; i++)
+    hash = (hash ^ ip[i]) * 16777619u;
+
+  return(((hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24)) % (N2N_HC_CONTEXTS / 2)) * 2);
+}
+
+/* ************************************** */
+
+/** Compress the headers of the frame into out.
+ *
+ *  Returns the length written to out, 0 when the frame is to be sent as it
+ *  is.
+ */
+size_t hc_compress(n2n_hc_t *hc, const uint8_t *frame, size_t len,
+                   uint8_t *out, size_t out_size, time_t now) {
+  size_t hdr_len = hc_header_len(frame, len), idx = 0;
+  const uint8_t *ip = frame + ETH_SIZE, *l4 = ip + IP_SIZE;
+  n2n_hc_ctx_t *ctx;
+  size_t out_len;
+
+  if((hdr_len == 0) || (len + HC_HDR_SIZE > out_size))
+    return(0);
+
+  ctx = &hc->ctx[hc_slot(frame)];
+
+  if(!hc_same_flow(ctx, frame) && ((ctx + 1)->last_used < ctx->last_used || hc_same_flow(ctx + 1, frame)))
+    ctx++;
+
+  ctx->last_used = ++hc->clock;
+
+  if(!hc_same_flow(ctx, frame)) {
+    /* A new flow takes the slot over */
+    ctx->valid = 1;
+    ctx->gen++;
+    ctx->hdr_len = hdr_len;
+    ctx->since_full = 0;
+    ctx->full_left = N2N_HC_STARTUP;
+  }
+
+  if(ctx->full_left || (ctx->since_full >= N2N_HC_REFRESH)
+     || ((now - ctx->last_full) >= N2N_HC_REFRESH_SEC)) {
+    /* The whole frame, its headers become the context */
+    out[idx++] = HC_FULL;
+    out[idx++] = ctx - hc->ctx;
+    out[idx++] = ctx->gen;
+    memcpy(out + idx, frame, len);
+    memcpy(ctx->hdr, frame, hdr_len);
+
+    if(ctx->full_left) ctx->full_left--;
+    ctx->since_full = 0;
+    ctx->last_full = now;
+
+    hc->saved -= HC_HDR_SIZE;
+    return(idx + len);
+  }
+
+  out[idx++] = (ip[9] == IP_PROTO_TCP) ? HC_TCP : HC_UDP;
+  out[idx++] = ctx - hc->ctx;
+  out[idx++] = ctx->gen;
+  out[idx++] = ip[1];                   /* TOS */
+  memcpy(out + idx, ip + 4, 2);         /* ID */
+  idx += 2;
+
+  if(ip[9] == IP_PROTO_TCP) {
+    memcpy(out + idx, l4 + 4, 8);       /* sequence, acknowledgement */
+    idx += 8;
+    out[idx++] = l4[13];                /* flags */
+    memcpy(out + idx, l4 + 14, 4);      /* window, checksum */
+    idx += 4;
+    memcpy(out + idx, l4 + TCP_SIZE, hdr_len - ETH_SIZE - IP_SIZE - TCP_SIZE); /* options */
+    idx += hdr_len - ETH_SIZE - IP_SIZE - TCP_SIZE;
+  } else {
+    memcpy(out + idx, l4 + 6, 2);       /* checksum */
+    idx += 2;
+  }
+
+  memcpy(out + idx, frame + hdr_len, len - hdr_len);
+  out_len = idx + len - hdr_len;
+
+  ctx->since_full++;
+  hc->saved += len - out_len;
+
+  return(out_len);
+}
+
+/* ************************************** */
+
+/** Rebuild the frame compressed by hc_compress() into frame.
+ *
+ *  Returns the length of the frame, 0 when it cannot be rebuilt: its
+ *  context was lost or is not valid.
+ */
+size_t hc_decompress(n2n_hc_t *hc, const uint8_t *in, size_t len,
+                     uint8_t *frame, size_t frame_size) {
+  n2n_hc_ctx_t *ctx;
+  uint8_t *ip = frame + ETH_SIZE, *l4 = ip + IP_SIZE;
+  size_t idx = HC_HDR_SIZE, hdr_len, opt_len, frame_len;
+  uint32_t sum = 0;
+  int i;
+
+  if((len < HC_HDR_SIZE) || (in[1] >= N2N_HC_CONTEXTS))
+    return(0);
+
+  ctx = &hc->ctx[in[1]];
+
+  if(in[0] == HC_FULL) {
+    frame_len = len - HC_HDR_SIZE;
+
+    if((frame_len > frame_size) || ((hdr_len = hc_header_len(in + idx, frame_len)) == 0))
+      return(0);
+
+    memcpy(frame, in + idx, frame_len);
+    memcpy(ctx->hdr, frame, hdr_len);
+    ctx->hdr_len = hdr_len;
+    ctx->gen = in[2];
+    ctx->valid = 1;
+
+    return(frame_len);
+  }
+
+  if(!ctx->valid || (ctx->gen != in[2])
+     || (in[0] != ((ctx->hdr[ETH_SIZE + 9] == IP_PROTO_TCP) ? HC_TCP : HC_UDP))) {
+    hc->miss++;
+    return(0);
+  }
+
+  hdr_len = ctx->hdr_len;
+  opt_len = (in[0] == HC_TCP) ? (hdr_len - ETH_SIZE - IP_SIZE - TCP_SIZE) : 0;
+
+  if(len < idx + 3 + ((in[0] == HC_TCP) ? (13 + opt_len) : 2))
+    return(0);
+
+  if((frame_len = hdr_len + len - idx - 3 - ((in[0] == HC_TCP) ? (13 + opt_len) : 2)) > frame_size)
+    return(0);
+
+  memcpy(frame, ctx->hdr, hdr_len);
+
+  ip[1] = in[idx++];
+  memcpy(ip + 4, in + idx, 2);
+  idx += 2;
+  ip[2] = (frame_len - ETH_SIZE) >> 8;
+  ip[3] = (frame_len - ETH_SIZE) & 0xff;
+
+  if(in[0] == HC_TCP) {
+    memcpy(l4 + 4, in + idx, 8);
+    idx += 8;
+    l4[13] = in[idx++];
+    memcpy(l4 + 14, in + idx, 4);
+    idx += 4;
+    l4[18] = l4[19] = 0;                /* urgent pointer */
+    memcpy(l4 + TCP_SIZE, in + idx, opt_len);
+    idx += opt_len;
+  } else {
+    l4[4] = (frame_len - ETH_SIZE - IP_SIZE) >> 8;
+    l4[5] = (frame_len - ETH_SIZE - IP_SIZE) & 0xff;
+    memcpy(l4 + 6, in + idx, 2);
+    idx += 2;
+  }
+
+  memcpy(frame + hdr_len, in + idx, len - idx);
+
+  /* IP header checksum */
+  ip[10] = ip[11] = 0;
+
+  for(i = 0; i < IP_SIZE; i += 2)
+    sum += (ip[i] << 8) | ip[i+1];
+
+  while(sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  sum = (uint16_t)~sum;
+  ip[10] = sum >> 8;
+  ip[11] = sum & 0xff;
+
+  return(frame_len);
+}
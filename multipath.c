@@ -0,0 +1,300 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Multipath bonding.
+ *
+ * An edge with several uplinks opens one socket per local address and
+ * spreads its P2P data packets over them. Each path is probed once a second
+ * (PATH_PROBE, echoed by the peers) for its RTT and loss. The scheduler is a
+ * smooth weighted round robin over the paths that answer, the configured
+ * weight scaled down by the loss; a path much slower than the fastest one is
+ * left out since its packets would arrive after the receiver stopped waiting
+ * for them.
+ *
+ * The packets carry the sequence of the FEC header. The receiver holds the
+ * ones that overtook a gap and releases them in order when the gap fills, or
+ * when it waited twice as long as gaps usually take to fill. A path does not
+ * reorder its own packets, so a gap is also given up on, without waiting,
+ * once every socket the peer spreads from sent a later packet: it was lost.
+ */
+
+#include "n2n.h"
+
+/* ************************************** */
+
+int path_is_up(const n2n_path_t *path, time_t now) {
+  return((path->last_ack != 0) && ((now - path->last_ack) <= N2N_PATH_TIMEOUT));
+}
+
+/* ************************************** */
+
+/** Pick the path of the next packet, -1 when none is up. */
+int path_schedule(n2n_path_t *paths, int num_paths, time_t now) {
+  uint32_t min_rtt = 0xffffffff;
+  int i, best = -1, total = 0;
+
+  for(i = 0; i < num_paths; i++) {
+    if(path_is_up(&paths[i], now) && (paths[i].rtt_usec < min_rtt))
+      min_rtt = paths[i].rtt_usec;
+  }
+
+  for(i = 0; i < num_paths; i++) {
+    n2n_path_t *path = &paths[i];
+    int weight;
+
+    if(!path_is_up(path, now) || (path->rtt_usec > (min_rtt + N2N_REORDER_MAX_USEC))) {
+      path->credit = 0;
+      continue;
+    }
+
+    weight = path->weight * (256 - path->loss) * (256 - path->loss) / 256;
+    if(weight == 0) weight = 1;
+
+    path->credit += weight;
+    total += weight;
+
+    if((best < 0) || (path->credit > paths[best].credit))
+      best = i;
+  }
+
+  if(best >= 0)
+    paths[best].credit -= total;
+
+  return(best);
+}
+
+/* ************************************** */
+
+/** Remember a probe sent on the path at usec, returns its sequence. */
+uint32_t path_probe_sent(n2n_path_t *path, uint32_t usec) {
+  uint32_t seq = path->probe_seq++;
+  uint32_t bit = 1u << (seq % N2N_PATH_PROBES);
+
+  path->probe_usec[seq % N2N_PATH_PROBES] = usec;
+  path->probe_sent |= bit;
+  path->probe_acked &= ~bit;
+
+  return(seq);
+}
+
+/* ************************************** */
+
+void path_probe_acked(n2n_path_t *path, uint32_t seq, uint32_t usec, time_t now) {
+  uint32_t bit = 1u << (seq % N2N_PATH_PROBES);
+  uint32_t rtt;
+
+  if(((path->probe_seq - seq - 1) >= N2N_PATH_PROBES) || (path->probe_acked & bit))
+    return; /* Too old, never sent or already answered */
+
+  rtt = usec - path->probe_usec[seq % N2N_PATH_PROBES];
+  path->rtt_usec = path->rtt_usec ? ((7 * (uint64_t)path->rtt_usec + rtt) / 8) : rtt;
+  path->probe_acked |= bit;
+  path->last_ack = now;
+}
+
+/* ************************************** */
+
+/** Recompute the loss from the probes old enough to have been answered. */
+void path_probe_update(n2n_path_t *path, uint32_t usec) {
+  uint32_t matured = 0, lost = 0;
+  int i;
+
+  for(i = 0; i < N2N_PATH_PROBES; i++) {
+    if((path->probe_sent & (1u << i)) && ((usec - path->probe_usec[i]) >= N2N_PATH_PROBE_WAIT)) {
+      matured++;
+
+      if(!(path->probe_acked & (1u << i)))
+        lost++;
+    }
+  }
+
+  path->loss = matured ? MIN(255, lost * 256 / matured) : 0;
+}
+
+/* ************************************** */
+
+static uint32_t reorder_timeout(const n2n_reorder_t *ro) {
+  uint32_t timeout = 2 * ro->wait_usec;
+
+  if(timeout < N2N_REORDER_MIN_USEC) timeout = N2N_REORDER_MIN_USEC;
+  if(timeout > N2N_REORDER_MAX_USEC) timeout = N2N_REORDER_MAX_USEC;
+
+  return(timeout);
+}
+
+/* ************************************** */
+
+/** Remember the newest unit spread from src. */
+static void reorder_src(n2n_reorder_t *ro, const n2n_sock_t *src, uint16_t seq, uint64_t usec) {
+  int i, oldest = 0;
+
+  for(i = 0; i < N2N_EDGE_MAX_PATHS; i++) {
+    if(ro->src_usec[i] && sock_equal(&ro->src[i], src)) {
+      if((int16_t)(seq - ro->src_seq[i]) > 0)
+        ro->src_seq[i] = seq;
+      ro->src_usec[i] = usec;
+      return;
+    }
+
+    if(ro->src_usec[i] < ro->src_usec[oldest])
+      oldest = i;
+  }
+
+  ro->src[oldest] = *src;
+  ro->src_seq[oldest] = seq;
+  ro->src_usec[oldest] = usec;
+}
+
+/* ************************************** */
+
+/** Whether all the sockets the peer currently spreads from sent a unit past
+ *  the expected one, which is then lost. */
+static int reorder_overtaken(const n2n_reorder_t *ro, uint64_t usec) {
+  int i, active = 0;
+
+  for(i = 0; i < N2N_EDGE_MAX_PATHS; i++) {
+    if(!ro->src_usec[i] || ((usec - ro->src_usec[i]) > N2N_REORDER_SRC_USEC))
+      continue;
+
+    if((int16_t)(ro->src_seq[i] - ro->next) <= 0)
+      return(0);
+
+    active++;
+  }
+
+  return(active > 0);
+}
+
+/* ************************************** */
+
+/** Oldest arrival among the held units. */
+static uint64_t reorder_oldest(const n2n_reorder_t *ro) {
+  uint64_t oldest = 0;
+  int i;
+
+  for(i = 0; i < N2N_REORDER_SLOTS; i++) {
+    if((ro->held & (1u << i)) && (!oldest || (ro->slots[i].usec < oldest)))
+      oldest = ro->slots[i].usec;
+  }
+
+  return(oldest);
+}
+
+/* ************************************** */
+
+/** Pass a received unit through the reordering.
+ *
+ *  Units with hold unset were not spread over paths and only move the
+ *  expected sequence. src is the socket a spread unit came from, NULL for
+ *  the ones rebuilt from parity. Returns 1 when the unit is to be delivered
+ *  now, 0 when it is held; reorder_pop() then gives what became deliverable.
+ */
+int reorder_push(n2n_reorder_t *ro, uint16_t seq, const uint8_t *unit, size_t len,
+                 int hold, const n2n_sock_t *src, uint64_t usec) {
+  int16_t gap = (int16_t)(seq - ro->next);
+  int slot = seq % N2N_REORDER_SLOTS;
+
+  if(hold && src)
+    reorder_src(ro, src, seq, usec);
+
+  if(!ro->synced) {
+    ro->synced = 1;
+    ro->next = seq + 1;
+    return(1);
+  }
+
+  if(gap < 0) {
+    /* Late: the gap was given up on, wait longer next time */
+    if(hold && (ro->wait_usec < N2N_REORDER_MAX_USEC))
+      ro->wait_usec += ro->wait_usec / 4 + 1;
+    return(1);
+  }
+
+  if((gap == 0) || !hold || (gap >= N2N_REORDER_SLOTS)) {
+    if((gap == 0) && ro->held) {
+      /* A gap filled */
+      uint32_t waited = usec - reorder_oldest(ro);
+
+      ro->wait_usec = (7 * (uint64_t)ro->wait_usec + waited) / 8;
+    }
+
+    /* Units held before a jump are late now, reorder_pop() flushes them */
+    ro->next = seq + 1;
+    return(1);
+  }
+
+  if(ro->held & (1u << slot))
+    return(0); /* Duplicate */
+
+  if((ro->slots == NULL)
+     && ((ro->slots = (n2n_reorder_slot_t*)malloc(N2N_REORDER_SLOTS * sizeof(n2n_reorder_slot_t))) == NULL))
+    return(1);
+
+  if(len > N2N_FEC_UNIT_SIZE)
+    return(1);
+
+  ro->slots[slot].seq = seq;
+  ro->slots[slot].len = len;
+  ro->slots[slot].usec = usec;
+  memcpy(ro->slots[slot].unit, unit, len);
+  ro->held |= (1u << slot);
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Next held unit that can be delivered at usec, in order. Returns its
+ *  length with unit pointing to it until the next push, 0 if none. */
+size_t reorder_pop(n2n_reorder_t *ro, uint64_t usec, const uint8_t **unit) {
+  int i, first = -1;
+  int16_t gap, first_gap = 0;
+
+  if(ro->held == 0)
+    return(0);
+
+  for(i = 0; i < N2N_REORDER_SLOTS; i++) {
+    if(!(ro->held & (1u << i)))
+      continue;
+
+    gap = (int16_t)(ro->slots[i].seq - ro->next);
+
+    if((first < 0) || (gap < first_gap))
+      first = i, first_gap = gap;
+  }
+
+  if((first_gap > 0) && ((usec - reorder_oldest(ro)) < reorder_timeout(ro))
+     && !reorder_overtaken(ro, usec))
+    return(0); /* Still waiting for the gap */
+
+  if(first_gap >= 0)
+    ro->next = ro->slots[first].seq + 1;
+
+  ro->held &= ~(1u << first);
+  *unit = ro->slots[first].unit;
+
+  return(ro->slots[first].len);
+}
+
+/* ************************************** */
+
+void reorder_free(n2n_reorder_t *ro) {
+  free(ro->slots);
+  ro->slots = NULL;
+  ro->held = 0;
+}
@@ -16,14 +16,21 @@
  *
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* CPU_SET and friends */
+#endif
+
 #include "n2n.h"
 
 #include "minilzo.h"
 
 #include <assert.h>
 
-#define PURGE_REGISTRATION_FREQUENCY   30
-#define REGISTRATION_TIMEOUT           60
+#ifdef __linux__
+#include <sched.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
 
 static const uint8_t broadcast_addr[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 static const uint8_t multicast_addr[6] = { 0x01, 0x00, 0x5E, 0x00, 0x00, 0x00 }; /* First 3 bytes are meaningful */
@@ -32,6 +39,12 @@ static const uint8_t ipv6_multicast_addr[6] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x
 /* ************************************** */
 
 SOCKET open_socket(int local_port, int bind_any) {
+  return(open_socket_addr(local_port, htonl(bind_any ? INADDR_ANY : INADDR_LOOPBACK)));
+}
+
+/* ************************************** */
+
+static SOCKET open_udp_socket(int local_port, uint32_t local_addr, int reuse_port) {
   SOCKET sock_fd;
   struct sockaddr_in local_address;
   int sockopt = 1;
@@ -48,19 +61,543 @@ SOCKET open_socket(int local_port, int bind_any) {
 
   setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR,(char *)&sockopt, sizeof(sockopt));
 
+#ifdef SO_REUSEPORT
+  if(reuse_port)
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&sockopt, sizeof(sockopt));
+#endif
+
   memset(&local_address, 0, sizeof(local_address));
   local_address.sin_family = AF_INET;
   local_address.sin_port = htons(local_port);
-  local_address.sin_addr.s_addr = htonl(bind_any ? INADDR_ANY : INADDR_LOOPBACK);
+  local_address.sin_addr.s_addr = local_addr;
 
   if(bind(sock_fd,(struct sockaddr*) &local_address, sizeof(local_address)) == -1) {
     traceEvent(TRACE_ERROR, "Bind error on local port %u [%s]\n", local_port, strerror(errno));
+    closesocket(sock_fd);
     return(-1);
   }
 
   return(sock_fd);
 }
 
+/* ************************************** */
+
+/** Open a UDP socket bound to a local IPv4 address (network order). */
+SOCKET open_socket_addr(int local_port, uint32_t local_addr) {
+  return(open_udp_socket(local_port, local_addr, 0));
+}
+
+/* ************************************** */
+
+/** Same with SO_REUSEPORT, so that the connected sockets of conn_sock.c
+ *  can share its port. */
+SOCKET open_socket_reuseport(int local_port, uint32_t local_addr) {
+  return(open_udp_socket(local_port, local_addr, 1));
+}
+
+/* ************************************** */
+
+/** Open the IPv6 UDP socket, next to the IPv4 one on the same port: it is
+ *  IPV6_V6ONLY so that the IPv4 traffic keeps going through the other. */
+SOCKET open_socket6(int local_port) {
+  SOCKET sock_fd;
+  struct sockaddr_in6 local_address;
+  int sockopt = 1;
+
+  if((sock_fd = socket(PF_INET6, SOCK_DGRAM, 0)) < 0) {
+    traceEvent(TRACE_WARNING, "Unable to create IPv6 socket [%s]", strerror(errno));
+    return(-1);
+  }
+
+  setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&sockopt, sizeof(sockopt));
+#ifdef IPV6_V6ONLY
+  setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&sockopt, sizeof(sockopt));
+#endif
+
+  memset(&local_address, 0, sizeof(local_address));
+  local_address.sin6_family = AF_INET6;
+  local_address.sin6_port = htons(local_port);
+  local_address.sin6_addr = in6addr_any;
+
+  if(bind(sock_fd, (struct sockaddr*) &local_address, sizeof(local_address)) == -1) {
+    traceEvent(TRACE_WARNING, "IPv6 bind error on local port %u [%s]", local_port, strerror(errno));
+    closesocket(sock_fd);
+    return(-1);
+  }
+
+  return(sock_fd);
+}
+
+/* ************************************** */
+
+/** Socket address of sock for sendto(), returns its length, 0 if sock has
+ *  no valid family. */
+socklen_t sock_to_sockaddr(n2n_sockaddr_t *sa, const n2n_sock_t *sock) {
+  memset(sa, 0, sizeof(n2n_sockaddr_t));
+
+  if(sock->family == AF_INET6) {
+    sa->in6.sin6_family = AF_INET6;
+    sa->in6.sin6_port = htons(sock->port);
+    memcpy(&sa->in6.sin6_addr, sock->addr.v6, IPV6_SIZE);
+    return(sizeof(struct sockaddr_in6));
+  }
+
+  if(sock->family == AF_INET) {
+    sa->in.sin_family = AF_INET;
+    sa->in.sin_port = htons(sock->port);
+    memcpy(&sa->in.sin_addr.s_addr, sock->addr.v4, IPV4_SIZE);
+    return(sizeof(struct sockaddr_in));
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** The n2n_sock_t of a received socket address. IPv4-mapped IPv6 addresses
+ *  become plain IPv4 ones, so that a peer has one address whatever the
+ *  socket it came in on. */
+void sockaddr_to_sock(n2n_sock_t *sock, const n2n_sockaddr_t *sa) {
+  memset(sock, 0, sizeof(n2n_sock_t));
+
+  if(sa->sa.sa_family == AF_INET6) {
+    const uint8_t *a = sa->in6.sin6_addr.s6_addr;
+
+    sock->port = ntohs(sa->in6.sin6_port);
+
+    if(IN6_IS_ADDR_V4MAPPED(&sa->in6.sin6_addr)) {
+      sock->family = AF_INET;
+      memcpy(sock->addr.v4, a + 12, IPV4_SIZE);
+    } else {
+      sock->family = AF_INET6;
+      memcpy(sock->addr.v6, a, IPV6_SIZE);
+    }
+  } else if(sa->sa.sa_family == AF_INET) {
+    sock->family = AF_INET;
+    sock->port = ntohs(sa->in.sin_port);
+    memcpy(sock->addr.v4, &sa->in.sin_addr.s_addr, IPV4_SIZE);
+  }
+}
+
+/* ************************************** */
+
+static int get_sock_buf(SOCKET sock, int optname) {
+  int size = 0;
+  socklen_t len = sizeof(size);
+
+  getsockopt(sock, SOL_SOCKET, optname, (char *)&size, &len);
+
+  return(size);
+}
+
+static void set_sock_buf(SOCKET sock, int size) {
+#ifdef SO_RCVBUFFORCE
+  /* Privileged processes may go past net.core.rmem_max/wmem_max */
+  if(setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, (char *)&size, sizeof(size)) != 0)
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&size, sizeof(size));
+
+#ifdef SO_SNDBUFFORCE
+  if(setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, (char *)&size, sizeof(size)) != 0)
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size));
+}
+
+/** Parse a socket buffer size: a number of bytes, optionally with a k or m
+ *  suffix, or "auto". */
+int parse_sock_buf_size(const char *spec) {
+  char *end;
+  long size;
+
+  if(spec == NULL)
+    return(0);
+
+  if(!strcmp(spec, "auto"))
+    return(N2N_SOCK_BUF_AUTO);
+
+  size = strtol(spec, &end, 10);
+  if((*end == 'k') || (*end == 'K')) size *= 1024;
+  if((*end == 'm') || (*end == 'M')) size *= 1024*1024;
+
+  if((size <= 0) || (size > N2N_SOCK_BUF_MAX)) {
+    traceEvent(TRACE_WARNING, "Invalid socket buffer size '%s': using system default", spec);
+    return(0);
+  }
+
+  return((int)size);
+}
+
+/** Apply the configured buffer sizes to a UDP socket and enable kernel drop
+ *  reporting (SO_RXQ_OVFL) on it. */
+int sock_buf_init(SOCKET sock, int size, n2n_sock_buf_t *sb) {
+  memset(sb, 0, sizeof(n2n_sock_buf_t));
+
+  if(size == N2N_SOCK_BUF_AUTO) {
+    sb->auto_size = 1;
+    size = N2N_SOCK_BUF_AUTO_START;
+  }
+
+  if(size > 0)
+    set_sock_buf(sock, size);
+
+#ifdef SO_RXQ_OVFL
+  {
+    int one = 1;
+
+    if(setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, (char *)&one, sizeof(one)) != 0)
+      traceEvent(TRACE_WARNING, "Unable to enable SO_RXQ_OVFL [%s]", strerror(errno));
+  }
+#endif
+
+  sb->rcvbuf = get_sock_buf(sock, SO_RCVBUF);
+  sb->sndbuf = get_sock_buf(sock, SO_SNDBUF);
+
+  traceEvent(TRACE_INFO, "Socket buffers: rcv %d snd %d%s",
+             sb->rcvbuf, sb->sndbuf, sb->auto_size ? " (auto)" : "");
+
+  return(0);
+}
+
+/** Account the kernel drops reported with a datagram. In auto mode the
+ *  receive buffer is doubled, at most once a second, while drops go on. */
+void sock_buf_update(SOCKET sock, n2n_sock_buf_t *sb, const n2n_rx_meta_t *meta, time_t now) {
+  uint32_t dropped;
+
+  /* The counter is cumulative and only reported once non-zero */
+  if((meta->kernel_drops == 0) || (meta->kernel_drops == sb->last_ovfl))
+    return;
+
+  dropped = meta->kernel_drops - sb->last_ovfl;
+  sb->last_ovfl = meta->kernel_drops;
+  sb->kernel_drops += dropped;
+
+  traceEvent(TRACE_DEBUG, "Kernel dropped %u datagrams (receive queue full)", dropped);
+
+  if(sb->auto_size && (now != sb->last_grow) && (sb->rcvbuf < N2N_SOCK_BUF_MAX)) {
+    /* The kernel reports twice the requested size for its bookkeeping */
+    set_sock_buf(sock, min(sb->rcvbuf, N2N_SOCK_BUF_MAX));
+    sb->rcvbuf = get_sock_buf(sock, SO_RCVBUF);
+    sb->sndbuf = get_sock_buf(sock, SO_SNDBUF);
+    sb->last_grow = now;
+
+    traceEvent(TRACE_NORMAL, "Kernel drops detected: socket buffers grown to rcv %d snd %d",
+               sb->rcvbuf, sb->sndbuf);
+  }
+}
+
+/** recvfrom() that also collects the ancillary data enabled on the socket.
+ *  Returns -1 with errno EAGAIN when no datagram is queued. */
+ssize_t recvfrom_meta(SOCKET sock, void *buf, size_t len,
+                      struct sockaddr *from, socklen_t *fromlen,
+                      n2n_rx_meta_t *meta) {
+#ifdef WIN32
+  memset(meta, 0, sizeof(n2n_rx_meta_t));
+  return(recvfrom(sock, buf, len, 0, from, fromlen));
+#else
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    uint8_t buf[256];
+  } control;
+  ssize_t rc;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = from;
+  msg.msg_namelen = *fromlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof(control);
+
+  /* Callers only read after select(), so this never has to wait. It must
+   * not either: a pending error queue (TX timestamps) also wakes select(). */
+  rc = recvmsg(sock, &msg, MSG_DONTWAIT);
+
+  *fromlen = msg.msg_namelen;
+  meta->kernel_drops = 0;
+  meta->rx_tstamp = 0;
+  meta->tos = 0;
+
+  if(rc < 0)
+    return(rc);
+
+  for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef SO_RXQ_OVFL
+    if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL))
+      memcpy(&meta->kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+#endif
+#ifdef SCM_TIMESTAMPING
+    if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING)) {
+      struct timespec sw; /* ts[0] of struct scm_timestamping */
+
+      memcpy(&sw, CMSG_DATA(cmsg), sizeof(sw));
+      meta->rx_tstamp = (uint64_t)sw.tv_sec * 1000000 + sw.tv_nsec / 1000;
+    }
+#endif
+#ifdef IP_RECVTOS
+    if((cmsg->cmsg_level == IPPROTO_IP)
+       && ((cmsg->cmsg_type == IP_TOS) || (cmsg->cmsg_type == IP_RECVTOS)))
+      meta->tos = *(uint8_t *)CMSG_DATA(cmsg);
+#endif
+#ifdef IPV6_TCLASS
+    if((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_TCLASS)) {
+      int tclass;
+
+      memcpy(&tclass, CMSG_DATA(cmsg), sizeof(tclass));
+      meta->tos = (uint8_t)tclass;
+    }
+#endif
+  }
+
+  return(rc);
+#endif
+}
+
+/** Report the TOS (traffic class over IPv6) of the received datagrams to
+ *  recvfrom_meta(). */
+int tos_enable(SOCKET sock) {
+#ifdef IP_RECVTOS
+  int on = 1;
+#ifdef IPV6_RECVTCLASS
+  struct sockaddr_storage local;
+  socklen_t len = sizeof(local);
+
+  if((getsockname(sock, (struct sockaddr *)&local, &len) == 0) && (local.ss_family == AF_INET6)) {
+    if(setsockopt(sock, IPPROTO_IPV6, IPV6_RECVTCLASS, (char *)&on, sizeof(on)) != 0) {
+      traceEvent(TRACE_WARNING, "Unable to enable IPV6_RECVTCLASS [%s]", strerror(errno));
+      return(-1);
+    }
+
+    return(0);
+  }
+#endif
+
+  if(setsockopt(sock, IPPROTO_IP, IP_RECVTOS, (char *)&on, sizeof(on)) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to enable IP_RECVTOS [%s]", strerror(errno));
+    return(-1);
+  }
+
+  return(0);
+#else
+  traceEvent(TRACE_WARNING, "Receiving the IP TOS is not supported on this platform");
+  return(-1);
+#endif
+}
+
+/** sendto() with the TOS of this datagram only, the socket default when 0. */
+ssize_t sendto_tos(SOCKET sock, const void *buf, size_t len,
+                   const struct sockaddr *to, socklen_t tolen, uint8_t tos) {
+#if defined(WIN32) || !defined(IP_TOS)
+  return(sendto(sock, buf, len, 0, to, tolen));
+#else
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    uint8_t buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  int val = tos;
+
+  if(tos == 0)
+    return(sendto(sock, buf, len, 0, to, tolen));
+
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)to;
+  msg.msg_namelen = tolen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+#ifdef IPV6_TCLASS
+  if(to->sa_family == AF_INET6) {
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_TCLASS;
+  } else
+#endif
+  {
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_TOS;
+  }
+  cmsg->cmsg_len = CMSG_LEN(sizeof(val));
+  memcpy(CMSG_DATA(cmsg), &val, sizeof(val));
+
+  return(sendmsg(sock, &msg, 0));
+#endif
+}
+
+/* ************************************** */
+
+static uint64_t realtime_usec(void) {
+#ifdef WIN32
+  return(0);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+}
+
+void latency_hist_add(n2n_latency_hist_t *hist, uint64_t usec) {
+  int i = 0;
+
+  while((usec > 0) && (i < N2N_LATENCY_BUCKETS - 1))
+    usec >>= 1, i++;
+
+  hist->bucket[i]++;
+  hist->count++;
+}
+
+/* Upper bound of the bucket holding the given quantile. */
+static uint32_t latency_hist_quantile(const n2n_latency_hist_t *hist, uint32_t pct) {
+  uint32_t target = (uint32_t)(((uint64_t)hist->count * pct + 99) / 100), seen = 0;
+  int i;
+
+  for(i=0; i<N2N_LATENCY_BUCKETS; i++) {
+    seen += hist->bucket[i];
+    if(seen >= target)
+      return(1u << i);
+  }
+
+  return(1u << (N2N_LATENCY_BUCKETS - 1));
+}
+
+/** Print a latency histogram summary as "n:<count> p50:<x p99:<y max:<z" in
+ *  microseconds. */
+int latency_hist_str(const n2n_latency_hist_t *hist, char *buf, size_t len) {
+  int i = N2N_LATENCY_BUCKETS - 1;
+
+  if(hist->count == 0)
+    return(snprintf(buf, len, "n:0"));
+
+  while((i > 0) && (hist->bucket[i] == 0))
+    i--;
+
+  return(snprintf(buf, len, "n:%u p50:<%uus p99:<%uus max:<%uus",
+                  hist->count,
+                  latency_hist_quantile(hist, 50),
+                  latency_hist_quantile(hist, 99),
+                  1u << i));
+}
+
+/** Enable software RX and TX timestamps on a UDP socket. */
+int tstamp_enable(SOCKET sock, n2n_tstamp_t *ts) {
+  memset(ts, 0, sizeof(n2n_tstamp_t));
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+      | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID
+      | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, (char *)&flags, sizeof(flags)) != 0) {
+      traceEvent(TRACE_WARNING, "Unable to enable SO_TIMESTAMPING [%s]", strerror(errno));
+      return(-1);
+    }
+
+    ts->enabled = 1;
+    return(0);
+  }
+#else
+  traceEvent(TRACE_WARNING, "Kernel timestamping is not supported on this platform");
+  return(-1);
+#endif
+}
+
+/** Account the time a received datagram spent queued in the kernel. */
+void tstamp_rx(n2n_tstamp_t *ts, const n2n_rx_meta_t *meta) {
+  uint64_t now;
+
+  if(!ts->enabled || (meta->rx_tstamp == 0))
+    return;
+
+  now = realtime_usec();
+  latency_hist_add(&ts->rx, (now > meta->rx_tstamp) ? (now - meta->rx_tstamp) : 0);
+}
+
+/** Time taken right before a sendto(), 0 when timestamping is off. */
+uint64_t tstamp_tx_begin(const n2n_tstamp_t *ts) {
+  return(ts->enabled ? realtime_usec() : 0);
+}
+
+/** Record the time of a datagram successfully handed to the kernel, as
+ *  returned by tstamp_tx_begin(). */
+void tstamp_tx_sent(n2n_tstamp_t *ts, uint64_t begin) {
+  if(!ts->enabled)
+    return;
+
+  ts->tx_sent[ts->tx_id & (N2N_TSTAMP_TX_RING - 1)] = begin;
+  ts->tx_id++;
+}
+
+/** Collect the TX timestamps queued by the kernel on the socket error queue.
+ *  This must run before blocking reads, as a pending error queue also makes
+ *  the socket readable. */
+void tstamp_drain_tx(SOCKET sock, n2n_tstamp_t *ts) {
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    uint8_t buf[256];
+  } control;
+  int i;
+
+  if(!ts->enabled)
+    return;
+
+  for(i=0; i<N2N_TSTAMP_TX_RING; i++) {
+    uint64_t tx_usec = 0;
+    uint32_t id = 0;
+    int got_id = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING)) {
+        struct timespec sw;
+
+        memcpy(&sw, CMSG_DATA(cmsg), sizeof(sw));
+        tx_usec = (uint64_t)sw.tv_sec * 1000000 + sw.tv_nsec / 1000;
+      } else if(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR))
+                || ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))) {
+        struct sock_extended_err err;
+
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+        if((err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) && (err.ee_info == SCM_TSTAMP_SND))
+          id = err.ee_data, got_id = 1;
+      }
+    }
+
+    /* Only IDs still in the ring can be matched with their send time */
+    if(got_id && tx_usec && ((uint32_t)(ts->tx_id - id) <= N2N_TSTAMP_TX_RING)) {
+      uint64_t sent = ts->tx_sent[id & (N2N_TSTAMP_TX_RING - 1)];
+
+      if(sent)
+        latency_hist_add(&ts->tx, (tx_usec > sent) ? (tx_usec - sent) : 0);
+    }
+  }
+#endif
+}
+
+/* ************************************** */
+
 static int traceLevel = 2 /* NORMAL */;
 static int useSyslog = 0, syslog_opened = 0;
 
@@ -97,7 +634,15 @@ void traceEvent(int eventTraceLevel, char* file, int line, char * format, ...) {
      */
 
     memset(buf, 0, sizeof(buf));
+#ifdef WIN32
     strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime(&theTime));
+#else
+    {
+      struct tm tm_buf; /* traceEvent() is called by the supernode workers too */
+
+      strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime_r(&theTime, &tm_buf));
+    }
+#endif
 
     va_start(va_ap, format);
     vsnprintf(buf, sizeof(buf)-1, format, va_ap);
@@ -229,6 +774,8 @@ char* msg_type2str(uint16_t msg_type) {
   case MSG_TYPE_REGISTER_SUPER_ACK: return("MSG_TYPE_REGISTER_SUPER_ACK");
   case MSG_TYPE_REGISTER_SUPER_NAK: return("MSG_TYPE_REGISTER_SUPER_NAK");
   case MSG_TYPE_FEDERATION: return("MSG_TYPE_FEDERATION");
+  case MSG_TYPE_PEER_INFO: return("MSG_TYPE_PEER_INFO");
+  case MSG_TYPE_QUERY_PEER: return("MSG_TYPE_QUERY_PEER");
   default: return("???");
   }
 
@@ -254,6 +801,237 @@ void hexdump(const uint8_t * buf, size_t len)
 
 /* *********************************************** */
 
+#define SIPROUND                                                 \
+  do {                                                           \
+    v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0;           \
+    v0 = (v0 << 32) | (v0 >> 32);                                \
+    v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2;           \
+    v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0;           \
+    v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2;           \
+    v2 = (v2 << 32) | (v2 >> 32);                                \
+  } while(0)
+
+static uint64_t load_le64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+
+  for(i=7; i>=0; i--)
+    v = (v << 8) | p[i];
+
+  return(v);
+}
+
+/** SipHash-2-4 keyed hash. Used wherever a hash must stay unpredictable to
+ *  remote senders, eg. stateless cookies and per-source accounting. */
+uint64_t siphash24(const uint8_t key[16], const void *data, size_t len) {
+  const uint8_t *in = (const uint8_t*)data;
+  uint64_t k0 = load_le64(key), k1 = load_le64(key + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t b = ((uint64_t)len) << 56, m;
+  size_t left = len & 7, i;
+
+  for(i=0; i+8 <= len; i += 8) {
+    m = load_le64(in + i);
+    v3 ^= m;
+    SIPROUND; SIPROUND;
+    v0 ^= m;
+  }
+
+  for(m=0; left > 0; left--)
+    m |= ((uint64_t)in[i + left - 1]) << (8 * (left - 1));
+
+  b |= m;
+  v3 ^= b;
+  SIPROUND; SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+
+  return(v0 ^ v1 ^ v2 ^ v3);
+}
+
+/* *********************************************** */
+
+/** Fill buf with random bytes, from the system entropy source when there is
+ *  one. */
+void fill_random(uint8_t *buf, size_t len) {
+  size_t i = 0;
+#ifndef WIN32
+  FILE *fd = fopen("/dev/urandom", "rb");
+
+  if(fd != NULL) {
+    i = fread(buf, 1, len, fd);
+    fclose(fd);
+  }
+#endif
+
+  for(; i<len; i++)
+    buf[i] = rand() & 0xff;
+}
+
+/* *********************************************** */
+
+/** Parse a CPU list such as "0-3,8,10" into list. Returns the number of CPUs
+ *  parsed or -1 if the specification is invalid. */
+int parse_cpu_list(const char *spec, n2n_cpu_list_t *list) {
+  const char *p = spec;
+  char *end;
+  long first, last;
+
+  memset(list, 0, sizeof(n2n_cpu_list_t));
+
+  if(spec == NULL)
+    return(-1);
+
+  while(*p != '\0') {
+    first = strtol(p, &end, 10);
+    if((end == p) || (first < 0) || (first > N2N_MAX_CPU_ID))
+      return(-1);
+
+    last = first;
+    if(*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if((end == p) || (last < first) || (last > N2N_MAX_CPU_ID))
+        return(-1);
+    }
+
+    for(; first <= last; first++) {
+      if(list->num >= N2N_MAX_CPUS) {
+        traceEvent(TRACE_WARNING, "Too many CPUs in '%s', only using the first %u",
+                   spec, N2N_MAX_CPUS);
+        return(list->num);
+      }
+
+      list->cpu[list->num++] = (uint16_t)first;
+    }
+
+    if(*end == ',')
+      end++;
+    else if(*end != '\0')
+      return(-1);
+
+    p = end;
+  }
+
+  return(list->num);
+}
+
+/** Pin the calling thread to a CPU. Memory touched first after this call is
+ *  allocated by the kernel on the NUMA node of that CPU, so callers pin
+ *  before setting up their buffers and tables. */
+int pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  if(sched_setaffinity(0 /* calling thread */, sizeof(set), &set) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to pin to CPU %d [%s]", cpu, strerror(errno));
+    return(-1);
+  }
+
+  traceEvent(TRACE_NORMAL, "Pinned to CPU %d", cpu);
+  return(0);
+#else
+  traceEvent(TRACE_WARNING, "CPU affinity is not supported on this platform");
+  return(-1);
+#endif
+}
+
+/** Tag the socket with the CPU that processes it. Within a SO_REUSEPORT
+ *  group the kernel then prefers it for the packets received on that CPU;
+ *  a socket alone in its group gets all its packets regardless, steering
+ *  them to the CPU is up to the RSS/RPS setup of the host. */
+int set_incoming_cpu(SOCKET sock, int cpu) {
+#ifdef SO_INCOMING_CPU
+  if(setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, (char *)&cpu, sizeof(cpu)) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to set SO_INCOMING_CPU %d [%s]", cpu, strerror(errno));
+    return(-1);
+  }
+
+  return(0);
+#else
+  return(-1);
+#endif
+}
+
+/** Enable kernel busy polling on a socket for up to usec microseconds per
+ *  receive. Raising it above net.core.busy_read needs CAP_NET_ADMIN. */
+int set_busy_poll(SOCKET sock, int usec) {
+#ifdef SO_BUSY_POLL
+  int one = 1;
+
+  if(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (char *)&usec, sizeof(usec)) != 0) {
+    traceEvent(TRACE_WARNING, "Unable to set SO_BUSY_POLL %d [%s]", usec, strerror(errno));
+    return(-1);
+  }
+
+#ifdef SO_PREFER_BUSY_POLL
+  setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char *)&one, sizeof(one));
+#else
+  (void)one;
+#endif
+
+  return(0);
+#else
+  return(-1);
+#endif
+}
+
+/* *********************************************** */
+
+/** Monotonic time in microseconds, for measuring short intervals. */
+uint64_t time_usec(void) {
+#ifdef WIN32
+  return((uint64_t)GetTickCount() * 1000);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+}
+
+#ifdef HAVE_SYS_SDT_H
+/* Semaphores of the USDT probes, raised by the tracers while attached */
+#define N2N_PROBE_SEMAPHORE_DEF(name) \
+  N2N_PROBE_SEMAPHORE(name) __attribute__((unused)) __attribute__((section(".probes")))
+
+N2N_PROBE_SEMAPHORE_DEF(edge_rx);
+N2N_PROBE_SEMAPHORE_DEF(edge_decode);
+N2N_PROBE_SEMAPHORE_DEF(edge_tx);
+N2N_PROBE_SEMAPHORE_DEF(peer_lookup);
+N2N_PROBE_SEMAPHORE_DEF(transform_fwd);
+N2N_PROBE_SEMAPHORE_DEF(transform_rev);
+N2N_PROBE_SEMAPHORE_DEF(register_super);
+N2N_PROBE_SEMAPHORE_DEF(register_super_ack);
+N2N_PROBE_SEMAPHORE_DEF(sn_rx);
+N2N_PROBE_SEMAPHORE_DEF(sn_decode);
+N2N_PROBE_SEMAPHORE_DEF(sn_register);
+N2N_PROBE_SEMAPHORE_DEF(sn_forward);
+N2N_PROBE_SEMAPHORE_DEF(sn_broadcast);
+N2N_PROBE_SEMAPHORE_DEF(sn_tx);
+#endif
+
+/** Monotonic time in nanoseconds, for profiling. */
+uint64_t time_nsec(void) {
+#ifdef WIN32
+  return((uint64_t)GetTickCount() * 1000000);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+/* *********************************************** */
+
 void print_n2n_version() {
   printf("Welcome to n2n v.%s for %s\n"
          "Built on %s\n"
@@ -350,8 +1128,10 @@ extern char * sock_to_cstr(n2n_sock_str_t out,
   memset(out, 0, N2N_SOCKBUF_SIZE);
 
   if(AF_INET6 == sock->family) {
-    /* INET6 not written yet */
-    snprintf(out, N2N_SOCKBUF_SIZE, "XXXX:%hu", sock->port);
+    char a[INET6_ADDRSTRLEN];
+
+    inet_ntop(AF_INET6, sock->addr.v6, a, sizeof(a));
+    snprintf(out, N2N_SOCKBUF_SIZE, "[%s]:%hu", a, sock->port);
     return out;
   } else {
     const uint8_t * a = sock->addr.v4;
@@ -125,6 +125,50 @@ typedef struct ether_hdr ether_hdr_t;
 #include "n2n_wire.h"
 #include "n2n_transforms.h"
 
+/* USDT probes of provider "n2n" for perf and bpftrace, eg.
+ * bpftrace -e 'usdt:./edge:n2n:transform_fwd { @ns = hist(arg3); }'
+ * Without sys/sdt.h they compile to nothing.
+ *
+ * Each probe has a semaphore, defined in n2n.c, that the tracer raises while
+ * attached: probe arguments that are costly to compute, like the clock
+ * reads of N2N_PROBE_CLOCK(), are only computed then. */
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define N2N_PROBE1(name,a)              DTRACE_PROBE1(n2n, name, a)
+#define N2N_PROBE2(name,a,b)            DTRACE_PROBE2(n2n, name, a, b)
+#define N2N_PROBE3(name,a,b,c)          DTRACE_PROBE3(n2n, name, a, b, c)
+#define N2N_PROBE4(name,a,b,c,d)        DTRACE_PROBE4(n2n, name, a, b, c, d)
+#define N2N_PROBE_SEMAPHORE(name)       volatile unsigned short n2n_##name##_semaphore
+#define N2N_PROBE_ENABLED(name)         __builtin_expect(n2n_##name##_semaphore != 0, 0)
+/* Start and elapsed time of a timed probe, 0 while it is not traced */
+#define N2N_PROBE_CLOCK(name)           (N2N_PROBE_ENABLED(name) ? time_nsec() : 0)
+#define N2N_PROBE_SINCE(t0)             ((t0) ? (time_nsec() - (t0)) : 0)
+
+extern N2N_PROBE_SEMAPHORE(edge_rx);
+extern N2N_PROBE_SEMAPHORE(edge_decode);
+extern N2N_PROBE_SEMAPHORE(edge_tx);
+extern N2N_PROBE_SEMAPHORE(peer_lookup);
+extern N2N_PROBE_SEMAPHORE(transform_fwd);
+extern N2N_PROBE_SEMAPHORE(transform_rev);
+extern N2N_PROBE_SEMAPHORE(register_super);
+extern N2N_PROBE_SEMAPHORE(register_super_ack);
+extern N2N_PROBE_SEMAPHORE(sn_rx);
+extern N2N_PROBE_SEMAPHORE(sn_decode);
+extern N2N_PROBE_SEMAPHORE(sn_register);
+extern N2N_PROBE_SEMAPHORE(sn_forward);
+extern N2N_PROBE_SEMAPHORE(sn_broadcast);
+extern N2N_PROBE_SEMAPHORE(sn_tx);
+#else
+#define N2N_PROBE1(name,a)              do { (void)(a); } while(0)
+#define N2N_PROBE2(name,a,b)            do { (void)(a); (void)(b); } while(0)
+#define N2N_PROBE3(name,a,b,c)          do { (void)(a); (void)(b); (void)(c); } while(0)
+#define N2N_PROBE4(name,a,b,c,d)        do { (void)(a); (void)(b); (void)(c); (void)(d); } while(0)
+#define N2N_PROBE_ENABLED(name)         0
+#define N2N_PROBE_CLOCK(name)           ((uint64_t)0)
+#define N2N_PROBE_SINCE(t0)             ((void)(t0), (uint64_t)0)
+#endif
+
 /* N2N_IFNAMSIZ is needed on win32 even if dev_name is not used after declaration */
 #define N2N_IFNAMSIZ            16 /* 15 chars * NULL */
 #ifndef WIN32
@@ -152,6 +196,8 @@ typedef struct tuntap_dev {
 #define MSG_TYPE_FEDERATION             8
 #define MSG_TYPE_PEER_INFO              9
 #define MSG_TYPE_QUERY_PEER            10
+#define MSG_TYPE_PEER_LIST             11
+#define MSG_TYPE_PATH_PROBE            12
 
 /* Set N2N_COMPRESSION_ENABLED to 0 to disable lzo1x compression of ethernet
  * frames. Doing this will break compatibility with the standard n2n packet
@@ -184,12 +230,362 @@ struct peer_info {
 #define HASH_FIND_PEER(head,mac,out)                                           \
     HASH_FIND(hh,head,mac,sizeof(n2n_mac_t),out)
 
+/* Compact peer table, used for the edges registered to a supernode. The
+ * fields needed to forward a packet and to purge the table live in 16-byte
+ * slots of one open addressing array, four to a cache line. The full socket,
+ * only needed for edges without an IPv4 address and for logging, is kept in
+ * a parallel array at the same index. */
+typedef struct n2n_peer_slot {
+  n2n_mac_t           mac_addr;
+  uint16_t            port;         /* Host byte order, 0 marks a free slot. */
+  uint32_t            addr;         /* IPv4 in network byte order, 0 if not IPv4. */
+  uint32_t            last_seen;    /* Truncated time_t. */
+} n2n_peer_slot_t;
+
+/* Epoch based reclamation. Readers on other threads announce the global
+ * epoch while they hold pointers into a shared structure; the writer retires
+ * memory it unpublished and frees it once every reader has moved past the
+ * epoch it was retired in. Retire and reclaim are for a single writer. */
+#define N2N_EPOCH_MAX_READERS 64
+
+typedef struct n2n_epoch_reader {
+  uint64_t            epoch;        /* Epoch seen on entry, 0 when quiescent. */
+  uint8_t             pad[56];      /* One reader per cache line. */
+} n2n_epoch_reader_t;
+
+typedef struct n2n_epoch_garbage {
+  void                *ptr;
+  void                (*free_fn)(void *ptr);
+  uint64_t            epoch;
+} n2n_epoch_garbage_t;
+
+typedef struct n2n_epoch {
+  uint64_t            global;
+  uint32_t            num_readers;
+  n2n_epoch_reader_t  readers[N2N_EPOCH_MAX_READERS];
+  n2n_epoch_garbage_t *garbage;
+  size_t              num_garbage;
+  size_t              max_garbage;
+} n2n_epoch_t;
+
+/* The arrays readers on other threads probe, replaced as a whole on resize. */
+typedef struct n2n_peer_version {
+  n2n_peer_slot_t     *slots;
+  n2n_sock_t          *socks;
+  uint32_t            mask;
+} n2n_peer_version_t;
+
+typedef struct n2n_peer_table {
+  n2n_peer_slot_t     *slots;
+  n2n_sock_t          *socks;
+  uint32_t            mask;         /* Number of slots minus one (power of two). */
+  uint32_t            count;
+  /* Lock-free readers, see peer_table_lookup(). The owner thread uses the
+   * fields above directly. */
+  n2n_peer_version_t  *version;
+  n2n_epoch_t         *epoch;       /* NULL when not shared: replaced arrays are freed at once. */
+  uint32_t            seq;          /* Odd while the owner is writing, only kept once shared. */
+} n2n_peer_table_t;
+
+#define N2N_PEER_TABLE_MIN_SIZE 16
+
+/* Forward error correction towards and from one peer, see fec.c */
+#define N2N_FEC_WINDOW          256     /* Data packets per loss measurement */
+#define N2N_FEC_UNIT_SIZE       N2N_PKT_BUF_SIZE
+
+typedef struct n2n_fec_tx {
+  uint16_t            seq;          /* Of the next data packet. */
+  uint8_t             group;        /* Size of the current group, 0 = no parity. */
+  uint8_t             index;        /* Position of the next data packet in it. */
+  uint8_t             peer_loss;    /* Last loss reported by the peer, in 1/256. */
+  uint16_t            len_xor;
+  uint16_t            parity_len;   /* Longest unit of the group so far. */
+  uint64_t            parity[N2N_FEC_UNIT_SIZE/8];
+  uint32_t            parity_sent;
+} n2n_fec_tx_t;
+
+typedef struct n2n_fec_rx {
+  uint8_t             synced;
+  uint16_t            next_seq;     /* Highest data sequence seen plus one. */
+  uint32_t            win_recv;
+  uint32_t            win_lost;
+  uint8_t             loss;         /* Measured over the last window, reported to the peer. */
+  uint8_t             group;        /* Group being collected, 0 = none. */
+  uint16_t            base;         /* Its first data sequence. */
+  uint32_t            have;         /* Bitmap of its units received. */
+  uint16_t            len[N2N_FEC_MAX_GROUP];
+  uint8_t             *units;       /* N2N_FEC_MAX_GROUP units, allocated with the first group. */
+  uint32_t            recovered;
+} n2n_fec_rx_t;
+
+/* Multipath: uplinks of the edge and reordering of what peers spread over
+ * theirs, see multipath.c */
+#define N2N_EDGE_MAX_PATHS      4
+#define N2N_PATH_PROBES         32      /* Probes remembered per path, for the loss */
+#define N2N_PATH_PROBE_WAIT     1000000 /* usec before an unanswered probe counts as lost */
+#define N2N_PATH_TIMEOUT        3       /* sec without an answered probe before a path is down */
+#define N2N_REORDER_SLOTS       32
+#define N2N_REORDER_MIN_USEC    2000
+#define N2N_REORDER_MAX_USEC    100000  /* Longest wait for a gap, also the largest RTT spread used */
+#define N2N_REORDER_SRC_USEC    1000000 /* Sockets of the sender that sent nothing for longer are ignored */
+
+typedef struct n2n_path {
+  SOCKET              sock;
+  uint32_t            addr;         /* Local IPv4 address, network order. */
+  uint8_t             weight;       /* Configured share of the traffic. */
+  int                 credit;       /* Smooth weighted round robin. */
+  uint32_t            rtt_usec;     /* Smoothed, 0 until measured. */
+  uint8_t             loss;         /* Of the recent probes, in 1/256. */
+  time_t              last_ack;     /* Last answered probe, 0 = never. */
+  uint32_t            probe_seq;
+  uint32_t            probe_sent;   /* Bitmaps of the probe slots. */
+  uint32_t            probe_acked;
+  uint32_t            probe_usec[N2N_PATH_PROBES];
+  uint32_t            tx_packets;
+} n2n_path_t;
+
+typedef struct n2n_reorder_slot {
+  uint16_t            seq;
+  uint16_t            len;
+  uint64_t            usec;         /* Arrival. */
+  uint8_t             unit[N2N_FEC_UNIT_SIZE];
+} n2n_reorder_slot_t;
+
+typedef struct n2n_reorder {
+  uint8_t             synced;
+  uint16_t            next;         /* Sequence to deliver next. */
+  uint32_t            held;         /* Bitmap of the slots in use. */
+  uint32_t            wait_usec;    /* Smoothed time the gaps took to fill. */
+  n2n_reorder_slot_t  *slots;       /* Allocated with the first gap. */
+  n2n_sock_t          src[N2N_EDGE_MAX_PATHS]; /* Sockets the units were spread from... */
+  uint16_t            src_seq[N2N_EDGE_MAX_PATHS]; /* ...the newest sequence from each... */
+  uint64_t            src_usec[N2N_EDGE_MAX_PATHS]; /* ...and when it came, 0 = unused. */
+} n2n_reorder_t;
+
+/* Header compression, see hc.c */
+#define N2N_HC_CONTEXTS         64      /* Flows compressed at a time to a peer, two per hash */
+#define N2N_HC_MAX_HDR          (14 + 20 + 60) /* Ethernet, IPv4 and TCP with options */
+#define N2N_HC_STARTUP          3       /* Full headers sent when a flow starts */
+#define N2N_HC_REFRESH          64      /* Frames between full headers of a flow... */
+#define N2N_HC_REFRESH_SEC      2       /* ...or seconds */
+
+typedef struct n2n_hc_ctx {
+  uint8_t             valid;
+  uint8_t             gen;          /* Tells the flows that used the slot apart. */
+  uint8_t             hdr_len;
+  uint8_t             full_left;    /* Full headers still to send at startup. */
+  uint16_t            since_full;
+  time_t              last_full;
+  uint32_t            last_used;    /* The least recent of the two is replaced. */
+  uint8_t             hdr[N2N_HC_MAX_HDR];
+} n2n_hc_ctx_t;
+
+typedef struct n2n_hc {
+  n2n_hc_ctx_t        ctx[N2N_HC_CONTEXTS];
+  uint32_t            clock;        /* Frames compressed, for last_used. */
+  int64_t             saved;        /* Bytes saved by the compression. */
+  uint32_t            miss;         /* Frames dropped for lack of a context. */
+} n2n_hc_t;
+
+/* Egress pacing, see pacing.c */
+#define N2N_PACE_QUEUE          64      /* Datagrams to a peer waiting for the pacer */
+#define N2N_PACE_BURST_USEC     1000    /* Depth of the token bucket, in time at the rate */
+
+typedef struct n2n_pace_slot {
+  n2n_sock_t          dest;
+  int8_t              path;         /* Multipath socket, -1 for the main one. */
+  uint8_t             is_p2p;
+  uint8_t             tos;          /* Outer TOS, see ecn.c */
+  uint16_t            len;
+  uint8_t             pkt[N2N_PKT_BUF_SIZE];
+} n2n_pace_slot_t;
+
+typedef struct n2n_pacer {
+  int64_t             tokens;       /* Bytes that may leave now, negative in debt. */
+  uint64_t            last_usec;    /* Last refill. */
+  uint32_t            head;
+  uint32_t            count;
+  n2n_pace_slot_t     *slots;       /* N2N_PACE_QUEUE, allocated when first needed. */
+} n2n_pacer_t;
+
+/* Connected sockets of the busy destinations, see conn_sock.c */
+#define N2N_CONN_SOCKS          64      /* Destinations tracked, two per hash */
+#define N2N_CONN_COLD_SEC       10      /* Seconds below a quarter of the rate before demotion */
+#define N2N_CONN_POOL           16      /* Sockets opened before dropping privileges, the most connected at once */
+
+#define N2N_CONN_SPARE          0       /* Pool socket not bound yet */
+#define N2N_CONN_PARKED         1       /* Bound, still connected to the destination it was demoted from */
+#define N2N_CONN_USED           2       /* Held by a slot */
+
+typedef struct n2n_conn_sock {
+  uint32_t            addr;         /* Destination, network order. */
+  uint16_t            port;         /* Network order, 0 while the slot is free. */
+  SOCKET              sock;         /* connect()ed to it, -1 if not promoted. */
+  uint32_t            pkts;         /* Datagrams since the last update. */
+  uint32_t            cold;         /* Seconds in a row below the demotion rate. */
+} n2n_conn_sock_t;
+
+typedef struct n2n_conn_socks {
+  uint32_t            pps;          /* Promotion rate, 0 = disabled. */
+  uint32_t            local_addr;   /* Of the main socket, network order. */
+  uint16_t            local_port;
+  uint8_t             recv_tos;     /* tos_enable() the connected sockets. */
+  time_t              last_update;
+  uint32_t            connected;
+  uint32_t            promoted;
+  uint32_t            demoted;
+  n2n_conn_sock_t     slot[N2N_CONN_SOCKS];
+  SOCKET              pool[N2N_CONN_POOL]; /* -1 once closed. */
+  uint8_t             pool_state[N2N_CONN_POOL];
+  uint32_t            pool_addr[N2N_CONN_POOL]; /* Destination it is connected to, network order. */
+  uint16_t            pool_port[N2N_CONN_POOL];
+} n2n_conn_socks_t;
+
+#define PURGE_REGISTRATION_FREQUENCY   30
+#define REGISTRATION_TIMEOUT           60
+
 #define N2N_EDGE_SN_HOST_SIZE   48
 #define N2N_EDGE_NUM_SUPERNODES 2
 #define N2N_EDGE_SUP_ATTEMPTS   3       /* Number of failed attmpts before moving on to next supernode. */
 #define N2N_PATHNAME_MAXLEN     256
 #define N2N_EDGE_MGMT_PORT      5644
+#define N2N_MAX_CPUS            64
+#define N2N_MAX_CPU_ID          1023    /* CPU_SETSIZE of glibc, minus one */
+
+#define N2N_SOCK_BUF_AUTO       -1             /* Grow the receive buffer on kernel drops */
+#define N2N_SOCK_BUF_AUTO_START (256*1024)
+#define N2N_SOCK_BUF_MAX        (16*1024*1024)
+
+/** A UDP peer address of either family, as passed to the socket calls. */
+typedef union n2n_sockaddr {
+  struct sockaddr     sa;
+  struct sockaddr_in  in;
+  struct sockaddr_in6 in6;
+} n2n_sockaddr_t;
+
+/** Ancillary data collected by recvfrom_meta() for each datagram. */
+typedef struct n2n_rx_meta {
+  uint32_t            kernel_drops;           /**< SO_RXQ_OVFL counter, 0 when not reported. */
+  uint64_t            rx_tstamp;              /**< Kernel RX software timestamp (realtime usec), 0 if none. */
+  uint8_t             tos;                    /**< Outer IP TOS (DSCP and ECN), 0 when not reported. */
+} n2n_rx_meta_t;
+
+/* ECN field, the low bits of the TOS (RFC 3168) */
+#define N2N_ECN_MASK            0x03
+#define N2N_ECN_NOT_ECT         0x00
+#define N2N_ECN_ECT1            0x01
+#define N2N_ECN_ECT0            0x02
+#define N2N_ECN_CE              0x03
+
+/** Log2 histogram of latencies: bucket i counts samples below 2^i usec. */
+#define N2N_LATENCY_BUCKETS     24
+typedef struct n2n_latency_hist {
+  uint32_t            count;
+  uint32_t            bucket[N2N_LATENCY_BUCKETS];
+} n2n_latency_hist_t;
+
+/** Kernel timestamping (SO_TIMESTAMPING) state of a UDP socket. */
+#define N2N_TSTAMP_TX_RING      256            /* Outstanding TX timestamps, power of two */
+typedef struct n2n_tstamp {
+  uint8_t             enabled;
+  uint32_t            tx_id;                  /**< Kernel OPT_ID of the next datagram sent. */
+  uint64_t            tx_sent[N2N_TSTAMP_TX_RING]; /**< sendto() time by ID (realtime usec). */
+  n2n_latency_hist_t  rx;                     /**< Kernel receive to processing. */
+  n2n_latency_hist_t  tx;                     /**< sendto() to kernel transmit. */
+} n2n_tstamp_t;
+
+/** Socket buffer sizing and kernel drop accounting of a UDP socket. */
+typedef struct n2n_sock_buf {
+  int                 auto_size;              /**< Double the receive buffer when the kernel drops. */
+  int                 rcvbuf;                 /**< Receive buffer size as reported by the kernel. */
+  int                 sndbuf;                 /**< Send buffer size as reported by the kernel. */
+  uint32_t            last_ovfl;              /**< Last SO_RXQ_OVFL counter seen. */
+  uint32_t            kernel_drops;           /**< Datagrams dropped by the kernel on this socket. */
+  time_t              last_grow;
+} n2n_sock_buf_t;
+
+/** CPUs a process or its workers may be pinned to, in order of use. */
+typedef struct n2n_cpu_list {
+  uint16_t            num;
+  uint16_t            cpu[N2N_MAX_CPUS];
+} n2n_cpu_list_t;
+
+#if defined(__linux__) && defined(HAVE_LINUX_IF_XDP_H)
+#define N2N_HAVE_XDP
+#endif
+
+/** AF_XDP socket bound to one interface queue (see xdp_linux.c). */
+#define N2N_XDP_FRAME_SIZE      2048           /* UMEM chunk, power of two */
+#define N2N_XDP_NUM_FRAMES      4096
+#define N2N_XDP_RING_SIZE       2048           /* RX, TX and completion rings */
+
+typedef struct n2n_xdp_ring {
+  uint32_t            *producer;
+  uint32_t            *consumer;
+  void                *desc;
+  uint32_t            mask;
+  void                *map;
+  size_t              map_len;
+} n2n_xdp_ring_t;
+
+typedef struct n2n_xdp {
+  int                 fd;                     /**< AF_XDP socket, -1 when not open. */
+  int                 map_fd;
+  int                 prog_fd;
+  int                 link_fd;
+  int                 ifindex;
+  int                 queue;
+  uint8_t             *umem;                  /**< Frames shared with the kernel. */
+  size_t              umem_len;
+  n2n_xdp_ring_t      fill, comp, rx, tx;
+  uint32_t            tx_queued;              /**< Frames queued since the last kick. */
+  size_t              rx_frames;
+  size_t              tx_frames;
+  size_t              tx_full;                /**< Frames dropped because the TX ring was full. */
+} n2n_xdp_t;
 
+#ifdef __linux__
+#define N2N_HAVE_SHM
+#endif
+
+#ifndef WIN32
+#define N2N_HAVE_DLOPEN
+#endif
+
+/** Shared-memory channel between two edges of the same host (see
+ *  shm_linux.c). The rings live in a memfd mapped by both edges. */
+#define N2N_SHM_RING_SLOTS      256            /* Power of two */
+#define N2N_SHM_FRAME_SIZE      N2N_PKT_BUF_SIZE
+
+typedef struct n2n_shm_slot {
+  uint32_t            len;
+  uint8_t             data[N2N_SHM_FRAME_SIZE];
+} n2n_shm_slot_t;
+
+typedef struct n2n_shm_ring {
+  uint32_t            head;                   /**< Written by the sender only. */
+  uint8_t             pad0[60];
+  uint32_t            tail;                   /**< Written by the receiver only. */
+  uint8_t             pad1[60];
+  uint32_t            need_wakeup;            /**< Receiver is about to sleep on its eventfd. */
+  uint8_t             pad2[60];
+  n2n_shm_slot_t      slot[N2N_SHM_RING_SLOTS];
+} n2n_shm_ring_t;
+
+typedef struct n2n_shm_chan {
+  n2n_mac_t           peer_mac;
+  uint8_t             initiator;              /**< We connected, the peer accepted. */
+  int                 sock;                   /**< Unix connection, readable when the peer is gone. */
+  int                 tx_event;               /**< eventfd to wake up the peer. */
+  int                 rx_event;               /**< eventfd the peer wakes us up with. */
+  n2n_shm_ring_t      *tx;
+  n2n_shm_ring_t      *rx;
+  void                *map;
+  size_t              map_len;
+  size_t              tx_frames;
+  size_t              rx_frames;
+  size_t              tx_full;
+} n2n_shm_chan_t;
 
 typedef char n2n_sn_name_t[N2N_EDGE_SN_HOST_SIZE];
 
@@ -206,6 +602,22 @@ typedef struct n2n_edge_conf {
   int                 register_interval;      /**< Interval for supernode registration, also used for UDP NAT hole punching. */
   int                 local_port;
   int                 mgmt_port;
+  n2n_cpu_list_t      cpu_affinity;           /**< CPUs to pin to, none if empty. */
+  int                 busy_poll_usec;         /**< Spin this long after traffic before blocking, 0 = never. */
+  int                 sock_buf_size;          /**< UDP socket buffers, 0 = system default, N2N_SOCK_BUF_AUTO. */
+  uint8_t             timestamping;           /**< Measure kernel queueing latencies (SO_TIMESTAMPING). */
+  char                *shm_dir;               /**< Rendezvous directory of the shared-memory transport, NULL = off. */
+  char                *peer_cache;            /**< File keeping the peers across restarts, NULL = off. */
+  int                 peer_list_max;          /**< Peers of the supernode list to pre-register with, 0 = off. */
+  uint8_t             fec_group;              /**< Largest FEC group of data packets per parity packet, 0 = off. */
+  uint8_t             num_paths;              /**< Uplinks to spread the P2P traffic over, 0 = off. */
+  uint32_t            path_addr[N2N_EDGE_MAX_PATHS]; /**< Their local addresses, network order. */
+  uint8_t             path_weight[N2N_EDGE_MAX_PATHS];
+  uint8_t             tos_propagate;          /**< Copy DSCP/ECN between inner and outer headers (RFC 6040). */
+  uint64_t            pace_rate;              /**< Egress rate cap of each peer in bytes/s, 0 = no pacing. */
+  uint8_t             header_compression;     /**< Compress the ethernet/IPv4/TCP/UDP headers. */
+  uint32_t            conn_sock_pps;          /**< Connect a socket to the peers sent more datagrams/s, 0 = off. */
+  char                *transop_plugin;        /**< Shared object of the transform to use instead of transop_id, NULL = none. */
 } n2n_edge_conf_t;
 
 typedef struct n2n_edge n2n_edge_t; /* Opaque, see edge_utils.c */
@@ -243,6 +655,7 @@ typedef struct n2n_edge n2n_edge_t; /* Opaque, see edge_utils.c */
 /* Transop Init Functions */
 int n2n_transop_null_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 int n2n_transop_twofish_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
+int n2n_transop_plugin_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 #ifdef N2N_HAVE_AES
 int n2n_transop_aes_cbc_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 #endif
@@ -269,6 +682,12 @@ uint8_t is_multi_broadcast(const uint8_t * dest_mac);
 char* msg_type2str(uint16_t msg_type);
 void hexdump(const uint8_t * buf, size_t len);
 void print_n2n_version();
+uint64_t siphash24(const uint8_t key[16], const void *data, size_t len);
+void fill_random(uint8_t *buf, size_t len);
+int parse_cpu_list(const char *spec, n2n_cpu_list_t *list);
+int pin_to_cpu(int cpu);
+uint64_t time_usec(void);
+uint64_t time_nsec(void);
 int is_empty_ip_address(const n2n_sock_t * sock);
 void print_edge_stats(const n2n_edge_t *eee);
 
@@ -276,15 +695,125 @@ void print_edge_stats(const n2n_edge_t *eee);
 char* sock_to_cstr( n2n_sock_str_t out,
                             const n2n_sock_t * sock );
 SOCKET open_socket(int local_port, int bind_any);
+SOCKET open_socket_addr(int local_port, uint32_t local_addr);
+SOCKET open_socket_reuseport(int local_port, uint32_t local_addr);
+SOCKET open_socket6(int local_port);
+socklen_t sock_to_sockaddr(n2n_sockaddr_t *sa, const n2n_sock_t *sock);
+void sockaddr_to_sock(n2n_sock_t *sock, const n2n_sockaddr_t *sa);
+int set_incoming_cpu(SOCKET sock, int cpu);
+int set_busy_poll(SOCKET sock, int usec);
+int sock_buf_init(SOCKET sock, int size, n2n_sock_buf_t *sb);
+void sock_buf_update(SOCKET sock, n2n_sock_buf_t *sb, const n2n_rx_meta_t *meta, time_t now);
+int parse_sock_buf_size(const char *spec);
+ssize_t recvfrom_meta(SOCKET sock, void *buf, size_t len,
+                      struct sockaddr *from, socklen_t *fromlen,
+                      n2n_rx_meta_t *meta);
+int tos_enable(SOCKET sock);
+ssize_t sendto_tos(SOCKET sock, const void *buf, size_t len,
+                   const struct sockaddr *to, socklen_t tolen, uint8_t tos);
+int tstamp_enable(SOCKET sock, n2n_tstamp_t *ts);
+void tstamp_rx(n2n_tstamp_t *ts, const n2n_rx_meta_t *meta);
+uint64_t tstamp_tx_begin(const n2n_tstamp_t *ts);
+void tstamp_tx_sent(n2n_tstamp_t *ts, uint64_t begin);
+void tstamp_drain_tx(SOCKET sock, n2n_tstamp_t *ts);
+void latency_hist_add(n2n_latency_hist_t *hist, uint64_t usec);
+int latency_hist_str(const n2n_latency_hist_t *hist, char *buf, size_t len);
 int sock_equal( const n2n_sock_t * a,
                        const n2n_sock_t * b );
 
+/* AF_XDP */
+int xdp_open(n2n_xdp_t *xdp, const char *ifname, int queue, uint16_t udp_port);
+void xdp_close(n2n_xdp_t *xdp);
+unsigned int xdp_rx_burst(n2n_xdp_t *xdp, uint64_t *addr, uint32_t *len, unsigned int max);
+uint8_t* xdp_frame(n2n_xdp_t *xdp, uint64_t addr);
+int xdp_tx(n2n_xdp_t *xdp, uint64_t addr, uint32_t len);
+void xdp_release(n2n_xdp_t *xdp, uint64_t addr);
+void xdp_flush(n2n_xdp_t *xdp);
+
+/* Shared memory */
+int shm_listen(const char *dir, const n2n_community_t community, const n2n_mac_t mac,
+               char *path, size_t path_len);
+n2n_shm_chan_t* shm_connect(const char *dir, const n2n_community_t community,
+                            const n2n_mac_t mac, const n2n_mac_t peer_mac);
+n2n_shm_chan_t* shm_accept(int listen_sock, const n2n_community_t community);
+void shm_close(n2n_shm_chan_t *chan);
+int shm_send(n2n_shm_chan_t *chan, const uint8_t *frame, size_t len);
+const uint8_t* shm_peek(n2n_shm_chan_t *chan, size_t *len);
+void shm_consume(n2n_shm_chan_t *chan);
+int shm_arm(n2n_shm_chan_t *chan);
+void shm_disarm(n2n_shm_chan_t *chan, int woken);
+
 /* Operations on peer_info lists. */
 size_t purge_peer_list( struct peer_info ** peer_list,
                         time_t purge_before );
 size_t clear_peer_list( struct peer_info ** peer_list );
 size_t purge_expired_registrations( struct peer_info ** peer_list, time_t* p_last_purge );
 
+/* Compact peer table */
+void peer_table_free(n2n_peer_table_t *table);
+n2n_peer_slot_t* peer_table_find(const n2n_peer_table_t *table, const n2n_mac_t mac);
+n2n_peer_slot_t* peer_table_add(n2n_peer_table_t *table, const n2n_mac_t mac, const n2n_sock_t *sock);
+void peer_table_del(n2n_peer_table_t *table, n2n_peer_slot_t *slot);
+size_t peer_table_purge(n2n_peer_table_t *table, time_t purge_before);
+void peer_table_set_sock(n2n_peer_table_t *table, n2n_peer_slot_t *slot, const n2n_sock_t *sock);
+#define peer_table_sock(table,slot) (&(table)->socks[(slot) - (table)->slots])
+void peer_table_share(n2n_peer_table_t *table, n2n_epoch_t *epoch);
+int peer_table_lookup(const n2n_peer_table_t *table, const n2n_mac_t mac, n2n_sock_t *sock);
+void epoch_init(n2n_epoch_t *epoch);
+void epoch_free(n2n_epoch_t *epoch);
+int epoch_register(n2n_epoch_t *epoch);
+void epoch_enter(n2n_epoch_t *epoch, int reader);
+void epoch_exit(n2n_epoch_t *epoch, int reader);
+void epoch_retire(n2n_epoch_t *epoch, void (*free_fn)(void *ptr), void *ptr);
+size_t epoch_reclaim(n2n_epoch_t *epoch);
+
+/* Forward error correction */
+uint8_t fec_group_size(uint8_t loss, uint8_t max_group);
+size_t fec_encode(n2n_fec_tx_t *tx, uint8_t max_group, uint8_t loss, uint8_t flags,
+                  uint8_t *body, size_t body_len, uint8_t *parity, size_t parity_size);
+size_t fec_decode(n2n_fec_rx_t *rx, const n2n_FEC_t *fec,
+                  const uint8_t *unit, size_t unit_len,
+                  uint8_t *out, size_t out_size, uint16_t *out_seq);
+void fec_rx_free(n2n_fec_rx_t *rx);
+
+/* Multipath */
+int path_schedule(n2n_path_t *paths, int num_paths, time_t now);
+int path_is_up(const n2n_path_t *path, time_t now);
+uint32_t path_probe_sent(n2n_path_t *path, uint32_t usec);
+void path_probe_acked(n2n_path_t *path, uint32_t seq, uint32_t usec, time_t now);
+void path_probe_update(n2n_path_t *path, uint32_t usec);
+int reorder_push(n2n_reorder_t *ro, uint16_t seq, const uint8_t *unit, size_t len,
+                 int hold, const n2n_sock_t *src, uint64_t usec);
+size_t reorder_pop(n2n_reorder_t *ro, uint64_t usec, const uint8_t **unit);
+void reorder_free(n2n_reorder_t *ro);
+
+/* Header compression */
+size_t hc_compress(n2n_hc_t *hc, const uint8_t *frame, size_t len,
+                   uint8_t *out, size_t out_size, time_t now);
+size_t hc_decompress(n2n_hc_t *hc, const uint8_t *in, size_t len,
+                     uint8_t *frame, size_t frame_size);
+
+/* Egress pacing */
+uint64_t parse_rate(const char *spec);
+int pacer_ready(n2n_pacer_t *pacer, uint64_t rate, uint64_t usec);
+void pacer_sent(n2n_pacer_t *pacer, size_t len);
+n2n_pace_slot_t* pacer_enqueue(n2n_pacer_t *pacer);
+n2n_pace_slot_t* pacer_head(n2n_pacer_t *pacer);
+void pacer_dequeue(n2n_pacer_t *pacer);
+uint64_t pacer_wait(const n2n_pacer_t *pacer, uint64_t rate);
+void pacer_free(n2n_pacer_t *pacer);
+
+/* Connected sockets */
+int conn_socks_init(n2n_conn_socks_t *cs, SOCKET main_sock, uint32_t pps);
+SOCKET conn_sock_lookup(n2n_conn_socks_t *cs, const struct sockaddr_in *dest);
+void conn_socks_update(n2n_conn_socks_t *cs, time_t now);
+void conn_sock_demote(n2n_conn_socks_t *cs, SOCKET sock);
+void conn_socks_free(n2n_conn_socks_t *cs);
+
+/* DSCP and ECN */
+uint8_t ecn_encap_tos(const uint8_t *frame, size_t len);
+int ecn_decap(uint8_t *frame, size_t len, uint8_t outer_tos);
+
 /* Edge conf */
 void edge_init_conf_defaults(n2n_edge_conf_t *conf);
 int edge_verify_conf(const n2n_edge_conf_t *conf);
@@ -29,6 +29,8 @@ typedef enum n2n_transform {
   N2N_TRANSFORM_ID_NULL = 1,
   N2N_TRANSFORM_ID_TWOFISH = 2,
   N2N_TRANSFORM_ID_AESCBC = 3,
+  N2N_TRANSFORM_ID_HC = 62,             /* The edge transform of a header compressed frame */
+  N2N_TRANSFORM_ID_FEC = 63,            /* n2n_FEC_t in front of one of the above */
 } n2n_transform_t;
 
 struct n2n_trans_op;
@@ -61,5 +63,25 @@ typedef struct n2n_trans_op {
   n2n_transform_f     rev;    /* decode a payload */
 } n2n_trans_op_t;
 
+/* Transform plugins: a shared object loaded with edge -j <file> exports an
+ * n2n_transop_plugin_t named N2N_TRANSOP_PLUGIN_SYMBOL. Its init() fills
+ * in the n2n_trans_op_t like the n2n_transop_*_init() of the built-in
+ * transforms do, with the transform_id of the plugin. The ABI version is
+ * bumped on any change to n2n_trans_op_t or to this struct: the edge only
+ * loads plugins built against the version it has. */
+#define N2N_TRANSOP_PLUGIN_ABI          1
+#define N2N_TRANSOP_PLUGIN_SYMBOL       "n2n_transop_plugin"
+
+typedef int             (*n2n_transop_plugin_init_f)( const char * key, /* -k, NULL if none */
+                                                      n2n_trans_op_t * ttt );
+
+typedef struct n2n_transop_plugin {
+  uint32_t                    abi_version;    /* N2N_TRANSOP_PLUGIN_ABI */
+  uint32_t                    trans_op_size;  /* sizeof(n2n_trans_op_t) */
+  const char *                name;
+  uint16_t                    transform_id;   /* N2N_TRANSFORM_ID_USER_START or above */
+  n2n_transop_plugin_init_f   init;           /* 0 on success */
+} n2n_transop_plugin_t;
+
 #endif /* #if !defined(N2N_TRANSFORMS_H_) */
 
@@ -42,6 +42,10 @@
 #define N2N_PKT_BUF_SIZE                2048
 #define N2N_SOCKBUF_SIZE                64      /* string representation of INET or INET6 sockets */
 
+/* Layout of the common header: version, ttl, flags then the community. */
+#define N2N_COMMON_COMMUNITY_OFFSET     4
+#define N2N_COMMON_SIZE                 (N2N_COMMON_COMMUNITY_OFFSET + N2N_COMMUNITY_SIZE)
+
 #define N2N_MULTICAST_PORT              1968
 #define N2N_MULTICAST_GROUP             "224.0.0.68"
 
@@ -63,9 +67,12 @@ typedef enum n2n_pc
     n2n_register_super_nak=7,   /* NAK from supernode to edge - registration refused */
     n2n_federation=8,           /* Not used by edge */
     n2n_peer_info=9,            /* Send info on a peer from sn to edge */
-    n2n_query_peer=10           /* ask supernode for info on a peer */
+    n2n_query_peer=10,          /* ask supernode for info on a peer */
+    n2n_peer_list=11,           /* Page of the active edges of a community from sn to edge */
+    n2n_path_probe=12           /* RTT and loss probe of one uplink, edge to edge */
 } n2n_pc_t;
 
+#define N2N_FLAGS_PEER_LIST             0x0100  /* REGISTER_SUPER asks for a PEER_LIST page */
 #define N2N_FLAGS_OPTIONS               0x0080
 #define N2N_FLAGS_SOCKET                0x0040
 #define N2N_FLAGS_FROM_SUPERNODE        0x0020
@@ -77,9 +84,26 @@ typedef enum n2n_pc
 #define IPV4_SIZE                       4
 #define IPV6_SIZE                       16
 
+/* Encoded sizes of the supernode replies with an IPv4 socket and no backup
+ * supernode. These have a fixed layout so they can be pre-encoded once and
+ * patched with the per-edge fields (see patch_REGISTER_SUPER_ACK). */
+#define N2N_SOCK_V4_SIZE                (2 + 2 + IPV4_SIZE)     /* flags, port, address */
+#define N2N_SOCK_V6_SIZE                (2 + 2 + IPV6_SIZE)
+#define N2N_REGISTER_SUPER_ACK_V4_SIZE  (N2N_COMMON_SIZE + N2N_COOKIE_SIZE + N2N_MAC_SIZE + 2 + N2N_SOCK_V4_SIZE + 1)
+#define N2N_REGISTER_SUPER_ACK_V6_SIZE  (N2N_COMMON_SIZE + N2N_COOKIE_SIZE + N2N_MAC_SIZE + 2 + N2N_SOCK_V6_SIZE + 1)
+#define N2N_PEER_INFO_V4_SIZE           (N2N_COMMON_SIZE + 2 + N2N_MAC_SIZE + N2N_SOCK_V4_SIZE)
+
+
+#define N2N_PEER_LIST_PAGE_SIZE         48      /* Entries of a PEER_LIST, fits the MTU with IPv6 sockets */
+
+#define N2N_FEC_HDR_SIZE                6       /* seq, group, index, loss, flags */
+#define N2N_FEC_MAX_GROUP               16      /* Data packets per parity packet */
 
 #define N2N_AUTH_TOKEN_SIZE             32      /* bytes */
 
+#define N2N_AUTH_SCHEME_NONE            0
+#define N2N_AUTH_SCHEME_SN_COOKIE       1       /* Echo of a supernode registration challenge */
+
 
 #define N2N_EUNKNOWN                    -1
 #define N2N_ENOTIMPL                    -2
@@ -143,6 +167,9 @@ typedef struct n2n_REGISTER_SUPER
     n2n_cookie_t        cookie;         /* Link REGISTER_SUPER and REGISTER_SUPER_ACK */
     n2n_mac_t           edgeMac;        /* MAC to register with edge sending socket */
     n2n_auth_t          auth;           /* Authentication scheme and tokens */
+    /* Only with N2N_FLAGS_PEER_LIST */
+    uint32_t            list_cursor;    /* Where the requested PEER_LIST page starts, 0 = first */
+    uint16_t            list_max;       /* Number of peers still wanted */
 } n2n_REGISTER_SUPER_t;
 
 /* Linked with n2n_register_super_ack in n2n_pc_t. Only from supernode to edge. */
@@ -165,10 +192,11 @@ typedef struct n2n_REGISTER_SUPER_ACK
 } n2n_REGISTER_SUPER_ACK_t;
 
 
-/* Linked with n2n_register_super_ack in n2n_pc_t. Only from supernode to edge. */
+/* Linked with n2n_register_super_nak in n2n_pc_t. Only from supernode to edge. */
 typedef struct n2n_REGISTER_SUPER_NAK
 {
     n2n_cookie_t        cookie;         /* Return cookie from REGISTER_SUPER */
+    n2n_auth_t          auth;           /* Challenge to echo in the next REGISTER_SUPER */
 } n2n_REGISTER_SUPER_NAK_t;
 
 typedef struct n2n_PEER_INFO
@@ -178,6 +206,48 @@ typedef struct n2n_PEER_INFO
     n2n_sock_t  sock;
 } n2n_PEER_INFO_t;
 
+typedef struct n2n_PEER_LIST_ENTRY
+{
+    n2n_mac_t   mac;
+    n2n_sock_t  sock;
+} n2n_PEER_LIST_ENTRY_t;
+
+/* Linked with n2n_peer_list in n2n_pc_t. Only from supernode to edge, in
+ * reply to a REGISTER_SUPER with N2N_FLAGS_PEER_LIST. */
+typedef struct n2n_PEER_LIST
+{
+    uint16_t                total;      /* Edges in the community, saturated */
+    uint32_t                cursor;     /* Cursor of the next page, 0 if this is the last one */
+    uint8_t                 count;
+    n2n_PEER_LIST_ENTRY_t   peers[N2N_PEER_LIST_PAGE_SIZE];
+} n2n_PEER_LIST_t;
+
+/* Header of the payload of a PACKET with transform N2N_TRANSFORM_ID_FEC.
+ * A data packet follows it with the real transform ID and payload (the
+ * unit), a parity packet with the XOR of the unit lengths and of the units
+ * of its group, zero-padded to the longest. */
+typedef struct n2n_FEC
+{
+    uint16_t    seq;            /* Data sequence, or first data sequence of the group for parity */
+    uint8_t     group;          /* Data packets in the group, 0 when no parity follows */
+    uint8_t     index;          /* Position in the group, equal to group for the parity */
+    uint8_t     loss;           /* Loss the sender measures from the receiver, in 1/256 */
+    uint8_t     flags;
+} n2n_FEC_t;
+
+#define N2N_FEC_FLAG_MULTIPATH          0x01    /* Sent over one of several paths, restore the order */
+
+/* Linked with n2n_path_probe in n2n_pc_t. Sent by an edge on one of its
+ * paths (-I) and echoed back by the peer to the address it came from. */
+typedef struct n2n_PATH_PROBE
+{
+    n2n_mac_t   srcMac;         /* Edge that probes */
+    n2n_mac_t   dstMac;         /* Peer that echoes */
+    uint8_t     path;           /* Index of the path probed */
+    uint8_t     echo;           /* 0 for the probe, 1 for the echo */
+    uint32_t    seq;
+} n2n_PATH_PROBE_t;
+
 typedef struct n2n_QUERY_PEER
 {
   n2n_mac_t           srcMac;
@@ -295,6 +365,17 @@ int decode_REGISTER_SUPER_ACK( n2n_REGISTER_SUPER_ACK_t * reg,
                                size_t * rem,
                                size_t * idx );
 
+int encode_REGISTER_SUPER_NAK( uint8_t * base,
+                               size_t * idx,
+                               const n2n_common_t * cmn,
+                               const n2n_REGISTER_SUPER_NAK_t * nak );
+
+int decode_REGISTER_SUPER_NAK( n2n_REGISTER_SUPER_NAK_t * nak,
+                               const n2n_common_t * cmn, /* info on how to interpret it */
+                               const uint8_t * base,
+                               size_t * rem,
+                               size_t * idx );
+
 int fill_sockaddr( struct sockaddr * addr,
                    size_t addrlen,
                    const n2n_sock_t * sock );
@@ -321,6 +402,46 @@ int decode_PEER_INFO( n2n_PEER_INFO_t * pkt,
                    size_t * rem,
                    size_t * idx );
 
+int patch_REGISTER_SUPER_ACK( uint8_t * base,
+                              const n2n_cookie_t cookie,
+                              const n2n_mac_t edgeMac,
+                              const n2n_sock_t * sock );
+
+int patch_PEER_INFO( uint8_t * base,
+                     const n2n_mac_t mac,
+                     const n2n_sock_t * sock );
+
+int encode_PEER_LIST( uint8_t * base,
+                      size_t * idx,
+                      const n2n_common_t * common,
+                      const n2n_PEER_LIST_t * pkt );
+
+int decode_PEER_LIST( n2n_PEER_LIST_t * pkt,
+                      const n2n_common_t * cmn, /* info on how to interpret it */
+                      const uint8_t * base,
+                      size_t * rem,
+                      size_t * idx );
+
+int encode_FEC( uint8_t * base,
+                size_t * idx,
+                const n2n_FEC_t * fec );
+
+int decode_FEC( n2n_FEC_t * fec,
+                const uint8_t * base,
+                size_t * rem,
+                size_t * idx );
+
+int encode_PATH_PROBE( uint8_t * base,
+                       size_t * idx,
+                       const n2n_common_t * common,
+                       const n2n_PATH_PROBE_t * pkt );
+
+int decode_PATH_PROBE( n2n_PATH_PROBE_t * pkt,
+                       const n2n_common_t * cmn, /* info on how to interpret it */
+                       const uint8_t * base,
+                       size_t * rem,
+                       size_t * idx );
+
 int encode_QUERY_PEER( uint8_t * base,
                    size_t * idx,
                    const n2n_common_t * common,
@@ -0,0 +1,149 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Egress pacing.
+ *
+ * The TAP hands over the bursts of the inner flows at the speed of the host,
+ * and sent as they come they overflow the shallow buffers of home routers
+ * and NATs on the path. A token bucket per peer, only N2N_PACE_BURST_USEC
+ * deep, spaces the datagrams out at the configured rate; the ones that find
+ * it empty wait in a short queue that the edge loop drains as the tokens
+ * come back. A full queue drops, which inner TCP takes as the congestion
+ * signal it is.
+ */
+
+#include "n2n.h"
+
+/* ************************************** */
+
+/** Parse a rate in bit/s with an optional k, m or g suffix (powers of
+ *  1000), eg. "20m". Returns bytes/s, 0 when invalid. */
+uint64_t parse_rate(const char *spec) {
+  char *end;
+  double rate;
+
+  if(spec == NULL)
+    return(0);
+
+  rate = strtod(spec, &end);
+
+  switch(*end) {
+  case 'k': case 'K': rate *= 1e3; end++; break;
+  case 'm': case 'M': rate *= 1e6; end++; break;
+  case 'g': case 'G': rate *= 1e9; end++; break;
+  }
+
+  if((*end != '\0') || (rate < 8000) || (rate > 1e11)) {
+    traceEvent(TRACE_WARNING, "Invalid rate '%s': expecting 8k to 100g bit/s", spec);
+    return(0);
+  }
+
+  return((uint64_t)(rate / 8));
+}
+
+/* ************************************** */
+
+static int64_t pacer_burst(uint64_t rate) {
+  int64_t burst = rate * N2N_PACE_BURST_USEC / 1000000;
+
+  /* At low rates still let a full size datagram through in one go */
+  return((burst < N2N_PKT_BUF_SIZE) ? N2N_PKT_BUF_SIZE : burst);
+}
+
+/* ************************************** */
+
+/** Refill the bucket for the time elapsed until usec and tell whether a
+ *  datagram may leave now. */
+int pacer_ready(n2n_pacer_t *pacer, uint64_t rate, uint64_t usec) {
+  int64_t burst = pacer_burst(rate);
+
+  if(pacer->last_usec == 0)
+    pacer->tokens = burst;
+  else if(usec > pacer->last_usec) {
+    pacer->tokens += (usec - pacer->last_usec) * rate / 1000000;
+
+    if(pacer->tokens > burst)
+      pacer->tokens = burst;
+  }
+
+  pacer->last_usec = usec;
+
+  return(pacer->tokens > 0);
+}
+
+/* ************************************** */
+
+/** Account a datagram sent after pacer_ready(). The bucket can go into debt
+ *  by one datagram, which keeps large datagrams from waiting for more than
+ *  the bucket holds. */
+void pacer_sent(n2n_pacer_t *pacer, size_t len) {
+  pacer->tokens -= len;
+}
+
+/* ************************************** */
+
+/** Slot at the tail of the queue for the caller to fill, NULL when full. */
+n2n_pace_slot_t* pacer_enqueue(n2n_pacer_t *pacer) {
+  n2n_pace_slot_t *slot;
+
+  if(pacer->count == N2N_PACE_QUEUE)
+    return(NULL);
+
+  if((pacer->slots == NULL)
+     && ((pacer->slots = (n2n_pace_slot_t*)malloc(N2N_PACE_QUEUE * sizeof(n2n_pace_slot_t))) == NULL))
+    return(NULL);
+
+  slot = &pacer->slots[(pacer->head + pacer->count) % N2N_PACE_QUEUE];
+  pacer->count++;
+
+  return(slot);
+}
+
+/* ************************************** */
+
+/** Oldest queued datagram, NULL if none. */
+n2n_pace_slot_t* pacer_head(n2n_pacer_t *pacer) {
+  return(pacer->count ? &pacer->slots[pacer->head] : NULL);
+}
+
+/* ************************************** */
+
+void pacer_dequeue(n2n_pacer_t *pacer) {
+  if(pacer->count == 0)
+    return;
+
+  pacer->head = (pacer->head + 1) % N2N_PACE_QUEUE;
+  pacer->count--;
+}
+
+/* ************************************** */
+
+/** Microseconds until the bucket lets the next datagram go, at least 1. */
+uint64_t pacer_wait(const n2n_pacer_t *pacer, uint64_t rate) {
+  uint64_t debt = (pacer->tokens > 0) ? 0 : (uint64_t)(1 - pacer->tokens);
+
+  return(debt * 1000000 / rate + 1);
+}
+
+/* ************************************** */
+
+void pacer_free(n2n_pacer_t *pacer) {
+  free(pacer->slots);
+  pacer->slots = NULL;
+  pacer->head = pacer->count = 0;
+}
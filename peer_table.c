@@ -0,0 +1,484 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Compact peer table.
+ *
+ * Linear probing over an array of 16-byte slots, kept at most 3/4 full and,
+ * after a purge, at least 1/8 full.
+ * Deletion shifts the following entries of the cluster back instead of
+ * leaving tombstones, so lookups never scan more than the cluster of their
+ * home slot and the purge scan sees every live entry exactly once.
+ *
+ * One owner thread writes the table. Once shared with peer_table_share(),
+ * other threads may read it without locks through peer_table_lookup(): the
+ * owner makes the sequence number odd while it moves entries around,
+ * readers copy what they probed and retry if the sequence changed under
+ * them. A resize publishes new arrays and hands the old ones to the epoch
+ * reclamation below, so a reader still probing them never touches freed
+ * memory. last_seen is updated in place without touching the sequence,
+ * readers do not look at it.
+ *
+ * The daemons only read their tables from the owner thread and do not
+ * share them: their writes skip the sequence and its fences. */
+
+#include "n2n.h"
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#ifdef __GNUC__
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define load_relaxed(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_release(p,v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define store_relaxed(p,v)  __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define fetch_add(p,v)      __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define fence_acquire()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fence_release()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#define fence_full()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+/* Without the GCC atomic builtins only the owner thread may use a table. */
+#define load_acquire(p)     (*(p))
+#define load_relaxed(p)     (*(p))
+#define store_release(p,v)  (*(p) = (v))
+#define store_relaxed(p,v)  (*(p) = (v))
+#define fetch_add(p,v)      ((*(p) += (v)) - (v))
+#define fence_acquire()
+#define fence_release()
+#define fence_full()
+#endif
+
+/* ************************************** */
+
+void epoch_init(n2n_epoch_t *epoch) {
+  memset(epoch, 0, sizeof(*epoch));
+  epoch->global = 1;
+}
+
+/** Free everything retired so far. No reader may be active. */
+void epoch_free(n2n_epoch_t *epoch) {
+  size_t i;
+
+  for(i = 0; i < epoch->num_garbage; i++)
+    epoch->garbage[i].free_fn(epoch->garbage[i].ptr);
+
+  free(epoch->garbage);
+  epoch->garbage = NULL;
+  epoch->num_garbage = epoch->max_garbage = 0;
+}
+
+/** Return the reader id for the calling thread, -1 if all are taken. */
+int epoch_register(n2n_epoch_t *epoch) {
+  uint32_t reader = fetch_add(&epoch->num_readers, 1);
+
+  if(reader >= N2N_EPOCH_MAX_READERS) {
+    traceEvent(TRACE_ERROR, "Too many epoch readers, max is %u", N2N_EPOCH_MAX_READERS);
+    return(-1);
+  }
+
+  return((int)reader);
+}
+
+void epoch_enter(n2n_epoch_t *epoch, int reader) {
+  store_relaxed(&epoch->readers[reader].epoch, load_acquire(&epoch->global));
+  /* Pairs with the fence in epoch_oldest(): either the writer sees us here or
+   * we see everything it unpublished before scanning. */
+  fence_full();
+}
+
+void epoch_exit(n2n_epoch_t *epoch, int reader) {
+  store_release(&epoch->readers[reader].epoch, 0);
+}
+
+/* Oldest epoch a reader is still in, or the current one if none is. */
+static uint64_t epoch_oldest(n2n_epoch_t *epoch) {
+  uint64_t oldest = load_relaxed(&epoch->global);
+  uint32_t num = load_acquire(&epoch->num_readers);
+  uint32_t i;
+
+  fence_full();
+
+  if(num > N2N_EPOCH_MAX_READERS)
+    num = N2N_EPOCH_MAX_READERS;
+
+  for(i = 0; i < num; i++) {
+    uint64_t seen = load_acquire(&epoch->readers[i].epoch);
+
+    if(seen && (seen < oldest))
+      oldest = seen;
+  }
+
+  return(oldest);
+}
+
+/** Free ptr with free_fn once no reader can reach it any more. It must
+ *  already be unpublished. */
+void epoch_retire(n2n_epoch_t *epoch, void (*free_fn)(void *ptr), void *ptr) {
+  uint64_t now = epoch->global;
+
+  if(epoch->num_garbage == epoch->max_garbage) {
+    size_t size = epoch->max_garbage ? epoch->max_garbage * 2 : 16;
+    n2n_epoch_garbage_t *garbage = realloc(epoch->garbage, size * sizeof(n2n_epoch_garbage_t));
+
+    if(!garbage) {
+      /* Out of memory: wait for the readers instead of deferring. */
+      store_release(&epoch->global, now + 1);
+      while(epoch_oldest(epoch) <= now)
+        ;
+      free_fn(ptr);
+      return;
+    }
+
+    epoch->garbage = garbage;
+    epoch->max_garbage = size;
+  }
+
+  epoch->garbage[epoch->num_garbage].ptr = ptr;
+  epoch->garbage[epoch->num_garbage].free_fn = free_fn;
+  epoch->garbage[epoch->num_garbage].epoch = now;
+  epoch->num_garbage++;
+
+  /* Readers entering from now on cannot find ptr. */
+  store_release(&epoch->global, now + 1);
+}
+
+/** Free what every reader has moved past and return how many. */
+size_t epoch_reclaim(n2n_epoch_t *epoch) {
+  uint64_t oldest;
+  size_t i, kept = 0;
+
+  if(!epoch->num_garbage)
+    return(0);
+
+  oldest = epoch_oldest(epoch);
+
+  for(i = 0; i < epoch->num_garbage; i++) {
+    if(epoch->garbage[i].epoch < oldest)
+      epoch->garbage[i].free_fn(epoch->garbage[i].ptr);
+    else
+      epoch->garbage[kept++] = epoch->garbage[i];
+  }
+
+  i = epoch->num_garbage - kept;
+  epoch->num_garbage = kept;
+
+  return(i);
+}
+
+/* ************************************** */
+
+static uint32_t peer_table_hash(const n2n_mac_t mac) {
+  uint32_t h;
+
+  /* The vendor part of the MAC is shared by many edges, mix in the rest. */
+  h = ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+  h ^= ((uint32_t)mac[0] << 8) | mac[1];
+  h *= 0x9E3779B1;
+
+  return(h ^ (h >> 16));
+}
+
+static void slot_set_sock(n2n_peer_slot_t *slot, const n2n_sock_t *sock) {
+  slot->port = sock->port;
+
+  if(sock->family == AF_INET)
+    memcpy(&slot->addr, sock->addr.v4, IPV4_SIZE);
+  else
+    slot->addr = 0;
+}
+
+/* ************************************** */
+
+static void peer_table_write_begin(n2n_peer_table_t *table) {
+  if(!table->epoch)
+    return; /* No reader to keep out */
+
+  store_relaxed(&table->seq, table->seq + 1);
+  fence_release();
+}
+
+static void peer_table_write_end(n2n_peer_table_t *table) {
+  if(table->epoch)
+    store_release(&table->seq, table->seq + 1);
+}
+
+static void peer_version_free(void *ptr) {
+  n2n_peer_version_t *version = (n2n_peer_version_t*)ptr;
+
+  free(version->slots);
+  free(version->socks);
+  free(version);
+}
+
+static void peer_table_retire(n2n_peer_table_t *table, n2n_peer_version_t *version) {
+  if(table->epoch) {
+    epoch_retire(table->epoch, peer_version_free, version);
+    epoch_reclaim(table->epoch);
+  } else
+    peer_version_free(version);
+}
+
+static int peer_table_resize(n2n_peer_table_t *table, uint32_t size) {
+  n2n_peer_version_t *version = calloc(1, sizeof(n2n_peer_version_t));
+  n2n_peer_slot_t *slots = calloc(size, sizeof(n2n_peer_slot_t));
+  n2n_sock_t *socks = calloc(size, sizeof(n2n_sock_t));
+  n2n_peer_version_t *old = table->version;
+  uint32_t i;
+
+  if(!version || !slots || !socks) {
+    free(version);
+    free(slots);
+    free(socks);
+    return(-1);
+  }
+
+  if(table->slots) {
+    for(i = 0; i <= table->mask; i++) {
+      uint32_t j;
+
+      if(table->slots[i].port == 0)
+        continue;
+
+      j = peer_table_hash(table->slots[i].mac_addr) & (size - 1);
+      while(slots[j].port != 0)
+        j = (j + 1) & (size - 1);
+
+      slots[j] = table->slots[i];
+      socks[j] = table->socks[i];
+    }
+  }
+
+  version->slots = slots;
+  version->socks = socks;
+  version->mask = size - 1;
+
+  table->slots = slots;
+  table->socks = socks;
+  table->mask = size - 1;
+  store_release(&table->version, version);
+
+  if(old)
+    peer_table_retire(table, old);
+
+  return(0);
+}
+
+void peer_table_free(n2n_peer_table_t *table) {
+  n2n_peer_version_t *version = table->version;
+
+  peer_table_write_begin(table);
+  store_release(&table->version, NULL);
+  table->slots = NULL;
+  table->socks = NULL;
+  table->mask = 0;
+  table->count = 0;
+  peer_table_write_end(table);
+
+  if(version)
+    peer_table_retire(table, version);
+}
+
+/** Let other threads read the table with peer_table_lookup(). Arrays the
+ *  table replaces are retired to epoch from now on. Must be called before
+ *  any reader starts. */
+void peer_table_share(n2n_peer_table_t *table, n2n_epoch_t *epoch) {
+  table->epoch = epoch;
+}
+
+/* ************************************** */
+
+n2n_peer_slot_t* peer_table_find(const n2n_peer_table_t *table, const n2n_mac_t mac) {
+  uint32_t i;
+
+  if(!table->count)
+    return(NULL);
+
+  i = peer_table_hash(mac) & table->mask;
+
+  while(table->slots[i].port != 0) {
+    if(memcmp(table->slots[i].mac_addr, mac, N2N_MAC_SIZE) == 0)
+      return(&table->slots[i]);
+
+    i = (i + 1) & table->mask;
+  }
+
+  return(NULL);
+}
+
+/** Look up mac from a thread other than the owner, inside epoch_enter() and
+ *  epoch_exit() on the epoch the table is shared with. Copies the socket
+ *  of the peer to sock and returns 1 if found, 0 if not. */
+int peer_table_lookup(const n2n_peer_table_t *table, const n2n_mac_t mac, n2n_sock_t *sock) {
+  uint32_t hash = peer_table_hash(mac);
+  uint32_t spins = 0;
+
+  for(;;) {
+    uint32_t seq = load_acquire(&table->seq);
+    const n2n_peer_version_t *version;
+    uint32_t i, n;
+    int found = 0;
+
+    if(seq & 1) {
+      /* The owner is moving entries, wait for it. */
+#ifndef WIN32
+      if(++spins == 1024) {
+        spins = 0;
+        sched_yield(); /* It may have been preempted. */
+      }
+#endif
+      continue;
+    }
+
+    version = load_acquire(&table->version);
+    if(!version)
+      return(0);
+
+    /* Bound the probe, a racing writer may fill slots as we pass them. */
+    i = hash & version->mask;
+    for(n = 0; n <= version->mask; n++) {
+      n2n_peer_slot_t slot;
+
+      memcpy(&slot, &version->slots[i], sizeof(slot));
+      if(slot.port == 0)
+        break;
+
+      if(memcmp(slot.mac_addr, mac, N2N_MAC_SIZE) == 0) {
+        memcpy(sock, &version->socks[i], sizeof(n2n_sock_t));
+        found = 1;
+        break;
+      }
+
+      i = (i + 1) & version->mask;
+    }
+
+    fence_acquire();
+    if(load_relaxed(&table->seq) == seq)
+      return(found);
+  }
+}
+
+/** Insert a peer that is not in the table yet. Returns NULL if the table
+ *  cannot grow or the socket has no port. */
+n2n_peer_slot_t* peer_table_add(n2n_peer_table_t *table, const n2n_mac_t mac, const n2n_sock_t *sock) {
+  uint32_t i;
+
+  if(sock->port == 0)
+    return(NULL);
+
+  peer_table_write_begin(table);
+
+  if(!table->slots || ((table->count + 1) * 4 > (table->mask + 1) * 3)) {
+    uint32_t size = table->slots ? (table->mask + 1) * 2 : N2N_PEER_TABLE_MIN_SIZE;
+
+    if(peer_table_resize(table, size) != 0) {
+      peer_table_write_end(table);
+      return(NULL);
+    }
+  }
+
+  i = peer_table_hash(mac) & table->mask;
+  while(table->slots[i].port != 0)
+    i = (i + 1) & table->mask;
+
+  memcpy(table->slots[i].mac_addr, mac, N2N_MAC_SIZE);
+  slot_set_sock(&table->slots[i], sock);
+  table->slots[i].last_seen = 0;
+  table->socks[i] = *sock;
+  table->count++;
+
+  peer_table_write_end(table);
+
+  return(&table->slots[i]);
+}
+
+void peer_table_set_sock(n2n_peer_table_t *table, n2n_peer_slot_t *slot, const n2n_sock_t *sock) {
+  if(sock->port == 0)
+    return;
+
+  peer_table_write_begin(table);
+  slot_set_sock(slot, sock);
+  *peer_table_sock(table, slot) = *sock;
+  peer_table_write_end(table);
+}
+
+/** Remove the entry at slot. Entries further along the cluster move back,
+ *  so slot may hold a different peer afterwards. */
+void peer_table_del(n2n_peer_table_t *table, n2n_peer_slot_t *slot) {
+  uint32_t hole = slot - table->slots;
+  uint32_t i = hole;
+
+  peer_table_write_begin(table);
+
+  for(;;) {
+    uint32_t home;
+
+    i = (i + 1) & table->mask;
+    if(table->slots[i].port == 0)
+      break;
+
+    /* Only move entries whose home is not in (hole, i]. */
+    home = peer_table_hash(table->slots[i].mac_addr) & table->mask;
+    if(((i - home) & table->mask) < ((i - hole) & table->mask))
+      continue;
+
+    table->slots[hole] = table->slots[i];
+    table->socks[hole] = table->socks[i];
+    hole = i;
+  }
+
+  memset(&table->slots[hole], 0, sizeof(n2n_peer_slot_t));
+  table->count--;
+
+  peer_table_write_end(table);
+}
+
+/** Remove the peers not seen since purge_before and return how many. */
+size_t peer_table_purge(n2n_peer_table_t *table, time_t purge_before) {
+  uint32_t before = (uint32_t)purge_before;
+  uint32_t i = 0;
+  size_t retval = 0;
+
+  if(!table->count)
+    return(0);
+
+  while(i <= table->mask) {
+    n2n_peer_slot_t *slot = &table->slots[i];
+
+    /* Free and live slots alternate at random, test both without a branch:
+     * the sign bit says expired, a free slot has a zero port. */
+    if(((slot->last_seen - before) >> 31) & (slot->port != 0)) {
+      /* Re-check the slot, the next entry of the cluster may have moved in. */
+      peer_table_del(table, slot);
+      retval++;
+    } else
+      i++;
+  }
+
+  /* Give the memory back after mass departures, readers switch over to the
+   * smaller arrays at their next lookup. */
+  if((table->mask + 1 > N2N_PEER_TABLE_MIN_SIZE) && (table->count * 8 < table->mask + 1)) {
+    uint32_t size = table->mask + 1;
+
+    while((size > N2N_PEER_TABLE_MIN_SIZE) && (table->count * 8 < size))
+      size /= 2;
+
+    peer_table_resize(table, size);
+  } else if(table->epoch)
+    epoch_reclaim(table->epoch);
+
+  return(retval);
+}
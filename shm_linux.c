@@ -0,0 +1,404 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Shared-memory channels between edges running on the same host.
+ *
+ * Every edge listens on a Unix socket named after its community and MAC in a
+ * rendezvous directory. An edge with a frame for a MAC whose socket exists
+ * connects to it and passes a memfd holding one single-producer ring per
+ * direction, plus an eventfd per direction. Frames are then copied once into
+ * the ring and written to the TAP device straight from it. The eventfds are
+ * only signalled when the receiver is about to sleep, so a busy channel runs
+ * without any system call. The Unix connection carries nothing else and is
+ * only watched to notice when the peer goes away.
+ *
+ * The socket is reachable by any local user, so the accepting edge trusts
+ * nothing it is sent: the memfd must have the size of the rings and be
+ * sealed against resizing (a truncated mapping faults on access), the
+ * eventfds are made non-blocking and the hello must come right away. */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* accept4 */
+#endif
+
+#include "n2n.h"
+
+#ifdef N2N_HAVE_SHM
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS     1033
+#define F_GET_SEALS     1034
+#define F_SEAL_SEAL     0x0001
+#define F_SEAL_SHRINK   0x0002
+#define F_SEAL_GROW     0x0004
+#endif
+
+#define N2N_SHM_MAGIC           "N2NS"
+#define N2N_SHM_VERSION         1
+#define N2N_SHM_HELLO_SIZE      (4 + 4 + N2N_COMMUNITY_SIZE + N2N_MAC_SIZE)
+#define N2N_SHM_MAP_SIZE        (2 * sizeof(n2n_shm_ring_t))
+#define N2N_SHM_HELLO_MSEC      100     /* Wait for the hello of a connecting edge */
+
+/* *************************************************** */
+
+/** Unix socket of the edge with <mac> in <community>. Characters that cannot
+ *  be part of a file name are replaced. */
+static int shm_sock_path(char *path, size_t len, const char *dir,
+			 const n2n_community_t community, const n2n_mac_t mac) {
+  char name[N2N_COMMUNITY_SIZE];
+  int i;
+
+  for(i=0; (i<N2N_COMMUNITY_SIZE-1) && community[i]; i++)
+    name[i] = (isalnum(community[i]) || (community[i] == '-')) ? community[i] : '_';
+  name[i] = '\0';
+
+  return(snprintf(path, len, "%s/%s-%02x%02x%02x%02x%02x%02x.sock", dir, name,
+		  mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]) >= (int)len ? -1 : 0);
+}
+
+static n2n_shm_chan_t* shm_chan_new(const n2n_mac_t peer_mac) {
+  n2n_shm_chan_t *chan = calloc(1, sizeof(n2n_shm_chan_t));
+
+  if(chan != NULL) {
+    memcpy(chan->peer_mac, peer_mac, N2N_MAC_SIZE);
+    chan->sock = chan->tx_event = chan->rx_event = -1;
+  }
+
+  return(chan);
+}
+
+/** Map the rings. The edge that connects sends on ring 0. */
+static int shm_chan_map(n2n_shm_chan_t *chan, int memfd, int initiator) {
+  n2n_shm_ring_t *rings;
+
+  chan->map_len = N2N_SHM_MAP_SIZE;
+  chan->map = mmap(NULL, chan->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+  if(chan->map == MAP_FAILED) {
+    chan->map = NULL;
+    traceEvent(TRACE_WARNING, "Unable to map shared-memory rings [%s]", strerror(errno));
+    return(-1);
+  }
+
+  rings = (n2n_shm_ring_t *)chan->map;
+  chan->initiator = initiator;
+  chan->tx = &rings[initiator ? 0 : 1];
+  chan->rx = &rings[initiator ? 1 : 0];
+
+  return(0);
+}
+
+/* *************************************************** */
+
+/** Listen for local edges of <community> willing to reach <mac>. Returns the
+ *  socket, its path is written to <path>. */
+int shm_listen(const char *dir, const n2n_community_t community, const n2n_mac_t mac,
+	       char *path, size_t path_len) {
+  struct sockaddr_un addr;
+  int sock;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if((shm_sock_path(path, path_len, dir, community, mac) < 0)
+     || (strlen(path) >= sizeof(addr.sun_path))) {
+    traceEvent(TRACE_ERROR, "Shared-memory socket path too long in %s", dir);
+    return(-1);
+  }
+
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+
+  if((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    return(-1);
+
+  /* A stale socket of a previous run with the same MAC */
+  unlink(path);
+
+  /* Access is controlled by the permissions of <dir>: the socket itself must
+   * stay reachable once the edges have dropped their privileges. */
+  if((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+     || (chmod(path, 0666) < 0)
+     || (listen(sock, 8) < 0)) {
+    traceEvent(TRACE_ERROR, "Unable to listen on %s [%s]", path, strerror(errno));
+    close(sock);
+    return(-1);
+  }
+
+  return(sock);
+}
+
+/** Open a channel to the local edge with <peer_mac>, if there is one. */
+n2n_shm_chan_t* shm_connect(const char *dir, const n2n_community_t community,
+			    const n2n_mac_t mac, const n2n_mac_t peer_mac) {
+  n2n_shm_chan_t *chan;
+  struct sockaddr_un addr;
+  uint8_t hello[N2N_SHM_HELLO_SIZE];
+  int fds[3] = { -1, -1, -1 };
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if((shm_sock_path(addr.sun_path, sizeof(addr.sun_path), dir, community, peer_mac) < 0)
+     || (access(addr.sun_path, F_OK) != 0))
+    return(NULL); /* not on this host */
+
+  if((chan = shm_chan_new(peer_mac)) == NULL)
+    return(NULL);
+
+  if(((chan->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+     || (connect(chan->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0))
+    goto fail;
+
+  if(((fds[0] = syscall(__NR_memfd_create, "n2n-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+     || (ftruncate(fds[0], N2N_SHM_MAP_SIZE) < 0)
+     || (fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+     || ((fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+     || ((fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+     || (shm_chan_map(chan, fds[0], 1) < 0)) {
+    traceEvent(TRACE_WARNING, "Unable to create shared-memory rings [%s]", strerror(errno));
+    goto fail;
+  }
+
+  memcpy(&hello[0], N2N_SHM_MAGIC, 4);
+  memset(&hello[4], 0, 4);
+  hello[4] = N2N_SHM_VERSION;
+  memcpy(&hello[8], community, N2N_COMMUNITY_SIZE);
+  memcpy(&hello[8 + N2N_COMMUNITY_SIZE], mac, N2N_MAC_SIZE);
+
+  /* fds[1] wakes up the peer, fds[2] wakes us up */
+  iov.iov_base = hello;
+  iov.iov_len = sizeof(hello);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if(sendmsg(chan->sock, &msg, MSG_NOSIGNAL) != sizeof(hello))
+    goto fail;
+
+  close(fds[0]);
+  chan->tx_event = fds[1];
+  chan->rx_event = fds[2];
+
+  return(chan);
+
+ fail:
+  if(fds[0] >= 0) close(fds[0]);
+  if(fds[1] >= 0) close(fds[1]);
+  if(fds[2] >= 0) close(fds[2]);
+  shm_close(chan);
+  return(NULL);
+}
+
+/** Whether the memfd of the peer can be mapped safely: the size of the rings,
+ *  which it cannot change any more. */
+static int shm_memfd_valid(int memfd) {
+  struct stat st;
+  int seals;
+
+  if((fstat(memfd, &st) < 0) || (st.st_size != (off_t)N2N_SHM_MAP_SIZE))
+    return(0);
+
+  seals = fcntl(memfd, F_GET_SEALS);
+
+  return((seals >= 0) && ((seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW)));
+}
+
+/** Accept a channel from a local edge of <community>. */
+n2n_shm_chan_t* shm_accept(int listen_sock, const n2n_community_t community) {
+  n2n_shm_chan_t *chan = NULL;
+  uint8_t hello[N2N_SHM_HELLO_SIZE];
+  int sock, fds[3] = { -1, -1, -1 }, num_fds = 0, i;
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct timeval wait = { 0, N2N_SHM_HELLO_MSEC * 1000 };
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  ssize_t len;
+
+  if((sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    return(NULL);
+
+  /* The edge loop waits for the hello: a client that sends nothing must not
+   * hold it up for long */
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+  iov.iov_base = hello;
+  iov.iov_len = sizeof(hello);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+  /* Take every descriptor passed, however it was split, so that none leaks;
+   * the ones that did not fit in cbuf were closed by the kernel. */
+  for(cmsg = (len < 0) ? NULL : CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+      int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), fd;
+
+      for(i=0; i<n; i++) {
+	memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+	if(num_fds < 3)
+	  fds[num_fds++] = fd;
+	else
+	  close(fd);
+      }
+    }
+  }
+
+  if((len != sizeof(hello)) || (num_fds != 3) || (msg.msg_flags & MSG_CTRUNC)
+     || memcmp(&hello[0], N2N_SHM_MAGIC, 4) || (hello[4] != N2N_SHM_VERSION)
+     || memcmp(&hello[8], community, N2N_COMMUNITY_SIZE)
+     || !shm_memfd_valid(fds[0])
+     || (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0)
+     || (fcntl(fds[2], F_SETFL, O_NONBLOCK) < 0)) {
+    traceEvent(TRACE_WARNING, "Rejected invalid shared-memory channel");
+    goto fail;
+  }
+
+  if(((chan = shm_chan_new(&hello[8 + N2N_COMMUNITY_SIZE])) == NULL)
+     || (shm_chan_map(chan, fds[0], 0) < 0))
+    goto fail;
+
+  close(fds[0]);
+  chan->sock = sock;
+  chan->tx_event = fds[2];
+  chan->rx_event = fds[1];
+
+  return(chan);
+
+ fail:
+  if(fds[0] >= 0) close(fds[0]);
+  if(fds[1] >= 0) close(fds[1]);
+  if(fds[2] >= 0) close(fds[2]);
+  if(chan) shm_close(chan);
+  else close(sock);
+  return(NULL);
+}
+
+void shm_close(n2n_shm_chan_t *chan) {
+  if(chan->map != NULL) munmap(chan->map, chan->map_len);
+  if(chan->sock >= 0) close(chan->sock);
+  if(chan->tx_event >= 0) close(chan->tx_event);
+  if(chan->rx_event >= 0) close(chan->rx_event);
+  free(chan);
+}
+
+/* *************************************************** */
+
+/** Copy a frame into the ring. Returns -1 if it does not fit. */
+int shm_send(n2n_shm_chan_t *chan, const uint8_t *frame, size_t len) {
+  n2n_shm_ring_t *ring = chan->tx;
+  uint32_t head = ring->head;
+  n2n_shm_slot_t *slot;
+
+  if((len > N2N_SHM_FRAME_SIZE)
+     || ((head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) >= N2N_SHM_RING_SLOTS)) {
+    chan->tx_full++;
+    return(-1);
+  }
+
+  slot = &ring->slot[head & (N2N_SHM_RING_SLOTS - 1)];
+  slot->len = len;
+  memcpy(slot->data, frame, len);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  chan->tx_frames++;
+
+  /* Pairs with the fence in shm_arm(): either the receiver sees the frame or
+   * we see that it is going to sleep. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&ring->need_wakeup, __ATOMIC_RELAXED)) {
+    uint64_t one = 1;
+
+    if(write(chan->tx_event, &one, sizeof(one)) < 0)
+      traceEvent(TRACE_DEBUG, "shared-memory wakeup failed [%s]", strerror(errno));
+  }
+
+  return(0);
+}
+
+/** Next received frame, in place in the ring, or NULL. It must be released
+ *  with shm_consume() once used. */
+const uint8_t* shm_peek(n2n_shm_chan_t *chan, size_t *len) {
+  n2n_shm_ring_t *ring = chan->rx;
+  const n2n_shm_slot_t *slot;
+  uint32_t tail = ring->tail;
+
+  if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+    return(NULL);
+
+  slot = &ring->slot[tail & (N2N_SHM_RING_SLOTS - 1)];
+  *len = (slot->len > N2N_SHM_FRAME_SIZE) ? N2N_SHM_FRAME_SIZE : slot->len;
+
+  return(slot->data);
+}
+
+void shm_consume(n2n_shm_chan_t *chan) {
+  __atomic_store_n(&chan->rx->tail, chan->rx->tail + 1, __ATOMIC_RELEASE);
+  chan->rx_frames++;
+}
+
+/** Ask to be woken up through rx_event before sleeping. Returns 1 if frames
+ *  are already waiting, in which case the caller must not sleep. */
+int shm_arm(n2n_shm_chan_t *chan) {
+  n2n_shm_ring_t *ring = chan->rx;
+
+  __atomic_store_n(&ring->need_wakeup, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail);
+}
+
+/** Stop the wakeups. If <woken>, rx_event was signalled and is cleared. */
+void shm_disarm(n2n_shm_chan_t *chan, int woken) {
+  uint64_t count;
+
+  __atomic_store_n(&chan->rx->need_wakeup, 0, __ATOMIC_RELAXED);
+
+  if(woken && (read(chan->rx_event, &count, sizeof(count)) < 0))
+    traceEvent(TRACE_DEBUG, "shared-memory wakeup read failed [%s]", strerror(errno));
+}
+
+#endif /* N2N_HAVE_SHM */
@@ -18,45 +18,253 @@
 
 /* Supernode for n2n-2.x */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sendmmsg */
+#endif
+
 #include "n2n.h"
 
 #ifdef WIN32
 #include <signal.h>
 #endif
 
+#ifdef __linux__
+#define N2N_SN_HAVE_WORKERS
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+
 #define N2N_SN_LPORT_DEFAULT 7654
 #define N2N_SN_PKTBUF_SIZE   2048
 
 #define N2N_SN_MGMT_PORT                5645
 
+/* Sizing of the allowed communities bloom filter */
+#define N2N_SN_FILTER_MIN_BITS          1024
+#define N2N_SN_FILTER_BITS_PER_ENTRY    16     /* ~0.2% false positives with 4 hashes */
+#define N2N_SN_FILTER_HASHES            4
+
+/* Registration challenge (stateless cookie) */
+#define N2N_SN_CHALLENGE_KEY_SIZE       16
+#define N2N_SN_CHALLENGE_TOKEN_SIZE     8
+#define N2N_SN_CHALLENGE_ROTATE         30     /* Seconds between secret rotations */
+
+/* Receive bursts and batched control replies */
+#ifdef WIN32
+#define N2N_SN_RX_BURST                 1      /* recvfrom() blocks on Windows */
+#else
+#define N2N_SN_RX_BURST                 32     /* Datagrams read per select() wakeup */
+#endif
+#define N2N_SN_TX_BATCH                 32
+#define N2N_SN_TX_BATCH_BUF             64     /* Fits REGISTER_SUPER_ACK and PEER_INFO */
+
+/* Per-source rate limiting (count-min sketch, one second windows) */
+#define N2N_SN_RATE_DEPTH               4
+#define N2N_SN_RATE_WIDTH               4096   /* Cells per row, power of two */
+#define N2N_SN_RATE_IP_SHARE            64     /* Default budget of a source IP in number of sockets */
+
+/* Community-sharded worker threads (-W) */
+#define N2N_SN_MAX_WORKERS              32
+#define N2N_SN_WORKER_RING              1024   /* Datagrams queued per worker, power of two */
+#define N2N_SN_REBALANCE_INTERVAL       5      /* Seconds between migration decisions */
+#define N2N_SN_REBALANCE_MIN_PPS        1000   /* Leave the busiest worker alone below this */
+
+/* Traffic traces (-w to record, -r to replay) */
+#define N2N_SN_TRACE_MAGIC              "N2NT"
+#define N2N_SN_TRACE_VERSION            1
+#define N2N_SN_TRACE_HDR_SIZE           16
+#define N2N_SN_TRACE_REC_SIZE           16
+#define N2N_SN_TRACE_SNAPLEN            64     /* Headers only: common header plus message header */
+#define N2N_SN_TRACE_HEADERS_ONLY       0x01
+
+/* AF_XDP fast path: frame layout of the relayed PACKETs */
+#define N2N_SN_XDP_ETH_SIZE             14
+#define N2N_SN_XDP_IP_SIZE              20     /* The XDP program skips IP options */
+#define N2N_SN_XDP_UDP_SIZE             8
+#define N2N_SN_XDP_HDR_SIZE             (N2N_SN_XDP_ETH_SIZE + N2N_SN_XDP_IP_SIZE + N2N_SN_XDP_UDP_SIZE)
+
 typedef struct sn_stats {
   size_t errors;              /* Number of errors encountered. */
   size_t reg_super;           /* Number of REGISTER_SUPER requests received. */
   size_t reg_super_nak;       /* Number of REGISTER_SUPER requests declined. */
+  size_t reg_challenge;       /* Number of REGISTER_SUPER challenged with a cookie. */
   size_t fwd;                 /* Number of messages forwarded. */
   size_t broadcast;           /* Number of messages broadcast to a community. */
+  size_t drop_short;          /* Datagrams too short to hold a common header. */
+  size_t drop_filter;         /* Datagrams rejected by the community filter. */
+  size_t drop_decode;         /* Datagrams with an undecodable common header. */
+  size_t drop_unknown;        /* Datagrams for a community we do not serve. */
+  size_t drop_rate;           /* Datagrams over the per-source rate limit. */
+  size_t xdp_fwd;             /* PACKETs forwarded by the AF_XDP fast path. */
+  size_t drop_worker;         /* Datagrams dropped on a full worker queue. */
   time_t last_fwd;            /* Time when last message was forwarded. */
   time_t last_reg_super;      /* Time when last REGISTER_SUPER was received. */
 } sn_stats_t;
 
+/* Bloom filter over the allowed community names. It is rebuilt every time
+ * the community list is loaded and checked on the raw datagram so that junk
+ * traffic is discarded before any decoding takes place. */
+typedef struct sn_community_filter {
+  uint8_t  *bits;
+  uint32_t mask;              /* Number of bits minus one (power of two). */
+} sn_community_filter_t;
+
+/* Per-source traffic accounting in fixed memory. Every socket (IP:port) gets
+ * the configured budget so that edges behind a shared NAT address are
+ * accounted separately; the address as a whole is capped at ip_share
+ * times that budget so a single host cannot escape the limit by spraying
+ * source ports. Only admitted datagrams are counted. Once an address is at
+ * its cap, only its sockets above their fair share (the cap divided by the
+ * sockets active behind it) are dropped: a heavy socket cannot starve the
+ * light ones behind the same NAT. */
+typedef struct sn_rate_cell {
+  uint32_t pkts;
+  uint32_t bytes;
+  uint32_t seen;              /* Socket: datagrams offered. IP: sockets seen. */
+} sn_rate_cell_t;
+
+typedef struct sn_rate_limiter {
+  uint32_t        max_pps;            /* 0 = no packet limit */
+  uint32_t        max_bps;            /* Bytes per second, 0 = no byte limit */
+  uint32_t        ip_share;           /* Budget of a source IP in number of sockets */
+  time_t          window;             /* Second currently being accounted. */
+  uint8_t         key[16];            /* Hash secret: sources cannot pick colliding cells. */
+  sn_rate_cell_t  *sock_cells;        /* N2N_SN_RATE_DEPTH x N2N_SN_RATE_WIDTH */
+  sn_rate_cell_t  *ip_cells;          /* N2N_SN_RATE_DEPTH x N2N_SN_RATE_WIDTH */
+} sn_rate_limiter_t;
+
+/* Small control replies waiting to be sent with a single sendmmsg(). */
+typedef struct sn_tx_batch {
+  unsigned int        num;
+  uint8_t             buf[N2N_SN_TX_BATCH][N2N_SN_TX_BATCH_BUF];
+  size_t              len[N2N_SN_TX_BATCH];
+  n2n_sockaddr_t      dest[N2N_SN_TX_BATCH]; /* IPv4 only, they share sendmmsg() on sock. */
+} sn_tx_batch_t;
+
 struct sn_community {
   char community[N2N_COMMUNITY_SIZE];
-  struct peer_info *edges;          /* Link list of registered edges. */
+  n2n_peer_table_t edges;           /* Registered edges. */
+  size_t           pkts;            /* Messages handled since the last load report. */
+
+  /* Replies pre-encoded for this community: only the cookie, MAC and socket
+   * are patched in per edge. */
+  uint8_t ack_tmpl[N2N_REGISTER_SUPER_ACK_V4_SIZE];
+  uint8_t peer_info_tmpl[N2N_PEER_INFO_V4_SIZE];
 
   UT_hash_handle   hh; /* makes this structure hashable */
 };
 
+/* Challenge secrets. There is a single set for the receiving thread and
+ * the workers, so a challenge validates whichever worker owns the community
+ * by the time the edge answers. Only the receiving thread rotates them: it
+ * fills the next key before publishing it in gen, and readers use the
+ * current key, key[gen % 3], and the previous one. The key they may still be
+ * reading is not overwritten before the rotation after next. */
+typedef struct sn_challenge_keys {
+  uint8_t             key[3][N2N_SN_CHALLENGE_KEY_SIZE];
+  uint32_t            gen;
+  time_t              rotated;        /* When the current key was generated. */
+} sn_challenge_keys_t;
+
 typedef struct n2n_sn {
   time_t              start_time;     /* Used to measure uptime. */
   sn_stats_t          stats;
   int                 daemon;         /* If non-zero then daemonise. */
   uint16_t            lport;          /* Local UDP port to bind to. */
   int                 sock;           /* Main socket for UDP traffic with edges. */
+  int                 sock6;          /* Same for the IPv6 edges, -1 without IPv6. */
   int                 mgmt_sock;      /* management socket. */
   int 	              lock_communities; /* If true, only loaded communities can be used. */
+  sn_community_filter_t community_filter; /* Fast reject of unknown communities when locked. */
+  int                 reg_challenge;  /* If true, new edges must echo a stateless cookie. */
+  sn_challenge_keys_t challenge_keys; /* Of the receiving thread, see challenge below. */
+  sn_challenge_keys_t *challenge;     /* The keys in use, shared with the workers. */
+  sn_rate_limiter_t   rate_limiter;   /* Per-source limits, enabled when cells are allocated. */
+  n2n_cpu_list_t      cpu_affinity;   /* CPUs to pin to, none if empty. */
+  int                 busy_poll_usec; /* Spin this long after traffic before blocking, 0 = never. */
+  int                 sock_buf_size;  /* 0 = system default, N2N_SOCK_BUF_AUTO = adaptive */
+  n2n_sock_buf_t      sock_buf;       /* Buffer sizing and kernel drops of the main socket. */
+  int                 timestamping;   /* If true, measure kernel queueing latencies. */
+  n2n_tstamp_t        tstamp;         /* Kernel timestamps of the main socket. */
+  uint32_t            conn_sock_pps;  /* Connect a socket to the edges sent more datagrams/s (-y). */
+  n2n_conn_socks_t    conn_socks;     /* Their sockets, conn_socks.pps is 0 when not used. */
+  sn_tx_batch_t       tx_batch;       /* Control replies of the current receive burst. */
+  char                *trace_path;    /* Record the received datagrams here (-w). */
+  int                 trace_headers_only; /* Only record the first N2N_SN_TRACE_SNAPLEN bytes. */
+  FILE                *trace;         /* Open trace being recorded. */
+  uint64_t            trace_last_usec; /* Time of the last recorded datagram. */
+  char                *replay_path;   /* Replay this trace instead of opening sockets (-r). */
+  int                 replay_realtime; /* Replay at the recorded pace instead of maximum speed. */
+  size_t              replay_tx;      /* Datagrams that would have been sent during the replay. */
+  size_t              replay_tx_bytes;
+  char                *xdp_ifname;    /* Interface of the AF_XDP fast path (-X). */
+  int                 xdp_queue;
+  n2n_xdp_t           xdp;            /* AF_XDP socket, xdp.fd is -1 when not used. */
+  int                 num_workers;    /* Community-sharded worker threads (-W), 0 = none. */
+  struct sn_worker    *workers;
+  struct sn_route     *routes;        /* Communities moved off their default worker. */
+  uint32_t            migrations;     /* Community moves started by the receiving thread. */
+  uint32_t            migrated;       /* Community moves completed by the workers. */
   struct sn_community *communities;
 } n2n_sn_t;
 
+#ifdef N2N_SN_HAVE_WORKERS
+/* With -W the main thread only receives: it runs admit_udp() and queues the
+ * datagram with its decoded common header to the worker owning the
+ * community, over a single-producer single-consumer ring. Every worker has
+ * a private n2n_sn_t holding its communities, so edge tables are never
+ * shared and need no locks. Communities are spread by name hash; a busy one
+ * can be moved to another worker, see sn_rebalance(). */
+#define N2N_SN_WORKER_PACKET            0
+#define N2N_SN_WORKER_MIGRATE           1      /* Hand the community over to slot.peer */
+#define N2N_SN_WORKER_ADOPT             2      /* Take the community handed over by slot.peer */
+
+typedef struct sn_worker_slot {
+  uint8_t             type;
+  uint8_t             peer;
+  n2n_sockaddr_t      sender;
+  n2n_common_t        cmn;            /* Decoded by the receiving thread. */
+  size_t              idx;            /* Offset past the common header. */
+  size_t              size;
+  time_t              now;
+  uint8_t             buf[N2N_SN_PKTBUF_SIZE];
+} sn_worker_slot_t;
+
+/* Published by a worker every second. */
+typedef struct sn_worker_load {
+  uint32_t            pps;            /* Messages per second. */
+  uint32_t            top_pps;        /* Messages per second of the busiest community. */
+  n2n_community_t     top;
+  uint32_t            communities;
+  uint32_t            edges;
+} sn_worker_load_t;
+
+struct sn_worker {
+  n2n_sn_t            sn;             /* Private state: communities, stats, replies. */
+  n2n_sn_t            *parent;
+  int                 id;
+  pthread_t           thread;
+  int                 event;          /* eventfd, written when the worker sleeps. */
+  sn_worker_slot_t    *ring;
+  uint32_t            head;           /* Only written by the receiving thread. */
+  uint32_t            tail;           /* Only written by the worker. */
+  int                 sleeping;
+  pthread_mutex_t     lock;           /* Protects load, stats and the handoff. */
+  sn_worker_load_t    load;
+  sn_stats_t          stats;          /* Copy of sn.stats, published with load. */
+  struct sn_community *handoff;       /* Community handed over on MIGRATE. */
+  int                 handoff_ready;
+  pthread_cond_t      handoff_cond;   /* Signalled when handoff_ready is set. */
+};
+
+struct sn_route {
+  char                community[N2N_COMMUNITY_SIZE];
+  int                 worker;
+  UT_hash_handle      hh;
+};
+#endif
+
 #define HASH_FIND_COMMUNITY(head,name,out) HASH_FIND_STR(head,name,out)
 
 static int try_forward(n2n_sn_t * sss,
@@ -83,7 +291,10 @@ static int init_sn(n2n_sn_t * sss) {
   sss->daemon = 1; /* By defult run as a daemon. */
   sss->lport = N2N_SN_LPORT_DEFAULT;
   sss->sock = -1;
+  sss->sock6 = -1;
   sss->mgmt_sock = -1;
+  sss->xdp.fd = -1;
+  sss->challenge = &sss->challenge_keys;
 
   return 0; /* OK */
 }
@@ -100,19 +311,483 @@ static void deinit_sn(n2n_sn_t * sss)
     }
   sss->sock=-1;
 
+  if(sss->sock6 >= 0)
+    closesocket(sss->sock6);
+  sss->sock6=-1;
+
   if(sss->mgmt_sock >= 0)
     {
       closesocket(sss->mgmt_sock);
     }
   sss->mgmt_sock=-1;
 
+  if(sss->conn_socks.pps)
+    conn_socks_free(&sss->conn_socks);
+  sss->conn_socks.pps = 0;
+
   HASH_ITER(hh, sss->communities, community, tmp) {
-    clear_peer_list(&community->edges);
+    peer_table_free(&community->edges);
     HASH_DEL(sss->communities, community);
     free(community);
   }
+
+  free(sss->community_filter.bits);
+  memset(&sss->community_filter, 0, sizeof(sn_community_filter_t));
+
+  free(sss->rate_limiter.sock_cells);
+  free(sss->rate_limiter.ip_cells);
+  memset(&sss->rate_limiter, 0, sizeof(sn_rate_limiter_t));
+
+  if(sss->trace != NULL) {
+    fclose(sss->trace);
+    sss->trace = NULL;
+  }
+
+#ifdef N2N_HAVE_XDP
+  if(sss->xdp.fd >= 0)
+    xdp_close(&sss->xdp);
+#endif
+}
+
+
+/** Send a datagram on the main socket of its family, or on the socket
+ *  connected to a busy edge. All traffic to edges goes through here. */
+static ssize_t sn_sendto(n2n_sn_t * sss,
+			 const uint8_t * pktbuf,
+			 size_t pktsize,
+			 const n2n_sockaddr_t * dest) {
+  uint64_t begin;
+  ssize_t sent;
+  SOCKET sock;
+
+  if(sss->replay_path != NULL) {
+    /* Replaying a trace: there is no socket, just account the datagram. */
+    sss->replay_tx++, sss->replay_tx_bytes += pktsize;
+    return(pktsize);
+  }
+
+  if(dest->sa.sa_family == AF_INET6) {
+    if(sss->sock6 < 0) {
+      errno = EAFNOSUPPORT;
+      return(-1);
+    }
+
+    sent = sendto(sss->sock6, pktbuf, pktsize, 0, &dest->sa, sizeof(struct sockaddr_in6));
+    N2N_PROBE2(sn_tx, pktsize, sent);
+
+    return(sent);
+  }
+
+  if(sss->conn_socks.pps
+     && ((sock = conn_sock_lookup(&sss->conn_socks, &dest->in)) >= 0)) {
+    if((sent = send(sock, pktbuf, pktsize, 0)) >= 0) {
+      N2N_PROBE2(sn_tx, pktsize, sent);
+      return(sent);
+    }
+
+    /* Refused, eg. by an ICMP port unreachable: back to the main socket */
+    traceEvent(TRACE_DEBUG, "Connected socket failed [%s]", strerror(errno));
+    conn_sock_demote(&sss->conn_socks, sock);
+  }
+
+  begin = tstamp_tx_begin(&sss->tstamp);
+  sent = sendto(sss->sock, pktbuf, pktsize, 0, &dest->sa, sizeof(struct sockaddr_in));
+
+  if(sent >= 0)
+    tstamp_tx_sent(&sss->tstamp, begin);
+
+  N2N_PROBE2(sn_tx, pktsize, sent);
+
+  return(sent);
+}
+
+/** Send all the batched replies. */
+static void sn_flush_batch(n2n_sn_t * sss) {
+  sn_tx_batch_t *batch = &sss->tx_batch;
+  unsigned int i = 0;
+
+  if(sss->replay_path != NULL) {
+    for(i=0; i<batch->num; i++)
+      sn_sendto(sss, batch->buf[i], batch->len[i], &batch->dest[i]);
+
+    batch->num = 0;
+    return;
+  }
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+  struct mmsghdr msgs[N2N_SN_TX_BATCH];
+  struct iovec iov[N2N_SN_TX_BATCH];
+  uint64_t begin = tstamp_tx_begin(&sss->tstamp);
+  int sent, j;
+
+  memset(msgs, 0, batch->num * sizeof(struct mmsghdr));
+
+  for(i=0; i<batch->num; i++) {
+    iov[i].iov_base = batch->buf[i];
+    iov[i].iov_len = batch->len[i];
+    msgs[i].msg_hdr.msg_name = &batch->dest[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  for(i=0; i<batch->num; ) {
+    sent = sendmmsg(sss->sock, &msgs[i], batch->num - i, 0);
+
+    if(sent <= 0) {
+      /* Skip the datagram that failed and go on with the rest */
+      ++(sss->stats.errors);
+      traceEvent(TRACE_DEBUG, "sendmmsg failed [%s]", strerror(errno));
+      i++;
+      continue;
+    }
+
+    for(j=0; j<sent; j++)
+      tstamp_tx_sent(&sss->tstamp, begin);
+
+    i += sent;
+  }
+#else
+  for(i=0; i<batch->num; i++)
+    sn_sendto(sss, batch->buf[i], batch->len[i], &batch->dest[i]);
+#endif
+
+  batch->num = 0;
+}
+
+/** Queue a small reply to be sent at the end of the receive burst. */
+static void sn_sendto_batched(n2n_sn_t * sss,
+			      const uint8_t * pktbuf,
+			      size_t pktsize,
+			      const n2n_sockaddr_t * dest) {
+  sn_tx_batch_t *batch = &sss->tx_batch;
+
+  if((pktsize > N2N_SN_TX_BATCH_BUF) || (dest->sa.sa_family != AF_INET)) {
+    sn_sendto(sss, pktbuf, pktsize, dest);
+    return;
+  }
+
+  memcpy(batch->buf[batch->num], pktbuf, pktsize);
+  batch->len[batch->num] = pktsize;
+  batch->dest[batch->num] = *dest;
+
+  if(++batch->num == N2N_SN_TX_BATCH)
+    sn_flush_batch(sss);
+}
+
+/** Create the trace file and write its header:
+ *
+ *  magic[4] version[1] flags[1] snaplen[2] start_time[4] reserved[4]
+ *
+ *  followed by one record per received datagram:
+ *
+ *  delta_usec[4] ipv4[4] port[2] orig_len[2] cap_len[2] reserved[2] data[cap_len]
+ *
+ *  All the fields are in network byte order. */
+static int trace_open(n2n_sn_t * sss) {
+  uint8_t hdr[N2N_SN_TRACE_HDR_SIZE];
+  size_t idx = 0;
+
+  sss->trace = fopen(sss->trace_path, "wb");
+  if(sss->trace == NULL) {
+    traceEvent(TRACE_ERROR, "Unable to create trace %s [%s]", sss->trace_path, strerror(errno));
+    return(-1);
+  }
+
+  encode_buf(hdr, &idx, N2N_SN_TRACE_MAGIC, 4);
+  encode_uint8(hdr, &idx, N2N_SN_TRACE_VERSION);
+  encode_uint8(hdr, &idx, sss->trace_headers_only ? N2N_SN_TRACE_HEADERS_ONLY : 0);
+  encode_uint16(hdr, &idx, sss->trace_headers_only ? N2N_SN_TRACE_SNAPLEN : N2N_SN_PKTBUF_SIZE);
+  encode_uint32(hdr, &idx, (uint32_t)time(NULL));
+  encode_uint32(hdr, &idx, 0);
+
+  if(fwrite(hdr, idx, 1, sss->trace) != 1) {
+    traceEvent(TRACE_ERROR, "Unable to write trace %s [%s]", sss->trace_path, strerror(errno));
+    fclose(sss->trace);
+    sss->trace = NULL;
+    return(-1);
+  }
+
+  sss->trace_last_usec = time_usec();
+  traceEvent(TRACE_NORMAL, "Recording %s to %s",
+	     sss->trace_headers_only ? "headers" : "datagrams", sss->trace_path);
+
+  return(0);
+}
+
+/** Append a received datagram to the trace. */
+static void trace_record(n2n_sn_t * sss,
+			 const n2n_sockaddr_t * sender_sock,
+			 const uint8_t * pktbuf,
+			 size_t pktsize) {
+  uint8_t rec[N2N_SN_TRACE_REC_SIZE];
+  size_t idx = 0, caplen = pktsize;
+  uint64_t now_usec, delta;
+
+  /* The records only have room for an IPv4 sender */
+  if(sender_sock->sa.sa_family != AF_INET)
+    return;
+
+  now_usec = time_usec(), delta = now_usec - sss->trace_last_usec;
+
+  if(sss->trace_headers_only && (caplen > N2N_SN_TRACE_SNAPLEN))
+    caplen = N2N_SN_TRACE_SNAPLEN;
+
+  sss->trace_last_usec = now_usec;
+
+  encode_uint32(rec, &idx, (delta > UINT32_MAX) ? UINT32_MAX : (uint32_t)delta);
+  encode_buf(rec, &idx, &sender_sock->in.sin_addr.s_addr, IPV4_SIZE);
+  encode_uint16(rec, &idx, ntohs(sender_sock->in.sin_port));
+  encode_uint16(rec, &idx, (uint16_t)pktsize);
+  encode_uint16(rec, &idx, (uint16_t)caplen);
+  encode_uint16(rec, &idx, 0);
+
+  if((fwrite(rec, idx, 1, sss->trace) != 1)
+     || (fwrite(pktbuf, caplen, 1, sss->trace) != 1)) {
+    traceEvent(TRACE_ERROR, "Unable to write trace %s [%s]: recording stopped",
+	       sss->trace_path, strerror(errno));
+    fclose(sss->trace);
+    sss->trace = NULL;
+  }
+}
+
+/* *************************************************** */
+
+/** Generate a new challenge secret every N2N_SN_CHALLENGE_ROTATE seconds. The
+ *  previous one is kept so that a challenge issued just before the rotation
+ *  is still accepted. Only called by the receiving thread. */
+static void challenge_rotate(sn_challenge_keys_t * keys, time_t now) {
+  uint32_t gen = keys->gen;
+
+  if((keys->rotated != 0) && ((now - keys->rotated) < N2N_SN_CHALLENGE_ROTATE))
+    return;
+
+  if(keys->rotated == 0)
+    fill_random(keys->key[gen % 3], N2N_SN_CHALLENGE_KEY_SIZE);
+
+  fill_random(keys->key[(gen + 1) % 3], N2N_SN_CHALLENGE_KEY_SIZE);
+  __atomic_store_n(&keys->gen, gen + 1, __ATOMIC_RELEASE);
+  keys->rotated = now;
+}
+
+/** Compute the challenge token for an edge. The token binds the sender
+ *  socket, the community and the edge MAC so it cannot be replayed from
+ *  elsewhere, and it is derived from a secret so no state must be kept.
+ *  key_idx 0 is the current secret, 1 the previous one. */
+static void challenge_token(const n2n_sn_t * sss, int key_idx,
+			    const n2n_sockaddr_t * sender_sock,
+			    const n2n_community_t community,
+			    const n2n_mac_t edgeMac,
+			    uint8_t token[N2N_SN_CHALLENGE_TOKEN_SIZE]) {
+  uint8_t msg[1 + IPV6_SIZE + sizeof(uint16_t) + N2N_COMMUNITY_SIZE + N2N_MAC_SIZE];
+  n2n_sock_t sender;
+  uint32_t gen;
+  uint64_t h;
+  int i;
+
+  /* The address is zero padded when IPv4 */
+  sockaddr_to_sock(&sender, sender_sock);
+  msg[0] = sender.family;
+  memcpy(&msg[1], sender.addr.v6, IPV6_SIZE);
+  memcpy(&msg[1 + IPV6_SIZE], &sender.port, sizeof(uint16_t));
+  memcpy(&msg[1 + IPV6_SIZE + sizeof(uint16_t)], community, N2N_COMMUNITY_SIZE);
+  memcpy(&msg[1 + IPV6_SIZE + sizeof(uint16_t) + N2N_COMMUNITY_SIZE], edgeMac, N2N_MAC_SIZE);
+
+  gen = __atomic_load_n(&sss->challenge->gen, __ATOMIC_ACQUIRE) + 3 - key_idx;
+  h = siphash24(sss->challenge->key[gen % 3], msg, sizeof(msg));
+
+  for(i=0; i<N2N_SN_CHALLENGE_TOKEN_SIZE; i++)
+    token[i] = (h >> (8 * i)) & 0xff;
+}
+
+/** Check whether a REGISTER_SUPER carries a valid challenge echo. */
+static int challenge_valid(const n2n_sn_t * sss,
+			   const n2n_sockaddr_t * sender_sock,
+			   const n2n_common_t * cmn,
+			   const n2n_REGISTER_SUPER_t * reg) {
+  uint8_t token[N2N_SN_CHALLENGE_TOKEN_SIZE];
+  int i;
+
+  if((reg->auth.scheme != N2N_AUTH_SCHEME_SN_COOKIE)
+     || (reg->auth.toksize != N2N_SN_CHALLENGE_TOKEN_SIZE))
+    return(0);
+
+  for(i=0; i<2; i++) {
+    challenge_token(sss, i, sender_sock, cmn->community, reg->edgeMac, token);
+
+    if(memcmp(token, reg->auth.token, N2N_SN_CHALLENGE_TOKEN_SIZE) == 0)
+      return(1);
+  }
+
+  return(0);
+}
+
+/** Answer a REGISTER_SUPER with a challenge to be echoed back. Nothing is
+ *  allocated here: the reply is built on the stack from the request. */
+static void send_challenge(n2n_sn_t * sss,
+			   const n2n_sockaddr_t * sender_sock,
+			   const n2n_common_t * cmn,
+			   const n2n_REGISTER_SUPER_t * reg) {
+  n2n_common_t                    cmn2;
+  n2n_REGISTER_SUPER_NAK_t        nak;
+  uint8_t                         nakbuf[N2N_SN_PKTBUF_SIZE];
+  size_t                          encx=0;
+
+  memset(&cmn2, 0, sizeof(cmn2));
+  cmn2.ttl = N2N_DEFAULT_TTL;
+  cmn2.pc = n2n_register_super_nak;
+  cmn2.flags = N2N_FLAGS_FROM_SUPERNODE;
+  memcpy(cmn2.community, cmn->community, sizeof(n2n_community_t));
+
+  memset(&nak, 0, sizeof(nak));
+  memcpy(&(nak.cookie), &(reg->cookie), sizeof(n2n_cookie_t));
+  nak.auth.scheme = N2N_AUTH_SCHEME_SN_COOKIE;
+  nak.auth.toksize = N2N_SN_CHALLENGE_TOKEN_SIZE;
+  challenge_token(sss, 0, sender_sock, cmn->community, reg->edgeMac, nak.auth.token);
+
+  encode_REGISTER_SUPER_NAK(nakbuf, &encx, &cmn2, &nak);
+
+  sn_sendto(sss, nakbuf, encx, sender_sock);
+
+  ++(sss->stats.reg_challenge);
+}
+
+/** Parse a "<pps>[:<kbps>[:<ip share>]]" rate limit specification and
+ *  allocate the sketches. */
+static int rate_limiter_init(sn_rate_limiter_t * rl, const char * spec) {
+  const char *kbps, *share;
+  size_t cells = N2N_SN_RATE_DEPTH * N2N_SN_RATE_WIDTH;
+
+  if(spec == NULL)
+    return(-1);
+
+  rl->max_pps = strtoul(spec, NULL, 10);
+  kbps = strchr(spec, ':');
+  rl->max_bps = kbps ? (strtoul(kbps + 1, NULL, 10) * 1000 / 8) : 0;
+  share = kbps ? strchr(kbps + 1, ':') : NULL;
+  rl->ip_share = share ? strtoul(share + 1, NULL, 10) : N2N_SN_RATE_IP_SHARE;
+
+  if(rl->ip_share == 0) {
+    traceEvent(TRACE_WARNING, "Invalid rate limit '%s': the IP share must be at least 1", spec);
+    return(-1);
+  }
+
+  if((rl->max_pps == 0) && (rl->max_bps == 0)) {
+    traceEvent(TRACE_WARNING, "Invalid rate limit '%s': ignored", spec);
+    return(-1);
+  }
+
+  if(rl->sock_cells == NULL) {
+    rl->sock_cells = (sn_rate_cell_t*)calloc(cells, sizeof(sn_rate_cell_t));
+    rl->ip_cells = (sn_rate_cell_t*)calloc(cells, sizeof(sn_rate_cell_t));
+
+    if((rl->sock_cells == NULL) || (rl->ip_cells == NULL)) {
+      free(rl->sock_cells), free(rl->ip_cells);
+      rl->sock_cells = rl->ip_cells = NULL;
+      return(-1);
+    }
+
+    fill_random(rl->key, sizeof(rl->key));
+  }
+
+  return(0);
+}
+
+/** Find the cells of a key in one sketch and return its estimate. */
+static sn_rate_cell_t rate_limiter_lookup(const sn_rate_limiter_t * rl,
+					  sn_rate_cell_t * cells,
+					  const void * key, size_t key_len,
+					  sn_rate_cell_t ** row) {
+  uint64_t h = siphash24(rl->key, key, key_len);
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+  sn_rate_cell_t est = { UINT32_MAX, UINT32_MAX, UINT32_MAX };
+  int i;
+
+  for(i=0; i<N2N_SN_RATE_DEPTH; i++) {
+    row[i] = &cells[i * N2N_SN_RATE_WIDTH + ((h1 + i * h2) & (N2N_SN_RATE_WIDTH - 1))];
+    est.pkts = min(est.pkts, row[i]->pkts);
+    est.bytes = min(est.bytes, row[i]->bytes);
+    est.seen = min(est.seen, row[i]->seen);
+  }
+
+  return(est);
+}
+
+/** Store the new estimate of a key (conservative update): only the cells
+ *  below it are raised, which keeps collisions from inflating the count of
+ *  light senders. */
+static void rate_limiter_raise(sn_rate_cell_t ** row, const sn_rate_cell_t * est) {
+  int i;
+
+  for(i=0; i<N2N_SN_RATE_DEPTH; i++) {
+    if(row[i]->pkts < est->pkts)   row[i]->pkts = est->pkts;
+    if(row[i]->bytes < est->bytes) row[i]->bytes = est->bytes;
+    if(row[i]->seen < est->seen)   row[i]->seen = est->seen;
+  }
 }
 
+/** Return non-zero if the sender is over its budget for the current second.
+ *  An IPv6 host is accounted by its /64 prefix, what a single subscriber
+ *  usually gets. */
+static int rate_limiter_over(sn_rate_limiter_t * rl,
+			     const n2n_sockaddr_t * sender_sock,
+			     size_t pkt_len,
+			     time_t now) {
+  uint8_t key[IPV6_SIZE + sizeof(uint16_t)];
+  sn_rate_cell_t *sock_row[N2N_SN_RATE_DEPTH], *ip_row[N2N_SN_RATE_DEPTH];
+  size_t key_len, ip_len;
+  sn_rate_cell_t sock, ip;
+  int over = 0;
+
+  if(now != rl->window) {
+    size_t cells = N2N_SN_RATE_DEPTH * N2N_SN_RATE_WIDTH;
+
+    memset(rl->sock_cells, 0, cells * sizeof(sn_rate_cell_t));
+    memset(rl->ip_cells, 0, cells * sizeof(sn_rate_cell_t));
+    rl->window = now;
+  }
+
+  if(sender_sock->sa.sa_family == AF_INET6) {
+    memcpy(key, &(sender_sock->in6.sin6_addr), IPV6_SIZE);
+    memcpy(&key[IPV6_SIZE], &(sender_sock->in6.sin6_port), sizeof(uint16_t));
+    key_len = IPV6_SIZE + sizeof(uint16_t), ip_len = 8;
+  } else {
+    memcpy(key, &(sender_sock->in.sin_addr.s_addr), IPV4_SIZE);
+    memcpy(&key[IPV4_SIZE], &(sender_sock->in.sin_port), sizeof(uint16_t));
+    key_len = IPV4_SIZE + sizeof(uint16_t), ip_len = IPV4_SIZE;
+  }
+
+  sock = rate_limiter_lookup(rl, rl->sock_cells, key, key_len, sock_row);
+  ip = rate_limiter_lookup(rl, rl->ip_cells, key, ip_len, ip_row);
+
+  /* A socket active in this second, admitted or not, gets a share */
+  if(sock.seen++ == 0)
+    ip.seen++;
+
+  if((rl->max_pps && (sock.pkts + 1 > rl->max_pps))
+     || (rl->max_bps && ((uint64_t)sock.bytes + pkt_len > rl->max_bps)))
+    over = 1;
+  else if((rl->max_pps && (ip.pkts + 1 > (uint64_t)rl->max_pps * rl->ip_share))
+	  || (rl->max_bps && ((uint64_t)ip.bytes + pkt_len > (uint64_t)rl->max_bps * rl->ip_share))) {
+    /* The address is at its cap: only its sockets above their fair share
+     * are dropped */
+    uint32_t socks = max(ip.seen, 1);
+
+    if((rl->max_pps && (sock.pkts + 1 > (uint64_t)rl->max_pps * rl->ip_share / socks))
+       || (rl->max_bps && ((uint64_t)sock.bytes + pkt_len > (uint64_t)rl->max_bps * rl->ip_share / socks)))
+      over = 1;
+  }
+
+  if(!over) {
+    sock.pkts++, sock.bytes += pkt_len;
+    ip.pkts++, ip.bytes += pkt_len;
+  }
+
+  rate_limiter_raise(sock_row, &sock);
+  rate_limiter_raise(ip_row, &ip);
+
+  return(over);
+}
 
 /** Determine the appropriate lifetime for new registrations.
  *
@@ -125,6 +800,87 @@ static uint16_t reg_lifetime(n2n_sn_t * sss) {
 }
 
 
+/** Pre-encode the replies of a community. The registration lifetime is
+ *  fixed, so it is encoded once here. */
+static void community_init_templates(n2n_sn_t * sss, struct sn_community * comm) {
+  n2n_common_t             cmn;
+  n2n_REGISTER_SUPER_ACK_t ack;
+  n2n_PEER_INFO_t          pi;
+  size_t                   encx;
+
+  memset(&cmn, 0, sizeof(cmn));
+  cmn.ttl = N2N_DEFAULT_TTL;
+  memcpy(cmn.community, comm->community, N2N_COMMUNITY_SIZE);
+
+  memset(&ack, 0, sizeof(ack));
+  cmn.pc = n2n_register_super_ack;
+  cmn.flags = N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
+  ack.lifetime = reg_lifetime(sss);
+  ack.sock.family = AF_INET;
+  ack.num_sn = 0; /* No backup */
+  encx = 0;
+  encode_REGISTER_SUPER_ACK(comm->ack_tmpl, &encx, &cmn, &ack);
+
+  memset(&pi, 0, sizeof(pi));
+  cmn.pc = n2n_peer_info;
+  cmn.flags = N2N_FLAGS_FROM_SUPERNODE;
+  pi.aflags = 0;
+  pi.sock.family = AF_INET;
+  encx = 0;
+  encode_PEER_INFO(comm->peer_info_tmpl, &encx, &cmn, &pi);
+}
+
+/** Answer a REGISTER_SUPER with N2N_FLAGS_PEER_LIST with one page of the
+ *  edges of comm, the registering one left out. The cursor is the slot the
+ *  page starts at, so that any page costs the same to build; the edge asks
+ *  for the next page with its next REGISTER_SUPER. Entries moved by a resize
+ *  in between may be skipped or sent twice, the edge only uses the list as
+ *  hints. */
+static void send_peer_list(n2n_sn_t * sss,
+			   const struct sn_community * comm,
+			   const n2n_REGISTER_SUPER_t * reg,
+			   const n2n_sockaddr_t * sender_sock) {
+  n2n_common_t     cmn;
+  n2n_PEER_LIST_t  list;
+  uint8_t          encbuf[N2N_SN_PKTBUF_SIZE];
+  size_t           encx = 0;
+  uint32_t         i, max = MIN(reg->list_max, N2N_PEER_LIST_PAGE_SIZE);
+
+  if(max == 0)
+    return;
+
+  memset(&cmn, 0, sizeof(cmn));
+  cmn.ttl = N2N_DEFAULT_TTL;
+  cmn.pc = n2n_peer_list;
+  cmn.flags = N2N_FLAGS_FROM_SUPERNODE;
+  memcpy(cmn.community, comm->community, N2N_COMMUNITY_SIZE);
+
+  memset(&list, 0, sizeof(list));
+  list.total = MIN(comm->edges.count, 0xffff);
+
+  for(i = reg->list_cursor; comm->edges.slots && (i <= comm->edges.mask); i++) {
+    const n2n_peer_slot_t *slot = &comm->edges.slots[i];
+
+    if((slot->port == 0) || !memcmp(slot->mac_addr, reg->edgeMac, N2N_MAC_SIZE))
+      continue;
+
+    if(list.count == max) {
+      list.cursor = i;
+      break;
+    }
+
+    memcpy(list.peers[list.count].mac, slot->mac_addr, N2N_MAC_SIZE);
+    list.peers[list.count].sock = *peer_table_sock(&comm->edges, slot);
+    list.count++;
+  }
+
+  encode_PEER_LIST(encbuf, &encx, &cmn, &list);
+  sn_sendto_batched(sss, encbuf, encx, sender_sock);
+
+  traceEvent(TRACE_DEBUG, "Tx PEER_LIST of %u/%u edges from %u",
+	     (unsigned int)list.count, (unsigned int)list.total, reg->list_cursor);
+}
+
 /** Update the edge table with the details of the edge which contacted the
  *  supernode. */
 static int update_edge(n2n_sn_t * sss,
@@ -134,31 +890,31 @@ static int update_edge(n2n_sn_t * sss,
 		       time_t now) {
   macstr_t            mac_buf;
   n2n_sock_str_t      sockbuf;
-  struct peer_info *  scan;
+  n2n_peer_slot_t *   scan;
 
   traceEvent(TRACE_DEBUG, "update_edge for %s [%s]",
 	     macaddr_str(mac_buf, edgeMac),
 	     sock_to_cstr(sockbuf, sender_sock));
 
-  HASH_FIND_PEER(comm->edges, edgeMac, scan);
+  scan = peer_table_find(&comm->edges, edgeMac);
 
   if(NULL == scan) {
       /* Not known */
 
-      scan = (struct peer_info*)calloc(1, sizeof(struct peer_info)); /* deallocated in purge_expired_registrations */
-
-      memcpy(&(scan->mac_addr), edgeMac, sizeof(n2n_mac_t));
-      memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
+      scan = peer_table_add(&comm->edges, edgeMac, sender_sock); /* removed in peer_table_purge */
 
-      HASH_ADD_PEER(comm->edges, scan);
+      if(NULL == scan) {
+	traceEvent(TRACE_ERROR, "update_edge failed to add %s", macaddr_str(mac_buf, edgeMac));
+	return -1;
+      }
 
       traceEvent(TRACE_INFO, "update_edge created   %s ==> %s",
 		 macaddr_str(mac_buf, edgeMac),
 		 sock_to_cstr(sockbuf, sender_sock));
     } else  {
       /* Known */
-      if(!sock_equal(sender_sock, &(scan->sock))) {
-	  memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
+      if(!sock_equal(sender_sock, peer_table_sock(&comm->edges, scan))) {
+	  peer_table_set_sock(&comm->edges, scan, sender_sock);
 
 	  traceEvent(TRACE_INFO, "update_edge updated   %s ==> %s",
 		     macaddr_str(mac_buf, edgeMac),
@@ -173,7 +929,7 @@ static int update_edge(n2n_sn_t * sss,
 
     }
 
-  scan->last_seen = now;
+  scan->last_seen = (uint32_t)now;
   return 0;
 }
 
@@ -188,28 +944,40 @@ static ssize_t sendto_sock(n2n_sn_t * sss,
                            size_t pktsize)
 {
   n2n_sock_str_t      sockbuf;
+  n2n_sockaddr_t      udpsock;
 
-  if(AF_INET == sock->family)
-    {
-      struct sockaddr_in udpsock;
-
-      udpsock.sin_family = AF_INET;
-      udpsock.sin_port = htons(sock->port);
-      memcpy(&(udpsock.sin_addr.s_addr), &(sock->addr.v4), IPV4_SIZE);
-
-      traceEvent(TRACE_DEBUG, "sendto_sock %lu to [%s]",
-		 pktsize,
-		 sock_to_cstr(sockbuf, sock));
-
-      return sendto(sss->sock, pktbuf, pktsize, 0,
-		    (const struct sockaddr *)&udpsock, sizeof(struct sockaddr_in));
-    }
-  else
+  if(sock_to_sockaddr(&udpsock, sock) == 0)
     {
-      /* AF_INET6 not implemented */
       errno = EAFNOSUPPORT;
       return -1;
     }
+
+  traceEvent(TRACE_DEBUG, "sendto_sock %lu to [%s]",
+	     pktsize,
+	     sock_to_cstr(sockbuf, sock));
+
+  return sn_sendto(sss, pktbuf, pktsize, &udpsock);
+}
+
+/** Send a datagram to a registered edge. IPv4 edges are reached straight
+ *  from the compact slot without touching the full socket. */
+static ssize_t sendto_edge(n2n_sn_t * sss,
+			   const n2n_peer_table_t * table,
+			   const n2n_peer_slot_t * slot,
+			   const uint8_t * pktbuf,
+			   size_t pktsize)
+{
+  n2n_sockaddr_t udpsock;
+
+  if(slot->addr == 0)
+    return(sendto_sock(sss, peer_table_sock(table, slot), pktbuf, pktsize));
+
+  memset(&udpsock, 0, sizeof(udpsock));
+  udpsock.in.sin_family = AF_INET;
+  udpsock.in.sin_port = htons(slot->port);
+  udpsock.in.sin_addr.s_addr = slot->addr;
+
+  return(sn_sendto(sss, pktbuf, pktsize, &udpsock));
 }
 
 static int try_forward(n2n_sn_t * sss,
@@ -218,7 +986,7 @@ static int try_forward(n2n_sn_t * sss,
 		       const uint8_t * pktbuf,
 		       size_t pktsize)
 {
-  struct peer_info *  scan;
+  n2n_peer_slot_t *   scan;
   struct sn_community *community;
   macstr_t            mac_buf;
   n2n_sock_str_t      sockbuf;
@@ -226,23 +994,26 @@ static int try_forward(n2n_sn_t * sss,
   HASH_FIND_COMMUNITY(sss->communities, (char*)cmn->community, community);
 
   if(!community) {
+    ++(sss->stats.drop_unknown);
     traceEvent(TRACE_DEBUG, "try_forward unknown community %s", cmn->community);
     return(-1);
   }
 
-  HASH_FIND_PEER(community->edges, dstMac, scan);
+  community->pkts++;
+  scan = peer_table_find(&community->edges, dstMac);
+
+  N2N_PROBE3(sn_forward, dstMac, pktsize, scan != NULL);
 
   if(NULL != scan)
     {
       int data_sent_len;
-      data_sent_len = sendto_sock(sss, &(scan->sock), pktbuf, pktsize);
+      data_sent_len = sendto_edge(sss, &community->edges, scan, pktbuf, pktsize);
 
       if(data_sent_len == pktsize)
         {
 	  ++(sss->stats.fwd);
-	  traceEvent(TRACE_DEBUG, "unicast %lu to [%s] %s",
+	  traceEvent(TRACE_DEBUG, "unicast %lu to %s",
 		     pktsize,
-		     sock_to_cstr(sockbuf, &(scan->sock)),
 		     macaddr_str(mac_buf, scan->mac_addr));
         }
       else
@@ -250,7 +1021,7 @@ static int try_forward(n2n_sn_t * sss,
 	  ++(sss->stats.errors);
 	  traceEvent(TRACE_ERROR, "unicast %lu to [%s] %s FAILED (%d: %s)",
 		     pktsize,
-		     sock_to_cstr(sockbuf, &(scan->sock)),
+		     sock_to_cstr(sockbuf, peer_table_sock(&community->edges, scan)),
 		     macaddr_str(mac_buf, scan->mac_addr),
 		     errno, strerror(errno));
         }
@@ -278,7 +1049,7 @@ static int try_broadcast(n2n_sn_t * sss,
 			 const uint8_t * pktbuf,
 			 size_t pktsize)
 {
-  struct peer_info *scan, *tmp;
+  n2n_peer_slot_t *scan, *end;
   struct sn_community *community;
   macstr_t            mac_buf;
   n2n_sock_str_t      sockbuf;
@@ -287,41 +1058,87 @@ static int try_broadcast(n2n_sn_t * sss,
 
   HASH_FIND_COMMUNITY(sss->communities, (char*)cmn->community, community);
 
+  N2N_PROBE3(sn_broadcast, srcMac, pktsize, community ? community->edges.count : 0);
+
   if(community) {
-    HASH_ITER(hh, community->edges, scan, tmp) {
-      if(memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t)) != 0) {
+    community->pkts++;
+    end = community->edges.slots ? &community->edges.slots[community->edges.mask + 1] : NULL;
+
+    for(scan = community->edges.slots; scan < end; scan++) {
+      if(scan->port && (memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t)) != 0)) {
 	  /* REVISIT: exclude if the destination socket is where the packet came from. */
 	  int data_sent_len;
 
-	  data_sent_len = sendto_sock(sss, &(scan->sock), pktbuf, pktsize);
+	  data_sent_len = sendto_edge(sss, &community->edges, scan, pktbuf, pktsize);
 
 	  if(data_sent_len != pktsize)
             {
 	      ++(sss->stats.errors);
 	      traceEvent(TRACE_WARNING, "multicast %lu to [%s] %s failed %s",
 			 pktsize,
-			 sock_to_cstr(sockbuf, &(scan->sock)),
+			 sock_to_cstr(sockbuf, peer_table_sock(&community->edges, scan)),
 			 macaddr_str(mac_buf, scan->mac_addr),
 			 strerror(errno));
             }
 	  else
             {
 	      ++(sss->stats.broadcast);
-	      traceEvent(TRACE_DEBUG, "multicast %lu to [%s] %s",
+	      traceEvent(TRACE_DEBUG, "multicast %lu to %s",
 			 pktsize,
-			 sock_to_cstr(sockbuf, &(scan->sock)),
 			 macaddr_str(mac_buf, scan->mac_addr));
             }
       }
     }
-  } else
+  } else {
+    ++(sss->stats.drop_unknown);
     traceEvent(TRACE_INFO, "ignoring broadcast on unknown community %s\n",
       cmn->community);
+  }
 
   return 0;
 }
 
 
+/** Statistics of the receiving thread plus those published by the workers
+ *  (up to one second old). */
+static void sn_stats_total(const n2n_sn_t * sss, sn_stats_t * stats, uint32_t * num_edges) {
+  struct sn_community *community, *tmp;
+
+  *stats = sss->stats;
+  *num_edges = 0;
+
+  HASH_ITER(hh, sss->communities, community, tmp) {
+    *num_edges += community->edges.count;
+  }
+
+#ifdef N2N_SN_HAVE_WORKERS
+  {
+    int i;
+
+    for(i=0; i<sss->num_workers; i++) {
+      sn_stats_t ws;
+      uint32_t edges;
+
+      pthread_mutex_lock(&sss->workers[i].lock);
+      ws = sss->workers[i].stats;
+      edges = sss->workers[i].load.edges;
+      pthread_mutex_unlock(&sss->workers[i].lock);
+
+      stats->errors += ws.errors;
+      stats->reg_super += ws.reg_super;
+      stats->reg_super_nak += ws.reg_super_nak;
+      stats->reg_challenge += ws.reg_challenge;
+      stats->fwd += ws.fwd;
+      stats->broadcast += ws.broadcast;
+      stats->drop_unknown += ws.drop_unknown;
+      stats->last_fwd = MAX(stats->last_fwd, ws.last_fwd);
+      stats->last_reg_super = MAX(stats->last_reg_super, ws.last_reg_super);
+      *num_edges += edges;
+    }
+  }
+#endif
+}
+
 static int process_mgmt(n2n_sn_t * sss,
 			const struct sockaddr_in * sender_sock,
 			const uint8_t * mgmt_buf,
@@ -332,7 +1149,7 @@ static int process_mgmt(n2n_sn_t * sss,
   size_t ressize=0;
   uint32_t num_edges=0;
   ssize_t r;
-  struct sn_community *community, *tmp;
+  sn_stats_t stats;
 
   traceEvent(TRACE_DEBUG, "process_mgmt");
 
@@ -342,9 +1159,7 @@ static int process_mgmt(n2n_sn_t * sss,
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "uptime    %lu\n", (now - sss->start_time));
 
-  HASH_ITER(hh, sss->communities, community, tmp) {
-    num_edges += HASH_COUNT(community->edges);
-  }
+  sn_stats_total(sss, &stats, &num_edges);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "edges     %u\n",
@@ -352,31 +1167,101 @@ static int process_mgmt(n2n_sn_t * sss,
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "errors    %u\n",
-		      (unsigned int)sss->stats.errors);
+		      (unsigned int)stats.errors);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "reg_sup   %u\n",
-		      (unsigned int)sss->stats.reg_super);
+		      (unsigned int)stats.reg_super);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "reg_nak   %u\n",
-		      (unsigned int)sss->stats.reg_super_nak);
+		      (unsigned int)stats.reg_super_nak);
+
+  ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+		      "reg_chal  %u\n",
+		      (unsigned int)stats.reg_challenge);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "fwd       %u\n",
-		      (unsigned int) sss->stats.fwd);
+		      (unsigned int) stats.fwd);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "broadcast %u\n",
-		      (unsigned int) sss->stats.broadcast);
+		      (unsigned int) stats.broadcast);
+
+  ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+		      "drops     short:%u filter:%u decode:%u unknown:%u rate:%u\n",
+		      (unsigned int) stats.drop_short,
+		      (unsigned int) stats.drop_filter,
+		      (unsigned int) stats.drop_decode,
+		      (unsigned int) stats.drop_unknown,
+		      (unsigned int) stats.drop_rate);
+
+  ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+		      "socket    rcvbuf:%u sndbuf:%u kernel_drops:%u\n",
+		      (unsigned int) sss->sock_buf.rcvbuf,
+		      (unsigned int) sss->sock_buf.sndbuf,
+		      (unsigned int) sss->sock_buf.kernel_drops);
+
+  if(sss->conn_socks.pps)
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"connected edges:%u promoted:%u demoted:%u\n",
+			(unsigned int) sss->conn_socks.connected,
+			(unsigned int) sss->conn_socks.promoted,
+			(unsigned int) sss->conn_socks.demoted);
+
+  if(sss->xdp.fd >= 0)
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"xdp       rx:%u fast_fwd:%u tx:%u tx_full:%u\n",
+			(unsigned int) sss->xdp.rx_frames,
+			(unsigned int) stats.xdp_fwd,
+			(unsigned int) sss->xdp.tx_frames,
+			(unsigned int) sss->xdp.tx_full);
+
+#ifdef N2N_SN_HAVE_WORKERS
+  if(sss->num_workers > 0) {
+    int i;
+
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"workers   %d queue_full:%u migrations:%u\n",
+			sss->num_workers,
+			(unsigned int) stats.drop_worker,
+			(unsigned int) sss->migrations);
+
+    for(i=0; i<sss->num_workers; i++) {
+      sn_worker_load_t load;
+
+      pthread_mutex_lock(&sss->workers[i].lock);
+      load = sss->workers[i].load;
+      pthread_mutex_unlock(&sss->workers[i].lock);
+
+      ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			  "worker %-2d pps:%u communities:%u edges:%u top:%s(%u pps)\n",
+			  i, load.pps, load.communities, load.edges,
+			  load.top_pps ? (char*)load.top : "-", load.top_pps);
+    }
+  }
+#endif
+
+  if(sss->tstamp.enabled) {
+    char hist[128];
+
+    latency_hist_str(&sss->tstamp.rx, hist, sizeof(hist));
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"rx_queue  %s\n", hist);
+
+    latency_hist_str(&sss->tstamp.tx, hist, sizeof(hist));
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"tx_queue  %s\n", hist);
+  }
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "last fwd  %lu sec ago\n",
-		      (long unsigned int)(now - sss->stats.last_fwd));
+		      (long unsigned int)(now - stats.last_fwd));
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "last reg  %lu sec ago\n",
-		      (long unsigned int) (now - sss->stats.last_reg_super));
+		      (long unsigned int) (now - stats.last_reg_super));
 
 
   r = sendto(sss->mgmt_sock, resbuf, ressize, 0/*flags*/,
@@ -391,6 +1276,94 @@ static int process_mgmt(n2n_sn_t * sss,
   return 0;
 }
 
+/** 64-bit FNV-1a of a community name. The two halves are used as the
+ *  independent hashes of the bloom filter (Kirsch-Mitzenmacher). */
+static uint64_t community_filter_hash(const uint8_t *name, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for(i=0; i<len; i++) {
+    h ^= name[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return(h);
+}
+
+/** Length of the community name held in a (possibly not terminated) buffer. */
+static size_t community_name_len(const uint8_t *name) {
+  const uint8_t *end = memchr(name, '\0', N2N_COMMUNITY_SIZE);
+
+  return(end ? (size_t)(end - name) : N2N_COMMUNITY_SIZE);
+}
+
+static void community_filter_add(sn_community_filter_t *filter, const char *name) {
+  uint64_t h = community_filter_hash((const uint8_t*)name, strlen(name));
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+  int i;
+
+  for(i=0; i<N2N_SN_FILTER_HASHES; i++) {
+    uint32_t bit = (h1 + i*h2) & filter->mask;
+
+    filter->bits[bit >> 3] |= (1 << (bit & 7));
+  }
+}
+
+/** @return 1 if the raw community bytes may belong to an allowed community,
+ *  0 if they definitely do not. */
+static int community_filter_check(const sn_community_filter_t *filter, const uint8_t *name) {
+  uint64_t h;
+  uint32_t h1, h2;
+  int i;
+
+  if(filter->bits == NULL)
+    return(1); /* No filter: let the hash lookup decide */
+
+  h = community_filter_hash(name, community_name_len(name));
+  h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+
+  for(i=0; i<N2N_SN_FILTER_HASHES; i++) {
+    uint32_t bit = (h1 + i*h2) & filter->mask;
+
+    if(!(filter->bits[bit >> 3] & (1 << (bit & 7))))
+      return(0);
+  }
+
+  return(1);
+}
+
+/** Rebuild the community filter from the current set of communities. */
+static int community_filter_rebuild(n2n_sn_t *sss) {
+  sn_community_filter_t *filter = &sss->community_filter;
+  struct sn_community *s, *tmp;
+  uint32_t num_bits = N2N_SN_FILTER_MIN_BITS;
+  uint32_t needed = HASH_COUNT(sss->communities) * N2N_SN_FILTER_BITS_PER_ENTRY;
+
+  while(num_bits < needed)
+    num_bits <<= 1;
+
+  free(filter->bits);
+  filter->mask = 0;
+
+  if((filter->bits = (uint8_t*)calloc(num_bits / 8, 1)) == NULL) {
+    traceEvent(TRACE_WARNING, "Unable to allocate the community filter");
+    return(-1);
+  }
+
+  filter->mask = num_bits - 1;
+
+  HASH_ITER(hh, sss->communities, s, tmp) {
+    community_filter_add(filter, s->community);
+  }
+
+  traceEvent(TRACE_INFO, "Community filter rebuilt [%u communities][%u bits]",
+	     HASH_COUNT(sss->communities), num_bits);
+
+  return(0);
+}
+
+/* *************************************************** */
+
 /** Load the list of allowed communities. Existing/previous ones will be removed
  *
  */
@@ -430,6 +1403,7 @@ static int load_allowed_sn_community(n2n_sn_t *sss, char *path) {
     if(s != NULL) {
       strncpy((char*)s->community, line, N2N_COMMUNITY_SIZE-1);
       s->community[N2N_COMMUNITY_SIZE-1] = '\0';
+      community_init_templates(sss, s);
       HASH_ADD_STR(sss->communities, community, s);
       num_communities++;
       traceEvent(TRACE_INFO, "Added allowed community '%s' [total: %u]",
@@ -445,33 +1419,36 @@ static int load_allowed_sn_community(n2n_sn_t *sss, char *path) {
   /* No new communities will be allowed */
   sss->lock_communities = 1;
 
+  community_filter_rebuild(sss);
+
   return(0);
 }
 
-/** Examine a datagram and determine what to do with it.
- *
+/** Checks done on every datagram before looking at the message: rate limit,
+ *  length, community filter and common header. On success the common header
+ *  is decoded into cmn and idx points past it.
  */
-static int process_udp(n2n_sn_t * sss,
-		       const struct sockaddr_in * sender_sock,
-		       const uint8_t * udp_buf,
-		       size_t udp_size,
-		       time_t now)
+static int admit_udp(n2n_sn_t * sss,
+		     const n2n_sockaddr_t * sender_sock,
+		     const uint8_t * udp_buf,
+		     size_t udp_size,
+		     time_t now,
+		     n2n_common_t * cmn,
+		     size_t * idx)
 {
-  n2n_common_t        cmn; /* common fields in the packet header */
   size_t              rem;
-  size_t              idx;
-  size_t              msg_type;
-  uint8_t             from_supernode;
-  macstr_t            mac_buf;
-  macstr_t            mac_buf2;
-  n2n_sock_str_t      sockbuf;
   char                buf[32];
 
-  traceEvent(TRACE_DEBUG, "Processing incoming UDP packet [len: %lu][sender: %s:%u]",
-	     udp_size, intoa(ntohl(sender_sock->sin_addr.s_addr), buf, sizeof(buf)),
-	     ntohs(sender_sock->sin_port));
+  if(sender_sock->sa.sa_family == AF_INET) {
+    traceEvent(TRACE_DEBUG, "Processing incoming UDP packet [len: %lu][sender: %s:%u]",
+	       udp_size, intoa(ntohl(sender_sock->in.sin_addr.s_addr), buf, sizeof(buf)),
+	       ntohs(sender_sock->in.sin_port));
 
-  /* Use decode_common() to determine the kind of packet then process it:
+    N2N_PROBE2(sn_rx, udp_size, sender_sock->in.sin_addr.s_addr);
+  } else
+    N2N_PROBE2(sn_rx, udp_size, 0);
+
+  /* Use decode_common() to determine the kind of packet then process it:
    *
    * REGISTER_SUPER adds an edge and generate a return REGISTER_SUPER_ACK
    *
@@ -480,13 +1457,68 @@ static int process_udp(n2n_sn_t * sss,
    * broadcast.
    */
 
+  /* Per-source accounting comes first: it is the only defence against a
+   * sender flooding us with datagrams that would fail any later check. */
+  if(sss->rate_limiter.sock_cells
+     && rate_limiter_over(&sss->rate_limiter, sender_sock, udp_size, now)) {
+    ++(sss->stats.drop_rate);
+    return -1;
+  }
+
+  if(udp_size < N2N_COMMON_SIZE) {
+    ++(sss->stats.drop_short);
+    traceEvent(TRACE_DEBUG, "Dropped short datagram [len: %lu]", udp_size);
+    return -1;
+  }
+
+  /* With locked communities, reject unknown ones on the raw bytes before
+   * spending any time decoding the packet. */
+  if(sss->lock_communities
+     && !community_filter_check(&sss->community_filter, &udp_buf[N2N_COMMON_COMMUNITY_OFFSET])) {
+    ++(sss->stats.drop_filter);
+    traceEvent(TRACE_DEBUG, "Dropped datagram for unknown community");
+    return -1;
+  }
+
   rem = udp_size; /* Counts down bytes of packet to protect against buffer overruns. */
-  idx = 0; /* marches through packet header as parts are decoded. */
-  if(decode_common(&cmn, udp_buf, &rem, &idx) < 0) {
-    traceEvent(TRACE_ERROR, "Failed to decode common section");
+  *idx = 0; /* marches through packet header as parts are decoded. */
+  if(decode_common(cmn, udp_buf, &rem, idx) < 0) {
+    ++(sss->stats.drop_decode);
+    traceEvent(TRACE_DEBUG, "Failed to decode common section");
     return -1; /* failed to decode packet */
   }
 
+  if(community_name_len(cmn->community) == N2N_COMMUNITY_SIZE) {
+    /* Not NULL terminated: cannot match any community we serve. */
+    ++(sss->stats.drop_unknown);
+    traceEvent(TRACE_DEBUG, "Dropped datagram with invalid community name");
+    return -1;
+  }
+
+  N2N_PROBE3(sn_decode, cmn->pc, cmn->flags, udp_size);
+
+  return 0;
+}
+
+/** Handle a message once its common header has been decoded by admit_udp().
+ *
+ */
+static int process_msg(n2n_sn_t * sss,
+		       const n2n_sockaddr_t * sender_sock,
+		       const n2n_common_t * hdr,
+		       const uint8_t * udp_buf,
+		       size_t udp_size,
+		       size_t idx,
+		       time_t now)
+{
+  n2n_common_t        cmn = *hdr; /* common fields in the packet header */
+  size_t              rem = udp_size - idx;
+  size_t              msg_type;
+  uint8_t             from_supernode;
+  macstr_t            mac_buf;
+  macstr_t            mac_buf2;
+  n2n_sock_str_t      sockbuf;
+
   msg_type = cmn.pc; /* packet code */
   from_supernode= cmn.flags & N2N_FLAGS_FROM_SUPERNODE;
 
@@ -529,9 +1561,7 @@ static int process_udp(n2n_sn_t * sss,
       /* We are going to add socket even if it was not there before */
       cmn2.flags |= N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
 
-      pkt.sock.family = AF_INET;
-      pkt.sock.port = ntohs(sender_sock->sin_port);
-      memcpy(pkt.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
+      sockaddr_to_sock(&pkt.sock, sender_sock);
 
       rec_buf = encbuf;
 
@@ -585,9 +1615,7 @@ static int process_udp(n2n_sn_t * sss,
 	/* We are going to add socket even if it was not there before */
 	cmn2.flags |= N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
 
-	reg.sock.family = AF_INET;
-	reg.sock.port = ntohs(sender_sock->sin_port);
-	memcpy(reg.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
+	sockaddr_to_sock(&reg.sock, sender_sock);
 
 	rec_buf = encbuf;
 
@@ -615,11 +1643,11 @@ static int process_udp(n2n_sn_t * sss,
   case MSG_TYPE_REGISTER_SUPER:
   {
     n2n_REGISTER_SUPER_t            reg;
-    n2n_REGISTER_SUPER_ACK_t        ack;
-    n2n_common_t                    cmn2;
-    uint8_t                         ackbuf[N2N_SN_PKTBUF_SIZE];
-    size_t                          encx=0;
+    n2n_sock_t                      sender;
+    uint8_t                         ackbuf[N2N_REGISTER_SUPER_ACK_V6_SIZE];
+    int                             encx;
     struct sn_community          *comm;
+    int                             known = 0; /* registered from this socket or just proved it */
 
     /* Edge requesting registration with us.  */
     sss->stats.last_reg_super=now;
@@ -628,6 +1656,33 @@ static int process_udp(n2n_sn_t * sss,
 
     HASH_FIND_COMMUNITY(sss->communities, (char*)cmn.community, comm);
 
+    sockaddr_to_sock(&sender, sender_sock);
+
+    if(comm) {
+      n2n_peer_slot_t *scan = peer_table_find(&comm->edges, reg.edgeMac);
+
+      known = (scan != NULL) && sock_equal(&sender, peer_table_sock(&comm->edges, scan));
+    }
+
+    /*
+      With challenges enabled, no state is allocated for an edge until it
+      proved that it can receive at the address it claims. Edges already
+      registered from the same socket are refreshed without a round trip.
+    */
+    if(sss->reg_challenge && !known && (comm || !sss->lock_communities)) {
+      if(challenge_valid(sss, sender_sock, &cmn, &reg))
+	known = 1;
+      else {
+	send_challenge(sss, sender_sock, &cmn, &reg);
+	N2N_PROBE2(sn_register, reg.edgeMac, 0);
+
+	traceEvent(TRACE_DEBUG, "Tx REGISTER_SUPER_NAK challenge for %s [%s]",
+		   macaddr_str(mac_buf, reg.edgeMac),
+		   sock_to_cstr(sockbuf, &sender));
+	break;
+      }
+    }
+
     /*
       Before we move any further, we need to check if the requested
       community is allowed by the supernode. In case it is not we do
@@ -640,6 +1695,7 @@ static int process_udp(n2n_sn_t * sss,
       if(comm) {
 	strncpy(comm->community, (char*)cmn.community, N2N_COMMUNITY_SIZE-1);
 	comm->community[N2N_COMMUNITY_SIZE-1] = '\0';
+	community_init_templates(sss, comm);
 	HASH_ADD_STR(sss->communities, community, comm);
 
 	traceEvent(TRACE_INFO, "New community: %s", comm->community);
@@ -647,39 +1703,55 @@ static int process_udp(n2n_sn_t * sss,
     }
 
     if(comm) {
-      cmn2.ttl = N2N_DEFAULT_TTL;
-      cmn2.pc = n2n_register_super_ack;
-      cmn2.flags = N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
-      memcpy(cmn2.community, cmn.community, sizeof(n2n_community_t));
-
-      memcpy(&(ack.cookie), &(reg.cookie), sizeof(n2n_cookie_t));
-      memcpy(ack.edgeMac, reg.edgeMac, sizeof(n2n_mac_t));
-      ack.lifetime = reg_lifetime(sss);
-
-      ack.sock.family = AF_INET;
-      ack.sock.port = ntohs(sender_sock->sin_port);
-      memcpy(ack.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
-
-      ack.num_sn=0; /* No backup */
-      memset(&(ack.sn_bak), 0, sizeof(n2n_sock_t));
-
+      comm->pkts++;
       traceEvent(TRACE_DEBUG, "Rx REGISTER_SUPER for %s [%s]",
 		 macaddr_str(mac_buf, reg.edgeMac),
-		 sock_to_cstr(sockbuf, &(ack.sock)));
+		 sock_to_cstr(sockbuf, &sender));
 
-      update_edge(sss, reg.edgeMac, comm, &(ack.sock), now);
+      update_edge(sss, reg.edgeMac, comm, &sender, now);
+      N2N_PROBE2(sn_register, reg.edgeMac, 1);
 
-      encode_REGISTER_SUPER_ACK(ackbuf, &encx, &cmn2, &ack);
+      if(sender.family == AF_INET) {
+	memcpy(ackbuf, comm->ack_tmpl, N2N_REGISTER_SUPER_ACK_V4_SIZE);
+	encx = patch_REGISTER_SUPER_ACK(ackbuf, reg.cookie, reg.edgeMac, &sender);
+      } else {
+	n2n_common_t             cmn2;
+	n2n_REGISTER_SUPER_ACK_t ack;
+	size_t                   ackx = 0;
+
+	memset(&cmn2, 0, sizeof(cmn2));
+	cmn2.ttl = N2N_DEFAULT_TTL;
+	cmn2.pc = n2n_register_super_ack;
+	cmn2.flags = N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
+	memcpy(cmn2.community, cmn.community, sizeof(n2n_community_t));
+
+	memset(&ack, 0, sizeof(ack));
+	memcpy(&(ack.cookie), &(reg.cookie), sizeof(n2n_cookie_t));
+	memcpy(ack.edgeMac, reg.edgeMac, sizeof(n2n_mac_t));
+	ack.lifetime = reg_lifetime(sss);
+	ack.sock = sender;
+	ack.num_sn = 0; /* No backup */
+
+	encode_REGISTER_SUPER_ACK(ackbuf, &ackx, &cmn2, &ack);
+	encx = ackx;
+      }
 
-      sendto(sss->sock, ackbuf, encx, 0,
-	     (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in));
+      sn_sendto_batched(sss, ackbuf, encx, sender_sock);
 
       traceEvent(TRACE_DEBUG, "Tx REGISTER_SUPER_ACK for %s [%s]",
 		 macaddr_str(mac_buf, reg.edgeMac),
-		 sock_to_cstr(sockbuf, &(ack.sock)));
-    } else
+		 sock_to_cstr(sockbuf, &sender));
+
+      /* The list is much larger than the request: never send it to a
+	 socket that may be spoofed. */
+      if((cmn.flags & N2N_FLAGS_PEER_LIST) && known)
+	send_peer_list(sss, comm, &reg, sender_sock);
+    } else {
+      ++(sss->stats.drop_unknown);
+      N2N_PROBE2(sn_register, reg.edgeMac, -1);
       traceEvent(TRACE_INFO, "Discarded registration: unallowed community '%s'",
 		 (char*)cmn.community);
+    }
     break;
   } case MSG_TYPE_QUERY_PEER: {
     n2n_QUERY_PEER_t query;
@@ -698,23 +1770,30 @@ static int process_udp(n2n_sn_t * sss,
     HASH_FIND_COMMUNITY(sss->communities, (char*)cmn.community, community);
 
     if(community) {
-      struct peer_info *scan;
-      HASH_FIND_PEER(community->edges, query.targetMac, scan);
+      n2n_peer_slot_t *scan = peer_table_find(&community->edges, query.targetMac);
+
+      community->pkts++;
 
       if (scan) {
-	  cmn2.ttl = N2N_DEFAULT_TTL;
-	  cmn2.pc = n2n_peer_info;
-	  cmn2.flags = N2N_FLAGS_FROM_SUPERNODE;
-	  memcpy( cmn2.community, cmn.community, sizeof(n2n_community_t) );
+	  const n2n_sock_t *sock = peer_table_sock(&community->edges, scan);
+
+	  if(sock->family == AF_INET) {
+	    memcpy( encbuf, community->peer_info_tmpl, N2N_PEER_INFO_V4_SIZE );
+	    encx = patch_PEER_INFO( encbuf, query.targetMac, sock );
+	  } else {
+	    cmn2.ttl = N2N_DEFAULT_TTL;
+	    cmn2.pc = n2n_peer_info;
+	    cmn2.flags = N2N_FLAGS_FROM_SUPERNODE;
+	    memcpy( cmn2.community, cmn.community, sizeof(n2n_community_t) );
 
-	  pi.aflags = 0;
-	  memcpy( pi.mac, query.targetMac, sizeof(n2n_mac_t) );
-	  pi.sock = scan->sock;
+	    pi.aflags = 0;
+	    memcpy( pi.mac, query.targetMac, sizeof(n2n_mac_t) );
+	    pi.sock = *sock;
 
-	  encode_PEER_INFO( encbuf, &encx, &cmn2, &pi );
+	    encode_PEER_INFO( encbuf, &encx, &cmn2, &pi );
+	  }
 
-	  sendto( sss->sock, encbuf, encx, 0,
-		  (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
+	  sn_sendto_batched( sss, encbuf, encx, sender_sock );
 
 	  traceEvent( TRACE_DEBUG, "Tx PEER_INFO to %s",
 		      macaddr_str( mac_buf, query.srcMac ) );
@@ -722,7 +1801,8 @@ static int process_udp(n2n_sn_t * sss,
 	  traceEvent( TRACE_DEBUG, "Ignoring QUERY_PEER for unknown edge %s",
 		      macaddr_str( mac_buf, query.targetMac ) );
       }
-    }
+    } else
+      ++(sss->stats.drop_unknown);
 
     break;
   }
@@ -734,6 +1814,220 @@ static int process_udp(n2n_sn_t * sss,
   return 0;
 }
 
+/** Examine a datagram and determine what to do with it.
+ *
+ */
+static int process_udp(n2n_sn_t * sss,
+		       const n2n_sockaddr_t * sender_sock,
+		       const uint8_t * udp_buf,
+		       size_t udp_size,
+		       time_t now)
+{
+  n2n_common_t        cmn; /* common fields in the packet header */
+  size_t              idx;
+
+  if(admit_udp(sss, sender_sock, udp_buf, udp_size, now, &cmn, &idx) < 0)
+    return -1;
+
+  return process_msg(sss, sender_sock, &cmn, udp_buf, udp_size, idx, now);
+}
+
+/* *************************************************** */
+
+#ifdef N2N_HAVE_XDP
+
+/** Locate the UDP payload of a frame received on the AF_XDP socket. The XDP
+ *  program already checked the protocols, only the lengths are left. */
+static uint8_t* xdp_udp_payload(uint8_t * frame,
+				uint32_t len,
+				n2n_sockaddr_t * sender_sock,
+				size_t * payload_len) {
+  uint16_t ip_len, udp_len;
+
+  if(len < N2N_SN_XDP_HDR_SIZE)
+    return(NULL);
+
+  ip_len = (frame[N2N_SN_XDP_ETH_SIZE + 2] << 8) | frame[N2N_SN_XDP_ETH_SIZE + 3];
+  udp_len = (frame[N2N_SN_XDP_ETH_SIZE + N2N_SN_XDP_IP_SIZE + 4] << 8)
+    | frame[N2N_SN_XDP_ETH_SIZE + N2N_SN_XDP_IP_SIZE + 5];
+
+  /* Short frames may carry ethernet padding: trust the IP and UDP lengths. */
+  if((ip_len > len - N2N_SN_XDP_ETH_SIZE)
+     || (udp_len < N2N_SN_XDP_UDP_SIZE)
+     || (udp_len != ip_len - N2N_SN_XDP_IP_SIZE))
+    return(NULL);
+
+  memset(sender_sock, 0, sizeof(struct sockaddr_in));
+  sender_sock->in.sin_family = AF_INET;
+  memcpy(&sender_sock->in.sin_addr.s_addr, &frame[N2N_SN_XDP_ETH_SIZE + 12], IPV4_SIZE);
+  memcpy(&sender_sock->in.sin_port, &frame[N2N_SN_XDP_ETH_SIZE + N2N_SN_XDP_IP_SIZE], 2);
+
+  *payload_len = udp_len - N2N_SN_XDP_UDP_SIZE;
+
+  return(&frame[N2N_SN_XDP_HDR_SIZE]);
+}
+
+static uint16_t ip_checksum(const uint8_t * hdr) {
+  uint32_t sum = 0;
+  int i;
+
+  for(i=0; i<N2N_SN_XDP_IP_SIZE; i+=2)
+    sum += (hdr[i] << 8) | hdr[i+1];
+
+  while(sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return((uint16_t)~sum);
+}
+
+/** The try_forward() of the fast path: a unicast PACKET from an edge to a
+ *  registered IPv4 edge is rewritten in the frame and sent back out of the
+ *  same interface. The socket of the sender is inserted by moving the headers
+ *  into the frame headroom so the payload is not touched.
+ *
+ *  The frame goes to the L2 peer it came from (the router in front of the
+ *  supernode) so this only suits a supernode with a single next hop.
+ *
+ *  Returns 1 when the frame at *addr is ready to be sent, 0 when the
+ *  datagram must take the regular path and -1 when it must be dropped. */
+static int sn_xdp_forward(n2n_sn_t * sss,
+			  uint64_t * addr,
+			  uint32_t * len,
+			  const n2n_sockaddr_t * sender_sock,
+			  size_t payload_len,
+			  time_t now) {
+  const size_t hdr_len = N2N_SN_XDP_HDR_SIZE + N2N_COMMON_SIZE + 2*N2N_MAC_SIZE;
+  uint8_t *frame = xdp_frame(&sss->xdp, *addr), *out, *n2n, *ip, *udp, tmp[N2N_MAC_SIZE];
+  struct sn_community *community;
+  n2n_peer_slot_t *scan;
+  n2n_sock_t sender;
+  uint16_t flags, csum;
+  size_t idx;
+
+  n2n = &frame[N2N_SN_XDP_HDR_SIZE];
+  flags = (n2n[2] << 8) | n2n[3];
+
+  if((payload_len < N2N_COMMON_SIZE + 2*N2N_MAC_SIZE)
+     || ((*addr & (N2N_XDP_FRAME_SIZE - 1)) < N2N_SOCK_V4_SIZE)
+     || (n2n[0] != N2N_PKT_VERSION)
+     || (n2n[1] < 1)
+     || ((flags & N2N_FLAGS_TYPE_MASK) != MSG_TYPE_PACKET)
+     || (flags & (N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE))
+     || is_multi_broadcast(&n2n[N2N_COMMON_SIZE + N2N_MAC_SIZE])
+     || (memchr(&n2n[N2N_COMMON_COMMUNITY_OFFSET], 0, N2N_COMMUNITY_SIZE) == NULL))
+    return(0);
+
+  HASH_FIND_COMMUNITY(sss->communities, (char*)&n2n[N2N_COMMON_COMMUNITY_OFFSET], community);
+  if(!community)
+    return(0);
+
+  scan = peer_table_find(&community->edges, &n2n[N2N_COMMON_SIZE + N2N_MAC_SIZE]);
+  if((scan == NULL) || (scan->addr == 0))
+    return(0);
+
+  if(sss->rate_limiter.sock_cells
+     && rate_limiter_over(&sss->rate_limiter, sender_sock, payload_len, now)) {
+    ++(sss->stats.drop_rate);
+    return(-1);
+  }
+
+  /* Move the headers up to the MACs in front and append the socket. */
+  out = frame - N2N_SOCK_V4_SIZE;
+  memmove(out, frame, hdr_len);
+
+  sockaddr_to_sock(&sender, sender_sock);
+  idx = hdr_len;
+  encode_sock(out, &idx, &sender);
+
+  n2n = &out[N2N_SN_XDP_HDR_SIZE];
+  flags |= N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
+  n2n[1]--; /* ttl */
+  n2n[2] = flags >> 8, n2n[3] = flags & 0xff;
+
+  /* Ethernet: back to where it came from */
+  memcpy(tmp, &out[0], N2N_MAC_SIZE);
+  memcpy(&out[0], &out[N2N_MAC_SIZE], N2N_MAC_SIZE);
+  memcpy(&out[N2N_MAC_SIZE], tmp, N2N_MAC_SIZE);
+
+  /* IP: from our address to the destination edge */
+  ip = &out[N2N_SN_XDP_ETH_SIZE];
+  payload_len += N2N_SOCK_V4_SIZE;
+  ip[2] = (N2N_SN_XDP_IP_SIZE + N2N_SN_XDP_UDP_SIZE + payload_len) >> 8;
+  ip[3] = (N2N_SN_XDP_IP_SIZE + N2N_SN_XDP_UDP_SIZE + payload_len) & 0xff;
+  ip[8] = 64; /* ttl */
+  memcpy(&ip[12], &ip[16], IPV4_SIZE);
+  memcpy(&ip[16], &scan->addr, IPV4_SIZE);
+  ip[10] = ip[11] = 0;
+  csum = ip_checksum(ip);
+  ip[10] = csum >> 8, ip[11] = csum & 0xff;
+
+  /* UDP: from our port to the edge, no checksum */
+  udp = &out[N2N_SN_XDP_ETH_SIZE + N2N_SN_XDP_IP_SIZE];
+  memcpy(&udp[0], &udp[2], 2);
+  udp[2] = scan->port >> 8, udp[3] = scan->port & 0xff;
+  udp[4] = (N2N_SN_XDP_UDP_SIZE + payload_len) >> 8;
+  udp[5] = (N2N_SN_XDP_UDP_SIZE + payload_len) & 0xff;
+  udp[6] = udp[7] = 0;
+
+  *addr -= N2N_SOCK_V4_SIZE;
+  *len = N2N_SN_XDP_HDR_SIZE + payload_len;
+
+  ++(sss->stats.fwd);
+  ++(sss->stats.xdp_fwd);
+  sss->stats.last_fwd = now;
+
+  N2N_PROBE3(sn_forward, scan->mac_addr, payload_len, 1);
+
+  return(1);
+}
+
+/** Process the frames queued on the AF_XDP socket. Whatever the fast path
+ *  cannot forward goes through process_udp() and the regular socket. */
+static void sn_xdp_burst(n2n_sn_t * sss, time_t now) {
+  uint64_t addr[N2N_SN_RX_BURST];
+  uint32_t len[N2N_SN_RX_BURST];
+  n2n_sockaddr_t sender_sock;
+  unsigned int num, i;
+  uint8_t *payload;
+  size_t payload_len;
+
+  xdp_flush(&sss->xdp);
+  num = xdp_rx_burst(&sss->xdp, addr, len, N2N_SN_RX_BURST);
+
+  for(i=0; i<num; i++) {
+    payload = xdp_udp_payload(xdp_frame(&sss->xdp, addr[i]), len[i], &sender_sock, &payload_len);
+
+    if(payload == NULL) {
+      ++(sss->stats.drop_short);
+      xdp_release(&sss->xdp, addr[i]);
+      continue;
+    }
+
+    if(sss->trace != NULL)
+      trace_record(sss, &sender_sock, payload, payload_len);
+
+    switch(sn_xdp_forward(sss, &addr[i], &len[i], &sender_sock, payload_len, now)) {
+    case 1:
+      if(xdp_tx(&sss->xdp, addr[i], len[i]) < 0) {
+	++(sss->stats.errors);
+	xdp_release(&sss->xdp, addr[i]);
+      }
+      break;
+
+    case 0:
+      process_udp(sss, &sender_sock, payload, payload_len, now);
+      /* fall through */
+    default:
+      xdp_release(&sss->xdp, addr[i]);
+    }
+  }
+
+  sn_flush_batch(sss);
+  xdp_flush(&sss->xdp);
+}
+
+#endif /* N2N_HAVE_XDP */
+
 /* *************************************************** */
 
 /** Help message to print if the command line arguments are not valid. */
@@ -743,10 +2037,22 @@ static void help() {
   printf("supernode <config file> (see supernode.conf)\n"
 	 "or\n"
 	 );
+  printf("supernode -r <file> [-R] [-c <path>] [-S] [-L <pps>[:<kbps>[:<share>]]]\n"
+	 "or\n"
+	 );
   printf("supernode ");
   printf("-l <lport> ");
   printf("-c <path> ");
   printf("[-f] ");
+  printf("[-S] ");
+  printf("[-L <pps>[:<kbps>[:<share>]]] ");
+  printf("[-x <cpu list>] ");
+  printf("[-B <usec>] ");
+  printf("[-q <bytes>|auto] ");
+  printf("[-T] ");
+  printf("[-w <file> [-H]] ");
+  printf("[-X <ifname>[@<queue>]] ");
+  printf("[-y <pps>] ");
   printf("[-v] ");
   printf("\n\n");
 
@@ -755,6 +2061,20 @@ static void help() {
 #if defined(N2N_HAVE_DAEMON)
   printf("-f        \tRun in foreground.\n");
 #endif /* #if defined(N2N_HAVE_DAEMON) */
+  printf("-S        \tRequire new edges to echo a registration challenge (flood protection).\n");
+  printf("-L <pps>[:<kbps>[:<share>]]\tLimit the traffic accepted from each source socket,\n"
+	 "          \tand from each source IP to <share> times that (default %u).\n", N2N_SN_RATE_IP_SHARE);
+  printf("-x <cpu list>\tPin the supernode to the first CPU of the list, eg. 2 or 0-3,8.\n");
+  printf("-B <usec>\tBusy-poll for <usec> after traffic before blocking (low latency).\n");
+  printf("-q <bytes>|auto\tUDP socket buffer size, or grow it when the kernel drops packets.\n");
+  printf("-T        \tMeasure kernel queueing latencies (SO_TIMESTAMPING), shown on the management port.\n");
+  printf("-w <file>\tRecord the received datagrams with their time and sender to <file>.\n");
+  printf("-H        \tOnly record the first %u bytes of each datagram (headers).\n", N2N_SN_TRACE_SNAPLEN);
+  printf("-r <file> \tReplay a recorded trace in-process, without sockets, and report the costs.\n");
+  printf("-R        \tReplay at the recorded pace instead of maximum speed.\n");
+  printf("-X <ifname>[@<queue>]\tForward unicast PACKETs with an AF_XDP socket on <ifname> (Linux).\n");
+  printf("-W <num>  \tProcess the communities on <num> worker threads (Linux).\n");
+  printf("-y <pps>  \tGive the edges sent more than <pps> datagrams/s a connected socket.\n");
   printf("-v        \tIncrease verbosity. Can be used multiple times.\n");
   printf("-h        \tThis help message.\n");
   printf("\n");
@@ -784,6 +2104,82 @@ static int setOption(int optkey, char *_optarg, n2n_sn_t *sss) {
     sss->daemon = 0;
     break;
 
+  case 'S': /* registration challenge */
+    sss->reg_challenge = 1;
+    break;
+
+  case 'L': /* per-source rate limit */
+    if(rate_limiter_init(&sss->rate_limiter, _optarg) == 0)
+      traceEvent(TRACE_NORMAL, "Rate limit per source: %u pps %u bytes/s, %u times that per IP",
+		 sss->rate_limiter.max_pps, sss->rate_limiter.max_bps, sss->rate_limiter.ip_share);
+    break;
+
+  case 'x': /* CPU affinity */
+    if(parse_cpu_list(_optarg, &sss->cpu_affinity) <= 0) {
+      traceEvent(TRACE_WARNING, "Invalid CPU list '%s': ignored", _optarg ? _optarg : "");
+      memset(&sss->cpu_affinity, 0, sizeof(n2n_cpu_list_t));
+    }
+    break;
+
+  case 'B': /* busy poll */
+    sss->busy_poll_usec = atoi(_optarg ? _optarg : "0");
+    break;
+
+  case 'q': /* socket buffers */
+    sss->sock_buf_size = parse_sock_buf_size(_optarg);
+    break;
+
+  case 'T': /* kernel timestamps */
+    sss->timestamping = 1;
+    break;
+
+  case 'w': /* record a trace */
+    if(_optarg != NULL)
+      sss->trace_path = strdup(_optarg);
+    break;
+
+  case 'H': /* record headers only */
+    sss->trace_headers_only = 1;
+    break;
+
+  case 'r': /* replay a trace */
+    if(_optarg != NULL) {
+      sss->replay_path = strdup(_optarg);
+      sss->daemon = 0;
+    }
+    break;
+
+  case 'R': /* replay at the original pace */
+    sss->replay_realtime = 1;
+    break;
+
+  case 'X': /* AF_XDP fast path */
+    if(_optarg != NULL) {
+      char *queue;
+
+      sss->xdp_ifname = strdup(_optarg);
+      if((queue = strchr(sss->xdp_ifname, '@')) != NULL) {
+	*queue = '\0';
+	sss->xdp_queue = atoi(&queue[1]);
+      }
+    }
+    break;
+
+  case 'W': /* worker threads */
+    sss->num_workers = atoi(_optarg ? _optarg : "0");
+    if((sss->num_workers < 0) || (sss->num_workers > N2N_SN_MAX_WORKERS)) {
+      traceEvent(TRACE_WARNING, "Invalid number of workers %d: using %d", sss->num_workers, N2N_SN_MAX_WORKERS);
+      sss->num_workers = (sss->num_workers < 0) ? 0 : N2N_SN_MAX_WORKERS;
+    }
+    break;
+
+  case 'y': /* connected sockets */
+    if((_optarg == NULL) || (atoi(_optarg) <= 0))
+      traceEvent(TRACE_WARNING, "Invalid rate '%s' for connected sockets: ignored", _optarg ? _optarg : "");
+    else
+      sss->conn_sock_pps = atoi(_optarg);
+    break;
+
   case 'h': /* help */
     help();
     break;
@@ -806,6 +2202,19 @@ static const struct option long_options[] = {
   { "communities",     required_argument, NULL, 'c' },
   { "foreground",      no_argument,       NULL, 'f' },
   { "local-port",      required_argument, NULL, 'l' },
+  { "reg-challenge",   no_argument,       NULL, 'S' },
+  { "rate-limit",      required_argument, NULL, 'L' },
+  { "cpu-affinity",    required_argument, NULL, 'x' },
+  { "busy-poll",       required_argument, NULL, 'B' },
+  { "sock-buf",        required_argument, NULL, 'q' },
+  { "timestamps",      no_argument,       NULL, 'T' },
+  { "record",          required_argument, NULL, 'w' },
+  { "record-headers",  no_argument,       NULL, 'H' },
+  { "replay",          required_argument, NULL, 'r' },
+  { "replay-realtime", no_argument,       NULL, 'R' },
+  { "xdp",             required_argument, NULL, 'X' },
+  { "workers",         required_argument, NULL, 'W' },
+  { "connect-edges",   required_argument, NULL, 'y' },
   { "help"   ,         no_argument,       NULL, 'h' },
   { "verbose",         no_argument,       NULL, 'v' },
   { NULL,              0,                 NULL,  0  }
@@ -817,7 +2226,7 @@ static const struct option long_options[] = {
 static int loadFromCLI(int argc, char * const argv[], n2n_sn_t *sss) {
   u_char c;
 
-  while((c = getopt_long(argc, argv, "fl:c:vh",
+  while((c = getopt_long(argc, argv, "fl:c:vhSL:x:B:q:Tw:Hr:RX:W:y:",
 			 long_options, NULL)) != '?') {
     if(c == 255) break;
     setOption(c, optarg, sss);
@@ -911,28 +2320,51 @@ static int loadFromFile(const char *path, n2n_sn_t *sss) {
 
 /* *************************************************** */
 
-static void dump_registrations(int signo) {
+static void dump_registrations(n2n_sn_t * sss) {
   struct sn_community *comm, *ctmp;
-  struct peer_info *list, *tmp;
+  n2n_sock_t *sock;
+  n2n_sock_str_t sockbuf;
   char buf[32];
-  time_t now = time(NULL);
+  uint32_t now = (uint32_t)time(NULL), i;
   u_int num = 0;
 
   traceEvent(TRACE_NORMAL, "====================================");
 
-  HASH_ITER(hh, sss_node.communities, comm, ctmp) {
+#ifdef N2N_SN_HAVE_WORKERS
+  /* The edge tables belong to the workers, only their reports can be read. */
+  for(num = 0; num < (u_int)sss->num_workers; num++) {
+    sn_worker_load_t load;
+
+    pthread_mutex_lock(&sss->workers[num].lock);
+    load = sss->workers[num].load;
+    pthread_mutex_unlock(&sss->workers[num].lock);
+
+    traceEvent(TRACE_NORMAL, "[worker: %u][communities: %u][edges: %u][pps: %u]",
+	       num, load.communities, load.edges, load.pps);
+  }
+  num = 0;
+#endif
+
+  HASH_ITER(hh, sss->communities, comm, ctmp) {
     traceEvent(TRACE_NORMAL, "Dumping community: %s", comm->community);
 
-    HASH_ITER(hh, comm->edges, list, tmp) {
-      if(list->sock.family == AF_INET)
+    for(i = 0; comm->edges.count && (i <= comm->edges.mask); i++) {
+      n2n_peer_slot_t *list = &comm->edges.slots[i];
+
+      if(list->port == 0)
+	continue;
+
+      sock = peer_table_sock(&comm->edges, list);
+
+      if(sock->family == AF_INET)
 	traceEvent(TRACE_NORMAL, "[id: %u][MAC: %s][edge: %u.%u.%u.%u:%u][last seen: %u sec ago]",
 		   ++num, macaddr_str(buf, list->mac_addr),
-		   list->sock.addr.v4[0], list->sock.addr.v4[1], list->sock.addr.v4[2], list->sock.addr.v4[3],
-		   list->sock.port,
+		   sock->addr.v4[0], sock->addr.v4[1], sock->addr.v4[2], sock->addr.v4[3],
+		   sock->port,
 		   now-list->last_seen);
       else
-	traceEvent(TRACE_NORMAL, "[id: %u][MAC: %s][edge: IPv6:%u][last seen: %u sec ago]",
-		   ++num, macaddr_str(buf, list->mac_addr), list->sock.port,
+	traceEvent(TRACE_NORMAL, "[id: %u][MAC: %s][edge: %s][last seen: %u sec ago]",
+		   ++num, macaddr_str(buf, list->mac_addr), sock_to_cstr(sockbuf, sock),
 		   now-list->last_seen);
     }
   }
@@ -942,10 +2374,40 @@ static void dump_registrations(int signo) {
 
 /* *************************************************** */
 
+/** Remove the expired registrations, and the communities left without edges
+ *  unless they were loaded from the allowed list. */
+static void purge_communities(n2n_sn_t * sss, time_t now) {
+  struct sn_community *comm, *tmp;
+  size_t num_reg = 0;
+
+  HASH_ITER(hh, sss->communities, comm, tmp) {
+    num_reg += peer_table_purge(&comm->edges, now - REGISTRATION_TIMEOUT);
+
+    /* Allowed communities are kept when locked, they make up the filter. */
+    if((comm->edges.count == 0) && !sss->lock_communities) {
+      traceEvent(TRACE_INFO, "Purging idle community %s", comm->community);
+      peer_table_free(&comm->edges);
+      HASH_DEL(sss->communities, comm);
+      free(comm);
+    }
+  }
+
+  traceEvent(TRACE_INFO, "Remove %u registrations", (unsigned int)num_reg);
+}
+
+/* *************************************************** */
+
 static int keep_running;
+static volatile sig_atomic_t dump_requested;
 
 #ifdef __linux__
 
+/** SIGHUP: the registrations are dumped by run_loop(), where the worker
+ *  locks can be taken. */
+static void dump_handler(int sig) {
+  dump_requested = 1;
+}
+
 static void term_handler(int sig) {
   static int called = 0;
 
@@ -963,6 +2425,570 @@ static void term_handler(int sig) {
 
 /* *************************************************** */
 
+#ifdef N2N_SN_HAVE_WORKERS
+
+/** Worker owning a community: the one it was moved to, otherwise the one
+ *  picked by the name hash. */
+static int sn_worker_route(const n2n_sn_t * sss, const n2n_community_t community) {
+  struct sn_route *route;
+
+  if(sss->routes != NULL) {
+    HASH_FIND_STR(sss->routes, (const char*)community, route);
+    if(route)
+      return(route->worker);
+  }
+
+  return(community_filter_hash(community, strlen((const char*)community)) % sss->num_workers);
+}
+
+/** Next free slot of a worker ring, NULL when full. Receiving thread only. */
+static sn_worker_slot_t* sn_worker_reserve(struct sn_worker * w) {
+  if((w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) >= N2N_SN_WORKER_RING)
+    return(NULL);
+
+  return(&w->ring[w->head & (N2N_SN_WORKER_RING - 1)]);
+}
+
+static void sn_worker_commit(struct sn_worker * w) {
+  __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+}
+
+/** Wake a worker up if it went to sleep on its empty ring. The fence pairs
+ *  with the one in sn_worker_sleep(): either the worker sees the new head or
+ *  we see it sleeping. */
+static void sn_worker_kick(struct sn_worker * w) {
+  uint64_t one = 1;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)
+     && (write(w->event, &one, sizeof(one)) != sizeof(one)))
+    traceEvent(TRACE_DEBUG, "Unable to wake worker %d: %s", w->id, strerror(errno));
+}
+
+static void sn_worker_sleep(struct sn_worker * w, int timeout_msec) {
+  struct pollfd pfd;
+  uint64_t val;
+
+  __atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == w->tail) {
+    pfd.fd = w->event;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if((poll(&pfd, 1, timeout_msec) > 0)
+       && (read(w->event, &val, sizeof(val)) != sizeof(val)))
+      traceEvent(TRACE_DEBUG, "Worker %d: eventfd read failed: %s", w->id, strerror(errno));
+  }
+
+  __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void sn_workers_kick(n2n_sn_t * sss, uint32_t mask) {
+  int i;
+
+  for(i=0; mask != 0; i++, mask >>= 1)
+    if(mask & 1)
+      sn_worker_kick(&sss->workers[i]);
+}
+
+/** Admit a datagram and queue it to the worker owning its community.
+ *  Returns the worker, or -1 when the datagram was dropped. */
+static int sn_dispatch(n2n_sn_t * sss,
+		       const n2n_sockaddr_t * sender_sock,
+		       const uint8_t * udp_buf,
+		       size_t udp_size,
+		       time_t now) {
+  n2n_common_t cmn;
+  size_t idx;
+  struct sn_worker *w;
+  sn_worker_slot_t *slot;
+
+  if(admit_udp(sss, sender_sock, udp_buf, udp_size, now, &cmn, &idx) < 0)
+    return(-1);
+
+  w = &sss->workers[sn_worker_route(sss, cmn.community)];
+
+  if((slot = sn_worker_reserve(w)) == NULL) {
+    ++(sss->stats.drop_worker);
+    return(-1);
+  }
+
+  slot->type = N2N_SN_WORKER_PACKET;
+  slot->sender = *sender_sock;
+  slot->cmn = cmn;
+  slot->idx = idx;
+  slot->size = udp_size;
+  slot->now = now;
+  memcpy(slot->buf, udp_buf, udp_size);
+  sn_worker_commit(w);
+
+  return(w->id);
+}
+
+/** Publish the load of the last period and restart the counters. */
+static void sn_worker_report(struct sn_worker * w, uint32_t msgs, time_t elapsed) {
+  struct sn_community *comm, *tmp;
+  sn_worker_load_t load;
+  size_t top_pkts = 0;
+
+  memset(&load, 0, sizeof(load));
+
+  HASH_ITER(hh, w->sn.communities, comm, tmp) {
+    if(comm->pkts > top_pkts) {
+      top_pkts = comm->pkts;
+      memcpy(load.top, comm->community, N2N_COMMUNITY_SIZE);
+    }
+
+    comm->pkts = 0;
+    load.communities++;
+    load.edges += comm->edges.count;
+  }
+
+  load.pps = msgs / elapsed;
+  load.top_pps = top_pkts / elapsed;
+
+  pthread_mutex_lock(&w->lock);
+  w->load = load;
+  w->stats = w->sn.stats;
+  pthread_mutex_unlock(&w->lock);
+}
+
+/** MIGRATE: take the community out of our table and hand it over. */
+static void sn_worker_migrate(struct sn_worker * w, const sn_worker_slot_t * slot) {
+  struct sn_community *comm;
+
+  HASH_FIND_COMMUNITY(w->sn.communities, (char*)slot->cmn.community, comm);
+  if(comm)
+    HASH_DEL(w->sn.communities, comm);
+
+  pthread_mutex_lock(&w->lock);
+  w->handoff = comm;
+  w->handoff_ready = 1;
+  pthread_cond_signal(&w->handoff_cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/** ADOPT: wait for the previous owner to reach its MIGRATE slot and take
+ *  the community. The receiving thread queued both slots at once and the
+ *  previous owner only has the datagrams queued before to go through. */
+static void sn_worker_adopt(struct sn_worker * w, const sn_worker_slot_t * slot) {
+  struct sn_worker *from = &w->parent->workers[slot->peer];
+  struct sn_community *comm, *existing;
+
+  pthread_mutex_lock(&from->lock);
+
+  /* sn_workers_stop() broadcasts once keep_running is cleared */
+  while(!from->handoff_ready && keep_running)
+    pthread_cond_wait(&from->handoff_cond, &from->lock);
+
+  if(!from->handoff_ready) {
+    pthread_mutex_unlock(&from->lock);
+    return;
+  }
+
+  comm = from->handoff;
+  from->handoff = NULL;
+  from->handoff_ready = 0;
+  pthread_mutex_unlock(&from->lock);
+
+  if(comm) {
+    HASH_FIND_COMMUNITY(w->sn.communities, comm->community, existing);
+
+    if(existing) {
+      /* Should not happen: the route only changes with this slot. */
+      traceEvent(TRACE_WARNING, "Worker %d already owns community %s", w->id, comm->community);
+      peer_table_free(&comm->edges);
+      free(comm);
+    } else {
+      HASH_ADD_STR(w->sn.communities, community, comm);
+      traceEvent(TRACE_NORMAL, "Community %s moved from worker %d to worker %d",
+		 comm->community, from->id, w->id);
+    }
+  }
+
+  __atomic_add_fetch(&w->parent->migrated, 1, __ATOMIC_RELEASE);
+}
+
+static void* sn_worker_main(void * arg) {
+  struct sn_worker *w = (struct sn_worker*)arg;
+  n2n_sn_t *sss = &w->sn;
+  time_t now = time(NULL), last_purge = now, last_report = now;
+  uint64_t last_rx_usec = 0;
+  uint32_t msgs = 0;
+
+  if(w->parent->cpu_affinity.num > 1)
+    pin_to_cpu(w->parent->cpu_affinity.cpu[(w->id + 1) % w->parent->cpu_affinity.num]);
+
+  while(keep_running) {
+    uint32_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+
+    if(head == w->tail) {
+      /* Busy-poll while traffic is flowing, block once idle. */
+      if((sss->busy_poll_usec == 0)
+	 || ((time_usec() - last_rx_usec) >= (uint64_t)sss->busy_poll_usec))
+	sn_worker_sleep(w, 1000);
+    } else {
+      while(w->tail != head) {
+	sn_worker_slot_t *slot = &w->ring[w->tail & (N2N_SN_WORKER_RING - 1)];
+
+	switch(slot->type) {
+	case N2N_SN_WORKER_PACKET:
+	  process_msg(sss, &slot->sender, &slot->cmn, slot->buf, slot->size, slot->idx, slot->now);
+	  msgs++;
+	  break;
+	case N2N_SN_WORKER_MIGRATE:
+	  sn_worker_migrate(w, slot);
+	  break;
+	case N2N_SN_WORKER_ADOPT:
+	  sn_worker_adopt(w, slot);
+	  break;
+	}
+
+	__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+      }
+
+      sn_flush_batch(sss);
+
+      if(sss->busy_poll_usec > 0)
+	last_rx_usec = time_usec();
+    }
+
+    now = time(NULL);
+
+    if(now != last_report) {
+      sn_worker_report(w, msgs, now - last_report);
+      msgs = 0;
+      last_report = now;
+    }
+
+    if((now - last_purge) >= PURGE_REGISTRATION_FREQUENCY) {
+      purge_communities(sss, now);
+      last_purge = now;
+    }
+  }
+
+  return(NULL);
+}
+
+/** Move the busiest community of the busiest worker to the least loaded
+ *  worker, when that lowers the peak by at least 10%. Big communities thus
+ *  end up on a worker of their own once there are enough workers, while the
+ *  many small ones stay where their name hash put them. One move at a time:
+ *  the next only starts once the previous one was adopted. */
+static void sn_rebalance(n2n_sn_t * sss) {
+  sn_worker_load_t load[N2N_SN_MAX_WORKERS];
+  sn_worker_slot_t *migrate, *adopt;
+  struct sn_route *route;
+  int i, hot = 0, cold = 0;
+
+  if(__atomic_load_n(&sss->migrated, __ATOMIC_ACQUIRE) != sss->migrations)
+    return;
+
+  for(i=0; i<sss->num_workers; i++) {
+    pthread_mutex_lock(&sss->workers[i].lock);
+    load[i] = sss->workers[i].load;
+    pthread_mutex_unlock(&sss->workers[i].lock);
+
+    if(load[i].pps > load[hot].pps) hot = i;
+    if(load[i].pps < load[cold].pps) cold = i;
+  }
+
+  if((load[hot].pps < N2N_SN_REBALANCE_MIN_PPS)
+     || (load[hot].top_pps == 0)
+     || (((uint64_t)load[cold].pps + load[hot].top_pps) * 10 > (uint64_t)load[hot].pps * 9))
+    return;
+
+  /* The report may predate the last move */
+  if(sn_worker_route(sss, load[hot].top) != hot)
+    return;
+
+  if(((migrate = sn_worker_reserve(&sss->workers[hot])) == NULL)
+     || ((adopt = sn_worker_reserve(&sss->workers[cold])) == NULL))
+    return;
+
+  migrate->type = N2N_SN_WORKER_MIGRATE;
+  migrate->peer = cold;
+  memcpy(migrate->cmn.community, load[hot].top, N2N_COMMUNITY_SIZE);
+  sn_worker_commit(&sss->workers[hot]);
+
+  adopt->type = N2N_SN_WORKER_ADOPT;
+  adopt->peer = hot;
+  memcpy(adopt->cmn.community, load[hot].top, N2N_COMMUNITY_SIZE);
+  sn_worker_commit(&sss->workers[cold]);
+
+  sn_worker_kick(&sss->workers[hot]);
+  sn_worker_kick(&sss->workers[cold]);
+
+  HASH_FIND_STR(sss->routes, (char*)load[hot].top, route);
+  if(route == NULL) {
+    route = (struct sn_route*)calloc(1, sizeof(struct sn_route));
+    if(route == NULL) {
+      traceEvent(TRACE_ERROR, "Unable to allocate a community route");
+      exit(-1); /* Both workers already acted on the move */
+    }
+    memcpy(route->community, load[hot].top, N2N_COMMUNITY_SIZE);
+    HASH_ADD_STR(sss->routes, community, route);
+  }
+  route->worker = cold;
+  sss->migrations++;
+
+  traceEvent(TRACE_NORMAL, "Moving community %s (%u pps) from worker %d (%u pps) to worker %d (%u pps)",
+	     (char*)load[hot].top, load[hot].top_pps, hot, load[hot].pps, cold, load[cold].pps);
+}
+
+/** Start the workers and hand them the communities loaded so far. */
+static int sn_workers_start(n2n_sn_t * sss) {
+  struct sn_community *comm, *tmp;
+  sigset_t mask, saved;
+  int i;
+
+  sss->workers = (struct sn_worker*)calloc(sss->num_workers, sizeof(struct sn_worker));
+  if(sss->workers == NULL)
+    return(-1);
+
+  for(i=0; i<sss->num_workers; i++) {
+    struct sn_worker *w = &sss->workers[i];
+
+    w->sn = *sss;
+    w->sn.num_workers = 0;
+    w->sn.workers = NULL;
+    w->sn.routes = NULL;
+    w->sn.communities = NULL;
+    w->sn.trace = NULL;
+    w->sn.mgmt_sock = -1;
+    w->sn.xdp.fd = -1;
+    memset(&w->sn.stats, 0, sizeof(sn_stats_t));
+    memset(&w->sn.tx_batch, 0, sizeof(sn_tx_batch_t));
+    memset(&w->sn.tstamp, 0, sizeof(n2n_tstamp_t));
+    memset(&w->sn.rate_limiter, 0, sizeof(sn_rate_limiter_t)); /* Applied by admit_udp() */
+    w->parent = sss;
+    w->id = i;
+    w->event = eventfd(0, EFD_NONBLOCK);
+    w->ring = (sn_worker_slot_t*)calloc(N2N_SN_WORKER_RING, sizeof(sn_worker_slot_t));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->handoff_cond, NULL);
+
+    if((w->event < 0) || (w->ring == NULL))
+      return(-1);
+  }
+
+  HASH_ITER(hh, sss->communities, comm, tmp) {
+    HASH_DEL(sss->communities, comm);
+    i = sn_worker_route(sss, (uint8_t*)comm->community);
+    HASH_ADD_STR(sss->workers[i].sn.communities, community, comm);
+  }
+
+  /* Signals are left to the receiving thread, which must leave select() */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &mask, &saved);
+
+  for(i=0; i<sss->num_workers; i++) {
+    if(pthread_create(&sss->workers[i].thread, NULL, sn_worker_main, &sss->workers[i]) != 0)
+      return(-1);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  return(0);
+}
+
+static void sn_workers_stop(n2n_sn_t * sss) {
+  struct sn_community *comm, *tmp;
+  struct sn_route *route, *rtmp;
+  int i;
+
+  for(i=0; i<sss->num_workers; i++) {
+    uint64_t one = 1;
+
+    if(write(sss->workers[i].event, &one, sizeof(one)) != sizeof(one))
+      traceEvent(TRACE_DEBUG, "Unable to wake worker %d: %s", i, strerror(errno));
+
+    /* A worker may be waiting for a handoff that will never come */
+    pthread_mutex_lock(&sss->workers[i].lock);
+    pthread_cond_broadcast(&sss->workers[i].handoff_cond);
+    pthread_mutex_unlock(&sss->workers[i].lock);
+  }
+
+  for(i=0; i<sss->num_workers; i++)
+    pthread_join(sss->workers[i].thread, NULL);
+
+  /* Give the communities back so that deinit_sn() frees them */
+  for(i=0; i<sss->num_workers; i++) {
+    struct sn_worker *w = &sss->workers[i];
+
+    HASH_ITER(hh, w->sn.communities, comm, tmp) {
+      HASH_DEL(w->sn.communities, comm);
+      HASH_ADD_STR(sss->communities, community, comm);
+    }
+
+    if(w->handoff) {
+      peer_table_free(&w->handoff->edges);
+      free(w->handoff);
+    }
+
+    close(w->event);
+    free(w->ring);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->handoff_cond);
+  }
+
+  HASH_ITER(hh, sss->routes, route, rtmp) {
+    HASH_DEL(sss->routes, route);
+    free(route);
+  }
+
+  free(sss->workers);
+  sss->workers = NULL;
+  sss->num_workers = 0;
+}
+
+#endif /* N2N_SN_HAVE_WORKERS */
+
+/* *************************************************** */
+
+typedef struct sn_replay_type {
+  size_t   count;
+  size_t   bytes;
+  uint64_t nsec;              /* Time spent in process_udp() */
+} sn_replay_type_t;
+
+/** Feed a recorded trace through process_udp() without any socket and report
+ *  the forwarding throughput and the cost of each message type. Headers only
+ *  traces are padded with zeros to the original datagram size. */
+static int run_replay(n2n_sn_t * sss) {
+  sn_replay_type_t types[N2N_FLAGS_TYPE_MASK + 1];
+  uint8_t hdr[N2N_SN_TRACE_HDR_SIZE], rec[N2N_SN_TRACE_REC_SIZE];
+  uint8_t pktbuf[N2N_SN_PKTBUF_SIZE], magic[4], version, flags;
+  uint16_t snaplen, port, orig_len, cap_len, reserved16;
+  uint32_t start_time, delta, reserved32;
+  uint64_t trace_usec = 0, begin_usec, begin_nsec, t0, elapsed_nsec, total_nsec = 0;
+  size_t rem, idx, num = 0, bytes = 0;
+  n2n_sockaddr_t sender_sock;
+  FILE *fd;
+  int i;
+
+  if((fd = fopen(sss->replay_path, "rb")) == NULL) {
+    traceEvent(TRACE_ERROR, "Unable to open trace %s [%s]", sss->replay_path, strerror(errno));
+    return(-1);
+  }
+
+  rem = sizeof(hdr), idx = 0;
+  if((fread(hdr, sizeof(hdr), 1, fd) != 1)
+     || (decode_buf(magic, sizeof(magic), hdr, &rem, &idx) < 0)
+     || (memcmp(magic, N2N_SN_TRACE_MAGIC, sizeof(magic)) != 0)
+     || (decode_uint8(&version, hdr, &rem, &idx) < 0)
+     || (version != N2N_SN_TRACE_VERSION)) {
+    traceEvent(TRACE_ERROR, "%s is not a supernode trace", sss->replay_path);
+    fclose(fd);
+    return(-1);
+  }
+
+  decode_uint8(&flags, hdr, &rem, &idx);
+  decode_uint16(&snaplen, hdr, &rem, &idx);
+  decode_uint32(&start_time, hdr, &rem, &idx);
+  decode_uint32(&reserved32, hdr, &rem, &idx);
+
+  traceEvent(TRACE_NORMAL, "Replaying %s (%s, snaplen %u) at %s speed", sss->replay_path,
+	     (flags & N2N_SN_TRACE_HEADERS_ONLY) ? "headers only" : "full datagrams",
+	     snaplen, sss->replay_realtime ? "original" : "maximum");
+
+  memset(types, 0, sizeof(types));
+  memset(&sender_sock, 0, sizeof(sender_sock));
+  sender_sock.in.sin_family = AF_INET;
+
+  sss->start_time = (time_t)start_time;
+  begin_usec = time_usec(), begin_nsec = time_nsec();
+
+  while(keep_running && (fread(rec, sizeof(rec), 1, fd) == 1)) {
+    time_t now;
+    uint16_t msg_type;
+
+    rem = sizeof(rec), idx = 0;
+    decode_uint32(&delta, rec, &rem, &idx);
+    decode_buf((uint8_t *)&sender_sock.in.sin_addr.s_addr, IPV4_SIZE, rec, &rem, &idx);
+    decode_uint16(&port, rec, &rem, &idx);
+    decode_uint16(&orig_len, rec, &rem, &idx);
+    decode_uint16(&cap_len, rec, &rem, &idx);
+    decode_uint16(&reserved16, rec, &rem, &idx);
+
+    if((cap_len > orig_len) || (orig_len > sizeof(pktbuf))
+       || ((cap_len > 0) && (fread(pktbuf, cap_len, 1, fd) != 1))) {
+      traceEvent(TRACE_ERROR, "Truncated or corrupted trace after %u datagrams", (unsigned int)num);
+      break;
+    }
+
+    memset(&pktbuf[cap_len], 0, orig_len - cap_len);
+    sender_sock.in.sin_port = htons(port);
+
+    trace_usec += delta;
+    now = (time_t)(start_time + trace_usec / 1000000);
+
+    if(sss->replay_realtime) {
+      uint64_t target = begin_usec + trace_usec, cur = time_usec();
+
+      if(target > cur) {
+#ifdef WIN32
+	Sleep((DWORD)((target - cur) / 1000));
+#else
+	usleep((useconds_t)(target - cur));
+#endif
+      }
+    }
+
+    msg_type = (orig_len >= 4) ? (((pktbuf[2] << 8) | pktbuf[3]) & N2N_FLAGS_TYPE_MASK) : 0;
+
+    t0 = time_nsec();
+    process_udp(sss, &sender_sock, pktbuf, orig_len, now);
+    sn_flush_batch(sss);
+    elapsed_nsec = time_nsec() - t0;
+
+    types[msg_type].count++;
+    types[msg_type].bytes += orig_len;
+    types[msg_type].nsec += elapsed_nsec;
+    total_nsec += elapsed_nsec;
+    num++, bytes += orig_len;
+  }
+
+  fclose(fd);
+
+  elapsed_nsec = time_nsec() - begin_nsec;
+  if(elapsed_nsec == 0) elapsed_nsec = 1;
+  if(total_nsec == 0) total_nsec = 1;
+
+  printf("Replayed %u datagrams (%u bytes) in %.3f sec: %.0f datagrams/s\n",
+	 (unsigned int)num, (unsigned int)bytes, (double)elapsed_nsec / 1e9,
+	 (double)num * 1e9 / elapsed_nsec);
+  printf("Processing only: %.0f datagrams/s, %.1f ns/datagram\n",
+	 (double)num * 1e9 / total_nsec, num ? (double)total_nsec / num : 0.0);
+  printf("Forwarded %u, broadcast %u, errors %u: %u datagrams sent (%.2f Mbit/s)\n",
+	 (unsigned int)sss->stats.fwd, (unsigned int)sss->stats.broadcast,
+	 (unsigned int)sss->stats.errors, (unsigned int)sss->replay_tx,
+	 (double)sss->replay_tx_bytes * 8 * 1000 / elapsed_nsec);
+  printf("%-26s %10s %12s %10s %7s\n", "Message type", "Count", "Bytes", "ns/msg", "Share");
+
+  for(i=0; i<=N2N_FLAGS_TYPE_MASK; i++) {
+    if(types[i].count == 0)
+      continue;
+
+    printf("%-26s %10u %12u %10.1f %6.1f%%\n", msg_type2str(i),
+	   (unsigned int)types[i].count, (unsigned int)types[i].bytes,
+	   (double)types[i].nsec / types[i].count,
+	   (double)types[i].nsec * 100 / total_nsec);
+  }
+
+  deinit_sn(sss);
+
+  return(0);
+}
+
+/* *************************************************** */
+
 /** Main program entry point from kernel. */
 int main(int argc, char * const argv[]) {
   int rc;
@@ -1000,7 +3026,39 @@ int main(int argc, char * const argv[]) {
 
   traceEvent(TRACE_DEBUG, "traceLevel is %d", getTraceLevel());
 
-  sss_node.sock = open_socket(sss_node.lport, 1 /*bind ANY*/);
+  if(sss_node.reg_challenge)
+    challenge_rotate(sss_node.challenge, time(NULL));
+
+  if(sss_node.replay_path != NULL) {
+#ifdef __linux__
+    signal(SIGTERM, term_handler);
+    signal(SIGINT, term_handler);
+#endif
+
+    keep_running = 1;
+    return(run_replay(&sss_node));
+  }
+
+  /* The packet buffers and the rate limiter sketches are first touched in
+   * run_loop(), after pinning, so they end up on the local NUMA node. */
+  if(sss_node.cpu_affinity.num > 0)
+    pin_to_cpu(sss_node.cpu_affinity.cpu[0]);
+
+#ifdef N2N_SN_HAVE_WORKERS
+  /* Workers send from their own copy of the supernode state, the connected
+   * sockets must stay with the receiving thread. */
+  if((sss_node.num_workers > 0) && sss_node.conn_sock_pps) {
+    traceEvent(TRACE_WARNING, "Connected sockets are not supported with workers: -y ignored");
+    sss_node.conn_sock_pps = 0;
+  }
+#endif
+
+  /* The connected sockets of the busy edges share its port */
+  if(sss_node.conn_sock_pps)
+    sss_node.sock = open_socket_reuseport(sss_node.lport, htonl(INADDR_ANY));
+  else
+    sss_node.sock = open_socket(sss_node.lport, 1 /*bind ANY*/);
+
   if(-1 == sss_node.sock) {
     traceEvent(TRACE_ERROR, "Failed to open main socket. %s", strerror(errno));
     exit(-2);
@@ -1008,6 +3066,61 @@ int main(int argc, char * const argv[]) {
     traceEvent(TRACE_NORMAL, "supernode is listening on UDP %u (main)", sss_node.lport);
   }
 
+  if((sss_node.sock6 = open_socket6(sss_node.lport)) >= 0)
+    traceEvent(TRACE_NORMAL, "supernode is listening on UDP %u (IPv6)", sss_node.lport);
+  else
+    traceEvent(TRACE_NORMAL, "No IPv6 socket, serving IPv4 edges only");
+
+  if(sss_node.cpu_affinity.num > 0)
+    set_incoming_cpu(sss_node.sock, sss_node.cpu_affinity.cpu[0]);
+
+  if(sss_node.busy_poll_usec > 0)
+    set_busy_poll(sss_node.sock, sss_node.busy_poll_usec);
+
+  sock_buf_init(sss_node.sock, sss_node.sock_buf_size, &sss_node.sock_buf);
+
+  if(sss_node.conn_sock_pps
+     && (conn_socks_init(&sss_node.conn_socks, sss_node.sock, sss_node.conn_sock_pps) == 0))
+    traceEvent(TRACE_NORMAL, "Connecting a socket to the edges sent over %u datagrams/s",
+	       (unsigned int)sss_node.conn_sock_pps);
+
+#ifdef N2N_SN_HAVE_WORKERS
+  if(sss_node.num_workers > 0) {
+    /* Workers send on the main socket: their TX timestamps could not be
+     * told apart, and the XDP path forwards from the receiving thread. */
+    if(sss_node.timestamping) {
+      traceEvent(TRACE_WARNING, "Kernel timestamps are not supported with workers: -T ignored");
+      sss_node.timestamping = 0;
+    }
+
+    if(sss_node.xdp_ifname != NULL) {
+      traceEvent(TRACE_WARNING, "AF_XDP is not supported with workers: -X ignored");
+      free(sss_node.xdp_ifname);
+      sss_node.xdp_ifname = NULL;
+    }
+  }
+#else
+  if(sss_node.num_workers > 0) {
+    traceEvent(TRACE_WARNING, "Worker threads are not supported on this platform: -W ignored");
+    sss_node.num_workers = 0;
+  }
+#endif
+
+  if(sss_node.timestamping)
+    tstamp_enable(sss_node.sock, &sss_node.tstamp);
+
+  if(sss_node.xdp_ifname != NULL) {
+#ifdef N2N_HAVE_XDP
+    if(xdp_open(&sss_node.xdp, sss_node.xdp_ifname, sss_node.xdp_queue, sss_node.lport) == 0)
+      traceEvent(TRACE_NORMAL, "supernode is forwarding PACKETs with AF_XDP on %s queue %d",
+		 sss_node.xdp_ifname, sss_node.xdp_queue);
+    else
+      traceEvent(TRACE_WARNING, "AF_XDP fast path disabled");
+#else
+    traceEvent(TRACE_WARNING, "AF_XDP is not supported on this platform: -X ignored");
+#endif
+  }
+
   sss_node.mgmt_sock = open_socket(N2N_SN_MGMT_PORT, 0 /* bind LOOPBACK */);
   if(-1 == sss_node.mgmt_sock) {
     traceEvent(TRACE_ERROR, "Failed to open management socket. %s", strerror(errno));
@@ -1015,30 +3128,123 @@ int main(int argc, char * const argv[]) {
   } else
     traceEvent(TRACE_NORMAL, "supernode is listening on UDP %u (management)", N2N_SN_MGMT_PORT);
 
+  if(sss_node.trace_path != NULL)
+    trace_open(&sss_node);
+
+  keep_running = 1;
+
+#ifdef N2N_SN_HAVE_WORKERS
+  if(sss_node.num_workers > 0) {
+    if(sn_workers_start(&sss_node) != 0) {
+      traceEvent(TRACE_ERROR, "Failed to start the worker threads. %s", strerror(errno));
+      exit(-2);
+    }
+
+    traceEvent(TRACE_NORMAL, "supernode is processing communities on %d workers", sss_node.num_workers);
+  }
+#endif
+
   traceEvent(TRACE_NORMAL, "supernode started");
 
 #ifdef __linux__
   signal(SIGTERM, term_handler);
   signal(SIGINT, term_handler);
-  signal(SIGHUP, dump_registrations);
+  signal(SIGHUP, dump_handler);
 #endif
 
-  keep_running = 1;
   return run_loop(&sss_node);
 }
 
 
+/** Read what is queued on sock, up to a burst, so that the replies can be
+ *  sent together. Returns -1 when the socket failed. */
+static int sn_recv_burst(n2n_sn_t * sss, SOCKET sock, uint8_t * pktbuf, time_t now) {
+  n2n_sockaddr_t      sender_sock;
+  socklen_t           i;
+  n2n_rx_meta_t       meta;
+  ssize_t             bread;
+  int                 burst, rc = 0;
+  uint32_t            kick = 0; /* Workers with new datagrams */
+
+  if(sock == sss->sock)
+    tstamp_drain_tx(sock, &sss->tstamp);
+
+  for(burst=0; burst<N2N_SN_RX_BURST; burst++) {
+    i = sizeof(sender_sock);
+    bread = recvfrom_meta(sock, pktbuf, N2N_SN_PKTBUF_SIZE,
+			  &sender_sock.sa, &i, &meta);
+
+#ifndef WIN32
+    if((bread < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      break; /* queue drained, or only TX timestamps were queued */
+#endif
+
+    if((bread < 0)
+#ifdef WIN32
+       && (WSAGetLastError() != WSAECONNRESET)
+#endif
+    ) {
+      if((sock != sss->sock) && (sock != sss->sock6)) {
+	/* The edge of a connected socket went away */
+	rc = -1;
+	break;
+      }
+
+      /* For UDP bread of zero just means no data (unlike TCP). */
+      /* The fd is no good now. Maybe we lost our interface. */
+      traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
+#ifdef WIN32
+      traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
+#endif
+      rc = -1;
+      break;
+    }
+
+    /* We have a datagram to process */
+    if(bread > 0) {
+      if(sock == sss->sock) {
+	sock_buf_update(sock, &sss->sock_buf, &meta, now);
+	tstamp_rx(&sss->tstamp, &meta);
+      }
+
+      if(sss->trace != NULL)
+	trace_record(sss, &sender_sock, pktbuf, bread);
+
+      /* And the datagram has data (not just a header) */
+#ifdef N2N_SN_HAVE_WORKERS
+      if(sss->num_workers > 0) {
+	int w = sn_dispatch(sss, &sender_sock, pktbuf, bread, now);
+
+	if(w >= 0)
+	  kick |= ((uint32_t)1 << w);
+      } else
+#endif
+      process_udp(sss, &sender_sock, pktbuf, bread, now);
+    }
+  }
+
+  sn_flush_batch(sss);
+
+#ifdef N2N_SN_HAVE_WORKERS
+  if(kick != 0)
+    sn_workers_kick(sss, kick);
+#endif
+
+  return(rc);
+}
+
 /** Long lived processing entry point. Split out from main to simply
  *  daemonisation on some platforms. */
 static int run_loop(n2n_sn_t * sss) {
   uint8_t pktbuf[N2N_SN_PKTBUF_SIZE];
   time_t last_purge_edges = 0;
-  struct sn_community *comm, *tmp;
+  time_t last_rebalance = 0;
+  uint64_t last_rx_usec = 0;
 
   sss->start_time = time(NULL);
 
   while(keep_running) {
-    int rc;
+    int rc, s;
     ssize_t bread;
     int max_sock;
     fd_set socket_mask;
@@ -1051,42 +3257,68 @@ static int run_loop(n2n_sn_t * sss) {
     FD_SET(sss->sock, &socket_mask);
     FD_SET(sss->mgmt_sock, &socket_mask);
 
-    wait_time.tv_sec = 10; wait_time.tv_usec = 0;
+    if(sss->sock6 >= 0) {
+      FD_SET(sss->sock6, &socket_mask);
+      max_sock = MAX(max_sock, sss->sock6);
+    }
+
+    if(sss->xdp.fd >= 0) {
+      FD_SET(sss->xdp.fd, &socket_mask);
+      max_sock = MAX(max_sock, sss->xdp.fd);
+    }
+
+    for(s=0; sss->conn_socks.pps && (s<N2N_CONN_SOCKS); s++) {
+      if(sss->conn_socks.slot[s].sock >= 0) {
+	FD_SET(sss->conn_socks.slot[s].sock, &socket_mask);
+	max_sock = MAX(max_sock, sss->conn_socks.slot[s].sock);
+      }
+    }
+
+    /* Busy-poll while traffic is flowing, block once idle. */
+    if((sss->busy_poll_usec > 0)
+       && ((time_usec() - last_rx_usec) < (uint64_t)sss->busy_poll_usec)) {
+      wait_time.tv_sec = 0; wait_time.tv_usec = 0;
+    } else {
+      wait_time.tv_sec = 10; wait_time.tv_usec = 0;
+    }
+
     rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
 
     now = time(NULL);
 
+    if((rc > 0) && (sss->busy_poll_usec > 0))
+      last_rx_usec = time_usec();
+
     if(rc > 0) {
       if(FD_ISSET(sss->sock, &socket_mask)) {
-	struct sockaddr_in  sender_sock;
-	socklen_t           i;
-
-	i = sizeof(sender_sock);
-	bread = recvfrom(sss->sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
-			 (struct sockaddr *)&sender_sock, (socklen_t*)&i);
-
-	if((bread < 0)
-#ifdef WIN32
-	   && (WSAGetLastError() != WSAECONNRESET)
-#endif
-	) {
-	  /* For UDP bread of zero just means no data (unlike TCP). */
-	  /* The fd is no good now. Maybe we lost our interface. */
-	  traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
-#ifdef WIN32
-	  traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
-#endif
+	if(sn_recv_burst(sss, sss->sock, pktbuf, now) < 0) {
 	  keep_running=0;
 	  break;
 	}
+      }
 
-	/* We have a datagram to process */
-	if(bread > 0) {
-	  /* And the datagram has data (not just a header) */
-	  process_udp(sss, &sender_sock, pktbuf, bread, now);
-	}
+      if((sss->sock6 >= 0) && FD_ISSET(sss->sock6, &socket_mask)
+	 && (sn_recv_burst(sss, sss->sock6, pktbuf, now) < 0)) {
+	/* Keep serving the IPv4 edges */
+	closesocket(sss->sock6);
+	sss->sock6 = -1;
       }
 
+      /* The kernel delivers the datagrams of the busy edges on their
+       * connected sockets */
+      for(s=0; sss->conn_socks.pps && (s<N2N_CONN_SOCKS); s++) {
+	SOCKET sock = sss->conn_socks.slot[s].sock;
+
+	if((sock >= 0) && FD_ISSET(sock, &socket_mask)
+	   && (sn_recv_burst(sss, sock, pktbuf, now) < 0))
+	  conn_sock_demote(&sss->conn_socks, sock);
+      }
+
+#ifdef N2N_HAVE_XDP
+      if((sss->xdp.fd >= 0) && FD_ISSET(sss->xdp.fd, &socket_mask))
+	sn_xdp_burst(sss, now);
+#endif
+
       if(FD_ISSET(sss->mgmt_sock, &socket_mask)) {
 	struct sockaddr_in  sender_sock;
 	size_t              i;
@@ -1108,18 +3340,37 @@ static int run_loop(n2n_sn_t * sss) {
       traceEvent(TRACE_DEBUG, "timeout");
     }
 
-    HASH_ITER(hh, sss->communities, comm, tmp) {
-      purge_expired_registrations( &comm->edges, &last_purge_edges );
+    if(dump_requested) {
+      dump_requested = 0;
+      dump_registrations(sss);
+    }
 
-      if(comm->edges == NULL) {
-	traceEvent(TRACE_INFO, "Purging idle community %s", comm->community);
-	HASH_DEL(sss->communities, comm);
-	free(comm);
-      }
+    /* With -W the workers own the communities and purge them */
+    if((sss->num_workers == 0) && ((now - last_purge_edges) >= PURGE_REGISTRATION_FREQUENCY)) {
+      purge_communities(sss, now);
+      last_purge_edges = now;
     }
 
+    if(sss->conn_socks.pps)
+      conn_socks_update(&sss->conn_socks, now);
+
+    if(sss->reg_challenge)
+      challenge_rotate(sss->challenge, now);
+
+#ifdef N2N_SN_HAVE_WORKERS
+    if((sss->num_workers > 1) && ((now - last_rebalance) >= N2N_SN_REBALANCE_INTERVAL)) {
+      sn_rebalance(sss);
+      last_rebalance = now;
+    }
+#endif
+
   } /* while */
 
+#ifdef N2N_SN_HAVE_WORKERS
+  if(sss->num_workers > 0)
+    sn_workers_stop(sss);
+#endif
+
   deinit_sn(sss);
 
   return 0;
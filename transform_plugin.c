@@ -0,0 +1,93 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Transforms loaded from a shared object, see n2n_transop_plugin_t.
+ *
+ * The plugin stays loaded for the life of the process: its deinit() is
+ * called through the n2n_trans_op_t like any other, and nothing is run
+ * after that could need it unloaded.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+#ifdef N2N_HAVE_DLOPEN
+#include <dlfcn.h>
+#endif
+
+/* ************************************** */
+
+int n2n_transop_plugin_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
+#ifdef N2N_HAVE_DLOPEN
+  const n2n_transop_plugin_t *plugin;
+  void *handle;
+
+  memset(ttt, 0, sizeof(n2n_trans_op_t));
+
+  if((handle = dlopen(conf->transop_plugin, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+    traceEvent(TRACE_ERROR, "Unable to load transform plugin: %s", dlerror());
+    return(-1);
+  }
+
+  plugin = (const n2n_transop_plugin_t *)dlsym(handle, N2N_TRANSOP_PLUGIN_SYMBOL);
+
+  if(plugin == NULL) {
+    traceEvent(TRACE_ERROR, "%s exports no %s", conf->transop_plugin, N2N_TRANSOP_PLUGIN_SYMBOL);
+    goto plugin_error;
+  }
+
+  if((plugin->abi_version != N2N_TRANSOP_PLUGIN_ABI)
+     || (plugin->trans_op_size != sizeof(n2n_trans_op_t))) {
+    traceEvent(TRACE_ERROR, "%s is built for plugin ABI %u (%u bytes), expecting %u (%u bytes)",
+	       conf->transop_plugin, plugin->abi_version, plugin->trans_op_size,
+	       N2N_TRANSOP_PLUGIN_ABI, (unsigned int)sizeof(n2n_trans_op_t));
+    goto plugin_error;
+  }
+
+  if((plugin->transform_id < N2N_TRANSFORM_ID_USER_START) || (plugin->init == NULL)) {
+    traceEvent(TRACE_ERROR, "%s: invalid transform ID %u, plugins start at %u",
+	       conf->transop_plugin, plugin->transform_id, N2N_TRANSFORM_ID_USER_START);
+    goto plugin_error;
+  }
+
+  if(plugin->init(conf->encrypt_key, ttt) != 0) {
+    traceEvent(TRACE_ERROR, "Transform plugin %s failed to initialise", plugin->name);
+    goto plugin_error;
+  }
+
+  if((ttt->fwd == NULL) || (ttt->rev == NULL) || (ttt->deinit == NULL) || (ttt->tick == NULL)
+     || (ttt->transform_id != plugin->transform_id)) {
+    traceEvent(TRACE_ERROR, "Transform plugin %s left its n2n_trans_op_t incomplete", plugin->name);
+    if(ttt->deinit) ttt->deinit(ttt);
+    goto plugin_error;
+  }
+
+  traceEvent(TRACE_NORMAL, "Loaded transform plugin %s (ID %u) from %s",
+	     plugin->name, plugin->transform_id, conf->transop_plugin);
+
+  return(0);
+
+ plugin_error:
+  memset(ttt, 0, sizeof(n2n_trans_op_t));
+  dlclose(handle);
+  return(-1);
+#else
+  traceEvent(TRACE_ERROR, "Transform plugins are not supported on this platform");
+  return(-1);
+#endif
+}
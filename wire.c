@@ -298,8 +298,15 @@ int encode_REGISTER_SUPER( uint8_t * base,
     retval += encode_common( base, idx, common );
     retval += encode_buf( base, idx, reg->cookie, N2N_COOKIE_SIZE );
     retval += encode_mac( base, idx, reg->edgeMac );
-    retval += encode_uint16( base, idx, 0 ); /* NULL auth scheme */
-    retval += encode_uint16( base, idx, 0 ); /* No auth data */
+    retval += encode_uint16( base, idx, reg->auth.scheme );
+    retval += encode_uint16( base, idx, reg->auth.toksize );
+    retval += encode_buf( base, idx, reg->auth.token, reg->auth.toksize );
+
+    if ( common->flags & N2N_FLAGS_PEER_LIST )
+    {
+        retval += encode_uint32( base, idx, reg->list_cursor );
+        retval += encode_uint16( base, idx, reg->list_max );
+    }
 
     return retval;
 }
@@ -316,7 +323,23 @@ int decode_REGISTER_SUPER( n2n_REGISTER_SUPER_t * reg,
     retval += decode_mac( reg->edgeMac, base, rem, idx );
     retval += decode_uint16( &(reg->auth.scheme), base, rem, idx );
     retval += decode_uint16( &(reg->auth.toksize), base, rem, idx );
+
+    if ( reg->auth.toksize > N2N_AUTH_TOKEN_SIZE )
+    {
+        /* Would overflow the token buffer: ignore the auth data */
+        reg->auth.scheme = N2N_AUTH_SCHEME_NONE;
+        reg->auth.toksize = 0;
+        return retval;
+    }
+
     retval += decode_buf( reg->auth.token, reg->auth.toksize, base, rem, idx );
+
+    if ( cmn->flags & N2N_FLAGS_PEER_LIST )
+    {
+        retval += decode_uint32( &(reg->list_cursor), base, rem, idx );
+        retval += decode_uint16( &(reg->list_max), base, rem, idx );
+    }
+
     return retval;
 }
 
@@ -413,6 +436,46 @@ int decode_REGISTER_SUPER_ACK( n2n_REGISTER_SUPER_ACK_t * reg,
     return retval;
 }
 
+int encode_REGISTER_SUPER_NAK( uint8_t * base,
+                               size_t * idx,
+                               const n2n_common_t * common,
+                               const n2n_REGISTER_SUPER_NAK_t * nak )
+{
+    int retval=0;
+    retval += encode_common( base, idx, common );
+    retval += encode_buf( base, idx, nak->cookie, N2N_COOKIE_SIZE );
+    retval += encode_uint16( base, idx, nak->auth.scheme );
+    retval += encode_uint16( base, idx, nak->auth.toksize );
+    retval += encode_buf( base, idx, nak->auth.token, nak->auth.toksize );
+
+    return retval;
+}
+
+int decode_REGISTER_SUPER_NAK( n2n_REGISTER_SUPER_NAK_t * nak,
+                               const n2n_common_t * cmn, /* info on how to interpret it */
+                               const uint8_t * base,
+                               size_t * rem,
+                               size_t * idx )
+{
+    size_t retval=0;
+
+    memset( nak, 0, sizeof(n2n_REGISTER_SUPER_NAK_t) );
+    retval += decode_buf( nak->cookie, N2N_COOKIE_SIZE, base, rem, idx );
+    retval += decode_uint16( &(nak->auth.scheme), base, rem, idx );
+    retval += decode_uint16( &(nak->auth.toksize), base, rem, idx );
+
+    if ( nak->auth.toksize > N2N_AUTH_TOKEN_SIZE )
+    {
+        nak->auth.scheme = N2N_AUTH_SCHEME_NONE;
+        nak->auth.toksize = 0;
+        return retval;
+    }
+
+    retval += decode_buf( nak->auth.token, nak->auth.toksize, base, rem, idx );
+
+    return retval;
+}
+
 int fill_sockaddr( struct sockaddr * addr,
                    size_t addrlen,
                    const n2n_sock_t * sock )
@@ -430,6 +493,18 @@ int fill_sockaddr( struct sockaddr * addr,
             retval=0;
         }
     }
+    else if ( AF_INET6 == sock->family )
+    {
+        if ( addrlen >= sizeof(struct sockaddr_in6) )
+        {
+            struct sockaddr_in6 * si = (struct sockaddr_in6 *)addr;
+            memset( si, 0, sizeof(struct sockaddr_in6) );
+            si->sin6_family = sock->family;
+            si->sin6_port = htons( sock->port );
+            memcpy( &(si->sin6_addr), sock->addr.v6, IPV6_SIZE );
+            retval=0;
+        }
+    }
 
     return retval;
 }
@@ -504,6 +579,179 @@ int decode_PEER_INFO( n2n_PEER_INFO_t * pkt,
     return retval;
 }
 
+/* Overwrite the per-edge fields of a REGISTER_SUPER_ACK previously encoded
+ * with an IPv4 socket and no backup supernode. */
+int patch_REGISTER_SUPER_ACK( uint8_t * base,
+                              const n2n_cookie_t cookie,
+                              const n2n_mac_t edgeMac,
+                              const n2n_sock_t * sock )
+{
+    size_t idx = N2N_COMMON_SIZE;
+
+    if ( sock->family != AF_INET )
+    {
+        return -1;
+    }
+
+    encode_buf( base, &idx, cookie, N2N_COOKIE_SIZE );
+    encode_mac( base, &idx, edgeMac );
+    idx += 2; /* lifetime */
+    encode_sock( base, &idx, sock );
+
+    return idx + 1; /* num_sn */
+}
+
+/* Overwrite the per-edge fields of a PEER_INFO previously encoded with an
+ * IPv4 socket. */
+int patch_PEER_INFO( uint8_t * base,
+                     const n2n_mac_t mac,
+                     const n2n_sock_t * sock )
+{
+    size_t idx = N2N_COMMON_SIZE + 2; /* aflags */
+
+    if ( sock->family != AF_INET )
+    {
+        return -1;
+    }
+
+    encode_mac( base, &idx, mac );
+    encode_sock( base, &idx, sock );
+
+    return idx;
+}
+
+int encode_PEER_LIST( uint8_t * base,
+                      size_t * idx,
+                      const n2n_common_t * common,
+                      const n2n_PEER_LIST_t * pkt )
+{
+    int retval=0;
+    uint8_t i;
+
+    retval += encode_common( base, idx, common );
+    retval += encode_uint16( base, idx, pkt->total );
+    retval += encode_uint32( base, idx, pkt->cursor );
+    retval += encode_uint8( base, idx, pkt->count );
+
+    for ( i=0; i < pkt->count; ++i )
+    {
+        retval += encode_mac( base, idx, pkt->peers[i].mac );
+        retval += encode_sock( base, idx, &(pkt->peers[i].sock) );
+    }
+
+    return retval;
+}
+
+int decode_PEER_LIST( n2n_PEER_LIST_t * pkt,
+                      const n2n_common_t * cmn, /* info on how to interpret it */
+                      const uint8_t * base,
+                      size_t * rem,
+                      size_t * idx )
+{
+    size_t retval=0;
+    uint8_t i;
+
+    memset( pkt, 0, sizeof(n2n_PEER_LIST_t) );
+    retval += decode_uint16( &(pkt->total), base, rem, idx );
+    retval += decode_uint32( &(pkt->cursor), base, rem, idx );
+    retval += decode_uint8( &(pkt->count), base, rem, idx );
+
+    if ( pkt->count > N2N_PEER_LIST_PAGE_SIZE )
+    {
+        return -1;
+    }
+
+    for ( i=0; i < pkt->count; ++i )
+    {
+        if ( *rem < N2N_MAC_SIZE + N2N_SOCK_V4_SIZE )
+        {
+            pkt->count = i; /* Truncated */
+            break;
+        }
+
+        retval += decode_mac( pkt->peers[i].mac, base, rem, idx );
+        retval += decode_sock( &(pkt->peers[i].sock), base, rem, idx );
+    }
+
+    return retval;
+}
+
+int encode_FEC( uint8_t * base,
+                size_t * idx,
+                const n2n_FEC_t * fec )
+{
+    int retval=0;
+
+    retval += encode_uint16( base, idx, fec->seq );
+    retval += encode_uint8( base, idx, fec->group );
+    retval += encode_uint8( base, idx, fec->index );
+    retval += encode_uint8( base, idx, fec->loss );
+    retval += encode_uint8( base, idx, fec->flags );
+
+    return retval;
+}
+
+int decode_FEC( n2n_FEC_t * fec,
+                const uint8_t * base,
+                size_t * rem,
+                size_t * idx )
+{
+    size_t retval=0;
+
+    if ( *rem < N2N_FEC_HDR_SIZE )
+    {
+        return -1;
+    }
+
+    retval += decode_uint16( &(fec->seq), base, rem, idx );
+    retval += decode_uint8( &(fec->group), base, rem, idx );
+    retval += decode_uint8( &(fec->index), base, rem, idx );
+    retval += decode_uint8( &(fec->loss), base, rem, idx );
+    retval += decode_uint8( &(fec->flags), base, rem, idx );
+
+    if ( (fec->group > N2N_FEC_MAX_GROUP) || (fec->index > fec->group) )
+    {
+        return -1;
+    }
+
+    return retval;
+}
+
+int encode_PATH_PROBE( uint8_t * base,
+                       size_t * idx,
+                       const n2n_common_t * common,
+                       const n2n_PATH_PROBE_t * pkt )
+{
+    int retval=0;
+
+    retval += encode_common( base, idx, common );
+    retval += encode_mac( base, idx, pkt->srcMac );
+    retval += encode_mac( base, idx, pkt->dstMac );
+    retval += encode_uint8( base, idx, pkt->path );
+    retval += encode_uint8( base, idx, pkt->echo );
+    retval += encode_uint32( base, idx, pkt->seq );
+
+    return retval;
+}
+
+int decode_PATH_PROBE( n2n_PATH_PROBE_t * pkt,
+                       const n2n_common_t * cmn, /* info on how to interpret it */
+                       const uint8_t * base,
+                       size_t * rem,
+                       size_t * idx )
+{
+    size_t retval=0;
+
+    memset( pkt, 0, sizeof(n2n_PATH_PROBE_t) );
+    retval += decode_mac( pkt->srcMac, base, rem, idx );
+    retval += decode_mac( pkt->dstMac, base, rem, idx );
+    retval += decode_uint8( &(pkt->path), base, rem, idx );
+    retval += decode_uint8( &(pkt->echo), base, rem, idx );
+    retval += decode_uint32( &(pkt->seq), base, rem, idx );
+
+    return retval;
+}
+
 int encode_QUERY_PEER( uint8_t * base,
                       size_t * idx,
                       const n2n_common_t * common,
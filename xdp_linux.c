@@ -0,0 +1,390 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* AF_XDP socket: frames of one interface queue are received into a UMEM
+ * shared with the kernel and can be transmitted again from the same memory.
+ * A small XDP program only redirects the IPv4/UDP frames carrying n2n
+ * PACKETs to a given port, everything else goes through the kernel stack. */
+
+#include "n2n.h"
+
+#ifdef N2N_HAVE_XDP
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#ifndef AF_XDP
+#define AF_XDP  44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define N2N_XDP_PROG_MAX_INSNS  48
+
+/* *************************************************** */
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+  return(syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr)));
+}
+
+static struct bpf_insn bpf_insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+  struct bpf_insn insn;
+
+  memset(&insn, 0, sizeof(insn));
+  insn.code = code;
+  insn.dst_reg = dst;
+  insn.src_reg = src;
+  insn.off = off;
+  insn.imm = imm;
+
+  return(insn);
+}
+
+/** Build the XDP program:
+ *
+ *  if(frame is IPv4/UDP without options or fragments to udp_port
+ *     and carries an n2n PACKET)
+ *    return bpf_redirect_map(xsks, rx_queue_index, XDP_PASS);
+ *  return XDP_PASS;
+ *
+ *  Fields are compared byte by byte so the program does not depend on the
+ *  host byte order. Returns the number of instructions. */
+static int xdp_prog_build(struct bpf_insn *prog, int map_fd, uint16_t udp_port) {
+  /* Frame offset, mask and expected value of the bytes to check. */
+  const struct { int16_t off; uint8_t mask; uint8_t val; } checks[] = {
+    { 12, 0xff, 0x08 },                 /* ethertype IPv4 */
+    { 13, 0xff, 0x00 },
+    { 14, 0xff, 0x45 },                 /* IPv4, no options */
+    { 20, 0x3f, 0x00 },                 /* not a fragment */
+    { 21, 0xff, 0x00 },
+    { 23, 0xff, IPPROTO_UDP },
+    { 36, 0xff, udp_port >> 8 },        /* UDP destination port */
+    { 37, 0xff, udp_port & 0xff },
+    { 42, 0xff, N2N_PKT_VERSION },      /* n2n common header */
+    { 45, N2N_FLAGS_TYPE_MASK, MSG_TYPE_PACKET },
+  };
+  int jumps[N2N_XDP_PROG_MAX_INSNS], num_jumps = 0, n = 0, i;
+
+  prog[n++] = bpf_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  prog[n++] = bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0);
+  prog[n++] = bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0);
+  prog[n++] = bpf_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+  prog[n++] = bpf_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 46);
+  jumps[num_jumps++] = n;
+  prog[n++] = bpf_insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+
+  for(i=0; i<(int)(sizeof(checks)/sizeof(checks[0])); i++) {
+    prog[n++] = bpf_insn(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, checks[i].off, 0);
+    if(checks[i].mask != 0xff)
+      prog[n++] = bpf_insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, checks[i].mask);
+    jumps[num_jumps++] = n;
+    prog[n++] = bpf_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, checks[i].val);
+  }
+
+  /* r1 = map (two instructions), r2 = rx_queue_index, r3 = fallback action */
+  prog[n++] = bpf_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+  prog[n++] = bpf_insn(0, 0, 0, 0, 0);
+  prog[n++] = bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0);
+  prog[n++] = bpf_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+  prog[n++] = bpf_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+  prog[n++] = bpf_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  /* pass: */
+  for(i=0; i<num_jumps; i++)
+    prog[jumps[i]].off = n - (jumps[i] + 1);
+
+  prog[n++] = bpf_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+  prog[n++] = bpf_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  return(n);
+}
+
+/** Load the program and attach it to the interface, redirecting to our
+ *  socket. The program is detached when xdp->link_fd is closed. */
+static int xdp_attach(n2n_xdp_t *xdp, uint16_t udp_port) {
+  struct bpf_insn prog[N2N_XDP_PROG_MAX_INSNS];
+  char log[4096];
+  union bpf_attr attr;
+  uint32_t key = xdp->queue, value = xdp->fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = xdp->queue + 1;
+  if((xdp->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+    traceEvent(TRACE_ERROR, "Unable to create XSK map [%s]", strerror(errno));
+    return(-1);
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = xdp->map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)&value;
+  if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+    traceEvent(TRACE_ERROR, "Unable to add the socket to the XSK map [%s]", strerror(errno));
+    return(-1);
+  }
+
+  log[0] = '\0';
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t)prog;
+  attr.insn_cnt = xdp_prog_build(prog, xdp->map_fd, udp_port);
+  attr.license = (uintptr_t)"GPL";
+  attr.log_buf = (uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+  if((xdp->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+    traceEvent(TRACE_ERROR, "Unable to load the XDP program [%s] %s", strerror(errno), log);
+    return(-1);
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = xdp->prog_fd;
+  attr.link_create.target_ifindex = xdp->ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  if((xdp->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+    traceEvent(TRACE_ERROR, "Unable to attach the XDP program [%s]", strerror(errno));
+    return(-1);
+  }
+
+  return(0);
+}
+
+/* *************************************************** */
+
+static int xdp_ring_map(n2n_xdp_t *xdp, n2n_xdp_ring_t *ring,
+			const struct xdp_ring_offset *off,
+			uint32_t size, size_t desc_size, off_t pgoff) {
+  ring->map_len = off->desc + size * desc_size;
+  ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, xdp->fd, pgoff);
+
+  if(ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    traceEvent(TRACE_ERROR, "Unable to map an XDP ring [%s]", strerror(errno));
+    return(-1);
+  }
+
+  ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+  ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+  ring->desc = (uint8_t *)ring->map + off->desc;
+  ring->mask = size - 1;
+
+  return(0);
+}
+
+static uint32_t xdp_ring_avail(const n2n_xdp_ring_t *ring) {
+  return(__atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer);
+}
+
+static uint32_t xdp_ring_free(const n2n_xdp_ring_t *ring) {
+  return(ring->mask + 1 - (*ring->producer - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE)));
+}
+
+/* *************************************************** */
+
+/** Open an AF_XDP socket on queue <queue> of <ifname> and redirect the n2n
+ *  PACKETs sent to <udp_port> to it. */
+int xdp_open(n2n_xdp_t *xdp, const char *ifname, int queue, uint16_t udp_port) {
+  struct xdp_umem_reg umem_reg;
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sxdp;
+  struct ifreq ifr;
+  socklen_t optlen = sizeof(off);
+  int fill_size = N2N_XDP_NUM_FRAMES, ring_size = N2N_XDP_RING_SIZE;
+  int sock;
+  uint32_t i;
+
+  memset(xdp, 0, sizeof(n2n_xdp_t));
+  xdp->fd = xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+  xdp->queue = queue;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+  sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if((sock < 0) || (ioctl(sock, SIOCGIFINDEX, &ifr) < 0)) {
+    traceEvent(TRACE_ERROR, "Unknown interface %s", ifname);
+    if(sock >= 0) close(sock);
+    return(-1);
+  }
+  close(sock);
+  xdp->ifindex = ifr.ifr_ifindex;
+
+  xdp->umem_len = (size_t)N2N_XDP_NUM_FRAMES * N2N_XDP_FRAME_SIZE;
+  xdp->umem = mmap(NULL, xdp->umem_len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(xdp->umem == MAP_FAILED) {
+    xdp->umem = NULL;
+    traceEvent(TRACE_ERROR, "Unable to allocate the XDP frames [%s]", strerror(errno));
+    goto fail;
+  }
+
+  if((xdp->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+    traceEvent(TRACE_ERROR, "Unable to open AF_XDP socket [%s]", strerror(errno));
+    goto fail;
+  }
+
+  memset(&umem_reg, 0, sizeof(umem_reg));
+  umem_reg.addr = (uintptr_t)xdp->umem;
+  umem_reg.len = xdp->umem_len;
+  umem_reg.chunk_size = N2N_XDP_FRAME_SIZE;
+  umem_reg.headroom = 0;
+
+  if((setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) < 0)
+     || (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(int)) < 0)
+     || (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(int)) < 0)
+     || (setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(int)) < 0)
+     || (setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(int)) < 0)
+     || (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)) {
+    traceEvent(TRACE_ERROR, "Unable to set up the XDP rings [%s]", strerror(errno));
+    goto fail;
+  }
+
+  if((xdp_ring_map(xdp, &xdp->fill, &off.fr, fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0)
+     || (xdp_ring_map(xdp, &xdp->comp, &off.cr, ring_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+     || (xdp_ring_map(xdp, &xdp->rx, &off.rx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0)
+     || (xdp_ring_map(xdp, &xdp->tx, &off.tx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0))
+    goto fail;
+
+  /* Every frame starts in the fill ring, the kernel hands them back on RX. */
+  for(i=0; i<N2N_XDP_NUM_FRAMES; i++)
+    ((uint64_t *)xdp->fill.desc)[i] = (uint64_t)i * N2N_XDP_FRAME_SIZE;
+  __atomic_store_n(xdp->fill.producer, N2N_XDP_NUM_FRAMES, __ATOMIC_RELEASE);
+
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = xdp->ifindex;
+  sxdp.sxdp_queue_id = queue;
+  if(bind(xdp->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+    traceEvent(TRACE_ERROR, "Unable to bind AF_XDP socket to %s queue %d [%s]",
+	       ifname, queue, strerror(errno));
+    goto fail;
+  }
+
+  if(xdp_attach(xdp, udp_port) < 0)
+    goto fail;
+
+  return(0);
+
+ fail:
+  xdp_close(xdp);
+  return(-1);
+}
+
+void xdp_close(n2n_xdp_t *xdp) {
+  n2n_xdp_ring_t *rings[] = { &xdp->fill, &xdp->comp, &xdp->rx, &xdp->tx };
+  unsigned int i;
+
+  if(xdp->link_fd >= 0) close(xdp->link_fd);
+  if(xdp->prog_fd >= 0) close(xdp->prog_fd);
+  if(xdp->map_fd >= 0) close(xdp->map_fd);
+
+  for(i=0; i<sizeof(rings)/sizeof(rings[0]); i++) {
+    if(rings[i]->map != NULL)
+      munmap(rings[i]->map, rings[i]->map_len);
+  }
+
+  if(xdp->fd >= 0) close(xdp->fd);
+  if(xdp->umem != NULL) munmap(xdp->umem, xdp->umem_len);
+
+  memset(xdp, 0, sizeof(n2n_xdp_t));
+  xdp->fd = xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+}
+
+/* *************************************************** */
+
+/** Take up to <max> received frames. Each one must be given back with
+ *  xdp_tx() or xdp_release(). */
+unsigned int xdp_rx_burst(n2n_xdp_t *xdp, uint64_t *addr, uint32_t *len, unsigned int max) {
+  uint32_t cons = *xdp->rx.consumer, avail = xdp_ring_avail(&xdp->rx);
+  const struct xdp_desc *desc = (const struct xdp_desc *)xdp->rx.desc;
+  unsigned int i;
+
+  if(avail > max) avail = max;
+
+  for(i=0; i<avail; i++) {
+    addr[i] = desc[(cons + i) & xdp->rx.mask].addr;
+    len[i] = desc[(cons + i) & xdp->rx.mask].len;
+  }
+
+  __atomic_store_n(xdp->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+  xdp->rx_frames += avail;
+
+  return(avail);
+}
+
+uint8_t* xdp_frame(n2n_xdp_t *xdp, uint64_t addr) {
+  return(xdp->umem + addr);
+}
+
+/** Queue a frame for transmission. It is given back to the kernel once sent. */
+int xdp_tx(n2n_xdp_t *xdp, uint64_t addr, uint32_t len) {
+  struct xdp_desc *desc = (struct xdp_desc *)xdp->tx.desc;
+  uint32_t prod = *xdp->tx.producer;
+
+  if(xdp_ring_free(&xdp->tx) == 0) {
+    xdp->tx_full++;
+    return(-1);
+  }
+
+  desc[prod & xdp->tx.mask].addr = addr;
+  desc[prod & xdp->tx.mask].len = len;
+  desc[prod & xdp->tx.mask].options = 0;
+  __atomic_store_n(xdp->tx.producer, prod + 1, __ATOMIC_RELEASE);
+  xdp->tx_queued++;
+
+  return(0);
+}
+
+/** Give a frame back to the kernel for reception. */
+void xdp_release(n2n_xdp_t *xdp, uint64_t addr) {
+  uint32_t prod = *xdp->fill.producer;
+
+  /* The fill ring holds all the frames so it cannot be full. */
+  ((uint64_t *)xdp->fill.desc)[prod & xdp->fill.mask] = addr & ~((uint64_t)N2N_XDP_FRAME_SIZE - 1);
+  __atomic_store_n(xdp->fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+/** Kick the transmission of the queued frames and recycle the sent ones. */
+void xdp_flush(n2n_xdp_t *xdp) {
+  uint32_t cons, avail, i;
+
+  if(xdp->tx_queued > 0) {
+    if((sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0)
+       && (errno != EAGAIN) && (errno != EBUSY) && (errno != ENOBUFS))
+      traceEvent(TRACE_DEBUG, "AF_XDP transmit failed [%s]", strerror(errno));
+
+    xdp->tx_frames += xdp->tx_queued;
+    xdp->tx_queued = 0;
+  }
+
+  cons = *xdp->comp.consumer;
+  avail = xdp_ring_avail(&xdp->comp);
+
+  for(i=0; i<avail; i++)
+    xdp_release(xdp, ((const uint64_t *)xdp->comp.desc)[(cons + i) & xdp->comp.mask]);
+
+  __atomic_store_n(xdp->comp.consumer, cons + avail, __ATOMIC_RELEASE);
+}
+
+#endif /* N2N_HAVE_XDP */